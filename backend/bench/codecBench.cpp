@@ -0,0 +1,364 @@
+/**
+ * filetransfer_microbench: cost of the control path, per message and per file
+ *
+ * Every file costs a handful of control messages (FILE_INFO, "ready",
+ * "receiving", FILE_CHECKSUM, "complete"), which dominates small-file
+ * workloads. This measures them in isolation so codec changes can be judged
+ * on numbers:
+ *   codec/...          TransferMessage serialize/deserialize/encode and
+ *                      MessageReader decoding, per message and wire format
+ *   handshake/memory   one file's full control exchange, built and parsed
+ *                      the way FileTransferClient::sendFile() and the
+ *                      server's handleClient()/receiveFile() do, without sockets
+ *   handshake/loopback real server and client sending 1-byte files over
+ *                      127.0.0.1 (both ends' allocations count)
+ *
+ * Allocations are counted by replacing the global operator new, so they
+ * include everything nlohmann::json and std::string do underneath.
+ * Results go to stdout (or --output) as JSON: ns_per_op, allocs_per_op,
+ * alloc_bytes_per_op and, for codec entries, wire_bytes.
+ *
+ * Usage: filetransfer_microbench [--iterations 200000] [--files 100] [--filter TEXT]
+ *                                [--port 47900] [--output FILE]
+ */
+#include "protocol.hpp"
+#include "checksum.hpp"
+#include "fileTransferServer.hpp"
+#include "fileTransferClient.hpp"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <filesystem>
+#include <unistd.h>
+#include <fcntl.h>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+static std::atomic<uint64_t> allocations{0};
+static std::atomic<uint64_t> allocated_bytes{0};
+
+static void* countedAlloc(std::size_t size) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+	void* memory = std::malloc(size > 0 ? size : 1);
+	if (!memory) {
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+static void* countedAlignedAlloc(std::size_t size, std::size_t alignment) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+	void* memory = nullptr;
+	if (posix_memalign(&memory, alignment < sizeof(void*) ? sizeof(void*) : alignment, size > 0 ? size : 1) != 0) {
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+void* operator new(std::size_t size) { return countedAlloc(size); }
+void* operator new[](std::size_t size) { return countedAlloc(size); }
+void* operator new(std::size_t size, std::align_val_t alignment) {
+	return countedAlignedAlloc(size, static_cast<std::size_t>(alignment));
+}
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+	return countedAlignedAlloc(size, static_cast<std::size_t>(alignment));
+}
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+	try { return countedAlloc(size); } catch (...) { return nullptr; }
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+	try { return countedAlloc(size); } catch (...) { return nullptr; }
+}
+void operator delete(void* memory) noexcept { std::free(memory); }
+void operator delete[](void* memory) noexcept { std::free(memory); }
+void operator delete(void* memory, std::size_t) noexcept { std::free(memory); }
+void operator delete[](void* memory, std::size_t) noexcept { std::free(memory); }
+void operator delete(void* memory, std::align_val_t) noexcept { std::free(memory); }
+void operator delete[](void* memory, std::align_val_t) noexcept { std::free(memory); }
+void operator delete(void* memory, std::size_t, std::align_val_t) noexcept { std::free(memory); }
+void operator delete[](void* memory, std::size_t, std::align_val_t) noexcept { std::free(memory); }
+
+// Results feed into this, so the optimizer can't drop the work
+static volatile size_t sink;
+
+struct Options {
+	uint64_t iterations = 200000;
+	uint64_t files = 100;
+	std::string filter;
+	int port = 47900;
+	std::string output;
+};
+
+/**
+ * Runs body() `iterations` times after a short warm-up
+ * @param wire_bytes: Encoded size of one message (0 if not applicable)
+ */
+template <typename Body>
+static json measure(const Options& options, const std::string& name, uint64_t iterations, size_t wire_bytes, Body body) {
+	if (!options.filter.empty() && name.find(options.filter) == std::string::npos) {
+		return nullptr;
+	}
+
+	uint64_t warmup = iterations / 10 + 1;
+	for (uint64_t i = 0; i < warmup; i++) {
+		body();
+	}
+
+	uint64_t allocs_before = allocations.load();
+	uint64_t bytes_before = allocated_bytes.load();
+	auto start = std::chrono::steady_clock::now();
+	for (uint64_t i = 0; i < iterations; i++) {
+		body();
+	}
+	double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	double allocs = static_cast<double>(allocations.load() - allocs_before);
+	double bytes = static_cast<double>(allocated_bytes.load() - bytes_before);
+
+	std::cerr << name << ": " << ns / iterations << " ns/op, " << allocs / iterations << " allocs/op" << std::endl;
+
+	json result = {
+		{"name", name},
+		{"iterations", iterations},
+		{"ns_per_op", ns / iterations},
+		{"allocs_per_op", allocs / iterations},
+		{"alloc_bytes_per_op", bytes / iterations}
+	};
+	if (wire_bytes > 0) {
+		result["wire_bytes"] = wire_bytes;
+	}
+	return result;
+}
+
+/**
+ * FILE_INFO as FileTransferClient::sendFile() builds it for a resumable, checksummed file
+ */
+static TransferMessage fileInfoMessage() {
+	TransferMessage msg;
+	msg.type = MessageType::FILE_INFO;
+	msg.data = {
+		{"filename", "holiday_photos_2024_0001.jpg"},
+		{"filesize", uint64_t(3481620)},
+		{"checksum", CHECKSUM_CRC32C},
+		{"mtime", int64_t(1718000000)}
+	};
+	return msg;
+}
+
+static void codecBenchmarks(const Options& options, json& results) {
+	const TransferMessage file_info = fileInfoMessage();
+	const TransferMessage ready = statusMessage({{"status", "ready"}});
+	const TransferMessage complete = statusMessage({{"status", "complete"}, {"filename", "holiday_photos_2024_0001.jpg"},
+		{"checksum", "1c2d3e4f"}});
+
+	std::string serialized = file_info.serialize();
+	results.push_back(measure(options, "codec/serialize/FILE_INFO", options.iterations, serialized.size(), [&]() {
+		sink = sink + file_info.serialize().size();
+	}));
+	results.push_back(measure(options, "codec/deserialize/FILE_INFO", options.iterations, serialized.size(), [&]() {
+		sink = sink + TransferMessage::deserialize(serialized).data.size();
+	}));
+
+	const std::pair<const char*, WireFormat> formats[] = {{"json", WireFormat::JSON}, {"binary", WireFormat::BINARY}};
+	const std::pair<const char*, const TransferMessage*> messages[] = {
+		{"FILE_INFO", &file_info}, {"STATUS_ready", &ready}, {"STATUS_complete", &complete}};
+
+	for (const auto& format : formats) {
+		for (const auto& message : messages) {
+			std::string encoded = message.second->encode(format.second);
+			std::string suffix = std::string(format.first) + "/" + message.first;
+
+			results.push_back(measure(options, "codec/encode/" + suffix, options.iterations, encoded.size(), [&]() {
+				sink = sink + message.second->encode(format.second).size();
+			}));
+
+			// A reader per connection, fed one message per recv() as on the wire
+			MessageReader reader;
+			reader.setFormat(format.second);
+			TransferMessage decoded;
+			results.push_back(measure(options, "codec/decode/" + suffix, options.iterations, encoded.size(), [&]() {
+				reader.feed(encoded.data(), encoded.size());
+				reader.next(decoded);
+				sink = sink + decoded.data.size();
+			}));
+		}
+	}
+}
+
+/**
+ * One file's control messages, both sides, no sockets: what the client and
+ * server build, encode, decode and inspect for every file
+ */
+static void handshakeInMemory(const Options& options, json& results) {
+	const std::pair<const char*, WireFormat> formats[] = {{"json", WireFormat::JSON}, {"binary", WireFormat::BINARY}};
+	for (const auto& format : formats) {
+		MessageReader server_reader;
+		MessageReader client_reader;
+		server_reader.setFormat(format.second);
+		client_reader.setFormat(format.second);
+		TransferMessage msg;
+
+		auto exchange = [&]() {
+			// Client: FILE_INFO
+			std::string wire = fileInfoMessage().encode(format.second);
+			server_reader.feed(wire.data(), wire.size());
+			server_reader.next(msg);
+			FileInfo info;
+			info.filename = msg.data["filename"];
+			info.filesize = msg.data["filesize"];
+			info.checksum = msg.data.value("checksum", "");
+			info.mtime = msg.data.value("mtime", int64_t(0));
+
+			// Server: "ready", then "receiving"
+			wire = statusMessage({{"status", "ready"}}).encode(format.second);
+			json receiving = {{"status", "receiving"}};
+			receiving["checksum"] = CHECKSUM_CRC32C;
+			wire += statusMessage(receiving).encode(format.second);
+			client_reader.feed(wire.data(), wire.size());
+			while (client_reader.next(msg) && msg.data.value("status", "") == "ready") {
+			}
+
+			// Client: FILE_CHECKSUM after the data
+			TransferMessage checksum;
+			checksum.type = MessageType::FILE_CHECKSUM;
+			checksum.data = {{"algorithm", CHECKSUM_CRC32C}, {"checksum", crc32cToHex(0x1c2d3e4f)}};
+			wire = checksum.encode(format.second);
+			server_reader.feed(wire.data(), wire.size());
+			server_reader.next(msg);
+
+			// Server: "complete"
+			json complete = {{"status", "complete"}, {"filename", info.filename}};
+			complete["checksum"] = msg.data.value("checksum", "");
+			wire = statusMessage(complete).encode(format.second);
+			client_reader.feed(wire.data(), wire.size());
+			client_reader.next(msg);
+			sink = sink + msg.data.size();
+		};
+
+		results.push_back(measure(options, std::string("handshake/memory/") + format.first, options.iterations / 10 + 1,
+			0, exchange));
+	}
+}
+
+/**
+ * Real server and client in this process; 1-byte files keep disk and data
+ * time out of the picture, so what is left is the per-file control path
+ */
+static void handshakeLoopback(const Options& options, json& results) {
+	const std::string name = "handshake/loopback";
+	if (options.files == 0 || (!options.filter.empty() && name.find(options.filter) == std::string::npos)) {
+		return;
+	}
+
+	char pattern[] = "/tmp/filetransfer_microbench.XXXXXX";
+	if (!mkdtemp(pattern)) {
+		std::cerr << "Cannot create scratch directory: " << strerror(errno) << std::endl;
+		return;
+	}
+	// The server writes into its working directory, so keep the source elsewhere
+	std::string dir = pattern;
+	std::string source = dir + "/src/tiny.bin";
+	std::filesystem::create_directories(dir + "/src");
+	std::filesystem::create_directories(dir + "/recv");
+	std::ofstream(source) << 'x';
+
+	char previous_dir[4096];
+	if (!getcwd(previous_dir, sizeof(previous_dir)) || chdir((dir + "/recv").c_str()) != 0) {
+		std::cerr << "Cannot enter " << dir << std::endl;
+		return;
+	}
+
+	int port = options.port;
+	const std::pair<const char*, WireFormat> formats[] = {{"json", WireFormat::JSON}, {"binary", WireFormat::BINARY}};
+	for (const auto& format : formats) {
+		FileTransferServer server(port++);
+		if (!server.start()) {
+			std::cerr << "Server failed to start" << std::endl;
+			continue;
+		}
+
+		// Output is per file; keep it out of the way
+		std::streambuf* stdout_buffer = std::cout.rdbuf(nullptr);
+		{
+			FileTransferClient client("127.0.0.1", port - 1);
+			client.setWireFormat(format.second);
+			client.setResume(false);
+			if (client.connect()) {
+				uint64_t failed = 0;
+				json result = measure(options, name + "/" + format.first, options.files, 0, [&]() {
+					if (!client.sendFile(source)) {
+						failed++;
+					}
+				});
+				result["failed"] = failed;
+				results.push_back(result);
+				client.disconnect();
+			}
+		}
+		std::cout.rdbuf(stdout_buffer);
+		server.stop();
+	}
+
+	chdir(previous_dir);
+	std::error_code ignored;
+	std::filesystem::remove_all(dir, ignored);
+}
+
+int main(int argc, char** argv) {
+	Options options;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			std::cerr << "Missing value for " << arg << std::endl;
+			return 1;
+		}
+		if (arg == "--iterations") {
+			options.iterations = std::max(1ULL, std::strtoull(argv[++i], nullptr, 10));
+		} else if (arg == "--files") {
+			options.files = std::strtoull(argv[++i], nullptr, 10);
+		} else if (arg == "--filter") {
+			options.filter = argv[++i];
+		} else if (arg == "--port") {
+			options.port = std::atoi(argv[++i]);
+		} else if (arg == "--output") {
+			options.output = argv[++i];
+		} else {
+			std::cerr << "Usage: filetransfer_microbench [--iterations N] [--files N] [--filter TEXT] "
+				"[--port P] [--output FILE]" << std::endl;
+			return 1;
+		}
+	}
+
+	json results = json::array();
+	codecBenchmarks(options, results);
+	handshakeInMemory(options, results);
+	handshakeLoopback(options, results);
+
+	// Filtered-out benchmarks left nulls behind
+	json report = {{"benchmark", "filetransfer_microbench"}, {"results", json::array()}};
+	for (const json& result : results) {
+		if (!result.is_null()) {
+			report["results"].push_back(result);
+		}
+	}
+
+	if (options.output.empty()) {
+		std::cout << report.dump(2) << std::endl;
+	} else {
+		std::ofstream out(options.output);
+		out << report.dump(2) << std::endl;
+		if (!out) {
+			std::cerr << "Cannot write " << options.output << std::endl;
+			return 1;
+		}
+	}
+	return 0;
+}
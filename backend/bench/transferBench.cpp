@@ -0,0 +1,550 @@
+/**
+ * filetransfer_bench: loopback throughput and latency sweep
+ *
+ * Runs a FileTransferServer and FileTransferClients in this process over
+ * 127.0.0.1 and sends generated files for every combination of file size,
+ * chunk size and concurrency. The results go to stdout (or --output) as one
+ * JSON document, so runs can be compared across releases:
+ *   mb_per_s            payload bytes / wall time (1 MB = 10^6 bytes)
+ *   cpu_seconds_per_gb  user + system time of the whole process per 10^9 bytes
+ *   syscalls_per_gb     every syscall (perf tracepoint) when the kernel lets us
+ *                       count them, otherwise only the read/write family from
+ *                       /proc/self/io; "syscall_counter" says which
+ *   latency_ms          per-file sendFile() time, handshake to "complete"
+ *                       (with --batch: each client's whole sendFiles() call)
+ *
+ * Usage: filetransfer_bench [options]
+ *   --sizes 1K,64K,1M,64M,1G,10G   File sizes (K/M/G are powers of 1024)
+ *   --chunks 1M                    Pipeline buffer / direct I/O sizes
+ *   --concurrency 1,4              Clients sending at the same time
+ *   --bytes 1G                     Payload per run; sets the number of files (at least 1 per client)
+ *   --max-files 1000               Cap on files per client
+ *   --data sparse|random           Sparse files (no disk reads) or pseudo-random bytes
+ *   --send-mode M                  buffered, sendfile, io_uring, pipelined (default), direct, mmap
+ *   --receive-mode M               buffered, splice, io_uring, pipelined (default), direct
+ *   --epoll                        Serve clients with event loops instead of threads
+ *   --batch                        Send each client's files with one sendFiles() call
+ *   --no-checksum                  Don't verify files end to end (setChecksum(false))
+ *   --port 47000                   First port (every run uses the next one)
+ *   --dir D                        Scratch directory (default: a new one in /tmp, removed afterwards)
+ *   --output FILE                  Write the JSON there instead of stdout
+ *
+ * Received files are deleted as soon as they arrive, so the largest size
+ * times the highest concurrency has to fit on the scratch filesystem.
+ */
+#include "fileTransferServer.hpp"
+#include "fileTransferClient.hpp"
+#include "ioUringEngine.hpp"
+#include "compression.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+struct Options {
+	std::vector<uint64_t> sizes = {1024, 64 * 1024, 1024 * 1024, 64ULL * 1024 * 1024, 1ULL << 30, 10ULL << 30};
+	std::vector<uint64_t> chunks = {1024 * 1024};
+	std::vector<uint64_t> concurrency = {1, 4};
+	uint64_t bytes = 1ULL << 30;
+	uint64_t max_files = 1000;
+	bool random_data = false;
+	std::string send_mode = "pipelined";
+	std::string receive_mode = "pipelined";
+	bool epoll = false;
+	bool batch = false;
+	bool checksum = true;
+	int port = 47000;
+	std::string dir;
+	std::string output;
+};
+
+/**
+ * "64K" -> 65536; plain numbers are bytes
+ */
+static uint64_t parseSize(const std::string& text) {
+	size_t end = 0;
+	uint64_t value = std::stoull(text, &end);
+	std::string suffix = text.substr(end);
+	if (suffix == "K" || suffix == "k") return value << 10;
+	if (suffix == "M" || suffix == "m") return value << 20;
+	if (suffix == "G" || suffix == "g") return value << 30;
+	if (!suffix.empty()) {
+		throw std::invalid_argument("bad size: " + text);
+	}
+	return value;
+}
+
+static std::vector<uint64_t> parseList(const std::string& text) {
+	std::vector<uint64_t> values;
+	std::stringstream stream(text);
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		values.push_back(parseSize(item));
+	}
+	if (values.empty()) {
+		throw std::invalid_argument("empty list");
+	}
+	return values;
+}
+
+static bool parseSendMode(const std::string& name, SendMode& mode) {
+	const std::pair<const char*, SendMode> modes[] = {{"buffered", SendMode::BUFFERED}, {"sendfile", SendMode::SENDFILE},
+		{"io_uring", SendMode::IO_URING}, {"pipelined", SendMode::PIPELINED}, {"direct", SendMode::DIRECT},
+		{"mmap", SendMode::MMAP}};
+	for (const auto& entry : modes) {
+		if (name == entry.first) {
+			mode = entry.second;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool parseReceiveMode(const std::string& name, ReceiveMode& mode) {
+	const std::pair<const char*, ReceiveMode> modes[] = {{"buffered", ReceiveMode::BUFFERED},
+		{"splice", ReceiveMode::SPLICE}, {"io_uring", ReceiveMode::IO_URING}, {"pipelined", ReceiveMode::PIPELINED},
+		{"direct", ReceiveMode::DIRECT}};
+	for (const auto& entry : modes) {
+		if (name == entry.first) {
+			mode = entry.second;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Counts the syscalls of this process while it is alive
+ * Preferred: the raw_syscalls:sys_enter tracepoint, inherited by every
+ * thread created afterwards (their counts are folded in as they exit, so
+ * read() only after all server and client threads are gone). Without
+ * tracefs or perf permissions: syscr + syscw of /proc/self/io, which only
+ * covers read/write-like calls (not send/recv).
+ */
+class SyscallCounter {
+private:
+	int perf_fd;
+	uint64_t start;
+
+	static uint64_t procIoCalls() {
+		std::ifstream io("/proc/self/io");
+		std::string key;
+		uint64_t value;
+		uint64_t calls = 0;
+		while (io >> key >> value) {
+			if (key == "syscr:" || key == "syscw:") {
+				calls += value;
+			}
+		}
+		return calls;
+	}
+
+	static int openTracepoint() {
+		const char* id_paths[] = {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+			"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"};
+		for (const char* path : id_paths) {
+			std::ifstream id_file(path);
+			uint64_t id;
+			if (!(id_file >> id)) {
+				continue;
+			}
+
+			perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_TRACEPOINT;
+			attr.config = id;
+			attr.inherit = 1;
+			attr.sample_period = 0;
+			int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+			if (fd >= 0) {
+				return fd;
+			}
+		}
+		return -1;
+	}
+
+public:
+	SyscallCounter() : perf_fd(openTracepoint()), start(perf_fd >= 0 ? 0 : procIoCalls()) {}
+
+	~SyscallCounter() {
+		if (perf_fd >= 0) {
+			close(perf_fd);
+		}
+	}
+
+	const char* source() const { return perf_fd >= 0 ? "perf" : "proc_io"; }
+
+	uint64_t read() const {
+		if (perf_fd < 0) {
+			return procIoCalls() - start;
+		}
+		uint64_t count = 0;
+		if (::read(perf_fd, &count, sizeof(count)) != sizeof(count)) {
+			return 0;
+		}
+		return count;
+	}
+};
+
+static double cpuSeconds() {
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+		(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/**
+ * Nearest-rank percentile of sorted samples
+ */
+static double percentile(const std::vector<double>& sorted, double p) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	size_t rank = static_cast<size_t>(p * sorted.size() + 0.999999);
+	return sorted[std::min(std::max(rank, static_cast<size_t>(1)), sorted.size()) - 1];
+}
+
+/**
+ * Creates the source file for one size: a hole, or xorshift bytes
+ */
+static bool makeSource(const std::string& path, uint64_t size, bool random_data) {
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return false;
+	}
+
+	bool ok = true;
+	if (!random_data) {
+		ok = ftruncate(fd, static_cast<off_t>(size)) == 0;
+	} else {
+		std::vector<uint64_t> block(128 * 1024);   // 1MB
+		uint64_t state = 0x9E3779B97F4A7C15ULL ^ size;
+		uint64_t written = 0;
+		while (ok && written < size) {
+			for (uint64_t& word : block) {
+				state ^= state << 13;
+				state ^= state >> 7;
+				state ^= state << 17;
+				word = state;
+			}
+			size_t count = static_cast<size_t>(std::min<uint64_t>(size - written, block.size() * sizeof(uint64_t)));
+			ok = write(fd, block.data(), count) == static_cast<ssize_t>(count);
+			written += count;
+		}
+	}
+	close(fd);
+	return ok;
+}
+
+/**
+ * One point of the sweep: fresh server, `concurrency` clients each sending
+ * `files` links to the same source under their own names
+ */
+static json runOne(const Options& options, const std::string& dir, const std::string& source, uint64_t file_size,
+		uint64_t chunk, unsigned concurrency, int port) {
+	uint64_t files = options.bytes / (file_size * concurrency);
+	files = std::max<uint64_t>(1, std::min(files, options.max_files));
+
+	// Distinct names, so concurrent transfers never meet in the receiving directory
+	std::vector<std::vector<std::string>> names(concurrency);
+	for (unsigned c = 0; c < concurrency; c++) {
+		for (uint64_t i = 0; i < files; i++) {
+			std::string name = "f" + std::to_string(file_size) + "_" + std::to_string(c) + "_" + std::to_string(i) + ".bin";
+			std::string link = dir + "/src/" + name;
+			unlink(link.c_str());
+			if (symlink(source.c_str(), link.c_str()) != 0) {
+				return {{"error", "cannot create " + link + ": " + strerror(errno)}};
+			}
+			names[c].push_back(name);
+		}
+	}
+
+	SendMode send_mode = SendMode::PIPELINED;
+	ReceiveMode receive_mode = ReceiveMode::PIPELINED;
+	parseSendMode(options.send_mode, send_mode);
+	parseReceiveMode(options.receive_mode, receive_mode);
+
+	SyscallCounter syscalls;
+	double cpu_start = cpuSeconds();
+
+	FileTransferServer server(port);
+	server.setReceiveMode(receive_mode);
+	server.setPipeline(4, chunk);
+	server.setDirectIoSize(chunk);
+	server.setWorkerPool(std::max<size_t>(64, concurrency), 256);
+	if (options.epoll) {
+		server.setServerMode(ServerMode::EPOLL);
+	}
+	if (!server.start()) {
+		return {{"error", "server failed to start on port " + std::to_string(port)}};
+	}
+
+	std::mutex results_mutex;
+	std::vector<double> latencies;
+	uint64_t sent_files = 0;
+	uint64_t failed_files = 0;
+
+	auto started = std::chrono::steady_clock::now();
+	std::vector<std::thread> clients;
+	for (unsigned c = 0; c < concurrency; c++) {
+		clients.emplace_back([&, c]() {
+			std::vector<double> mine;
+			uint64_t failed = 0;
+
+			FileTransferClient client("127.0.0.1", port);
+			client.setSendMode(send_mode);
+			client.setPipeline(4, chunk);
+			client.setDirectIoSize(chunk);
+			client.setChecksum(options.checksum);
+			if (!client.connect()) {
+				failed = files;
+			} else if (options.batch) {
+				std::vector<std::string> paths;
+				for (const std::string& name : names[c]) {
+					paths.push_back(dir + "/src/" + name);
+				}
+
+				auto begin = std::chrono::steady_clock::now();
+				bool ok = client.sendFiles(paths);
+				auto end = std::chrono::steady_clock::now();
+
+				// Failures aren't broken down per file here; count them all
+				if (ok) {
+					mine.push_back(std::chrono::duration<double, std::milli>(end - begin).count());
+				} else {
+					failed = files;
+				}
+				client.disconnect();
+			} else {
+				for (const std::string& name : names[c]) {
+					auto begin = std::chrono::steady_clock::now();
+					bool ok = client.sendFile(dir + "/src/" + name);
+					auto end = std::chrono::steady_clock::now();
+
+					if (ok) {
+						mine.push_back(std::chrono::duration<double, std::milli>(end - begin).count());
+					} else {
+						failed++;
+					}
+					unlink((dir + "/recv/" + name).c_str());
+				}
+				client.disconnect();
+			}
+
+			std::lock_guard<std::mutex> lock(results_mutex);
+			latencies.insert(latencies.end(), mine.begin(), mine.end());
+			sent_files += mine.size();
+			failed_files += failed;
+		});
+	}
+	for (std::thread& client : clients) {
+		client.join();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+	// Worker threads fold their syscall counts in as they exit
+	server.stop();
+	uint64_t calls = syscalls.read();
+	double cpu = cpuSeconds() - cpu_start;
+
+	for (const auto& client_names : names) {
+		for (const std::string& name : client_names) {
+			unlink((dir + "/src/" + name).c_str());
+			unlink((dir + "/recv/" + name).c_str());
+		}
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+	if (options.batch) {
+		sent_files = files * concurrency - failed_files;
+	}
+	double bytes = static_cast<double>(sent_files * file_size);
+	double gb = bytes / 1e9;
+
+	return {
+		{"file_size", file_size},
+		{"chunk_size", chunk},
+		{"concurrency", concurrency},
+		{"files", sent_files},
+		{"failed", failed_files},
+		{"bytes", sent_files * file_size},
+		{"seconds", seconds},
+		{"mb_per_s", seconds > 0 ? bytes / 1e6 / seconds : 0},
+		{"cpu_seconds_per_gb", gb > 0 ? cpu / gb : 0},
+		{"syscalls_per_gb", gb > 0 ? calls / gb : 0},
+		{"latency_ms", {
+			{"p50", percentile(latencies, 0.50)},
+			{"p99", percentile(latencies, 0.99)},
+			{"max", latencies.empty() ? 0 : latencies.back()}
+		}}
+	};
+}
+
+static void usage() {
+	std::cerr << "Usage: filetransfer_bench [--sizes LIST] [--chunks LIST] [--concurrency LIST] [--bytes N]\n"
+		"         [--max-files N] [--data sparse|random] [--send-mode M] [--receive-mode M]\n"
+		"         [--epoll] [--batch] [--no-checksum] [--port P] [--dir D] [--output FILE]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+	Options options;
+	try {
+		for (int i = 1; i < argc; i++) {
+			std::string arg = argv[i];
+			bool has_value = i + 1 < argc;
+			if (arg == "--epoll") {
+				options.epoll = true;
+			} else if (arg == "--batch") {
+				options.batch = true;
+			} else if (arg == "--no-checksum") {
+				options.checksum = false;
+			} else if (!has_value) {
+				usage();
+				return 1;
+			} else if (arg == "--sizes") {
+				options.sizes = parseList(argv[++i]);
+			} else if (arg == "--chunks") {
+				options.chunks = parseList(argv[++i]);
+			} else if (arg == "--concurrency") {
+				options.concurrency = parseList(argv[++i]);
+			} else if (arg == "--bytes") {
+				options.bytes = parseSize(argv[++i]);
+			} else if (arg == "--max-files") {
+				options.max_files = std::max<uint64_t>(1, parseSize(argv[++i]));
+			} else if (arg == "--data") {
+				options.random_data = std::string(argv[++i]) == "random";
+			} else if (arg == "--send-mode") {
+				options.send_mode = argv[++i];
+			} else if (arg == "--receive-mode") {
+				options.receive_mode = argv[++i];
+			} else if (arg == "--port") {
+				options.port = std::stoi(argv[++i]);
+			} else if (arg == "--dir") {
+				options.dir = argv[++i];
+			} else if (arg == "--output") {
+				options.output = argv[++i];
+			} else {
+				usage();
+				return 1;
+			}
+		}
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		usage();
+		return 1;
+	}
+
+	SendMode send_mode;
+	ReceiveMode receive_mode;
+	if (!parseSendMode(options.send_mode, send_mode) || !parseReceiveMode(options.receive_mode, receive_mode)) {
+		std::cerr << "Unknown send or receive mode" << std::endl;
+		return 1;
+	}
+
+	bool own_dir = options.dir.empty();
+	if (own_dir) {
+		char pattern[] = "/tmp/filetransfer_bench.XXXXXX";
+		if (!mkdtemp(pattern)) {
+			std::cerr << "Cannot create scratch directory: " << strerror(errno) << std::endl;
+			return 1;
+		}
+		options.dir = pattern;
+	}
+	options.dir = std::filesystem::absolute(options.dir).string();
+	std::filesystem::create_directories(options.dir + "/src");
+	std::filesystem::create_directories(options.dir + "/recv");
+
+	// The server writes into its working directory
+	if (chdir((options.dir + "/recv").c_str()) != 0) {
+		std::cerr << "Cannot enter " << options.dir << "/recv: " << strerror(errno) << std::endl;
+		return 1;
+	}
+
+	utsname host;
+	uname(&host);
+	char timestamp[32];
+	std::time_t now = std::time(nullptr);
+	std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+
+	json report = {
+		{"benchmark", "filetransfer_bench"},
+		{"timestamp", timestamp},
+		{"host", {
+			{"kernel", host.release},
+			{"machine", host.machine},
+			{"cpus", std::thread::hardware_concurrency()}
+		}},
+		{"config", {
+			{"data", options.random_data ? "random" : "sparse"},
+			{"send_mode", options.send_mode},
+			{"receive_mode", options.receive_mode},
+			{"server_mode", options.epoll ? "epoll" : "threads"},
+			{"batch", options.batch},
+			{"checksum", options.checksum},
+			{"syscall_counter", SyscallCounter().source()},
+			{"io_uring", IoUringEngine::isAvailable()},
+			{"lz4", BlockCompressor::isAvailable()}
+		}},
+		{"results", json::array()}
+	};
+
+	// Transfers log every file to stdout; keep it for the report
+	std::streambuf* stdout_buffer = std::cout.rdbuf(nullptr);
+
+	int port = options.port;
+	for (uint64_t size : options.sizes) {
+		std::string source = options.dir + "/src/source_" + std::to_string(size) + ".bin";
+		if (!makeSource(source, size, options.random_data)) {
+			std::cerr << "Cannot create " << source << ": " << strerror(errno) << std::endl;
+			continue;
+		}
+
+		for (uint64_t chunk : options.chunks) {
+			for (uint64_t concurrency : options.concurrency) {
+				std::cerr << "size " << size << ", chunk " << chunk << ", concurrency " << concurrency << std::endl;
+				report["results"].push_back(runOne(options, options.dir, source, size, chunk,
+					static_cast<unsigned>(std::max<uint64_t>(1, concurrency)), port++));
+			}
+		}
+		unlink(source.c_str());
+	}
+
+	std::cout.rdbuf(stdout_buffer);
+
+	if (own_dir) {
+		chdir("/");
+		std::error_code ignored;
+		std::filesystem::remove_all(options.dir, ignored);
+	}
+
+	if (options.output.empty()) {
+		std::cout << report.dump(2) << std::endl;
+	} else {
+		std::ofstream out(options.output);
+		out << report.dump(2) << std::endl;
+		if (!out) {
+			std::cerr << "Cannot write " << options.output << std::endl;
+			return 1;
+		}
+	}
+	return 0;
+}
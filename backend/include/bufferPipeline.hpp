@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include "ringBuffer.hpp"
+#include "bufferPool.hpp"
+
+/**
+ * O_DIRECT transfers need buffer addresses, file offsets and lengths that are
+ * multiples of the device's logical block size; this covers every common one
+ */
+static const size_t DIRECT_IO_ALIGNMENT = 4096;
+
+/**
+ * Fixed set of large, page-aligned buffers cycling between an I/O thread and
+ * the thread that drains it (disk reader -> socket sender, or socket
+ * receiver -> disk writer), so disk and network work at the same time
+ * instead of taking turns.
+ *
+ * The producer acquire()s an empty buffer, fills it and push()es it; the
+ * consumer pop()s it, uses it and release()s it. At most `depth` buffers
+ * exist, so a slow consumer stalls the producer instead of using memory.
+ * Buffers come from the shared BufferPool and change hands through two
+ * lock-free SPSC rings; a side that finds its ring empty spins briefly and
+ * then sleeps until the other side signals.
+ */
+class BufferPipeline {
+public:
+	struct Buffer {
+		char* data;
+		size_t length;        // Bytes filled
+		uint64_t offset;      // File offset of data[0]
+	};
+
+	static const size_t MAX_DEPTH = 64;
+
+	/**
+	 * @param depth: Number of buffers in flight (2 to MAX_DEPTH)
+	 * @param buffer_size: Bytes per buffer
+	 */
+	BufferPipeline(size_t depth, size_t buffer_size);
+
+	BufferPipeline(const BufferPipeline&) = delete;
+	BufferPipeline& operator=(const BufferPipeline&) = delete;
+
+	size_t bufferSize() const { return buffer_size; }
+	size_t bufferCount() const { return depth; }
+
+	/**
+	 * Producer: waits for an empty buffer
+	 * @return: nullptr if the pipeline was aborted
+	 */
+	Buffer* acquire();
+
+	/**
+	 * Producer: hands a filled buffer to the consumer
+	 */
+	void push(Buffer* buffer);
+
+	/**
+	 * Producer: no more buffers will be pushed
+	 */
+	void finish();
+
+	/**
+	 * Consumer: waits for the next filled buffer
+	 * @return: nullptr once the producer finished and everything was consumed, or on abort
+	 */
+	Buffer* pop();
+
+	/**
+	 * Consumer: returns a buffer for the producer to fill again
+	 */
+	void release(Buffer* buffer);
+
+	/**
+	 * Consumer: gives up a buffer for good, e.g. one the kernel may still be
+	 * reading (MSG_ZEROCOPY); its memory is leaked instead of going back to the pool
+	 */
+	void abandon(Buffer* buffer);
+
+	/**
+	 * Either side: stops the other one (on error)
+	 */
+	void abort();
+
+private:
+	size_t buffer_size;
+	size_t depth;
+	PooledBuffer storage[MAX_DEPTH];
+	Buffer buffers[MAX_DEPTH];
+	SpscRing<Buffer*, MAX_DEPTH> free_buffers;     // consumer -> producer
+	SpscRing<Buffer*, MAX_DEPTH> filled_buffers;   // producer -> consumer
+	std::atomic<bool> finished;
+	std::atomic<bool> aborted;
+
+	// Sleeping side of a wait; wake() only takes the mutex when someone sleeps
+	std::mutex wait_mutex;
+	std::condition_variable wait_cv;
+	std::atomic<int> waiters;
+
+	/**
+	 * Blocks until ready() is true: a short spin, then sleeps until woken
+	 */
+	template <typename Ready>
+	void waitUntil(Ready ready);
+
+	/**
+	 * Wakes a waiting side after a ring or flag changed
+	 */
+	void wake();
+};
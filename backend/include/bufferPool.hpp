@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "ringBuffer.hpp"
+
+/**
+ * Process-wide pool of fixed-size I/O buffers
+ * Buffers are carved out of large anonymous mappings (huge pages when the
+ * system has them), page aligned and never returned to the system, so once
+ * a transfer has warmed the pool, later transfers reuse the same memory
+ * instead of allocating. The free list is a lock-free stack of buffer
+ * indices; growing the pool is the only locked (and rare) path.
+ *
+ * There is one pool per power-of-two size class (see forSize()); use
+ * PooledBuffer rather than calling acquire()/release() by hand.
+ */
+class BufferPool {
+public:
+	static const size_t MIN_BUFFER_SIZE = 4096;
+	static const size_t MAX_BUFFER_SIZE = 64 * 1024 * 1024;
+	static const uint32_t MAX_BUFFERS = 4096;             // Per pool
+	static const uint32_t NO_BUFFER = UINT32_MAX;
+
+	explicit BufferPool(size_t buffer_size);
+	~BufferPool();
+
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	/**
+	 * Shared pool for buffers of at least `size` bytes
+	 * @return: nullptr if size is above MAX_BUFFER_SIZE
+	 */
+	static BufferPool* forSize(size_t size);
+
+	/**
+	 * Takes a buffer off the free list, growing the pool if it is empty
+	 * @return: Buffer index, NO_BUFFER if the pool is at MAX_BUFFERS or out of memory
+	 */
+	uint32_t acquire();
+
+	/**
+	 * Puts a buffer back on the free list (any thread)
+	 */
+	void release(uint32_t index);
+
+	char* data(uint32_t index) const { return slots[index]; }
+	size_t bufferSize() const { return buffer_size; }
+
+	/**
+	 * Buffers created so far (in use or free)
+	 */
+	uint32_t allocated() const { return count.load(std::memory_order_acquire); }
+
+private:
+	// (ABA tag << 32) | (index + 1); 0 = empty. Alone on its cache line, it is the one contended word
+	alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> head;
+
+	alignas(CACHE_LINE_SIZE) size_t buffer_size;
+	std::atomic<uint32_t> count;
+	char* slots[MAX_BUFFERS];                     // Index -> buffer
+	std::atomic<uint32_t> next[MAX_BUFFERS];      // Free list links (index + 1, 0 = end)
+	std::mutex grow_mutex;
+	std::vector<std::pair<void*, size_t>> arenas; // Mappings to unmap at exit
+
+	bool pop(uint32_t& index);
+	void push(uint32_t index);
+
+	/**
+	 * Maps a new arena and adds its buffers (minus the one returned) to the free list
+	 * @return: Index of a fresh buffer for the caller, NO_BUFFER on failure
+	 */
+	uint32_t grow();
+};
+
+/**
+ * A buffer borrowed from the shared pool for the lifetime of this object
+ * Sizes the pool can't serve (over MAX_BUFFER_SIZE, or a pool at its limit)
+ * fall back to a private page-aligned allocation, so callers never see a failure.
+ */
+class PooledBuffer {
+private:
+	BufferPool* pool;
+	uint32_t index;
+	char* buffer;
+	size_t capacity;
+
+	void reset();
+
+public:
+	PooledBuffer() : pool(nullptr), index(BufferPool::NO_BUFFER), buffer(nullptr), capacity(0) {}
+
+	/**
+	 * @param size: Minimum usable bytes (the pool's size class may give more)
+	 */
+	explicit PooledBuffer(size_t size);
+	~PooledBuffer() { reset(); }
+
+	PooledBuffer(PooledBuffer&& other) noexcept;
+	PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+	PooledBuffer(const PooledBuffer&) = delete;
+	PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+	char* data() const { return buffer; }
+	size_t size() const { return capacity; }
+
+	/**
+	 * Lets go of the buffer without returning it to the pool or freeing it
+	 * (for memory something outside our control may still use)
+	 */
+	void leak();
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * CRC32C (Castagnoli), the end-to-end checksum of file transfers
+ * Uses the CPU's CRC32 instructions (SSE4.2 on x86-64, the CRC extension
+ * on ARMv8) when they are present, checked once at runtime, and a
+ * slicing-by-8 table version otherwise. The hardware paths run at several
+ * GB/s per core, so hashing keeps up with the send/receive loops instead
+ * of needing a second pass over the file.
+ *
+ * Values chain: crc32cUpdate(crc32cUpdate(0, a), b) == crc32c(a + b)
+ */
+const char* const CHECKSUM_CRC32C = "crc32c";
+
+/**
+ * Continues a CRC32C over more data
+ * @param crc: Checksum of everything before data (0 to start)
+ * @return: Checksum including data
+ */
+uint32_t crc32cUpdate(uint32_t crc, const void* data, size_t length);
+
+/**
+ * Continues a CRC32C over a range of a file
+ * Reads through a temporary mapping, so bytes that were just sent with
+ * sendfile() or spliced to disk are hashed straight from the page cache
+ * @param fd: Readable descriptor
+ * @return: false if the range couldn't be read or goes past the end of the file
+ */
+bool crc32cUpdateFromFile(uint32_t& crc, int fd, uint64_t offset, uint64_t length);
+
+/**
+ * Zero-copy paths hash what they moved a window at a time, not every
+ * sendfile()/splice() call: one mapping per window. Smaller than
+ * WriteBehind::WINDOW, so the pages are still cached when they are read.
+ */
+const uint64_t CRC32C_READBACK_WINDOW = 4 * 1024 * 1024;
+
+/**
+ * @return: Checksum as 8 lowercase hex digits (the wire format)
+ */
+std::string crc32cToHex(uint32_t crc);
+
+/**
+ * @return: "sse4.2", "armv8" or "software", for logging
+ */
+const char* crc32cImplementation();
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * Adaptive LZ4 compression of the file data stream
+ * When both sides agree on it in FILE_INFO / "receiving", the raw file
+ * bytes are replaced by a sequence of blocks, each holding up to
+ * COMPRESSION_BLOCK_SIZE bytes of the file:
+ *   raw_length(4) stored_length(4)   big-endian, high bit of stored_length = LZ4
+ * followed by stored_length bytes, LZ4 compressed or copied as is.
+ *
+ * Every block decides on its own. A small sample is compressed first and
+ * only blocks that look compressible get the full treatment; a run of
+ * incompressible blocks (media, archives) makes the compressor stop trying
+ * for a while, so already-compressed files cost next to no CPU.
+ *
+ * Only available when built with LZ4 (FT_ENABLE_LZ4); otherwise it is never
+ * offered or accepted and transfers send raw bytes.
+ */
+
+const char* const COMPRESSION_LZ4 = "lz4";
+const size_t COMPRESSION_BLOCK_SIZE = 128 * 1024;
+const size_t COMPRESSION_HEADER_SIZE = 8;
+const uint32_t COMPRESSION_FLAG_LZ4 = 0x80000000;
+
+class BlockCompressor {
+private:
+	int misses;                  // Consecutive blocks that didn't compress
+	int skip;                    // Blocks left to store without trying
+	uint64_t raw_bytes;
+	uint64_t wire_bytes;
+	char sample[4096 + 4096 / 255 + 16];   // Scratch output of the probe (LZ4_COMPRESSBOUND of the sample)
+
+	/**
+	 * Compresses a sample from the middle of the block with LZ4's fastest setting
+	 * @return: true if the block looks worth compressing
+	 */
+	bool probe(const char* data, size_t length);
+
+public:
+	BlockCompressor();
+
+	/**
+	 * Checks whether LZ4 support was compiled in
+	 */
+	static bool isAvailable();
+
+	/**
+	 * Encodes one block (header + LZ4 or stored bytes)
+	 * @param length: At most COMPRESSION_BLOCK_SIZE
+	 * @param out: At least COMPRESSION_HEADER_SIZE + compressionBound() bytes
+	 * @return: Size of the encoded block
+	 */
+	size_t encode(const char* data, size_t length, char* out);
+
+	uint64_t rawBytes() const { return raw_bytes; }
+	uint64_t wireBytes() const { return wire_bytes; }
+};
+
+/**
+ * Largest stored_length a valid block can have
+ */
+size_t compressionBound();
+
+/**
+ * Parses a block header
+ * @return: false if the lengths are out of range
+ */
+bool decodeBlockHeader(const unsigned char* header, uint32_t& raw_length, uint32_t& stored_length, bool& compressed);
+
+/**
+ * Decompresses an LZ4 block
+ * @return: false if the data is corrupt or doesn't decompress to exactly raw_length bytes
+ */
+bool decompressBlock(const char* data, size_t length, char* out, size_t raw_length);
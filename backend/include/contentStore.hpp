@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+/**
+ * Content-addressed copies of received files, keyed by SHA-256 (sha256.hpp)
+ * A sender that announces a file's hash in FILE_INFO can be told "already
+ * have it" when an earlier transfer (under any name, from any client)
+ * brought the same bytes; the file is then created from the stored copy
+ * instead of being sent again.
+ *
+ * Objects live in <directory>/<first 2 hex digits>/<other 62>, read-only.
+ * Files are copied in and out with a reflink (FICLONE) where the filesystem
+ * supports it, so on btrfs/XFS a stored object and all the files made from
+ * it share their blocks; elsewhere copy_file_range() keeps the copy in the
+ * kernel. Objects are never hardlinked to received files: the server
+ * overwrites existing files in place, which would silently change the
+ * object behind every other file made from it.
+ *
+ * A hash announced by a client is only trusted after the store has hashed
+ * the bytes itself, so a client can't plant content under someone else's hash.
+ */
+class ContentStore {
+private:
+	std::string directory;
+
+	std::string objectPath(const std::string& hash) const;
+
+public:
+	/**
+	 * @param directory: Where objects are kept (created if missing, see open())
+	 */
+	explicit ContentStore(const std::string& directory);
+
+	/**
+	 * Creates the store directory
+	 * @return: false if it doesn't exist and can't be created
+	 */
+	bool open();
+
+	/**
+	 * @return: true if an object with this hash (and size) is stored
+	 */
+	bool has(const std::string& hash, uint64_t size) const;
+
+	/**
+	 * Creates a file from a stored object, replacing whatever is at path
+	 * The copy is written next to path and renamed into place once complete
+	 * @param mode: Permission bits of the new file
+	 * @return: false if there is no such object or the copy failed (path is left alone)
+	 */
+	bool materialize(const std::string& hash, uint64_t size, const std::string& path, uint32_t mode) const;
+
+	/**
+	 * Stores a copy of a received file under the hash its sender announced
+	 * @return: true if the object is stored (or already was), false if the
+	 *          file's content doesn't match the hash or the copy failed
+	 */
+	bool add(const std::string& hash, const std::string& path);
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * rsync-style delta transfer of a file the receiver already has an older copy of
+ *
+ * The receiver cuts its copy (the basis) into fixed-size blocks and sends a
+ * signature per block: a weak rolling checksum plus a strong hash. The
+ * sender slides a window over its file one byte at a time; the weak
+ * checksum can be rolled forward in O(1), so every offset is tested against
+ * the basis blocks and only candidates are confirmed with the strong hash.
+ * What goes over the wire is a list of COPY (basis block) and LITERAL
+ * (new bytes) operations, so a few changed regions in a big image cost
+ * little more than the regions themselves.
+ */
+
+struct BlockSignature {
+	uint32_t weak;      // rollingChecksum() of the block
+	uint64_t strong;    // strongHash() of the block
+};
+
+/**
+ * One instruction for rebuilding the file
+ * LITERAL: `length` bytes taken from the sender's file at `offset`
+ * COPY:    `count` consecutive basis blocks starting at `block`
+ */
+struct DeltaOp {
+	enum class Kind { LITERAL, COPY };
+
+	Kind kind;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t block;
+	uint64_t count;
+};
+
+/**
+ * Weak checksum of rsync: two 16-bit sums that can be rolled forward a byte at a time
+ */
+uint32_t rollingChecksum(const unsigned char* data, size_t length);
+
+/**
+ * Slides the window one byte: drops `out` from the front, appends `in`
+ * @param length: Window size
+ */
+inline uint32_t rollingChecksumRoll(uint32_t checksum, unsigned char out, unsigned char in, size_t length) {
+	uint32_t a = checksum & 0xffff;
+	uint32_t b = checksum >> 16;
+	a = (a - out + in) & 0xffff;
+	b = (b - static_cast<uint32_t>(length) * out + a) & 0xffff;
+	return a | (b << 16);
+}
+
+/**
+ * 64-bit XXH64 hash, used to confirm weak checksum matches
+ */
+uint64_t strongHash(const void* data, size_t length);
+
+/**
+ * Block size for a basis file, about sqrt(size) like rsync, within [2KB, 128KB]
+ */
+size_t deltaBlockSize(uint64_t file_size);
+
+/**
+ * Computes the signature of every full block of a file (a short tail block is left out)
+ * @return: false if the file couldn't be read
+ */
+bool computeSignatures(int fd, uint64_t file_size, size_t block_size, std::vector<BlockSignature>& signatures);
+
+/**
+ * Scans a file against the basis signatures and produces the operations that rebuild it
+ * Consecutive block matches are merged into one COPY, and literals are
+ * split into pieces of at most max_literal bytes.
+ * @param data: Whole file contents (e.g. a read-only mapping)
+ * @param emit: Called for every operation in file order; return false to stop
+ * @return: false if emit stopped the scan
+ */
+bool generateDelta(const unsigned char* data, uint64_t size, const std::vector<BlockSignature>& signatures,
+		size_t block_size, size_t max_literal, const std::function<bool(const DeltaOp&)>& emit);
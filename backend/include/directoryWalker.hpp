@@ -0,0 +1,104 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+
+struct WalkEntry {
+	std::string path;     // Relative to the root, '/'-separated
+	bool directory;
+	uint64_t size;        // Regular files only
+	uint32_t mode;        // Permission bits
+};
+
+/**
+ * Lists a directory tree on several threads while the caller consumes it
+ * Every worker takes a directory from a shared queue, reads it with
+ * getdents64 in large chunks and stats its entries; subdirectories go back
+ * on the queue, so wide trees are listed in parallel and the first entries
+ * are available long before the walk ends. A directory is always returned
+ * before anything inside it.
+ *
+ * Only regular files and directories are returned; symlinks, devices etc.
+ * are skipped (and counted). Entries wait in a bounded queue, so a slow
+ * consumer pauses the walk instead of holding a huge tree in memory.
+ */
+class DirectoryWalker {
+private:
+	std::string root;
+	unsigned thread_count;
+	std::vector<std::thread> workers;
+
+	std::mutex mutex;
+	std::condition_variable work_ready;      // Directories queued, walk done or stopping
+	std::condition_variable entries_ready;   // Entries queued or walk done
+	std::condition_variable space_ready;     // Consumer took entries
+	std::deque<std::string> directories;     // Listed by the next free worker
+	std::deque<WalkEntry> entries;           // Waiting for next()
+	unsigned busy;                           // Workers listing a directory
+	bool finished;
+	bool stopping;
+	uint64_t skipped;
+	uint64_t errors;
+
+	static const size_t MAX_QUEUED_ENTRIES = 64 * 1024;
+
+	void workerLoop();
+
+	/**
+	 * Lists one directory, handing its entries over in slices
+	 * @param relative: Path below the root ("" for the root itself)
+	 */
+	void listDirectory(const std::string& relative);
+
+	/**
+	 * Queues the entries (and subdirectories) found so far
+	 * @return: false if the walk is being stopped
+	 */
+	bool publish(std::vector<WalkEntry>& found, std::vector<std::string>& subdirectories);
+
+public:
+	/**
+	 * @param threads: Listing threads (at least 1)
+	 */
+	DirectoryWalker(const std::string& root, unsigned threads = 4);
+
+	/**
+	 * Stops the walk if it is still running
+	 */
+	~DirectoryWalker();
+
+	DirectoryWalker(const DirectoryWalker&) = delete;
+	DirectoryWalker& operator=(const DirectoryWalker&) = delete;
+
+	/**
+	 * Starts the listing threads
+	 * @return: false if root isn't a readable directory
+	 */
+	bool start();
+
+	/**
+	 * Takes the next entry
+	 * @param wait: Block until one is available (false: return false right away if none is)
+	 * @return: false once the walk is complete and every entry was taken (or nothing is ready yet)
+	 */
+	bool next(WalkEntry& entry, bool wait = true);
+
+	/**
+	 * @return: true once every entry was taken
+	 */
+	bool done();
+
+	/**
+	 * Stops the workers and joins them
+	 */
+	void stop();
+
+	uint64_t skippedCount();
+	uint64_t errorCount();
+};
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <atomic>
+#include <unordered_map>
+#include <cstdint>
+#include <memory>
+#include <netinet/in.h>
+#include "protocol.hpp"
+#include "transferJournal.hpp"
+#include "writeBehind.hpp"
+#include "ringBuffer.hpp"
+#include "fileBatch.hpp"
+
+class FileTransferServer;
+struct StripedTransfer;
+struct ClientConnection;
+
+/**
+ * Where a connection currently is in the receive protocol
+ */
+enum class ConnectionPhase {
+	AWAITING_FILE_INFO,   // Waiting for (the rest of) a control message
+	RECEIVING_DATA,       // Streaming file bytes to disk
+	RECEIVING_STRIPE,     // Writing one range of a striped file in place
+	RECEIVING_BATCH,      // Writing the bodies of a FILE_BATCH
+	VERIFYING             // File or stripe data done, waiting for its FILE_CHECKSUM
+};
+
+/**
+ * Per-connection state machine used by the epoll server
+ * Holds everything that lives on the stack of handleClient()/receiveFile()
+ * in thread-per-client mode, so one thread can juggle many transfers
+ */
+struct Connection {
+	int socket_fd;
+	std::string ip_address;
+	int port;
+	std::shared_ptr<ClientConnection> client;  // Server-side client state (progress counter)
+	ConnectionPhase phase;
+	MessageReader reader;         // Splits control bytes into messages
+	WireFormat format;            // Format for replies (switched by HELLO)
+	std::string outbox;           // Replies the socket wasn't ready to take yet
+	bool want_write;              // Whether EPOLLOUT is currently armed
+	FileInfo file_info;           // File being received (RECEIVING_DATA)
+	std::string output_filename;
+	std::string data_filename;    // File actually written (.part file when resumable)
+	TransferJournal journal;      // Received ranges, persisted for resumable transfers
+	WriteBehind writeback;        // Non-waiting: starts writeback, never blocks the loop on it
+	int output_fd;
+	bool splice_to_file;          // Output file takes splice() writes (false: recv()/write() instead)
+	uint64_t total_received;
+	int last_percentage;
+	bool verify;                  // Sender follows the file's data with FILE_CHECKSUM
+	uint32_t crc;                 // CRC32C of the data of the current file or stripe
+	uint64_t hashed;              // End of the file data in crc (spliced data is hashed a window at a time)
+	std::shared_ptr<StripedTransfer> stripe;  // Transfer of the current stripe (RECEIVING_STRIPE)
+	uint64_t stripe_start;        // File offset of the current stripe
+	uint64_t stripe_offset;       // File offset of the next stripe byte
+	uint64_t stripe_remaining;    // Bytes of the current stripe still to come
+	bool stripe_completed;        // This stripe's bytes completed the file
+	uint64_t owned_transfer;      // Striped transfer announced by this connection (0: none)
+	std::unique_ptr<BatchReceiver> batch;  // Files of the current batch (RECEIVING_BATCH)
+};
+
+/**
+ * EventLoop is one reactor thread of the epoll server
+ * Sockets are non-blocking and every connection advances its state machine
+ * only when epoll says it is readable/writable, so a handful of loops can
+ * serve thousands of concurrent transfers
+ */
+class EventLoop {
+private:
+	FileTransferServer& server;
+	int epoll_fd;
+	int wake_fd;                        // eventfd: new sockets handed over / shutdown requested
+	int listen_fd;                      // Listening socket polled by this loop (-1 if none)
+	int splice_pipe[2];                 // Shared by this loop's connections in SPLICE mode
+	std::thread* loop_thread;
+	std::atomic<bool> running;
+	std::unordered_map<int, Connection*> connections;  // Only touched by the loop thread
+	MpscRing<Connection*, 1024> pending;  // Accepted sockets waiting to be registered (any thread -> loop)
+	std::vector<char> buffer;           // Receive buffer shared by this loop's connections
+
+	// Journal checkpoints and the files of interrupted transfers are synced
+	// here, so a slow disk never holds up the loop's other connections
+	std::thread* disk_thread;
+	std::mutex disk_mutex;
+	std::condition_variable disk_cv;
+	std::deque<std::function<void()>> disk_jobs;
+	bool disk_stopping;
+
+	/**
+	 * Disk thread: runs queued jobs in order until stop() (finishing the queue first)
+	 */
+	void runDiskJobs();
+
+	/**
+	 * Hands blocking file work to the disk thread
+	 */
+	void queueDiskJob(std::function<void()> job);
+
+	/**
+	 * Queues the connection's journal checkpoint if one is due
+	 */
+	void checkpointLater(Connection* conn);
+
+	/**
+	 * server.addStripeData(), with due journal checkpoints written on the disk thread
+	 * @return: true if this completed the file
+	 */
+	bool addStripeData(Connection* conn, const std::shared_ptr<StripedTransfer>& transfer,
+			uint64_t offset, uint64_t length);
+
+	/**
+	 * Main loop: waits on epoll and dispatches events until stop()
+	 */
+	void run();
+
+	/**
+	 * Accepts every queued connection on listen_fd and hands it to a loop
+	 */
+	void acceptConnections();
+
+	/**
+	 * Adds sockets handed over by adopt() to this loop's epoll set
+	 */
+	void registerPending();
+
+	void handleReadable(Connection* conn);
+	void handleWritable(Connection* conn);
+
+	/**
+	 * Parses and acts on every complete control message received so far
+	 * @return: false if the connection should be closed
+	 */
+	bool processControl(Connection* conn);
+
+	/**
+	 * Handles a FILE_INFO message: opens the output file and switches to RECEIVING_DATA
+	 * @return: false if the connection should be closed
+	 */
+	bool beginFile(Connection* conn, const TransferMessage& msg);
+
+	/**
+	 * Moves as much file data as is available without blocking on the socket
+	 * @return: false if the connection should be closed
+	 */
+	bool receiveData(Connection* conn);
+
+	/**
+	 * Writes bytes that arrived together with the FILE_INFO message
+	 * @return: false on disk error
+	 */
+	bool writeData(Connection* conn, const char* data, size_t length);
+
+	/**
+	 * Discards whatever a failed splice() left in splice_pipe
+	 */
+	void drainSplicePipe();
+
+	/**
+	 * Adds spliced file data that isn't in conn->crc yet, read back from the page cache
+	 * @return: false if the file couldn't be read
+	 */
+	bool hashSpliced(Connection* conn);
+
+	/**
+	 * Handles a FILE_STRIPE message: switches to RECEIVING_STRIPE for its range
+	 * @return: false if the connection should be closed
+	 */
+	bool beginStripe(Connection* conn, const TransferMessage& msg);
+
+	/**
+	 * Moves available stripe bytes into place without blocking on the socket
+	 * @return: false if the connection should be closed
+	 */
+	bool receiveStripeData(Connection* conn);
+
+	/**
+	 * Writes stripe bytes at the current stripe offset
+	 * @return: false on disk error
+	 */
+	bool writeStripeData(Connection* conn, const char* data, size_t length);
+
+	/**
+	 * Handles a FILE_BATCH message: switches to RECEIVING_BATCH for its bodies
+	 * @return: false if the connection should be closed
+	 */
+	bool beginBatch(Connection* conn, const TransferMessage& msg);
+
+	/**
+	 * Moves available batch bytes into their files without blocking on the socket
+	 * @return: false if the connection should be closed
+	 */
+	bool receiveBatchData(Connection* conn);
+
+	/**
+	 * Acknowledges a complete batch and goes back to control messages
+	 */
+	void finishBatch(Connection* conn);
+
+	/**
+	 * Acknowledges a fully received stripe and goes back to control messages
+	 * Verified stripes wait in VERIFYING for their checksum first
+	 */
+	void finishStripe(Connection* conn);
+
+	/**
+	 * Called once total_received reaches the file size
+	 * Verified files wait in VERIFYING for their checksum first
+	 */
+	void finishFile(Connection* conn);
+
+	/**
+	 * Handles FILE_CHECKSUM: completes the file/stripe if it matches
+	 * @return: false if the connection should be closed
+	 */
+	bool verifyChecksum(Connection* conn, const TransferMessage& msg);
+
+	/**
+	 * Queues a reply and tries to send it right away
+	 */
+	void queueReply(Connection* conn, const std::string& reply);
+
+	/**
+	 * Sends as much of the outbox as the socket takes, arming EPOLLOUT for the rest
+	 * @return: false if the connection should be closed
+	 */
+	bool flushOutbox(Connection* conn);
+
+	/**
+	 * Closes the file of an interrupted transfer: kept for resuming if the
+	 * journal allows it (checkpointed on the disk thread), removed otherwise
+	 */
+	void abandonFile(Connection* conn);
+
+	/**
+	 * Unregisters and closes a connection, dealing with half-received files
+	 */
+	void closeConnection(Connection* conn);
+
+public:
+	EventLoop(FileTransferServer& server);
+	~EventLoop();
+
+	/**
+	 * Creates the epoll instance and starts the loop thread
+	 * @param listen_socket: Non-blocking listening socket this loop accepts on (-1 for none)
+	 * @param cpu: CPU to pin the loop thread to (-1: let the scheduler decide)
+	 * @return: true if the loop is running
+	 */
+	bool start(int listen_socket = -1, int cpu = -1);
+
+	/**
+	 * Wakes the loop, closes its connections and joins the threads
+	 */
+	void stop();
+
+	/**
+	 * Hands an accepted socket to this loop (thread-safe)
+	 * @param socket_fd: Connected, non-blocking socket
+	 * @param client: The server's entry for it
+	 */
+	void adopt(int socket_fd, std::shared_ptr<ClientConnection> client);
+};
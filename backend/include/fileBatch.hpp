@@ -0,0 +1,190 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+#include "protocol.hpp"
+
+/**
+ * Small-file batching (FILE_BATCH)
+ * A per-file exchange costs a couple of round trips, which is all the time
+ * it takes to send a small file. In batch mode the sender packs many small
+ * files into one message and doesn't wait between batches:
+ *   FILE_BATCH {"batch": id, "files": [{"name", "size", "checksum", "mode"}, ...]}
+ * followed by the bodies of all its files back to back, in manifest order.
+ * Names are relative paths; {"name", "type": "dir", "mode"} entries create
+ * directories (and have no body), which is how directory transfers lay out
+ * the tree on the receiver as it is walked.
+ *
+ * The receiver writes the files as their bytes arrive and answers every
+ * batch once it is on disk:
+ *   {"status": "batch_complete", "batch": id, "received": n,
+ *    "failed": [{"name", "reason"}, ...]}        ("failed" only if any did)
+ * A failed file (bad name, can't be created, checksum mismatch) doesn't
+ * stop the rest of the batch; its bytes are skipped. Missing parent
+ * directories are created.
+ *
+ * Servers that support it say "batch": true in their HELLO reply; senders
+ * keep up to BATCH_WINDOW batches unacknowledged.
+ */
+
+const size_t BATCH_MAX_FILES = 256;                   // Files per batch (keeps the manifest small)
+const uint64_t BATCH_MAX_BYTES = 4 * 1024 * 1024;     // Body bytes per batch the sender aims for
+const uint64_t BATCH_FILE_LIMIT = 1024 * 1024;        // Larger files go through the per-file exchange
+const size_t BATCH_WINDOW = 4;                        // Batches in flight before waiting for an ack
+
+struct BatchEntry {
+	std::string name;
+	uint64_t size;
+	std::string checksum;   // CRC32C as hex, empty if the sender didn't send one
+	bool directory;
+	uint32_t mode;          // Permission bits
+};
+
+/**
+ * Sending end: fills FILE_BATCH messages and keeps track of their acks
+ * Batches are streamed without waiting; up to BATCH_WINDOW may be
+ * unacknowledged, and acks that have already arrived are drained after
+ * every batch so they never fill the socket buffer while we send.
+ */
+class BatchSender {
+private:
+	int socket_fd;
+	WireFormat format;
+	std::function<bool(nlohmann::json&, int)> read_reply;   // The connection's reply reader
+	nlohmann::json files;      // Manifest of the batch being filled
+	std::string bodies;        // Its files' bytes, back to back
+	uint64_t next_batch;
+	size_t acks_pending;
+	size_t confirmed;          // Entries the server stored
+	size_t failures;           // Entries the server reported failed
+
+	/**
+	 * Reads acks until at most `keep` batches are unacknowledged
+	 * @return: false if the connection failed or the server rejected a batch
+	 */
+	bool collectAcks(size_t keep);
+
+public:
+	/**
+	 * @param read_reply: Reads the next server reply (recv flags as second argument,
+	 *                    false + errno EAGAIN with MSG_DONTWAIT if none is there yet)
+	 */
+	BatchSender(int socket_fd, WireFormat format, std::function<bool(nlohmann::json&, int)> read_reply);
+
+	/**
+	 * Reads a file into the current batch, sending the batch once it is full
+	 * @param file_fd: Open file, read from its current position
+	 * @param size: Bytes to send (a file that shrank is sent as it is now)
+	 * @return: false if a full batch couldn't be sent
+	 */
+	bool addFile(const std::string& name, int file_fd, uint64_t size, uint32_t mode = 0644);
+
+	/**
+	 * Adds a directory to the current batch (created before any later entry)
+	 * @return: false if a full batch couldn't be sent
+	 */
+	bool addDirectory(const std::string& name, uint32_t mode = 0755);
+
+	bool empty() const { return files.empty(); }
+
+	/**
+	 * Sends the current batch, if any
+	 * @return: false on connection error or a rejected batch
+	 */
+	bool flush();
+
+	/**
+	 * Sends the current batch and waits until every batch is acknowledged
+	 * (needed before any other exchange on the connection)
+	 * @return: false on connection error or a rejected batch
+	 */
+	bool drain();
+
+	uint64_t batchCount() const { return next_batch; }
+	size_t confirmedCount() const { return confirmed; }
+	size_t failureCount() const { return failures; }
+};
+
+/**
+ * Receiving end of one FILE_BATCH, fed with whatever bytes the socket has
+ * (shared by handleClient() and the event loop)
+ */
+class BatchReceiver {
+private:
+	uint64_t id;
+	std::vector<BatchEntry> entries;
+	size_t current;          // Entry whose bytes come next
+	uint64_t written;        // Bytes of it consumed so far
+	int output_fd;           // Its output file (-1: skipping its bytes)
+	uint32_t crc;
+	size_t received;         // Files written and verified
+	uint64_t total_bytes;    // Body bytes of the whole batch
+	uint64_t consumed;       // Body bytes seen so far
+	nlohmann::json failed;
+	std::function<void(const std::string&, uint64_t)> file_callback;
+
+	/**
+	 * Creates the current entry's file; empty files are finished right away
+	 */
+	void openCurrent();
+
+	/**
+	 * Verifies and closes the current entry, then moves on to the next one
+	 */
+	void finishCurrent();
+
+	/**
+	 * Records the current entry as failed and skips the rest of its bytes
+	 */
+	void failCurrent(const std::string& reason);
+
+public:
+	BatchReceiver();
+
+	/**
+	 * Removes a half-written file if the batch was interrupted
+	 */
+	~BatchReceiver();
+
+	BatchReceiver(const BatchReceiver&) = delete;
+	BatchReceiver& operator=(const BatchReceiver&) = delete;
+
+	/**
+	 * Called for every file that was received and verified
+	 */
+	void setFileCallback(std::function<void(const std::string&, uint64_t)> callback) {
+		file_callback = callback;
+	}
+
+	/**
+	 * Parses the manifest and creates the first file
+	 * @param msg: The FILE_BATCH message
+	 * @return: false if the manifest is malformed or too large (the body
+	 *          length is unknown then, so the connection can't continue)
+	 */
+	bool begin(const TransferMessage& msg);
+
+	/**
+	 * Writes body bytes to the files they belong to
+	 * @return: Bytes used, less than length only once the batch is complete
+	 */
+	size_t consume(const char* data, size_t length);
+
+	bool done() const { return current == entries.size(); }
+
+	/**
+	 * @return: Body bytes still expected
+	 */
+	uint64_t remaining() const;
+
+	size_t fileCount() const { return entries.size(); }
+	uint64_t totalBytes() const { return total_bytes; }
+
+	/**
+	 * @return: The "batch_complete" reply, once done()
+	 */
+	TransferMessage reply() const;
+};
@@ -1,9 +1,43 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include <functional>  // For callback functions
 #include <cstdint>
+#include <fstream>
+#include <atomic>
+#include <memory>
 #include "protocol.hpp"
+#include "transferJournal.hpp"
+#include "merkleTree.hpp"
+#include "zeroCopy.hpp"
+
+/**
+ * How file data is pushed onto the socket once the handshake is done
+ * BUFFERED: read() into a user-space buffer, then send() it (works for any source)
+ * SENDFILE: sendfile(2) straight from the page cache to the socket (zero-copy),
+ *           falls back to BUFFERED when the source is not a regular file.
+ *           The end-to-end checksum has to read the pages back (mapped a few
+ *           MB at a time), a second pass over the data: see setChecksum()
+ * IO_URING: batches of linked read/send operations through io_uring,
+ *           falls back to SENDFILE when io_uring is unavailable
+ * PIPELINED: read() on a separate disk thread, send() on this one, handing
+ *           over large buffers through a bounded queue (works for any source)
+ * DIRECT:   PIPELINED with the disk reads going through O_DIRECT, so sending
+ *           a huge file doesn't push everything else out of the page cache;
+ *           falls back to PIPELINED when the filesystem refuses O_DIRECT
+ * MMAP:     send() straight from a sliding read-only mapping of the file,
+ *           with readahead advice for the next window and the last one
+ *           unmapped, so memory use stays bounded on huge files
+ */
+enum class SendMode {
+    BUFFERED,
+    SENDFILE,
+    IO_URING,
+    PIPELINED,
+    DIRECT,
+    MMAP
+};
 
 /**
  * FileTransferClient class handles sending files to a remote server
@@ -15,11 +49,160 @@ private:
     std::string server_ip;   // IP address of the receiving device
     int port;
     bool connected;
+    SendMode send_mode;      // Data path used by sendFile()
+    WireFormat wire_format;  // Format requested at connect time
+    WireFormat active_format;  // Format the server agreed to
+    unsigned int stripe_count;  // Parallel connections per file (1 = single stream)
+    uint64_t stripe_size;       // Bytes per FILE_STRIPE range
+    bool resume;                // Offer resuming interrupted transfers (sends mtime in FILE_INFO)
+    bool checksum;              // Offer end-to-end CRC32C verification in FILE_INFO
+    uint64_t chunk_size;        // Bytes per hash tree leaf (0 = no per-chunk verification)
+    bool delta_sync;            // Offer a delta against the server's copy of the file
+    bool compression;           // Offer adaptive LZ4 compression of the file data
+    bool deduplicate;           // Send the SHA-256 of each file so the server can skip content it has
+    size_t pipeline_depth;      // Buffers in flight in PIPELINED mode
+    size_t pipeline_buffer_size;  // Bytes per buffer in PIPELINED mode
+    size_t direct_io_size;      // Bytes per read in DIRECT mode
+    bool zero_copy;             // Send PIPELINED/DIRECT buffers with MSG_ZEROCOPY
+    uint64_t zero_copy_bytes;   // Bytes the kernel sent without copying, all transfers
+    std::unique_ptr<ZeroCopySender> zero_copy_sender;  // Created on first use; the kernel numbers completions per socket
+    bool negotiated;            // HELLO exchanged (connect() skips it for JSON)
+    bool batch_supported;       // Server accepts FILE_BATCH (said so in its HELLO reply)
+    bool hello_unanswered;      // HELLO timed out; a late reply may still arrive
+    int retry_after;            // Seconds the server asked us to wait when it was busy (0: not busy)
     
     // Callback function for progress updates (using std::function for flexibility)
     // This allows the UI to show transfer progress
     std::function<void(int percentage, uint64_t transferred, uint64_t total)> progress_callback;
 
+    // Last percentage printed to the console, so we only log every 10%
+    int last_percentage;
+
+    // Splits the server's replies into messages (JSON or binary frames)
+    MessageReader reader;
+
+    /**
+     * Blocks until the next complete reply from the server is available
+     * @param reply: Reply data (e.g. {"status": "ready"})
+     * @param recv_flags: Extra recv() flags; with MSG_DONTWAIT, false + errno EAGAIN means "nothing yet"
+     * @return: false if the connection closed or the reply was malformed
+     */
+    bool readReply(nlohmann::json& reply, int recv_flags = 0);
+
+    /**
+     * sendFile() under a name of our choosing
+     * @param filename: Name (relative path) the server stores the file under
+     */
+    bool sendFileAs(const std::string& filepath, const std::string& filename);
+
+    /**
+     * Sends HELLO, switching to binary framing if requested and the server agrees
+     * Servers from before HELLO never answer it: after HELLO_TIMEOUT_MS the
+     * connection stays on JSON without optional features
+     * @return: false if the server didn't answer the HELLO
+     */
+    bool negotiateWireFormat();
+
+    /**
+     * Streams the file through a user-space buffer with read()/send()
+     * @param crc: If set, CRC32C continued over every byte sent
+     * @return: true if all bytes were sent
+     */
+    bool sendBuffered(std::ifstream& file, uint64_t file_size, uint64_t& total_sent, uint32_t* crc = nullptr);
+
+    /**
+     * Streams the file with sendfile(2), no user-space copies
+     * @param file_fd: Descriptor of the (regular) source file
+     * @param crc: If set, CRC32C continued over every byte sent
+     * @return: true if all bytes were sent
+     */
+    bool sendWithSendfile(int file_fd, uint64_t file_size, uint64_t& total_sent, uint32_t* crc = nullptr);
+
+    /**
+     * Sends from a window of the file mapped read-only, hashing the same pages
+     * @param file_fd: Descriptor of the (regular) source file
+     * @param crc: If set, CRC32C continued over every byte sent
+     * @return: true if all bytes were sent (errno ENODEV: the file can't be mapped)
+     */
+    bool sendMapped(int file_fd, uint64_t file_size, uint64_t& total_sent, uint32_t* crc = nullptr);
+
+    /**
+     * Reads the file on a disk thread while this thread sends the buffers it filled
+     * @param file_fd: Descriptor of the source, positioned anywhere (regular files) or at total_sent
+     * @param crc: If set, CRC32C continued over every byte sent
+     * @param direct: file_fd was opened with O_DIRECT: read whole aligned blocks with pread()
+     * @return: true if all bytes were sent
+     */
+    bool sendPipelined(int file_fd, uint64_t file_size, uint64_t& total_sent, uint32_t* crc = nullptr,
+                       bool direct = false);
+
+    /**
+     * Streams the file as compressed blocks (see compression.hpp), logs effective vs. wire throughput
+     * @param crc: If set, CRC32C continued over every (uncompressed) byte sent
+     * @return: true if all bytes were sent
+     */
+    bool sendCompressed(std::ifstream& file, uint64_t file_size, uint64_t& total_sent, uint32_t* crc = nullptr);
+
+    /**
+     * Sends every leaf of the hash tree as MERKLE_LEAVES batches
+     * @return: false if a batch couldn't be sent
+     */
+    bool sendMerkleLeaves(const MerkleTree& tree);
+
+    /**
+     * Sends the FILE_CHECKSUM trailer: the whole file after FILE_INFO (resumed
+     * prefix included), the stripe's range after FILE_STRIPE
+     * @return: false if the message couldn't be sent
+     */
+    bool sendChecksum(uint32_t crc);
+
+    /**
+     * Sends the file as a delta against the server's copy: reads the block
+     * signatures the server sends, then COPY/LITERAL operations and the
+     * checksum of the whole file
+     * @param file_fd: Descriptor of the (regular) source file
+     * @param block_size: Basis block size from the server's "receiving" reply
+     * @param block_count: Number of signatures that follow
+     * @return: true if the delta and its checksum were sent
+     */
+    bool sendDelta(int file_fd, uint64_t file_size, uint64_t block_size, uint64_t block_count);
+
+    /**
+     * Sends the file as stripes over this connection plus stripe_count - 1 new ones
+     * @param transfer_id: Id the server assigned in its "receiving" reply
+     * @param received: Ranges the server already has from an earlier attempt (skipped)
+     * @param verify: Follow every stripe with its checksum (the server asked for it)
+     * @return: true once the server confirmed the complete file
+     */
+    bool sendStriped(int file_fd, uint64_t file_size, uint64_t transfer_id, const RangeSet& received,
+            bool verify, uint64_t& total_sent);
+
+    /**
+     * Worker loop of a striped transfer: claims stripes until none are left,
+     * then waits for the server's acks of every stripe it sent
+     * @param next_offset: Shared cursor, each stripe is claimed with fetch_add
+     * @param failed: Shared flag, set by any worker that fails so the others stop
+     * @param on_sent: Called with the byte count of every chunk put on the socket (or skipped)
+     * @param completed: Set if one of this connection's acks was "complete"
+     * @return: true if every stripe sent here was acknowledged
+     */
+    bool sendStripes(int file_fd, uint64_t file_size, uint64_t transfer_id, const RangeSet& received,
+            bool verify, std::atomic<uint64_t>& next_offset, std::atomic<bool>& failed,
+            const std::function<void(uint64_t)>& on_sent, bool& completed);
+
+    /**
+     * Sends bytes [offset, offset + length) of the file, sendfile() with a pread() fallback
+     * @param crc: If set, CRC32C continued over the range
+     * @return: true if all bytes were sent
+     */
+    bool sendRange(int file_fd, uint64_t offset, uint64_t length, const std::function<void(uint64_t)>& on_sent,
+            uint32_t* crc = nullptr);
+
+    /**
+     * Logs progress every 10% and forwards it to the progress callback
+     */
+    void reportProgress(uint64_t total_sent, uint64_t file_size);
+
 public:
     /**
      * Constructor - initializes the client with server details
@@ -42,6 +225,31 @@ public:
      */
     bool sendFile(const std::string& filepath);
     
+    /**
+     * Sends many files over the connection, packing small ones (up to 1MB)
+     * into batches that are streamed without waiting for a reply per file;
+     * the server acknowledges whole batches as they land. Pays off when
+     * files are small enough that round trips, not bandwidth, set the pace.
+     * Larger files, and all files for servers without batch support, are
+     * sent one by one with sendFile().
+     * @param filepaths: Files to send (stored under their base names)
+     * @return: true if the server confirmed every file
+     */
+    bool sendFiles(const std::vector<std::string>& filepaths);
+    
+    /**
+     * Sends a directory tree; the server recreates it under the directory's
+     * name. The tree is listed on walk_threads threads while this one sends,
+     * so the first files go out long before the walk ends; small files and
+     * directories travel in batches (see sendFiles()), large files one by
+     * one. Permission bits are kept; symlinks and special files are skipped.
+     * Needs a server with batch support.
+     * @param dirpath: Directory to send
+     * @param walk_threads: Threads listing directories (default: 4)
+     * @return: true if every file and directory arrived
+     */
+    bool sendDirectory(const std::string& dirpath, unsigned walk_threads = 4);
+    
     /**
      * Closes the connection gracefully
      */
@@ -55,5 +263,129 @@ public:
         progress_callback = callback;
     }
     
+    /**
+     * Selects the data path used by sendFile()
+     * @param mode: BUFFERED, SENDFILE, IO_URING, PIPELINED, DIRECT or MMAP (default: SENDFILE)
+     */
+    void setSendMode(SendMode mode) { send_mode = mode; }
+    
+    /**
+     * Sizes the buffer queue between the disk and network threads of PIPELINED mode
+     * @param depth: Buffers in flight (default: 4, at least 2)
+     * @param buffer_size: Bytes per buffer (default: 1MB)
+     */
+    void setPipeline(size_t depth, size_t buffer_size) {
+        pipeline_depth = depth;
+        pipeline_buffer_size = buffer_size;
+    }
+    
+    /**
+     * Sets the size of each disk read in DIRECT mode (one pipeline buffer)
+     * Larger reads keep the device busy with fewer requests; 1-4MB is a good range
+     * @param bytes: Read size, rounded down to a multiple of 4KB (default: 4MB)
+     */
+    void setDirectIoSize(size_t bytes) { direct_io_size = bytes; }
+    
+    /**
+     * Sends the buffers of PIPELINED and DIRECT mode with MSG_ZEROCOPY, so
+     * send() pins them instead of copying them into the kernel; a buffer is
+     * only refilled once the kernel has released it. Falls back to plain
+     * send() when the kernel or socket doesn't support it.
+     * @param enable: true to use zero-copy sends (default: false)
+     */
+    void setZeroCopy(bool enable) { zero_copy = enable; }
+    
+    /**
+     * Bytes that actually went out without a copy (loopback and some NICs
+     * make the kernel copy anyway)
+     */
+    uint64_t getZeroCopyBytes() const { return zero_copy_bytes; }
+    
+    /**
+     * Selects the control message format negotiated in connect()
+     * JSON skips negotiation entirely, which keeps captures human-readable
+     * and works with every server. BINARY sends HELLO and switches if the
+     * server agrees; a server too old to answer costs HELLO_TIMEOUT_MS in
+     * connect(), after which the connection stays on JSON.
+     * @param format: JSON (default) or BINARY
+     */
+    void setWireFormat(WireFormat format) { wire_format = format; }
+    
+    /**
+     * Enables striped transfers: files larger than one stripe are split into
+     * ranges sent over `count` parallel connections, which fills long-fat
+     * or lossy links that a single TCP stream can't. Needs a regular file
+     * and a server that supports it, otherwise sendFile() uses one stream.
+     * @param count: Parallel connections per file (1 disables striping)
+     * @param size: Bytes per stripe (default: 8MB)
+     */
+    void setStripes(unsigned int count, uint64_t size = 8 * 1024 * 1024) {
+        stripe_count = count > 0 ? count : 1;
+        stripe_size = size > 0 ? size : 8 * 1024 * 1024;
+    }
+    
+    /**
+     * Lets the server keep interrupted transfers and resume them
+     * The source's size and modification time identify it, so a file that
+     * changed since the interrupted attempt is sent again from the start
+     * @param enabled: true (default) to resume, false to always start over
+     */
+    void setResume(bool enabled) { resume = enabled; }
+    
+    /**
+     * Offers end-to-end CRC32C verification of each file; the server checks
+     * the checksum before replying "complete". Cheap where the data passes
+     * through user space anyway. With SENDFILE (and a SPLICE receiver) the
+     * data never does, so both ends read it back from the page cache: turn
+     * it off there if the link is fast enough for that pass to show.
+     * @param enabled: true (default) to verify, false to rely on TCP's checksums
+     */
+    void setChecksum(bool enabled) { checksum = enabled; }
+    
+    /**
+     * Enables per-chunk verification of single-stream transfers: the file is
+     * hashed into a Merkle tree before sending (on all cores), the server
+     * checks every chunk as it lands and asks for corrupt chunks again
+     * instead of failing the whole transfer
+     * @param size: Bytes per chunk, e.g. 1MB; 0 (default) turns it off
+     */
+    void setChunkVerification(uint64_t size) { chunk_size = size; }
+    
+    /**
+     * Enables delta transfers: when the server already has a file of the
+     * same name, it sends block signatures of its copy and only the parts
+     * that changed are sent, rsync style. Costs a read of both copies, so it
+     * pays off for big files that change a little between pushes.
+     * @param enabled: true to offer deltas, false (default) to always send the whole file
+     */
+    void setDeltaSync(bool enabled) { delta_sync = enabled; }
+    
+    /**
+     * Enables compression of single-stream transfers when the server supports
+     * it (both sides built with LZ4). Each block is compressed only if a quick
+     * probe says it will shrink, so already-compressed files go out almost as
+     * fast as without. Data is read and sent through user space, in place of
+     * sendfile()/io_uring.
+     * @param enabled: true to offer compression, false (default) to send raw bytes
+     */
+    void setCompression(bool enabled) { compression = enabled; }
+    
+    /**
+     * Sends each file's SHA-256 in FILE_INFO. A server with a content store
+     * that already received the same bytes (under any name) creates the
+     * file from its copy and replies "complete" without taking any data.
+     * Costs a read of the file before sending; pays off when the same
+     * content is pushed repeatedly (build artifacts, VM images, backups).
+     * @param enabled: true to send hashes, false (default) to always send the data
+     */
+    void setDeduplication(bool enabled) { deduplicate = enabled; }
+    
     bool isConnected() const { return connected; }
+    
+    /**
+     * After a failed connect() or sendFile(): whether the server turned the
+     * connection away because all its workers were busy
+     * @return: Seconds the server asked to wait before retrying, 0 if it wasn't busy
+     */
+    int getRetryAfter() const { return retry_after; }
 };
@@ -6,21 +6,130 @@
 #include <functional>
 #include <cstdint>
 #include <map>
+#include <deque>
+#include <condition_variable>
+#include <unordered_map>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <netinet/in.h>
 #include "protocol.hpp"
+#include "transferJournal.hpp"
+#include "writeBehind.hpp"
+#include "merkleTree.hpp"
+#include "deltaSync.hpp"
+#include "ringBuffer.hpp"
+#include "contentStore.hpp"
+
+class EventLoop;
+
+/**
+ * How file data is moved from the socket to disk in receiveFile()
+ * BUFFERED: recv() into a user-space buffer, then write() it out
+ * SPLICE:   splice(2) socket -> pipe -> file, data never enters user space;
+ *           a verified transfer (client setChecksum()) reads it back from
+ *           the page cache for the checksum, a few MB per mapping
+ * IO_URING: batches of linked recv/write operations through io_uring
+ *           (thread-per-client mode only, event loops treat it as BUFFERED)
+ * PIPELINED: recv() on the connection thread, write() on a separate disk
+ *           thread, handing over large buffers through a bounded queue
+ *           (thread-per-client mode only, event loops treat it as BUFFERED)
+ * DIRECT:   PIPELINED with the disk writes going through O_DIRECT, so large
+ *           transfers don't push everything else out of the page cache;
+ *           falls back to PIPELINED when the filesystem refuses O_DIRECT
+ *           (thread-per-client mode only, event loops treat it as BUFFERED)
+ */
+enum class ReceiveMode {
+	BUFFERED,
+	SPLICE,
+	IO_URING,
+	PIPELINED,
+	DIRECT
+};
 
 /**
- * Structure to hold information about a connected client
- * Used to track multiple simultaneous connections
+ * How connections are serviced
+ * THREAD_PER_CLIENT: each connection is served by a blocking handleClient()
+ *                    on a worker from a bounded pool (see setWorkerPool())
+ * EPOLL:             a small fixed set of event loops with non-blocking sockets
+ */
+enum class ServerMode {
+	THREAD_PER_CLIENT,
+	EPOLL
+};
+
+/**
+ * What happens to a new connection when every worker is busy (THREAD_PER_CLIENT mode)
+ * QUEUE:     wait in the pending queue for a worker; rejected once the queue is full
+ * REJECT:    refused at once with a "busy" reply carrying retry_after
+ * SHED_IDLE: the connection that has been idle the longest (at least a second)
+ *            is disconnected to make room; queued as with QUEUE when none is
+ */
+enum class AdmissionPolicy {
+	QUEUE,
+	REJECT,
+	SHED_IDLE
+};
+
+/**
+ * Snapshot of a connected client, as returned by getConnectedClients()
  */
 struct ClientInfo {
 	int socket_fd;                    // Client socket file descriptor
 	std::string ip_address;           // Client IP address
 	int port;                          // Client port
-	std::thread* handler_thread;       // Thread handling this client
 	bool is_active;                    // Whether client is still connected
 	uint64_t bytes_received;           // For tracking transfer progress
 	std::string current_filename;      // File being received from this client
+	WireFormat wire_format;            // Message format negotiated with HELLO
+};
+
+/**
+ * Live state of a connected client
+ * Shared between the server's client table and the thread or event loop
+ * serving the connection, which looks it up once per transfer and then
+ * publishes progress through the atomic counter without taking clients_mutex.
+ */
+struct ClientConnection {
+	int socket_fd;                     // -1 once removed (guarded by clients_mutex)
+	std::string ip_address;
+	int port;
+	std::string current_filename;      // Guarded by clients_mutex
+	WireFormat wire_format;            // Guarded by clients_mutex
+	std::atomic<bool> is_active;
+	std::atomic<int64_t> idle_since;   // Steady clock ms since a worker has been waiting on it (0: busy or queued)
+
+	// Written for every chunk received: keep it off the lines the fields above share
+	alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> bytes_received;
+
+	ClientConnection(int socket_fd, const std::string& ip_address, int port)
+		: socket_fd(socket_fd), ip_address(ip_address), port(port),
+		wire_format(WireFormat::JSON), is_active(true), idle_since(0), bytes_received(0) {}
+};
+
+/**
+ * A file arriving as byte ranges (stripes) over several parallel connections
+ * The output file is preallocated and every stripe is written in place with
+ * pwrite(), so stripes can land in any order on any connection. Shared by
+ * all connections carrying its stripes; the transfer finalizes once the
+ * received byte count reaches the file size.
+ */
+struct StripedTransfer {
+	uint64_t id;                       // Sent back to the client in the "receiving" reply
+	FileInfo file_info;
+	std::string output_filename;
+	std::string data_filename;         // Where stripes are written (.part file when resumable)
+	int output_fd;
+	int control_socket;                // Connection that sent FILE_INFO
+	std::mutex mutex;                  // Guards the fields below
+	TransferJournal journal;           // Completed ranges, persisted for resumable transfers
+	uint64_t bytes_received;           // Bytes covered by all stripes, for progress and completion
+	int last_percentage;
+	bool finished;                     // Completed or aborted, no more data accepted
+	bool verify;                       // Every stripe is followed by FILE_CHECKSUM, recorded once it matches
+	bool checkpoint_queued;            // An event loop's disk thread is about to checkpoint the journal
+
+	~StripedTransfer();
 };
 
 /**
@@ -28,13 +137,41 @@ struct ClientInfo {
  * This is the receiver side of the file transfer application
  */
 class FileTransferServer {
+	// Event loops run the same protocol and share callbacks/client bookkeeping
+	friend class EventLoop;
+
 private:
 	int server_fd;                      // Server socket file descriptor
 	int port;                            // Port to listen on
 	bool is_running;                     // Server status flag
-	std::vector<ClientInfo> clients;     // List of connected clients
+	std::unordered_map<int, std::shared_ptr<ClientConnection>> clients;  // Connected clients by socket
 	std::thread* accept_thread;          // Thread for accepting new connections
-	std::mutex clients_mutex;             // Mutex for thread-safe client list access
+	std::mutex clients_mutex;             // Guards clients (not the byte counters)
+	ReceiveMode receive_mode;            // Data path used by receiveFile()
+	size_t pipe_size;                    // Requested pipe capacity for SPLICE mode
+	size_t pipeline_depth;               // Buffers in flight in PIPELINED mode
+	size_t pipeline_buffer_size;         // Bytes per buffer in PIPELINED mode
+	size_t direct_io_size;               // Bytes per write in DIRECT mode
+	ServerMode server_mode;              // Thread-per-client or epoll reactor
+	size_t event_loop_count;             // Number of reactor threads in EPOLL mode
+	std::vector<EventLoop*> event_loops; // Reactors (EPOLL mode only)
+	std::atomic<size_t> next_loop;       // Round-robin cursor for new connections
+	bool sharded_listeners;              // EPOLL mode: one SO_REUSEPORT listener per event loop
+	std::vector<int> shard_fds;          // Listeners of event loops 1..n-1 (loop 0 uses server_fd)
+	int listen_backlog;                  // Accept queue length passed to listen()
+	size_t max_workers;                  // Connections served at once in THREAD_PER_CLIENT mode
+	size_t max_pending;                  // Accepted connections allowed to wait for a worker
+	AdmissionPolicy admission_policy;    // What to do with a connection when all workers are busy
+	int retry_after;                     // Seconds suggested to rejected clients
+	std::vector<std::thread> workers;    // Started on demand, up to max_workers
+	std::deque<std::pair<int, struct sockaddr_in>> pending_connections;  // Waiting for a worker
+	size_t idle_workers;                 // Workers waiting for a connection
+	std::mutex workers_mutex;            // Guards the four fields above
+	std::condition_variable workers_cv;  // Signals pending connections and shutdown
+	std::map<uint64_t, std::shared_ptr<StripedTransfer>> striped_transfers;  // Incomplete striped files
+	std::mutex transfers_mutex;          // Guards striped_transfers and next_transfer_id
+	uint64_t next_transfer_id;
+	std::unique_ptr<ContentStore> content_store;  // Deduplicates files sent with a hash (nullptr: off)
 	
 	// Callback for notifying about received files
 	std::function<void(const std::string& filename, uint64_t size)> file_received_callback;
@@ -56,14 +193,276 @@ private:
 	 */
 	void handleClient(int client_socket, struct sockaddr_in client_addr);
 	
+	/**
+	 * Worker thread: serves pending connections one after another until stop()
+	 */
+	void workerLoop();
+	
+	/**
+	 * Applies the admission policy to a newly accepted socket and queues it for a worker
+	 * @return: false if the connection was turned away (the socket is closed)
+	 */
+	bool admitConnection(int client_socket, const struct sockaddr_in& client_addr);
+	
+	/**
+	 * Disconnects the client that has been idle the longest
+	 * @return: false if no connection is idle
+	 */
+	bool shedIdleClient();
+	
 	/**
 	 * Receives a file from a client
 	 * @param client_socket: Client socket
+	 * @param reader: Connection's message reader (for the checksum trailer)
 	 * @param file_info: File information from client
 	 * @param client_ip: Client IP for logging
+	 * @param format: Wire format negotiated for this connection (for replies)
+	 * @return: true if file received successfully
+	 */
+	bool receiveFile(int client_socket, MessageReader& reader, const FileInfo& file_info,
+			const std::string& client_ip, WireFormat format);
+	
+	/**
+	 * Copies file data through a user-space buffer with recv()/write()
+	 * @param output_fd: Destination file descriptor, positioned at total_received
+	 * @param total_received: Bytes received so far (resume offset), updated as data arrives
+	 * @param journal: Records received bytes for resuming
+	 * @param writeback: Pushes written data to disk behind the transfer (see writeBehind.hpp)
+	 * @param crc: If set, CRC32C continued over every byte received
+	 * @param chunks: If set, checks every chunk against the sender's hash tree as it lands
+	 * @return: true if the loop ended without a socket/disk error
+	 */
+	bool receiveBuffered(int client_socket, int output_fd, const FileInfo& file_info,
+			const std::string& client_ip, uint64_t& total_received, TransferJournal& journal, WriteBehind& writeback,
+			uint32_t* crc = nullptr, ChunkVerifier* chunks = nullptr);
+	
+	/**
+	 * Moves file data with splice() through a pipe, no user-space copies
+	 * @param crc: If set, CRC32C continued over every byte received (read back from the page cache)
+	 * @param chunks: If set, checks every chunk against the sender's hash tree as it lands
+	 * @return: true if the loop ended without a socket/disk error
+	 */
+	bool receiveWithSplice(int client_socket, int output_fd, const FileInfo& file_info,
+			const std::string& client_ip, uint64_t& total_received, TransferJournal& journal, WriteBehind& writeback,
+			uint32_t* crc = nullptr, ChunkVerifier* chunks = nullptr);
+	
+	/**
+	 * Receives on this thread and writes on a disk thread, so a slow write doesn't stall the socket
+	 * @param crc: If set, CRC32C continued over every byte received
+	 * @param chunks: If set, checks every chunk against the sender's hash tree as it lands
+	 * @param direct: Write block-aligned buffers through O_DIRECT (unaligned head and tail go through the page cache)
+	 * @return: true if the loop ended without a socket/disk error
+	 */
+	bool receivePipelined(int client_socket, int output_fd, const FileInfo& file_info,
+			const std::string& client_ip, uint64_t& total_received, TransferJournal& journal, WriteBehind& writeback,
+			uint32_t* crc = nullptr, ChunkVerifier* chunks = nullptr, bool direct = false);
+	
+	/**
+	 * Receives file data sent as compressed blocks (see compression.hpp) and writes it decoded
+	 * @param reader: Connection's message reader (may already hold the first block)
+	 * @param crc: If set, CRC32C continued over every decoded byte
+	 * @param chunks: If set, checks every chunk against the sender's hash tree as it lands
+	 * @return: true if the whole file arrived without a socket/disk/decoding error
+	 */
+	bool receiveCompressed(int client_socket, MessageReader& reader, int output_fd, const FileInfo& file_info,
+			const std::string& client_ip, uint64_t& total_received, TransferJournal& journal, WriteBehind& writeback,
+			uint32_t* crc = nullptr, ChunkVerifier* chunks = nullptr);
+	
+	/**
+	 * Blocks until the next control message, which must be of the given type
+	 * (e.g. the FILE_CHECKSUM trailer that follows file or stripe data)
+	 * @param msg: Filled with the message
+	 * @return: false if the connection failed or sent something else
+	 */
+	bool receiveMessage(int client_socket, MessageReader& reader, MessageType type, TransferMessage& msg);
+	
+	/**
+	 * Reads the sender's MERKLE_LEAVES batches into tree and checks them against file_info.merkle_root
+	 * @return: false if the leaves are missing or don't add up to the root
+	 */
+	bool receiveMerkleLeaves(int client_socket, MessageReader& reader, const FileInfo& file_info,
+			MerkleTree& tree);
+	
+	/**
+	 * Writes file data the reader pulled in along with the preceding control message
+	 * @param output_fd: Positioned at total_received, left positioned after the new bytes
+	 * @return: false on disk error
+	 */
+	static bool receiveEarlyData(MessageReader& reader, int output_fd, const FileInfo& file_info,
+			uint64_t& total_received, TransferJournal& journal, WriteBehind& writeback, ChunkVerifier* chunks);
+	
+	/**
+	 * Reads raw bytes that follow a control message (the reader may already hold some of them)
+	 * @return: false if the connection failed first
+	 */
+	bool receiveRaw(int client_socket, MessageReader& reader, char* data, uint64_t length);
+	
+	/**
+	 * Has the sender resend chunks that failed verification and writes them in place
+	 * @param bad: Indices of the corrupt chunks
+	 * @return: true once every chunk matches its leaf
+	 */
+	bool repairChunks(int client_socket, MessageReader& reader, int output_fd, const MerkleTree& tree,
+			std::vector<uint64_t> bad, WireFormat format);
+	
+	/**
+	 * Rebuilds a file we already have an older copy of from the sender's delta
+	 * The existing file is left alone until the rebuilt copy is complete and
+	 * its checksum matches, then the rebuilt copy replaces it
 	 * @return: true if file received successfully
 	 */
-	bool receiveFile(int client_socket, const FileInfo& file_info, const std::string& client_ip);
+	bool receiveDelta(int client_socket, MessageReader& reader, const FileInfo& file_info,
+			const std::string& client_ip, WireFormat format);
+	
+	/**
+	 * Copies a byte range from one file to another, in the kernel where the filesystem allows
+	 * @return: false on disk error
+	 */
+	static bool copyRange(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t length);
+	
+	/**
+	 * @return: true if a FILE_CHECKSUM trailer matches the CRC32C of the received data
+	 */
+	static bool checksumMatches(const TransferMessage& msg, uint32_t crc);
+	
+	/**
+	 * Checks that a striped FILE_INFO announces a file worth striping
+	 * @return: false for an empty file or one no bigger than its stripe_size
+	 */
+	static bool stripeableSize(const TransferMessage& msg);
+	
+	/**
+	 * Handles FILE_INFO for a striped file: creates and preallocates the output file,
+	 * or reopens the partial file of an interrupted attempt
+	 * @param control_socket: Connection that sent FILE_INFO (aborts the transfer if it drops)
+	 * @return: The registered transfer, nullptr if the file couldn't be created
+	 */
+	std::shared_ptr<StripedTransfer> beginStripedTransfer(const FileInfo& file_info, int control_socket);
+	
+	/**
+	 * Builds the "receiving" reply for a striped transfer (with transfer_id and any resumed ranges)
+	 */
+	static TransferMessage stripedReceivingReply(StripedTransfer& transfer);
+	
+	/**
+	 * Looks up a striped transfer that is still receiving data
+	 * @return: nullptr if the id is unknown, finished or aborted
+	 */
+	std::shared_ptr<StripedTransfer> findStripedTransfer(uint64_t id);
+	
+	/**
+	 * Records stripe bytes that are on disk, finalizing the file when all have arrived
+	 * @param checkpoint_due: If set, journal checkpoints are left to the caller: set to
+	 *                        true when one is due (see checkpointStripedTransfer())
+	 * @return: true if this call completed the file
+	 */
+	bool addStripeData(StripedTransfer& transfer, uint64_t offset, uint64_t length, ClientConnection* client,
+			const std::string& client_ip, bool* checkpoint_due = nullptr);
+	
+	/**
+	 * Writes a due journal checkpoint of a striped transfer, without holding
+	 * its mutex while the data file is synced
+	 */
+	static void checkpointStripedTransfer(StripedTransfer& transfer);
+	
+	/**
+	 * Drops an incomplete striped transfer
+	 * Resumable transfers keep their partial file and journal, others are removed
+	 */
+	void abortStripedTransfer(uint64_t id);
+	
+	/**
+	 * Receives one FILE_STRIPE range on a thread-per-client connection
+	 * @param reader: Connection's message reader (may already hold the first data bytes)
+	 * @param msg: The FILE_STRIPE message
+	 * @return: false if the connection should be closed
+	 */
+	bool receiveStripe(int client_socket, MessageReader& reader, const TransferMessage& msg,
+			const std::string& client_ip, WireFormat format);
+	
+	/**
+	 * Receives the files of one FILE_BATCH and acknowledges them with "batch_complete"
+	 * @param reader: Connection's message reader (may already hold the first file bytes)
+	 * @param msg: The FILE_BATCH manifest
+	 * @return: false if the connection should be closed
+	 */
+	bool receiveBatch(int client_socket, MessageReader& reader, const TransferMessage& msg,
+			const std::string& client_ip, WireFormat format);
+	
+	/**
+	 * Creates a file from the content store instead of receiving it, if the store has its hash
+	 * @return: true if the file is in place (and reported through the callback)
+	 */
+	bool restoreFromStore(const FileInfo& file_info);
+	
+	/**
+	 * Adds a received file to the content store if its sender announced a hash
+	 */
+	void addToStore(const FileInfo& file_info, const std::string& path);
+	
+	/**
+	 * pwrite() loop: writes all of data at offset
+	 * @return: false on disk error
+	 */
+	static bool writeAt(int fd, const char* data, size_t length, uint64_t offset);
+	
+	/**
+	 * Opens a second descriptor on the same file with O_DIRECT (through /proc/self/fd)
+	 * @return: -1 if the filesystem refuses O_DIRECT (e.g. tmpfs)
+	 */
+	static int openDirect(int fd);
+	
+	/**
+	 * Opens the file an incoming transfer is written to
+	 * Resumable transfers (FILE_INFO with mtime) go to a .part file whose
+	 * journal may hold ranges from an earlier attempt; others truncate as before.
+	 * Space for the whole file is reserved up front (see preallocate())
+	 * @param journal: Opened on the data file, holds the recovered ranges
+	 * @param data_filename: Set to the file actually written
+	 * @return: Descriptor (read/write), -1 on error
+	 */
+	static int openOutputFile(const FileInfo& file_info, TransferJournal& journal, std::string& data_filename);
+	
+	/**
+	 * Reserves disk space for a whole incoming file and sets its access pattern hints
+	 * Filesystems without fallocate() are left to allocate as usual
+	 * @return: false if the disk doesn't have room for the file
+	 */
+	static bool preallocate(int fd, uint64_t size);
+	
+	/**
+	 * Moves a finished .part file to its final name and drops its journal
+	 * @return: false if the rename failed
+	 */
+	static bool commitOutputFile(const std::string& data_filename, const std::string& output_filename,
+			TransferJournal& journal);
+	
+	/**
+	 * Publishes received byte count and logs progress every 10%
+	 * @param client: Connection to credit (nullptr if it was already removed)
+	 */
+	void updateProgress(ClientConnection* client, const std::string& client_ip,
+			uint64_t total_received, uint64_t file_size, int& last_percentage);
+	
+	/**
+	 * Looks up a connected client's state, to be held for the duration of a transfer
+	 * @return: nullptr if the socket isn't (or no longer) registered
+	 */
+	std::shared_ptr<ClientConnection> findClient(int socket_fd);
+	
+	/**
+	 * Registers an accepted socket and assigns it to an event loop (EPOLL mode)
+	 * @param socket_fd: Non-blocking client socket
+	 * @param client_addr: Client address information
+	 * @param owner: Loop that accepted it, which keeps it (sharded listeners); nullptr for round-robin
+	 */
+	void dispatchConnection(int socket_fd, const struct sockaddr_in& client_addr, EventLoop* owner = nullptr);
+	
+	/**
+	 * Opens another listening socket on our port for a sharded event loop
+	 * @return: Non-blocking listening socket, -1 on error
+	 */
+	int openShardListener();
 	
 	/**
 	 * Removes a client from the clients list
@@ -110,6 +509,93 @@ public:
 		progress_callback = callback;
 	}
 	
+	/**
+	 * Selects the data path used for incoming files
+	 * @param mode: BUFFERED, SPLICE, IO_URING, PIPELINED or DIRECT, see ReceiveMode (default: SPLICE)
+	 */
+	void setReceiveMode(ReceiveMode mode) { receive_mode = mode; }
+	
+	/**
+	 * Sets the pipe capacity used by SPLICE mode (F_SETPIPE_SZ)
+	 * Bigger pipes mean fewer splice() calls; unprivileged processes are
+	 * capped by /proc/sys/fs/pipe-max-size (1MB by default)
+	 * @param bytes: Requested pipe size in bytes
+	 */
+	void setPipeSize(size_t bytes) { pipe_size = bytes; }
+	
+	/**
+	 * Sizes the buffer queue between the network and disk threads of PIPELINED mode
+	 * @param depth: Buffers in flight (default: 4, at least 2)
+	 * @param buffer_size: Bytes per buffer (default: 1MB)
+	 */
+	void setPipeline(size_t depth, size_t buffer_size) {
+		pipeline_depth = depth;
+		pipeline_buffer_size = buffer_size;
+	}
+	
+	/**
+	 * Sets the size of each disk write in DIRECT mode (one pipeline buffer)
+	 * Larger writes keep the device busy with fewer requests; 1-4MB is a good range
+	 * @param bytes: Write size, rounded down to a multiple of 4KB (default: 4MB)
+	 */
+	void setDirectIoSize(size_t bytes) { direct_io_size = bytes; }
+	
+	/**
+	 * Selects how connections are serviced (must be called before start())
+	 * @param mode: THREAD_PER_CLIENT (default) or EPOLL
+	 */
+	void setServerMode(ServerMode mode) { server_mode = mode; }
+	
+	/**
+	 * Bounds the workers serving connections in THREAD_PER_CLIENT mode
+	 * @param workers: Connections served at once (default: 64)
+	 * @param pending: Accepted connections allowed to wait for a worker (default: 256)
+	 */
+	void setWorkerPool(size_t workers, size_t pending) {
+		max_workers = workers > 0 ? workers : 1;
+		max_pending = pending;
+	}
+	
+	/**
+	 * Chooses what happens to new connections while every worker is busy
+	 * @param policy: QUEUE (default), REJECT or SHED_IDLE
+	 * @param retry_seconds: retry_after sent with "busy" replies (default: 5)
+	 */
+	void setAdmissionPolicy(AdmissionPolicy policy, int retry_seconds = 5) {
+		admission_policy = policy;
+		retry_after = retry_seconds;
+	}
+	
+	/**
+	 * Sets the number of event loop threads used in EPOLL mode
+	 * @param count: Reactor threads (default: min(4, hardware threads))
+	 */
+	void setEventLoopThreads(size_t count) { event_loop_count = count > 0 ? count : 1; }
+	
+	/**
+	 * Gives every event loop a listening socket of its own (EPOLL mode, before start())
+	 * All of them are bound to the port with SO_REUSEPORT, so the kernel spreads
+	 * incoming connections over the loops: each loop accepts and serves its own
+	 * connections on the core it is pinned to, with no hand-off between threads
+	 * @param enabled: true for one listener per loop, false (default) for a single shared one
+	 */
+	void setShardedListeners(bool enabled) { sharded_listeners = enabled; }
+	
+	/**
+	 * Sets the length of the accept queue of the listening socket(s) (before start())
+	 * @param backlog: Pending connections the kernel holds (default: SOMAXCONN, capped by net.core.somaxconn)
+	 */
+	void setListenBacklog(int backlog) { listen_backlog = backlog > 0 ? backlog : SOMAXCONN; }
+	
+	/**
+	 * Keeps a content-addressed copy of every file that arrives with a SHA-256
+	 * hash, so the same content sent again (under any name) isn't transferred:
+	 * the sender is told the file is complete and it is created from the copy
+	 * @param directory: Store location; should be on the same filesystem as the received files for reflinks
+	 * @return: false if the store directory can't be created
+	 */
+	bool setContentStore(const std::string& directory);
+	
 	/**
 	 * Gets list of connected clients
 	 * @return: Vector of client information
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+struct io_uring;  // From liburing, only needed by the implementation
+
+/**
+ * IoUringEngine moves file data between a file and a socket with io_uring
+ * Instead of one blocking syscall per chunk, a whole batch of
+ * read -> send (or recv -> write) pairs is queued as one chain of linked
+ * SQEs and submitted with a single io_uring_enter(). Buffers and both
+ * descriptors are registered with the ring once per transfer, so the
+ * kernel doesn't have to map them again for every operation.
+ *
+ * Only available when built with liburing (FT_ENABLE_IO_URING) and the
+ * running kernel allows io_uring; callers fall back to another mode otherwise.
+ */
+class IoUringEngine {
+private:
+	struct io_uring* ring;
+	unsigned int batch_size;          // read/send (or recv/write) pairs per submission
+	size_t chunk_size;                // Bytes per registered buffer
+	std::vector<char*> buffers;       // Registered (page aligned) buffers, one per pair
+	bool initialized;
+
+	/**
+	 * Registers buffers and the two descriptors used by a transfer
+	 * @return: true on success
+	 */
+	bool setup(int file_fd, int socket_fd);
+
+	/**
+	 * Unregisters descriptors so the ring can be reused for the next transfer
+	 */
+	void teardown();
+
+public:
+	/**
+	 * @param batch_size: Number of chunk pairs queued per submission (default: 8)
+	 * @param chunk_size: Size of each registered buffer (default: 256KB)
+	 */
+	IoUringEngine(unsigned int batch_size = 8, size_t chunk_size = 256 * 1024);
+	~IoUringEngine();
+
+	/**
+	 * Checks whether io_uring support was compiled in and the kernel accepts it
+	 * @return: true if transfers can use this engine
+	 */
+	static bool isAvailable();
+
+	/**
+	 * Sends length bytes of file_fd starting at offset to socket_fd
+	 * @param progress: Called with the total sent after every batch; return false to abort
+	 * @param total_sent: Bytes sent so far, updated as batches complete
+	 * @return: true if all bytes were sent
+	 */
+	bool sendFile(int file_fd, int socket_fd, uint64_t length, uint64_t& total_sent,
+			std::function<bool(uint64_t)> progress);
+
+	/**
+	 * Receives length bytes from socket_fd and writes them to file_fd from offset 0
+	 * @param progress: Called with the total received after every batch; return false to abort
+	 * @param total_received: Bytes written so far, updated as batches complete
+	 * @return: true if all bytes were received and written
+	 */
+	bool receiveFile(int socket_fd, int file_fd, uint64_t length, uint64_t& total_received,
+			std::function<bool(uint64_t)> progress);
+};
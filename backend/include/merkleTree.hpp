@@ -0,0 +1,106 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/**
+ * Hash tree over the fixed-size chunks of a file
+ * Leaves are the CRC32C of each chunk; every parent is the CRC32C of its
+ * two children's hashes (an odd node out is carried up unchanged). The
+ * root, sent in FILE_INFO, vouches for the leaf list, and the leaves let
+ * the receiver check every chunk on its own as it lands, so a corrupt
+ * chunk is sent again by itself instead of failing the whole file.
+ *
+ * Like the rest of the transfer checksums this catches transmission and
+ * storage errors, not deliberate tampering.
+ */
+class MerkleTree {
+private:
+	uint64_t file_size;
+	uint64_t chunk_size;
+	std::vector<uint32_t> leaves;
+
+public:
+	static const uint64_t DEFAULT_CHUNK_SIZE = 1024 * 1024;
+	static const uint64_t MIN_CHUNK_SIZE = 4096;
+	static const uint64_t MAX_LEAVES = 16 * 1024 * 1024;   // 64MB of leaf hashes
+
+	MerkleTree() : file_size(0), chunk_size(DEFAULT_CHUNK_SIZE) {}
+
+	/**
+	 * Empty tree (all leaves 0) for a file of the given geometry
+	 */
+	MerkleTree(uint64_t file_size, uint64_t chunk_size);
+
+	/**
+	 * @return: true if a tree with these parameters is reasonable to build and send
+	 */
+	static bool validGeometry(uint64_t file_size, uint64_t chunk_size);
+
+	/**
+	 * Hashes every chunk of a file, spread over several threads
+	 * @param fd: Readable descriptor of a file of file_size bytes
+	 * @param threads: Worker threads (0: one per hardware thread)
+	 * @return: false if the file couldn't be read
+	 */
+	bool build(int fd, unsigned int threads = 0);
+
+	/**
+	 * Re-hashes chunks [first, last) of a file already on disk, in parallel
+	 * @return: Indices of chunks whose hash doesn't match their leaf (or couldn't be read)
+	 */
+	std::vector<uint64_t> verify(int fd, uint64_t first, uint64_t last, unsigned int threads = 0) const;
+
+	uint32_t root() const;
+	std::string rootHex() const;
+
+	uint64_t leafCount() const { return leaves.size(); }
+	uint64_t chunkSize() const { return chunk_size; }
+	uint64_t chunkOffset(uint64_t index) const { return index * chunk_size; }
+	uint64_t chunkLength(uint64_t index) const;
+
+	uint32_t leaf(uint64_t index) const { return leaves[index]; }
+	void setLeaf(uint64_t index, uint32_t hash) { leaves[index] = hash; }
+};
+
+/**
+ * Checks chunks against their leaves while a file streams in front to back
+ * Data is hashed as it is written, so each chunk is judged the moment its
+ * last byte lands and nothing has to be read back at the end.
+ */
+class ChunkVerifier {
+private:
+	const MerkleTree& tree;
+	uint64_t position;               // File offset of the next byte
+	uint32_t crc;                    // Hash of the current chunk so far
+	std::vector<uint64_t> bad;
+
+	/**
+	 * Bookkeeping after `length` bytes of the current chunk were hashed
+	 */
+	void advance(uint64_t length);
+
+public:
+	/**
+	 * @param start: Offset the stream starts at, a multiple of the chunk size
+	 */
+	ChunkVerifier(const MerkleTree& tree, uint64_t start);
+
+	/**
+	 * Hashes the next bytes of the stream
+	 */
+	void update(const char* data, size_t length);
+
+	/**
+	 * Hashes the next bytes of the stream from the file they were written to
+	 * (for zero-copy paths where the data never reached user space)
+	 * @return: false if the file couldn't be read
+	 */
+	bool updateFromFile(int fd, uint64_t length);
+
+	/**
+	 * @return: Chunks that didn't match so far, in file order
+	 */
+	const std::vector<uint64_t>& badChunks() const { return bad; }
+};
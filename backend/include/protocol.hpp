@@ -12,13 +12,37 @@ enum class MessageType {
 	FILE_CHUNK,
 	TRANSFER_PROGRESS,
 	DISCONNECT,
-	ERROR
+	ERROR,
+	HELLO,            // Connect-time negotiation (always sent as JSON)
+	STATUS,           // Server replies: ready / receiving / complete / error
+	FILE_STRIPE,      // One range of a striped transfer, raw bytes follow
+	FILE_CHECKSUM,    // Checksum of the data just sent, verified before "complete"
+	MERKLE_LEAVES,    // A batch of per-chunk hashes, sent before the data when the server asks
+	FILE_DELTA,       // One delta operation: copy basis blocks, or literal bytes that follow
+	FILE_BATCH        // Manifest of several small files, their bodies follow back to back
+};
+
+/**
+ * Encoding used for control messages on a connection
+ * JSON:   unframed JSON text, easy to read in a packet capture (legacy default)
+ * BINARY: fixed FrameHeader + MessagePack payload, negotiated with HELLO
+ */
+enum class WireFormat {
+	JSON,
+	BINARY
 };
 
 struct FileInfo {
 	std::string filename;
 	uint64_t filesize;
-	std::string checksum;
+	std::string checksum;  // Checksum algorithm the sender offers ("crc32c"), empty for none
+	int64_t mtime;         // Source modification time; 0 if the sender can't resume
+	std::string merkle_root;   // Root of the sender's chunk hash tree, empty if it sent none
+	uint64_t chunk_size = 0;   // Bytes per tree leaf
+	bool delta = false;        // Sender can send a delta against an existing copy
+	std::vector<std::string> compression;   // Codecs the sender can compress the data with ("lz4")
+	uint32_t mode = 0644;      // Permission bits of the source
+	std::string sha256;        // Content hash (hex) for the receiver's content store, empty if not sent
 };
 
 struct TransferMessage {
@@ -27,4 +51,189 @@ struct TransferMessage {
 
 	std::string serialize() const;
 	static TransferMessage deserialize(const std::string& jsonStr);
+
+	/**
+	 * Encodes the message for the given wire format
+	 * STATUS messages are sent as the bare data object in JSON mode,
+	 * which is what servers have always replied with
+	 */
+	std::string encode(WireFormat format) const;
+};
+
+/**
+ * Builds a STATUS reply, e.g. statusMessage({{"status", "ready"}})
+ */
+TransferMessage statusMessage(nlohmann::json data);
+
+/**
+ * Binary frame layout (all fields big-endian, 16 bytes):
+ *   magic(4) version(1) type(1) flags(2) length(8)
+ * followed by `length` payload bytes
+ */
+const uint32_t FRAME_MAGIC = 0x4C465431;     // "LFT1"
+const uint8_t FRAME_VERSION = 1;
+const size_t FRAME_HEADER_SIZE = 16;
+const uint16_t FRAME_FLAG_MSGPACK = 0x0001;  // Payload is MessagePack-encoded message data
+// Largest JSON control message accepted: unframed JSON has no length field, so
+// this bounds what a peer can make us buffer (delta signature batches are ~130KB)
+const size_t MAX_CONTROL_MESSAGE = 1024 * 1024;
+// Frames only carry control messages (file data is sent raw), so the same
+// bound applies; it is also the most a FrameDecoder's buffer ever holds
+const uint64_t MAX_FRAME_PAYLOAD = MAX_CONTROL_MESSAGE;
+const int HELLO_TIMEOUT_MS = 5000;           // Clients wait this long for a HELLO reply before assuming an older server
+
+struct FrameHeader {
+	uint32_t magic;
+	uint8_t version;
+	uint8_t type;        // MessageType
+	uint16_t flags;
+	uint64_t length;     // Payload size in bytes
+};
+
+/**
+ * Writes a header in wire byte order
+ * @param out: Destination, at least FRAME_HEADER_SIZE bytes
+ */
+void encodeFrameHeader(const FrameHeader& header, uint8_t* out);
+
+/**
+ * Streaming frame decoder
+ * Bytes can be fed in any split (one byte at a time, several frames at
+ * once); the decoder keeps its own state between calls. The header is
+ * assembled in a fixed array and the payload in a buffer that is reused
+ * from frame to frame, so reassembling frames doesn't allocate once the
+ * buffer has grown to the largest payload. That covers the framing layer
+ * only: MessageReader::next() still decodes each payload into a
+ * nlohmann::json object, which allocates per message.
+ */
+class FrameDecoder {
+public:
+	enum class Status {
+		NEED_MORE,     // Frame incomplete, feed more bytes
+		FRAME_READY,   // header()/payload() hold a full frame
+		BAD_FRAME      // Wrong magic/version, unknown message type or oversized payload
+	};
+
+	FrameDecoder();
+
+	/**
+	 * Consumes bytes up to the end of the current frame
+	 * @param status: Result after consuming
+	 * @return: Number of bytes consumed (the rest belongs to later frames)
+	 */
+	size_t feed(const uint8_t* data, size_t length, Status& status);
+
+	/**
+	 * Starts the next frame (call after handling FRAME_READY)
+	 */
+	void reset();
+
+	const FrameHeader& header() const { return current; }
+	const uint8_t* payload() const { return payload_buffer.data(); }
+	size_t payloadSize() const { return payload_filled; }
+
+private:
+	uint8_t header_bytes[FRAME_HEADER_SIZE];
+	size_t header_filled;
+	FrameHeader current;
+	std::vector<uint8_t> payload_buffer;
+	size_t payload_filled;
 };
+
+/**
+ * Splits a received byte stream into TransferMessages
+ * Handles both wire formats; the format can be switched mid-stream
+ * (after HELLO) without losing bytes that were already received.
+ * Every message is parsed into a json object (allocates, see FrameDecoder)
+ */
+class MessageReader {
+public:
+	MessageReader();
+
+	void setFormat(WireFormat wire_format) { format = wire_format; }
+	WireFormat getFormat() const { return format; }
+
+	/**
+	 * Appends bytes received from the socket
+	 */
+	void feed(const char* data, size_t length);
+
+	/**
+	 * Pops the next complete message
+	 * @return: true if msg was filled, false if more bytes are needed
+	 * @throws: std::runtime_error when the stream can't be trusted any more (isCorrupt():
+	 *          bad frame header or payload, unbalanced or oversized JSON),
+	 *          json::exception on a JSON message that doesn't parse (it is skipped)
+	 */
+	bool next(TransferMessage& msg);
+
+	/**
+	 * Bytes received but not part of any message so far
+	 */
+	size_t buffered() const { return pending.size() - pending_offset; }
+
+	/**
+	 * Removes and returns the unparsed bytes (e.g. file data that followed a control message)
+	 */
+	std::string takeBuffered();
+
+	/**
+	 * A corrupt frame header means the stream can't be resynchronized
+	 */
+	bool isCorrupt() const { return corrupt; }
+
+private:
+	WireFormat format;
+	bool corrupt;
+	std::string pending;
+	size_t pending_offset;
+	FrameDecoder decoder;
+
+	// Progress of the brace scan through the JSON message at pending_offset,
+	// kept between calls so every byte is looked at once
+	size_t scanned;
+	int depth;
+	bool in_string;
+	bool escaped;
+
+	/**
+	 * Continues the brace scan over newly received bytes
+	 * @return: Length of the complete message at pending_offset, 0 if it isn't complete yet
+	 */
+	size_t scanJson();
+};
+
+/**
+ * Server side of the HELLO exchange
+ * @param hello: HELLO message received from the client
+ * @param reply: Filled with the STATUS reply to send (always as JSON)
+ * @return: Format to use for the rest of the connection
+ */
+WireFormat negotiateWireFormat(const TransferMessage& hello, TransferMessage& reply);
+
+/**
+ * Checks a file name received from a peer before anything is created under it
+ * Relative paths with '/' separators are fine (directory transfers); absolute
+ * paths and "", "." or ".." components are not
+ * @return: true if the name stays inside the receiving directory
+ */
+bool isSafeRelativePath(const std::string& name);
+
+/**
+ * Sends a whole buffer on a blocking socket
+ * @return: true if every byte was sent
+ */
+bool sendAll(int socket_fd, const char* data, size_t length);
+
+/**
+ * Encodes and sends a message on a blocking socket
+ * @return: true if the whole message was sent
+ */
+bool sendMessage(int socket_fd, const TransferMessage& msg, WireFormat format);
+
+/**
+ * CRC32C of a whole file, as hex (see checksum.hpp)
+ * Transfers hash inline; this is for checking a file after the fact
+ * @return: Empty string if the file can't be read
+ */
+std::string calculateChecksum(const std::string& filepath);
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Lock-free bounded rings for handing ownership of objects (buffers,
+ * connections) from one thread to another without copying them
+ * Storage is inline, so a ring never allocates; Capacity must be a power
+ * of two. Both are non-blocking: callers decide how to wait.
+ */
+
+static const size_t CACHE_LINE_SIZE = 64;
+
+/**
+ * One producer thread, one consumer thread
+ * Head and tail live on their own cache lines, so the two sides only touch
+ * shared lines when the ring actually changes hands
+ */
+template <typename T, size_t Capacity>
+class SpscRing {
+	static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+private:
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> head;   // Next slot to pop (consumer)
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail;   // Next slot to push (producer)
+	alignas(CACHE_LINE_SIZE) T slots[Capacity];
+
+public:
+	SpscRing() : head(0), tail(0) {}
+
+	/**
+	 * Producer only
+	 * @return: false if the ring is full
+	 */
+	bool tryPush(const T& item) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == Capacity) {
+			return false;
+		}
+		slots[t & (Capacity - 1)] = item;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * Consumer only
+	 * @return: false if the ring is empty
+	 */
+	bool tryPop(T& item) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		item = slots[h & (Capacity - 1)];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool empty() const {
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	}
+};
+
+/**
+ * Any number of producer threads, one consumer thread
+ * Every slot carries a sequence number (Vyukov's bounded queue): producers
+ * claim a slot by advancing the tail with a CAS and publish it by bumping
+ * its sequence, so the consumer never sees a half-written slot.
+ */
+template <typename T, size_t Capacity>
+class MpscRing {
+	static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+private:
+	struct Slot {
+		std::atomic<size_t> sequence;
+		T item;
+	};
+
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail;   // Shared by producers
+	alignas(CACHE_LINE_SIZE) size_t head;                // Consumer only
+	alignas(CACHE_LINE_SIZE) Slot slots[Capacity];
+
+public:
+	MpscRing() : tail(0), head(0) {
+		for (size_t i = 0; i < Capacity; i++) {
+			slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	/**
+	 * Any thread
+	 * @return: false if the ring is full
+	 */
+	bool tryPush(const T& item) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		while (true) {
+			Slot& slot = slots[t & (Capacity - 1)];
+			size_t sequence = slot.sequence.load(std::memory_order_acquire);
+			intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(t);
+
+			if (diff == 0) {
+				if (tail.compare_exchange_weak(t, t + 1, std::memory_order_relaxed)) {
+					slot.item = item;
+					slot.sequence.store(t + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false;  // Slot not consumed yet: full
+			} else {
+				t = tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	/**
+	 * Consumer only
+	 * @return: false if the ring is empty (or the next item isn't published yet)
+	 */
+	bool tryPop(T& item) {
+		Slot& slot = slots[head & (Capacity - 1)];
+		if (slot.sequence.load(std::memory_order_acquire) != head + 1) {
+			return false;
+		}
+		item = slot.item;
+		slot.sequence.store(head + Capacity, std::memory_order_release);
+		head++;
+		return true;
+	}
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * SHA-256, the content hash that identifies files in the receiver's
+ * content store (contentStore.hpp). CRC32C catches transmission errors,
+ * but anyone can make two files with the same CRC; a store that hands out
+ * one sender's bytes for another sender's file needs a hash nobody can
+ * collide on purpose.
+ *
+ * Uses the x86 SHA extensions when the CPU has them (checked once at
+ * runtime, about 5x faster) and portable code otherwise.
+ */
+const char* const HASH_SHA256 = "sha256";
+
+class Sha256 {
+private:
+	uint32_t state[8];
+	uint64_t total_length;       // Bytes hashed so far
+	unsigned char pending[64];   // Start of an incomplete block
+	size_t pending_length;
+
+public:
+	Sha256();
+
+	void update(const void* data, size_t length);
+
+	/**
+	 * Pads and finishes the hash; the object can't be updated afterwards
+	 * @return: Digest as 64 lowercase hex digits (the wire format)
+	 */
+	std::string finishHex();
+};
+
+/**
+ * Hashes a whole file (from offset 0, whatever the descriptor's position)
+ * @param hex: Digest as 64 lowercase hex digits
+ * @return: false if the file couldn't be read
+ */
+bool sha256File(int fd, std::string& hex);
+
+/**
+ * @return: true if hex looks like a digest from finishHex() (safe to use in a path)
+ */
+bool isSha256Hex(const std::string& hex);
+
+/**
+ * @return: "sha-ni" or "software", for logging
+ */
+const char* sha256Implementation();
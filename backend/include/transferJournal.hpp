@@ -0,0 +1,157 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <memory>
+#include <cstdint>
+#include "protocol.hpp"
+
+/**
+ * Set of disjoint byte ranges [start, end), merged as they are added
+ * Used to track which parts of a file have arrived (any order, any overlap)
+ */
+class RangeSet {
+private:
+	std::map<uint64_t, uint64_t> spans;   // start -> end, never touching each other
+	uint64_t total;                       // Bytes covered by all spans
+
+public:
+	RangeSet() : total(0) {}
+
+	/**
+	 * Adds [offset, offset + length), merging with overlapping/adjacent spans
+	 * @return: Number of bytes that were not covered before
+	 */
+	uint64_t add(uint64_t offset, uint64_t length);
+
+	/**
+	 * @return: true if [offset, offset + length) is covered entirely
+	 */
+	bool contains(uint64_t offset, uint64_t length) const;
+
+	/**
+	 * @return: Length of the span starting at 0 (what a sequential resume can skip)
+	 */
+	uint64_t prefix() const;
+
+	uint64_t covered() const { return total; }
+	bool empty() const { return spans.empty(); }
+	const std::map<uint64_t, uint64_t>& spanMap() const { return spans; }
+
+	void clear() {
+		spans.clear();
+		total = 0;
+	}
+};
+
+/**
+ * Journal file shared by a TransferJournal and the checkpoints taken from it
+ * (defined in transferJournal.cpp)
+ */
+struct JournalFile;
+
+/**
+ * Contents of a checkpoint, copied so it can be written on another thread
+ * (see TransferJournal::snapshot())
+ */
+struct JournalCheckpoint {
+	std::string journal_path;    // Empty: nothing to write
+	FileInfo file_info;
+	RangeSet ranges;
+	std::shared_ptr<JournalFile> file;
+};
+
+/**
+ * Sidecar journal of a partially received file
+ * Resumable transfers are written to "<name>.part"; next to it,
+ * "<name>.part.journal" records the completed ranges, the identity of the
+ * source (size + modification time) and a rolling checksum over the end of
+ * every range. If the connection drops, the next FILE_INFO for the same
+ * file picks up from the recorded ranges instead of starting from zero.
+ *
+ * The journal is only rewritten at checkpoints (every JOURNAL_INTERVAL bytes
+ * and when a transfer is interrupted). The data file is synced first, so
+ * the journal never claims bytes that aren't on disk. That sync can take a
+ * while: threads that serve other connections too take a snapshot() and
+ * write() it elsewhere. Once discarded, a journal is never written again,
+ * even by a checkpoint still on its way.
+ */
+class TransferJournal {
+private:
+	std::string journal_path;    // Empty: ranges are tracked in memory only
+	FileInfo file_info;
+	RangeSet completed;
+	uint64_t unsynced;           // Bytes recorded since the last checkpoint
+	std::shared_ptr<JournalFile> file;
+
+	/**
+	 * Adler-32 over the last CHECK_WINDOW bytes of every range
+	 * Cheap to recompute, and catches partial files that were truncated,
+	 * replaced or not flushed after the journal was written
+	 */
+	static bool rangeChecksum(const RangeSet& ranges, int data_fd, uint32_t& checksum);
+
+	/**
+	 * Reads the journal and checks it against file_info and the data file
+	 * @return: true if its ranges can be trusted
+	 */
+	bool load(int data_fd);
+
+public:
+	static const uint64_t JOURNAL_INTERVAL = 64ull * 1024 * 1024;
+	static const size_t CHECK_WINDOW = 64 * 1024;
+
+	TransferJournal();
+
+	/**
+	 * @return: Name of the partial data file for an output file
+	 */
+	static std::string partPath(const std::string& output_filename) { return output_filename + ".part"; }
+
+	/**
+	 * Starts tracking a transfer
+	 * @param part_path: Partial data file (opened read/write); empty keeps the journal in memory only
+	 * @param data_fd: Descriptor of the partial file, used to validate a journal from an earlier attempt
+	 * @return: true if ranges from an earlier attempt were recovered
+	 */
+	bool open(const std::string& part_path, const FileInfo& info, int data_fd);
+
+	/**
+	 * Marks bytes as written, checkpointing every JOURNAL_INTERVAL bytes
+	 * Call it after anything that reads the bytes back from the page cache (checksums)
+	 * @param data_fd: Data file to checkpoint; -1 leaves checkpoints to the caller (see checkpointDue())
+	 * @return: Number of newly covered bytes (overlapping data isn't counted twice)
+	 */
+	uint64_t record(uint64_t offset, uint64_t length, int data_fd);
+
+	/**
+	 * @return: true once JOURNAL_INTERVAL bytes were recorded since the last checkpoint or snapshot
+	 */
+	bool checkpointDue() const { return isPersistent() && unsynced >= JOURNAL_INTERVAL; }
+
+	/**
+	 * Syncs the data file and atomically replaces the journal
+	 * @return: false if either could not be written
+	 */
+	bool checkpoint(int data_fd);
+
+	/**
+	 * Copies what the next checkpoint would write, for write() on another thread
+	 */
+	JournalCheckpoint snapshot();
+
+	/**
+	 * Writes a snapshot: same as checkpoint(), from any thread
+	 * @param data_fd: Descriptor of the data file (e.g. a dup() the caller closes afterwards)
+	 * @return: false if nothing was written (error, or the journal was discarded meanwhile)
+	 */
+	static bool write(const JournalCheckpoint& checkpoint, int data_fd);
+
+	/**
+	 * Deletes the journal file (transfer finished or abandoned)
+	 */
+	void discard();
+
+	const RangeSet& ranges() const { return completed; }
+	bool isPersistent() const { return !journal_path.empty(); }
+};
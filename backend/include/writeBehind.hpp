@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * Keeps a file written front to back from piling up dirty pages
+ * Every WINDOW bytes, writeback of the new window is started in the
+ * background (sync_file_range), then the window before it is waited for
+ * and dropped from the page cache. Disk writes overlap the network instead
+ * of arriving in one stall when the kernel starts throttling, and a file
+ * larger than RAM doesn't push everything else out of the cache.
+ * Writes that don't continue the previous one restart the window.
+ *
+ * An event loop must never wait for the disk: its instances only start
+ * writeback, and drop whatever part of the previous window is already clean.
+ */
+class WriteBehind {
+private:
+	bool wait;                   // Wait for the previous window's writeback before dropping it
+	uint64_t window_start;       // Start of the window being filled
+	uint64_t end;                // End of the contiguous data written so far
+	uint64_t flushing_start;     // Window whose writeback was started last (== window_start: none)
+
+public:
+	static const uint64_t WINDOW = 8 * 1024 * 1024;
+
+	/**
+	 * @param wait: false for threads that serve other connections too (never blocks on writeback)
+	 */
+	explicit WriteBehind(bool wait = true) : wait(wait), window_start(0), end(0), flushing_start(0) {}
+
+	/**
+	 * Notes [offset, offset + length) as written and starts/completes writeback as windows fill
+	 */
+	void written(int data_fd, uint64_t offset, uint64_t length);
+
+	void reset() { window_start = end = flushing_start = 0; }
+};
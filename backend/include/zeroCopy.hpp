@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+
+/**
+ * send() without the user-to-kernel copy (SO_ZEROCOPY + MSG_ZEROCOPY)
+ * The kernel pins the caller's pages and transmits from them, so a buffer
+ * handed to send() must not be reused until the kernel reports it released
+ * through the socket's error queue. Every send() returns a sequence number;
+ * a buffer may be recycled once isDone() says so for its sequence.
+ *
+ * The kernel still copies when it has to (loopback, devices without
+ * scatter-gather); notifications say so, and zeroCopyBytes() only counts
+ * bytes that really went out without a copy. Kernels or sockets without
+ * support are detected when the sender is created and everything goes
+ * through plain send(), where every sequence is done at once.
+ *
+ * The kernel numbers zero-copy sends per socket, from 0 for the socket's
+ * whole life: keep one sender per socket, not one per transfer, or later
+ * completions are mistaken for ones already reported.
+ *
+ * Pinning and notifications cost more than copying small buffers: use it
+ * for chunks of 64KB and up.
+ */
+class ZeroCopySender {
+private:
+	int socket_fd;
+	bool active;                   // MSG_ZEROCOPY in use (false: plain send())
+	uint64_t calls;                // Zero-copy send calls made (kernel ids 0 .. calls - 1)
+	uint64_t released;             // Calls the kernel has reported released, in order
+	std::deque<size_t> lengths;    // Bytes of every call not released yet
+	uint64_t zero_copy_bytes;
+	uint64_t copied_bytes;
+
+	/**
+	 * Marks calls up to kernel id `last` released
+	 * @param copied: The kernel fell back to copying for these
+	 */
+	void release(uint32_t last, bool copied);
+
+public:
+	/**
+	 * @param enable: false always uses plain send()
+	 */
+	ZeroCopySender(int socket_fd, bool enable);
+
+	ZeroCopySender(const ZeroCopySender&) = delete;
+	ZeroCopySender& operator=(const ZeroCopySender&) = delete;
+
+	bool enabled() const { return active; }
+
+	/**
+	 * Sends all of data (zero-copy when enabled); the memory must stay
+	 * untouched until isDone(sequence()) afterwards
+	 * @return: false on socket error
+	 */
+	bool send(const char* data, size_t length);
+
+	/**
+	 * @return: Sequence number covering everything sent so far
+	 */
+	uint64_t sequence() const { return calls; }
+
+	/**
+	 * @return: true once the kernel no longer needs the data sent up to `seq`
+	 */
+	bool isDone(uint64_t seq) const { return released >= seq; }
+
+	/**
+	 * Reads pending completion notifications without blocking
+	 */
+	void reap();
+
+	/**
+	 * Blocks until isDone(seq)
+	 * @param timeout_ms: Maximum wait
+	 * @return: false on timeout
+	 */
+	bool wait(uint64_t seq, int timeout_ms);
+
+	uint64_t zeroCopyBytes() const { return zero_copy_bytes; }
+	uint64_t copiedBytes() const { return copied_bytes; }
+};
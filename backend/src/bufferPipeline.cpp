@@ -0,0 +1,88 @@
+#include "bufferPipeline.hpp"
+#include <thread>
+
+BufferPipeline::BufferPipeline(size_t depth, size_t buffer_size)
+	: buffer_size(buffer_size > 0 ? buffer_size : BufferPool::MIN_BUFFER_SIZE),
+	depth(depth < 2 ? 2 : (depth > MAX_DEPTH ? MAX_DEPTH : depth)), finished(false), aborted(false), waiters(0) {
+	// Pooled buffers are page aligned, which keeps the door open for O_DIRECT
+	for (size_t i = 0; i < this->depth; i++) {
+		storage[i] = PooledBuffer(this->buffer_size);
+		buffers[i] = {storage[i].data(), 0, 0};
+		free_buffers.tryPush(&buffers[i]);
+	}
+}
+
+template <typename Ready>
+void BufferPipeline::waitUntil(Ready ready) {
+	// The other side usually answers within microseconds: don't sleep for that
+	for (int spin = 0; spin < 100; spin++) {
+		if (ready()) {
+			return;
+		}
+		std::this_thread::yield();
+	}
+
+	// Announce the sleeper before the final check; wake() checks waiters after
+	// publishing, so one of the two always sees the other (seq_cst on both sides)
+	waiters.fetch_add(1);
+	{
+		std::unique_lock<std::mutex> lock(wait_mutex);
+		wait_cv.wait(lock, ready);
+	}
+	waiters.fetch_sub(1);
+}
+
+void BufferPipeline::wake() {
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (waiters.load() > 0) {
+		std::lock_guard<std::mutex> lock(wait_mutex);
+		wait_cv.notify_all();
+	}
+}
+
+BufferPipeline::Buffer* BufferPipeline::acquire() {
+	Buffer* buffer = nullptr;
+	waitUntil([&]() { return aborted.load() || free_buffers.tryPop(buffer); });
+	if (!buffer) {
+		return nullptr;
+	}
+	buffer->length = 0;
+	return buffer;
+}
+
+void BufferPipeline::push(Buffer* buffer) {
+	// Never full: the ring holds every buffer there is
+	filled_buffers.tryPush(buffer);
+	wake();
+}
+
+void BufferPipeline::finish() {
+	finished.store(true);
+	wake();
+}
+
+BufferPipeline::Buffer* BufferPipeline::pop() {
+	Buffer* buffer = nullptr;
+	waitUntil([&]() {
+		// Anything pushed before finish() is still delivered
+		return filled_buffers.tryPop(buffer) || aborted.load() || (finished.load() && filled_buffers.empty());
+	});
+	if (buffer && aborted.load()) {
+		return nullptr;
+	}
+	return buffer;
+}
+
+void BufferPipeline::release(Buffer* buffer) {
+	free_buffers.tryPush(buffer);
+	wake();
+}
+
+void BufferPipeline::abandon(Buffer* buffer) {
+	storage[buffer - buffers].leak();
+}
+
+void BufferPipeline::abort() {
+	aborted.store(true);
+	wake();
+}
@@ -0,0 +1,202 @@
+#include "bufferPool.hpp"
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+static const size_t SIZE_CLASSES = 15;      // 4KB .. 64MB
+
+BufferPool::BufferPool(size_t buffer_size) : head(0), buffer_size(buffer_size), count(0) {
+	for (uint32_t i = 0; i < MAX_BUFFERS; i++) {
+		slots[i] = nullptr;
+		next[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+BufferPool::~BufferPool() {
+	for (const auto& arena : arenas) {
+		munmap(arena.first, arena.second);
+	}
+}
+
+/**
+ * Pools are created on first use and live until exit; the classes are powers of two
+ */
+BufferPool* BufferPool::forSize(size_t size) {
+	static std::unique_ptr<BufferPool> pools[SIZE_CLASSES];
+	static std::mutex pools_mutex;
+
+	if (size > MAX_BUFFER_SIZE) {
+		return nullptr;
+	}
+
+	size_t size_class = 0;
+	size_t class_size = MIN_BUFFER_SIZE;
+	while (class_size < size) {
+		class_size <<= 1;
+		size_class++;
+	}
+
+	std::lock_guard<std::mutex> lock(pools_mutex);
+	if (!pools[size_class]) {
+		pools[size_class].reset(new BufferPool(class_size));
+	}
+	return pools[size_class].get();
+}
+
+/**
+ * Treiber stack pop; the tag in the upper half makes a head that was popped
+ * and pushed back in between (ABA) fail the CAS
+ */
+bool BufferPool::pop(uint32_t& index) {
+	uint64_t old_head = head.load(std::memory_order_acquire);
+	while (true) {
+		uint32_t top = static_cast<uint32_t>(old_head);
+		if (top == 0) {
+			return false;
+		}
+
+		uint64_t tag = (old_head >> 32) + 1;
+		uint64_t new_head = (tag << 32) | next[top - 1].load(std::memory_order_relaxed);
+		if (head.compare_exchange_weak(old_head, new_head, std::memory_order_acq_rel, std::memory_order_acquire)) {
+			index = top - 1;
+			return true;
+		}
+	}
+}
+
+void BufferPool::push(uint32_t index) {
+	uint64_t old_head = head.load(std::memory_order_relaxed);
+	while (true) {
+		next[index].store(static_cast<uint32_t>(old_head), std::memory_order_relaxed);
+
+		uint64_t tag = (old_head >> 32) + 1;
+		uint64_t new_head = (tag << 32) | (index + 1);
+		if (head.compare_exchange_weak(old_head, new_head, std::memory_order_release, std::memory_order_relaxed)) {
+			return;
+		}
+	}
+}
+
+uint32_t BufferPool::acquire() {
+	uint32_t index;
+	if (pop(index)) {
+		return index;
+	}
+	return grow();
+}
+
+void BufferPool::release(uint32_t index) {
+	push(index);
+}
+
+/**
+ * Arenas are at least one huge page: reserved huge pages (MAP_HUGETLB) when
+ * the administrator set some aside, otherwise transparent huge pages if enabled
+ */
+uint32_t BufferPool::grow() {
+	std::lock_guard<std::mutex> lock(grow_mutex);
+
+	// Another thread may have grown the pool (or buffers came back) while we waited
+	uint32_t index;
+	if (pop(index)) {
+		return index;
+	}
+
+	uint32_t first = count.load(std::memory_order_relaxed);
+	if (first >= MAX_BUFFERS) {
+		return NO_BUFFER;
+	}
+
+	uint32_t buffers = static_cast<uint32_t>((HUGE_PAGE_SIZE + buffer_size - 1) / buffer_size);
+	if (buffers > MAX_BUFFERS - first) {
+		buffers = MAX_BUFFERS - first;
+	}
+	size_t arena_size = (buffers * buffer_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+	void* arena = mmap(nullptr, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (arena == MAP_FAILED) {
+		arena = mmap(nullptr, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (arena == MAP_FAILED) {
+			return NO_BUFFER;
+		}
+		madvise(arena, arena_size, MADV_HUGEPAGE);
+	}
+	arenas.emplace_back(arena, arena_size);
+
+	for (uint32_t i = 0; i < buffers; i++) {
+		slots[first + i] = static_cast<char*>(arena) + i * buffer_size;
+	}
+	count.store(first + buffers, std::memory_order_release);
+
+	for (uint32_t i = 1; i < buffers; i++) {
+		push(first + i);
+	}
+	return first;
+}
+
+PooledBuffer::PooledBuffer(size_t size) : pool(BufferPool::forSize(size)), index(BufferPool::NO_BUFFER),
+	buffer(nullptr), capacity(0) {
+	if (pool) {
+		index = pool->acquire();
+	}
+	if (index != BufferPool::NO_BUFFER) {
+		buffer = pool->data(index);
+		capacity = pool->bufferSize();
+		return;
+	}
+
+	// Too big for any pool, or the pool is exhausted: a private buffer
+	pool = nullptr;
+	void* memory = nullptr;
+	size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	if (posix_memalign(&memory, page, size > 0 ? size : page) != 0) {
+		throw std::bad_alloc();
+	}
+	buffer = static_cast<char*>(memory);
+	capacity = size;
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other) noexcept
+	: pool(other.pool), index(other.index), buffer(other.buffer), capacity(other.capacity) {
+	other.pool = nullptr;
+	other.index = BufferPool::NO_BUFFER;
+	other.buffer = nullptr;
+	other.capacity = 0;
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept {
+	if (this != &other) {
+		reset();
+		pool = other.pool;
+		index = other.index;
+		buffer = other.buffer;
+		capacity = other.capacity;
+		other.pool = nullptr;
+		other.index = BufferPool::NO_BUFFER;
+		other.buffer = nullptr;
+		other.capacity = 0;
+	}
+	return *this;
+}
+
+void PooledBuffer::leak() {
+	pool = nullptr;
+	index = BufferPool::NO_BUFFER;
+	buffer = nullptr;
+	capacity = 0;
+}
+
+void PooledBuffer::reset() {
+	if (pool) {
+		pool->release(index);
+	} else {
+		free(buffer);
+	}
+	pool = nullptr;
+	index = BufferPool::NO_BUFFER;
+	buffer = nullptr;
+	capacity = 0;
+}
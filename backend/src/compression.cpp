@@ -0,0 +1,126 @@
+#include "compression.hpp"
+#include <algorithm>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+static void encodeHeader(char* out, uint32_t raw_length, uint32_t stored_length) {
+	for (int i = 0; i < 4; i++) {
+		out[i] = static_cast<char>(raw_length >> (24 - 8 * i));
+		out[4 + i] = static_cast<char>(stored_length >> (24 - 8 * i));
+	}
+}
+
+bool decodeBlockHeader(const unsigned char* header, uint32_t& raw_length, uint32_t& stored_length, bool& compressed) {
+	raw_length = 0;
+	stored_length = 0;
+	for (int i = 0; i < 4; i++) {
+		raw_length = (raw_length << 8) | header[i];
+		stored_length = (stored_length << 8) | header[4 + i];
+	}
+	compressed = (stored_length & COMPRESSION_FLAG_LZ4) != 0;
+	stored_length &= ~COMPRESSION_FLAG_LZ4;
+
+	if (raw_length == 0 || raw_length > COMPRESSION_BLOCK_SIZE) {
+		return false;
+	}
+	return compressed ? stored_length <= compressionBound() : stored_length == raw_length;
+}
+
+BlockCompressor::BlockCompressor() : misses(0), skip(0), raw_bytes(0), wire_bytes(0) {}
+
+#ifdef HAVE_LZ4
+
+static const size_t SAMPLE_SIZE = 4096;
+static const int MAX_SKIP = 64;           // Blocks (8MB) between attempts on incompressible data
+
+/**
+ * A block is only sent compressed if that saves at least 1/8 of it
+ */
+static bool worthwhile(size_t compressed, size_t raw) {
+	return compressed > 0 && compressed < raw - raw / 8;
+}
+
+bool BlockCompressor::isAvailable() {
+	return true;
+}
+
+size_t compressionBound() {
+	return LZ4_COMPRESSBOUND(COMPRESSION_BLOCK_SIZE);
+}
+
+bool BlockCompressor::probe(const char* data, size_t length) {
+	if (length < 4 * SAMPLE_SIZE) {
+		return true;  // Small block: compressing it outright is about as cheap
+	}
+
+	const char* middle = data + (length - SAMPLE_SIZE) / 2;
+	int size = LZ4_compress_fast(middle, sample, SAMPLE_SIZE, static_cast<int>(sizeof(sample)), 8);
+	return worthwhile(size, SAMPLE_SIZE);
+}
+
+size_t BlockCompressor::encode(const char* data, size_t length, char* out) {
+	int compressed = 0;
+	bool tried = skip == 0;
+	if (!tried) {
+		skip--;
+	} else if (probe(data, length)) {
+		compressed = LZ4_compress_default(data, out + COMPRESSION_HEADER_SIZE,
+				static_cast<int>(length), static_cast<int>(compressionBound()));
+	}
+
+	size_t encoded;
+	if (worthwhile(compressed, length)) {
+		misses = 0;
+		encodeHeader(out, static_cast<uint32_t>(length), static_cast<uint32_t>(compressed) | COMPRESSION_FLAG_LZ4);
+		encoded = COMPRESSION_HEADER_SIZE + compressed;
+	} else {
+		// Back off quadratically while the data keeps refusing to compress
+		if (tried) {
+			misses = std::min(misses + 1, 8);
+			skip = std::min(misses * misses, MAX_SKIP);
+		}
+		encodeHeader(out, static_cast<uint32_t>(length), static_cast<uint32_t>(length));
+		std::copy(data, data + length, out + COMPRESSION_HEADER_SIZE);
+		encoded = COMPRESSION_HEADER_SIZE + length;
+	}
+
+	raw_bytes += length;
+	wire_bytes += encoded;
+	return encoded;
+}
+
+bool decompressBlock(const char* data, size_t length, char* out, size_t raw_length) {
+	int size = LZ4_decompress_safe(data, out, static_cast<int>(length), static_cast<int>(raw_length));
+	return size >= 0 && static_cast<size_t>(size) == raw_length;
+}
+
+#else  // !HAVE_LZ4
+
+bool BlockCompressor::isAvailable() {
+	return false;
+}
+
+size_t compressionBound() {
+	return COMPRESSION_BLOCK_SIZE;
+}
+
+bool BlockCompressor::probe(const char*, size_t) {
+	return false;
+}
+
+size_t BlockCompressor::encode(const char* data, size_t length, char* out) {
+	encodeHeader(out, static_cast<uint32_t>(length), static_cast<uint32_t>(length));
+	std::copy(data, data + length, out + COMPRESSION_HEADER_SIZE);
+
+	raw_bytes += length;
+	wire_bytes += COMPRESSION_HEADER_SIZE + length;
+	return COMPRESSION_HEADER_SIZE + length;
+}
+
+bool decompressBlock(const char*, size_t, char*, size_t) {
+	return false;
+}
+
+#endif
@@ -0,0 +1,184 @@
+#include "contentStore.hpp"
+#include "sha256.hpp"
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+/**
+ * Copies a whole file: reflink if the filesystem shares blocks, copy_file_range()
+ * if it can copy in the kernel, read()/write() otherwise
+ * @param out_fd: Empty file
+ * @return: false on disk error
+ */
+static bool cloneFile(int in_fd, int out_fd, uint64_t size) {
+	if (ioctl(out_fd, FICLONE, in_fd) == 0) {
+		return true;
+	}
+
+	loff_t in_offset = 0;
+	loff_t out_offset = 0;
+	while (static_cast<uint64_t>(out_offset) < size) {
+		ssize_t n = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, size - out_offset, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+			break;
+		}
+		if (n <= 0) {
+			return false;
+		}
+	}
+
+	std::vector<char> buffer(1024 * 1024);
+	while (static_cast<uint64_t>(out_offset) < size) {
+		ssize_t n = pread(in_fd, buffer.data(), buffer.size(), in_offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		for (ssize_t done = 0; done < n;) {
+			ssize_t w = pwrite(out_fd, buffer.data() + done, n - done, out_offset);
+			if (w < 0 && errno == EINTR) {
+				continue;
+			}
+			if (w < 0) {
+				return false;
+			}
+			done += w;
+			out_offset += w;
+		}
+		in_offset += n;
+	}
+	return true;
+}
+
+ContentStore::ContentStore(const std::string& directory) : directory(directory) {
+}
+
+bool ContentStore::open() {
+	if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+		std::cerr << "Cannot create content store " << directory << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+	return true;
+}
+
+std::string ContentStore::objectPath(const std::string& hash) const {
+	return directory + "/" + hash.substr(0, 2) + "/" + hash.substr(2);
+}
+
+bool ContentStore::has(const std::string& hash, uint64_t size) const {
+	if (!isSha256Hex(hash)) {
+		return false;
+	}
+	struct stat st;
+	return stat(objectPath(hash).c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+		static_cast<uint64_t>(st.st_size) == size;
+}
+
+bool ContentStore::materialize(const std::string& hash, uint64_t size, const std::string& path, uint32_t mode) const {
+	if (!isSha256Hex(hash)) {
+		return false;
+	}
+
+	int object_fd = ::open(objectPath(hash).c_str(), O_RDONLY | O_CLOEXEC);
+	if (object_fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(object_fd, &st) != 0 || static_cast<uint64_t>(st.st_size) != size) {
+		close(object_fd);
+		return false;
+	}
+
+	std::string temp_path = path + ".dedup";
+	int output_fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+	if (output_fd < 0) {
+		close(object_fd);
+		return false;
+	}
+
+	bool copied = cloneFile(object_fd, output_fd, size);
+	close(object_fd);
+	if (close(output_fd) != 0) {
+		copied = false;
+	}
+
+	if (!copied || rename(temp_path.c_str(), path.c_str()) != 0) {
+		std::cerr << "Cannot restore " << path << " from the content store: " << strerror(errno) << std::endl;
+		std::remove(temp_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+/**
+ * The copy is hashed rather than the received file: nobody else writes to
+ * it, so what was checked is exactly what gets stored
+ */
+bool ContentStore::add(const std::string& hash, const std::string& path) {
+	if (!isSha256Hex(hash)) {
+		return false;
+	}
+
+	std::string object_path = objectPath(hash);
+	if (access(object_path.c_str(), F_OK) == 0) {
+		return true;
+	}
+
+	int input_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (input_fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(input_fd, &st) != 0) {
+		close(input_fd);
+		return false;
+	}
+
+	std::string subdirectory = directory + "/" + hash.substr(0, 2);
+	if (mkdir(subdirectory.c_str(), 0755) != 0 && errno != EEXIST) {
+		std::cerr << "Cannot create " << subdirectory << ": " << strerror(errno) << std::endl;
+		close(input_fd);
+		return false;
+	}
+
+	// Unique name: another connection may be storing the same content right now
+	std::string temp_path = object_path + ".XXXXXX";
+	int object_fd = mkstemp(&temp_path[0]);
+	if (object_fd < 0) {
+		close(input_fd);
+		return false;
+	}
+
+	bool stored = cloneFile(input_fd, object_fd, st.st_size);
+	close(input_fd);
+
+	std::string actual;
+	if (stored && (!sha256File(object_fd, actual) || actual != hash)) {
+		std::cerr << "Not storing " << path << ": content doesn't match its announced hash" << std::endl;
+		stored = false;
+	}
+
+	fchmod(object_fd, 0444);
+	if (close(object_fd) != 0) {
+		stored = false;
+	}
+
+	if (!stored || rename(temp_path.c_str(), object_path.c_str()) != 0) {
+		std::remove(temp_path.c_str());
+		return false;
+	}
+	return true;
+}
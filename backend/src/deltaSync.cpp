@@ -0,0 +1,243 @@
+#include "deltaSync.hpp"
+#include <cmath>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+
+uint32_t rollingChecksum(const unsigned char* data, size_t length) {
+	uint32_t a = 0;
+	uint32_t b = 0;
+	for (size_t i = 0; i < length; i++) {
+		a += data[i];
+		b += static_cast<uint32_t>(length - i) * data[i];
+	}
+	return (a & 0xffff) | ((b & 0xffff) << 16);
+}
+
+static const uint64_t XXH_PRIME1 = 11400714785074694791ULL;
+static const uint64_t XXH_PRIME2 = 14029467366897019727ULL;
+static const uint64_t XXH_PRIME3 = 1609587929392839161ULL;
+static const uint64_t XXH_PRIME4 = 9650029242287828579ULL;
+static const uint64_t XXH_PRIME5 = 2870177450012600261ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char* p) {
+	uint64_t v;
+	std::memcpy(&v, p, 8);
+	return v;
+}
+
+static inline uint32_t read32(const unsigned char* p) {
+	uint32_t v;
+	std::memcpy(&v, p, 4);
+	return v;
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input) {
+	acc += input * XXH_PRIME2;
+	acc = rotl64(acc, 31);
+	return acc * XXH_PRIME1;
+}
+
+static inline uint64_t xxhMerge(uint64_t acc, uint64_t value) {
+	acc ^= xxhRound(0, value);
+	return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+/**
+ * XXH64 with seed 0 (little-endian reads, as on every platform we build for)
+ */
+uint64_t strongHash(const void* data, size_t length) {
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	const unsigned char* end = p + length;
+	uint64_t h;
+
+	if (length >= 32) {
+		uint64_t v1 = XXH_PRIME1 + XXH_PRIME2;
+		uint64_t v2 = XXH_PRIME2;
+		uint64_t v3 = 0;
+		uint64_t v4 = 0 - XXH_PRIME1;
+
+		while (p + 32 <= end) {
+			v1 = xxhRound(v1, read64(p));
+			v2 = xxhRound(v2, read64(p + 8));
+			v3 = xxhRound(v3, read64(p + 16));
+			v4 = xxhRound(v4, read64(p + 24));
+			p += 32;
+		}
+
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxhMerge(h, v1);
+		h = xxhMerge(h, v2);
+		h = xxhMerge(h, v3);
+		h = xxhMerge(h, v4);
+	} else {
+		h = XXH_PRIME5;
+	}
+
+	h += length;
+
+	while (p + 8 <= end) {
+		h ^= xxhRound(0, read64(p));
+		h = rotl64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+		p += 8;
+	}
+	if (p + 4 <= end) {
+		h ^= static_cast<uint64_t>(read32(p)) * XXH_PRIME1;
+		h = rotl64(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+		p += 4;
+	}
+	while (p < end) {
+		h ^= (*p) * XXH_PRIME5;
+		h = rotl64(h, 11) * XXH_PRIME1;
+		p++;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME2;
+	h ^= h >> 29;
+	h *= XXH_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+size_t deltaBlockSize(uint64_t file_size) {
+	const size_t MIN_BLOCK = 2048;
+	const size_t MAX_BLOCK = 128 * 1024;
+
+	// Round up to a multiple of 1KB so blocks line up with typical page/sector sizes
+	size_t block = static_cast<size_t>(std::sqrt(static_cast<double>(file_size)));
+	block = (block + 1023) & ~static_cast<size_t>(1023);
+
+	if (block < MIN_BLOCK) return MIN_BLOCK;
+	if (block > MAX_BLOCK) return MAX_BLOCK;
+	return block;
+}
+
+bool computeSignatures(int fd, uint64_t file_size, size_t block_size, std::vector<BlockSignature>& signatures) {
+	signatures.clear();
+	signatures.reserve(file_size / block_size);
+
+	// Read many blocks per syscall; signatures are computed from the buffer
+	const size_t BLOCKS_PER_READ = 64;
+	std::vector<unsigned char> buffer(block_size * BLOCKS_PER_READ);
+	uint64_t full_blocks = file_size / block_size;
+	uint64_t offset = 0;
+
+	while (signatures.size() < full_blocks) {
+		uint64_t blocks = full_blocks - signatures.size();
+		if (blocks > BLOCKS_PER_READ) blocks = BLOCKS_PER_READ;
+		size_t want = static_cast<size_t>(blocks * block_size);
+
+		size_t done = 0;
+		while (done < want) {
+			ssize_t n = pread(fd, buffer.data() + done, want - done, static_cast<off_t>(offset + done));
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) {
+				return false;
+			}
+			done += n;
+		}
+
+		for (uint64_t i = 0; i < blocks; i++) {
+			const unsigned char* block = buffer.data() + i * block_size;
+			signatures.push_back({rollingChecksum(block, block_size), strongHash(block, block_size)});
+		}
+		offset += want;
+	}
+
+	return true;
+}
+
+bool generateDelta(const unsigned char* data, uint64_t size, const std::vector<BlockSignature>& signatures,
+		size_t block_size, size_t max_literal, const std::function<bool(const DeltaOp&)>& emit) {
+	// Weak checksum -> basis blocks with that checksum
+	std::unordered_map<uint32_t, std::vector<uint64_t>> index;
+	index.reserve(signatures.size());
+	for (uint64_t i = 0; i < signatures.size(); i++) {
+		index[signatures[i].weak].push_back(i);
+	}
+
+	uint64_t literal_start = 0;
+	DeltaOp pending_copy = {DeltaOp::Kind::COPY, 0, 0, 0, 0};
+
+	auto flushCopy = [&]() {
+		if (pending_copy.count == 0) {
+			return true;
+		}
+		bool ok = emit(pending_copy);
+		pending_copy.count = 0;
+		return ok;
+	};
+
+	auto flushLiteral = [&](uint64_t end) {
+		while (literal_start < end) {
+			uint64_t length = (end - literal_start < max_literal) ? end - literal_start : max_literal;
+			if (!emit({DeltaOp::Kind::LITERAL, literal_start, length, 0, 0})) {
+				return false;
+			}
+			literal_start += length;
+		}
+		return true;
+	};
+
+	uint64_t pos = 0;
+	bool have_weak = false;
+	uint32_t weak = 0;
+
+	while (!signatures.empty() && pos + block_size <= size) {
+		if (!have_weak) {
+			weak = rollingChecksum(data + pos, block_size);
+			have_weak = true;
+		}
+
+		auto candidates = index.find(weak);
+		if (candidates != index.end()) {
+			uint64_t strong = strongHash(data + pos, block_size);
+			uint64_t match = signatures.size();
+
+			// Prefer the block right after the previous match: keeps runs together
+			for (uint64_t block : candidates->second) {
+				if (signatures[block].strong == strong) {
+					match = block;
+					if (pending_copy.count > 0 && block == pending_copy.block + pending_copy.count) {
+						break;
+					}
+				}
+			}
+
+			if (match < signatures.size()) {
+				if (literal_start < pos) {
+					if (!flushCopy() || !flushLiteral(pos)) {
+						return false;
+					}
+				}
+
+				if (pending_copy.count > 0 && match == pending_copy.block + pending_copy.count) {
+					pending_copy.count++;
+				} else {
+					if (!flushCopy()) {
+						return false;
+					}
+					pending_copy = {DeltaOp::Kind::COPY, 0, 0, match, 1};
+				}
+
+				pos += block_size;
+				literal_start = pos;
+				have_weak = false;
+				continue;
+			}
+		}
+
+		// No match here: slide the window one byte
+		if (pos + block_size < size) {
+			weak = rollingChecksumRoll(weak, data[pos], data[pos + block_size], block_size);
+		}
+		pos++;
+	}
+
+	return flushCopy() && flushLiteral(size);
+}
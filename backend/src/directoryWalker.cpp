@@ -0,0 +1,219 @@
+#include "directoryWalker.hpp"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// Layout of the records getdents64 fills the buffer with
+struct LinuxDirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+// Entries handed over per lock, so huge directories stream out while they are read
+static const size_t PUBLISH_BATCH = 1024;
+
+DirectoryWalker::DirectoryWalker(const std::string& root, unsigned threads) : root(root),
+	thread_count(threads > 0 ? threads : 1), busy(0), finished(false), stopping(false), skipped(0), errors(0) {
+}
+
+DirectoryWalker::~DirectoryWalker() {
+	stop();
+}
+
+bool DirectoryWalker::start() {
+	struct stat st;
+	if (stat(root.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+		std::cerr << "Not a directory: " << root << std::endl;
+		return false;
+	}
+
+	directories.push_back("");
+	for (unsigned i = 0; i < thread_count; i++) {
+		workers.emplace_back(&DirectoryWalker::workerLoop, this);
+	}
+	return true;
+}
+
+void DirectoryWalker::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	work_ready.notify_all();
+	space_ready.notify_all();
+	entries_ready.notify_all();
+
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+	workers.clear();
+}
+
+/**
+ * The walk is over when no directory is queued and no worker is listing one
+ * (a busy worker may still queue more)
+ */
+void DirectoryWalker::workerLoop() {
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (true) {
+		work_ready.wait(lock, [this]() {
+			return stopping || finished || !directories.empty();
+		});
+		if (stopping || finished) {
+			return;
+		}
+
+		std::string relative = std::move(directories.front());
+		directories.pop_front();
+		busy++;
+
+		lock.unlock();
+		listDirectory(relative);
+		lock.lock();
+
+		busy--;
+		if (busy == 0 && directories.empty()) {
+			finished = true;
+			work_ready.notify_all();
+			entries_ready.notify_all();
+		}
+	}
+}
+
+void DirectoryWalker::listDirectory(const std::string& relative) {
+	std::string path = relative.empty() ? root : root + "/" + relative;
+	int dir_fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) {
+		std::cerr << "Cannot open directory " << path << ": " << strerror(errno) << std::endl;
+		std::lock_guard<std::mutex> lock(mutex);
+		errors++;
+		return;
+	}
+
+	std::vector<WalkEntry> found;
+	std::vector<std::string> subdirectories;
+	alignas(8) char buffer[64 * 1024];
+
+	while (true) {
+		long n = syscall(SYS_getdents64, dir_fd, buffer, sizeof(buffer));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			std::cerr << "Cannot read directory " << path << ": " << strerror(errno) << std::endl;
+			std::lock_guard<std::mutex> lock(mutex);
+			errors++;
+			break;
+		}
+		if (n == 0) {
+			break;
+		}
+
+		for (long offset = 0; offset < n;) {
+			const LinuxDirent64* dirent = reinterpret_cast<const LinuxDirent64*>(buffer + offset);
+			offset += dirent->d_reclen;
+
+			const char* name = dirent->d_name;
+			if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+				continue;
+			}
+
+			struct stat st;
+			if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+				std::lock_guard<std::mutex> lock(mutex);
+				errors++;
+				continue;
+			}
+
+			WalkEntry entry;
+			entry.path = relative.empty() ? name : relative + "/" + name;
+			entry.directory = S_ISDIR(st.st_mode);
+			entry.size = entry.directory ? 0 : static_cast<uint64_t>(st.st_size);
+			entry.mode = st.st_mode & 07777;
+
+			if (entry.directory) {
+				subdirectories.push_back(entry.path);
+			} else if (!S_ISREG(st.st_mode)) {
+				std::lock_guard<std::mutex> lock(mutex);
+				skipped++;
+				continue;
+			}
+			found.push_back(std::move(entry));
+
+			if (found.size() >= PUBLISH_BATCH && !publish(found, subdirectories)) {
+				close(dir_fd);
+				return;
+			}
+		}
+	}
+
+	close(dir_fd);
+	publish(found, subdirectories);
+}
+
+/**
+ * Subdirectories are queued for listing only after their own entries, so
+ * the consumer always sees a directory before its contents
+ */
+bool DirectoryWalker::publish(std::vector<WalkEntry>& found, std::vector<std::string>& subdirectories) {
+	std::unique_lock<std::mutex> lock(mutex);
+	space_ready.wait(lock, [this]() {
+		return stopping || entries.size() < MAX_QUEUED_ENTRIES;
+	});
+	if (stopping) {
+		return false;
+	}
+
+	for (WalkEntry& entry : found) {
+		entries.push_back(std::move(entry));
+	}
+	for (std::string& subdirectory : subdirectories) {
+		directories.push_back(std::move(subdirectory));
+	}
+	found.clear();
+	subdirectories.clear();
+
+	entries_ready.notify_one();
+	work_ready.notify_all();
+	return true;
+}
+
+bool DirectoryWalker::next(WalkEntry& entry, bool wait) {
+	std::unique_lock<std::mutex> lock(mutex);
+	if (wait) {
+		entries_ready.wait(lock, [this]() {
+			return stopping || finished || !entries.empty();
+		});
+	}
+	if (entries.empty()) {
+		return false;
+	}
+
+	entry = std::move(entries.front());
+	entries.pop_front();
+	space_ready.notify_one();
+	return true;
+}
+
+bool DirectoryWalker::done() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return (finished || stopping) && entries.empty();
+}
+
+uint64_t DirectoryWalker::skippedCount() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return skipped;
+}
+
+uint64_t DirectoryWalker::errorCount() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return errors;
+}
@@ -0,0 +1,1168 @@
+#include "eventLoop.hpp"
+#include "fileTransferServer.hpp"
+#include "checksum.hpp"
+#include <iostream>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+
+using json = nlohmann::json;
+
+// Limits how long one busy connection can hold the loop before others get a turn
+static const int MAX_READS_PER_EVENT = 16;
+
+EventLoop::EventLoop(FileTransferServer& server)
+	: server(server), epoll_fd(-1), wake_fd(-1), listen_fd(-1), loop_thread(nullptr),
+	running(false), buffer(256 * 1024), disk_thread(nullptr), disk_stopping(false) {
+	splice_pipe[0] = splice_pipe[1] = -1;
+}
+
+EventLoop::~EventLoop() {
+	stop();
+}
+
+/**
+ * Creates the epoll set and starts the loop thread
+ */
+bool EventLoop::start(int listen_socket, int cpu) {
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		std::cerr << "Failed to create epoll instance: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	// eventfd lets other threads interrupt epoll_wait() (new socket or shutdown)
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd < 0) {
+		std::cerr << "Failed to create eventfd: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = wake_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+	listen_fd = listen_socket;
+	if (listen_fd >= 0) {
+		ev.events = EPOLLIN;
+		ev.data.fd = listen_fd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+			std::cerr << "Failed to watch listening socket: " << strerror(errno) << std::endl;
+			return false;
+		}
+	}
+
+	// One pipe per loop is enough for splice(): it is always drained to disk
+	// before the loop moves on to the next connection
+	if (server.receive_mode == ReceiveMode::SPLICE) {
+		if (pipe2(splice_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+			std::cerr << "Failed to create splice pipe, using buffered receive: " << strerror(errno) << std::endl;
+			splice_pipe[0] = splice_pipe[1] = -1;
+		} else {
+			fcntl(splice_pipe[1], F_SETPIPE_SZ, static_cast<int>(server.pipe_size));
+		}
+	}
+
+	disk_stopping = false;
+	disk_thread = new std::thread(&EventLoop::runDiskJobs, this);
+
+	running = true;
+	loop_thread = new std::thread(&EventLoop::run, this);
+
+	// A pinned loop keeps its connections' state and socket buffers in one core's caches
+	if (cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		int result = pthread_setaffinity_np(loop_thread->native_handle(), sizeof(cpus), &cpus);
+		if (result != 0) {
+			std::cerr << "Failed to pin event loop to CPU " << cpu << ": " << strerror(result) << std::endl;
+		}
+	}
+	return true;
+}
+
+/**
+ * Stops the loop thread and releases everything it owns
+ */
+void EventLoop::stop() {
+	if (loop_thread) {
+		running = false;
+		uint64_t one = 1;
+		ssize_t ignored = write(wake_fd, &one, sizeof(one));
+		(void)ignored;
+
+		if (loop_thread->joinable()) {
+			loop_thread->join();
+		}
+		delete loop_thread;
+		loop_thread = nullptr;
+	}
+
+	// Connections still open at shutdown are treated like a client disconnect
+	for (auto& entry : connections) {
+		Connection* conn = entry.second;
+		if (conn->output_fd >= 0) {
+			abandonFile(conn);
+		}
+		server.removeClient(conn->socket_fd);
+		close(conn->socket_fd);
+		delete conn;
+	}
+	connections.clear();
+
+	Connection* conn;
+	while (pending.tryPop(conn)) {
+		server.removeClient(conn->socket_fd);
+		close(conn->socket_fd);
+		delete conn;
+	}
+
+	// Checkpoints of the files abandoned above are still queued: finish them
+	if (disk_thread) {
+		{
+			std::lock_guard<std::mutex> lock(disk_mutex);
+			disk_stopping = true;
+		}
+		disk_cv.notify_one();
+		disk_thread->join();
+		delete disk_thread;
+		disk_thread = nullptr;
+	}
+
+	if (splice_pipe[0] >= 0) close(splice_pipe[0]);
+	if (splice_pipe[1] >= 0) close(splice_pipe[1]);
+	splice_pipe[0] = splice_pipe[1] = -1;
+
+	if (wake_fd >= 0) close(wake_fd);
+	if (epoll_fd >= 0) close(epoll_fd);
+	wake_fd = epoll_fd = -1;
+}
+
+/**
+ * Queues an accepted socket for this loop and wakes it up
+ */
+void EventLoop::adopt(int socket_fd, std::shared_ptr<ClientConnection> client) {
+	Connection* conn = new Connection();
+	conn->socket_fd = socket_fd;
+	conn->ip_address = client->ip_address;
+	conn->port = client->port;
+	conn->client = std::move(client);
+	conn->phase = ConnectionPhase::AWAITING_FILE_INFO;
+	conn->format = WireFormat::JSON;
+	conn->want_write = false;
+	conn->output_fd = -1;
+	conn->writeback = WriteBehind(false);
+	conn->total_received = 0;
+	conn->last_percentage = -1;
+	conn->verify = false;
+	conn->crc = 0;
+	conn->hashed = 0;
+	conn->splice_to_file = true;
+	conn->stripe_start = 0;
+	conn->stripe_offset = 0;
+	conn->stripe_remaining = 0;
+	conn->stripe_completed = false;
+	conn->owned_transfer = 0;
+
+	// A full ring means the loop is behind on a burst of connections: let it
+	// catch up (or catch up ourselves when the accepting loop is this one)
+	while (!pending.tryPush(conn)) {
+		if (loop_thread && std::this_thread::get_id() == loop_thread->get_id()) {
+			registerPending();
+		} else {
+			uint64_t one = 1;
+			ssize_t ignored = write(wake_fd, &one, sizeof(one));
+			(void)ignored;
+			std::this_thread::yield();
+		}
+	}
+
+	uint64_t one = 1;
+	ssize_t ignored = write(wake_fd, &one, sizeof(one));
+	(void)ignored;
+}
+
+/**
+ * Main reactor loop
+ */
+void EventLoop::run() {
+	const int MAX_EVENTS = 256;
+	struct epoll_event events[MAX_EVENTS];
+
+	while (running) {
+		// No timeout needed: shutdown and new sockets both arrive through wake_fd
+		int count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		if (count < 0) {
+			if (errno == EINTR) continue;
+			std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+			break;
+		}
+
+		for (int i = 0; i < count && running; i++) {
+			int fd = events[i].data.fd;
+
+			if (fd == wake_fd) {
+				uint64_t value;
+				ssize_t ignored = read(wake_fd, &value, sizeof(value));
+				(void)ignored;
+				registerPending();
+				continue;
+			}
+
+			if (fd == listen_fd) {
+				acceptConnections();
+				continue;
+			}
+
+			auto it = connections.find(fd);
+			if (it == connections.end()) {
+				continue;  // Closed earlier in this batch
+			}
+			Connection* conn = it->second;
+
+			if (events[i].events & EPOLLOUT) {
+				handleWritable(conn);
+				if (connections.find(fd) == connections.end()) continue;
+			}
+
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				handleReadable(conn);
+			}
+		}
+	}
+}
+
+/**
+ * Drains the listen backlog; sockets are spread round-robin over all loops,
+ * or stay on this loop when every loop has a listener of its own
+ */
+void EventLoop::acceptConnections() {
+	while (running) {
+		struct sockaddr_in client_addr;
+		socklen_t client_len = sizeof(client_addr);
+		int client_socket = accept4(listen_fd, (struct sockaddr*)&client_addr, &client_len,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (client_socket < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				std::cerr << "Failed to accept connection: " << strerror(errno) << std::endl;
+			}
+			return;
+		}
+
+		// Disable Nagle's algorithm for better performance with small packets
+		int flag = 1;
+		setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+		server.dispatchConnection(client_socket, client_addr, server.sharded_listeners ? this : nullptr);
+	}
+}
+
+/**
+ * Moves sockets from the pending list into the epoll set
+ */
+void EventLoop::registerPending() {
+	Connection* conn;
+	while (pending.tryPop(conn)) {
+		struct epoll_event ev = {};
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.fd = conn->socket_fd;
+
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->socket_fd, &ev) < 0) {
+			std::cerr << "Failed to watch client socket: " << strerror(errno) << std::endl;
+			server.removeClient(conn->socket_fd);
+			close(conn->socket_fd);
+			delete conn;
+			continue;
+		}
+
+		connections[conn->socket_fd] = conn;
+	}
+}
+
+/**
+ * Socket readable: either more control bytes or more file data
+ */
+void EventLoop::handleReadable(Connection* conn) {
+	if (conn->phase == ConnectionPhase::RECEIVING_DATA) {
+		if (!receiveData(conn)) {
+			closeConnection(conn);
+		}
+		return;
+	}
+
+	if (conn->phase == ConnectionPhase::RECEIVING_STRIPE) {
+		if (!receiveStripeData(conn)) {
+			closeConnection(conn);
+		}
+		return;
+	}
+
+	if (conn->phase == ConnectionPhase::RECEIVING_BATCH) {
+		if (!receiveBatchData(conn)) {
+			closeConnection(conn);
+		}
+		return;
+	}
+
+	for (int reads = 0; reads < MAX_READS_PER_EVENT; reads++) {
+		ssize_t received = recv(conn->socket_fd, buffer.data(), buffer.size(), 0);
+
+		if (received < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+			if (errno == EINTR) continue;
+			if (errno != ECONNRESET) {
+				std::cerr << "Error receiving from client " << conn->ip_address << ": "
+					<< strerror(errno) << std::endl;
+			}
+			closeConnection(conn);
+			return;
+		}
+
+		if (received == 0) {
+			std::cout << "Client " << conn->ip_address << " closed connection gracefully" << std::endl;
+			closeConnection(conn);
+			return;
+		}
+
+		conn->reader.feed(buffer.data(), received);
+		if (!processControl(conn)) {
+			closeConnection(conn);
+			return;
+		}
+
+		// FILE_INFO switched us to data mode; the rest goes through receiveData()
+		if (conn->phase == ConnectionPhase::RECEIVING_DATA) {
+			if (!receiveData(conn)) {
+				closeConnection(conn);
+			}
+			return;
+		}
+
+		if (conn->phase == ConnectionPhase::RECEIVING_STRIPE) {
+			if (!receiveStripeData(conn)) {
+				closeConnection(conn);
+			}
+			return;
+		}
+
+		if (conn->phase == ConnectionPhase::RECEIVING_BATCH) {
+			if (!receiveBatchData(conn)) {
+				closeConnection(conn);
+			}
+			return;
+		}
+	}
+}
+
+/**
+ * Socket writable again: push out queued replies
+ */
+void EventLoop::handleWritable(Connection* conn) {
+	if (!flushOutbox(conn)) {
+		closeConnection(conn);
+	}
+}
+
+/**
+ * Handles every complete control message sitting in the inbox
+ */
+bool EventLoop::processControl(Connection* conn) {
+	while (conn->phase == ConnectionPhase::AWAITING_FILE_INFO || conn->phase == ConnectionPhase::VERIFYING) {
+		TransferMessage msg;
+		try {
+			// The reader caps unframed JSON at MAX_CONTROL_MESSAGE (throws, isCorrupt())
+			if (!conn->reader.next(msg)) {
+				return true;  // Wait for the rest of the message
+			}
+		} catch (const json::exception& e) {
+			std::cerr << "JSON parse error from " << conn->ip_address << ": " << e.what() << std::endl;
+			continue;
+		} catch (const std::exception& e) {
+			std::cerr << "Error processing message from " << conn->ip_address << ": " << e.what() << std::endl;
+			if (conn->reader.isCorrupt()) {
+				return false;
+			}
+			continue;
+		}
+
+		// A file or stripe waiting for its checksum still holds its output file:
+		// the sender owes FILE_CHECKSUM before anything else (as in thread mode)
+		if (conn->phase == ConnectionPhase::VERIFYING && msg.type != MessageType::FILE_CHECKSUM &&
+			msg.type != MessageType::DISCONNECT && msg.type != MessageType::ERROR) {
+			std::cerr << "Expected FILE_CHECKSUM from " << conn->ip_address << ", got message type "
+				<< static_cast<int>(msg.type) << std::endl;
+			return false;
+		}
+
+		try {
+			switch (msg.type) {
+				case MessageType::HELLO: {
+					TransferMessage reply;
+					WireFormat format = negotiateWireFormat(msg, reply);
+					queueReply(conn, reply.encode(WireFormat::JSON));
+					conn->format = format;
+					conn->reader.setFormat(format);
+
+					std::lock_guard<std::mutex> lock(server.clients_mutex);
+					conn->client->wire_format = format;
+					break;
+				}
+
+				case MessageType::FILE_INFO:
+					if (!beginFile(conn, msg)) {
+						return false;
+					}
+					break;
+
+				case MessageType::FILE_STRIPE:
+					if (!beginStripe(conn, msg)) {
+						return false;
+					}
+					break;
+
+				case MessageType::FILE_BATCH:
+					if (!beginBatch(conn, msg)) {
+						return false;
+					}
+					break;
+
+				case MessageType::FILE_CHECKSUM:
+					if (!verifyChecksum(conn, msg)) {
+						return false;
+					}
+					break;
+
+				case MessageType::DISCONNECT:
+					std::cout << "Client " << conn->ip_address << " sent disconnect" << std::endl;
+					return false;
+
+				case MessageType::ERROR: {
+					std::string error_msg = msg.data.value("reason", "Unknown error");
+					if (error_msg != "client_disconnect" && error_msg != "client_finished") {
+						std::cerr << "Error from client " << conn->ip_address << ": " << error_msg << std::endl;
+					}
+					break;
+				}
+
+				default:
+					std::cout << "Received message type " << static_cast<int>(msg.type)
+						<< " from " << conn->ip_address << std::endl;
+					break;
+			}
+		} catch (const json::exception& e) {
+			std::cerr << "Invalid message from " << conn->ip_address << ": " << e.what() << std::endl;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * FILE_INFO received: same replies as handleClient()/receiveFile(), without blocking
+ */
+bool EventLoop::beginFile(Connection* conn, const TransferMessage& msg) {
+	conn->file_info.filename = msg.data["filename"];
+	conn->file_info.filesize = msg.data["filesize"];
+	conn->file_info.mtime = msg.data.value("mtime", int64_t(0));
+	conn->file_info.checksum = msg.data.value("checksum", "");
+	conn->file_info.mode = msg.data.value("mode", 0644u) & 0777;
+	conn->file_info.sha256 = msg.data.value("sha256", "");
+	conn->output_filename = conn->file_info.filename;
+	conn->total_received = 0;
+	conn->writeback.reset();
+	conn->splice_to_file = true;
+	conn->last_percentage = -1;
+	conn->verify = conn->file_info.checksum == CHECKSUM_CRC32C;
+	conn->crc = 0;
+
+	// Directory transfers send relative paths; nothing may land outside this directory
+	if (!isSafeRelativePath(conn->file_info.filename)) {
+		std::cerr << "Refusing file " << conn->file_info.filename << " from " << conn->ip_address << std::endl;
+		queueReply(conn, statusMessage({{"status", "error"}, {"reason", "Invalid file name"}}).encode(conn->format));
+		return true;
+	}
+
+	std::cout << "Receiving file: " << conn->file_info.filename
+		<< " (" << conn->file_info.filesize << " bytes)" << std::endl;
+
+	{
+		std::lock_guard<std::mutex> lock(server.clients_mutex);
+		conn->client->current_filename = conn->file_info.filename;
+	}
+	conn->client->bytes_received.store(0, std::memory_order_relaxed);
+
+	// Send acknowledgment
+	queueReply(conn, statusMessage({{"status", "ready"}}).encode(conn->format));
+
+	// Same content arrived before: nothing to send
+	if (server.restoreFromStore(conn->file_info)) {
+		queueReply(conn, statusMessage({{"status", "complete"}, {"filename", conn->file_info.filename},
+			{"deduplicated", true}}).encode(conn->format));
+		return true;
+	}
+
+	// Striped: data arrives later as FILE_STRIPE messages on any connection
+	if (msg.data.value("stripes", 1) > 1) {
+		// Clients only stripe files bigger than one stripe
+		if (!FileTransferServer::stripeableSize(msg)) {
+			queueReply(conn, statusMessage({{"status", "error"}, {"reason", "File too small to stripe"}}).encode(conn->format));
+			return true;
+		}
+		// The client gave up on the file it announced before (no-op if that completed).
+		// Done here rather than on the disk thread: the new file may reuse its partial file
+		if (conn->owned_transfer != 0) {
+			server.abortStripedTransfer(conn->owned_transfer);
+			conn->owned_transfer = 0;
+		}
+		std::shared_ptr<StripedTransfer> transfer = server.beginStripedTransfer(conn->file_info, conn->socket_fd);
+		if (!transfer) {
+			queueReply(conn, statusMessage({{"status", "error"}, {"reason", "Cannot create file"}}).encode(conn->format));
+			return true;
+		}
+		conn->owned_transfer = transfer->id;
+
+		// A resumed file may already be complete: nothing left to send
+		if (transfer->bytes_received == conn->file_info.filesize &&
+			addStripeData(conn, transfer, 0, 0)) {
+			queueReply(conn, statusMessage({{"status", "complete"}, {"filename", transfer->output_filename}}).encode(conn->format));
+			return true;
+		}
+		queueReply(conn, FileTransferServer::stripedReceivingReply(*transfer).encode(conn->format));
+		return true;
+	}
+
+	conn->output_fd = FileTransferServer::openOutputFile(conn->file_info, conn->journal, conn->data_filename);
+	if (conn->output_fd < 0) {
+		std::cerr << "Failed to create output file: " << conn->output_filename << std::endl;
+		const char* reason = (errno == ENOSPC) ? "Not enough disk space" : "Cannot create file";
+		queueReply(conn, statusMessage({{"status", "error"}, {"reason", reason}}).encode(conn->format));
+		return true;
+	}
+
+	std::cout << "Creating file: " << conn->data_filename << std::endl;
+
+	// Same resume rule as receiveFile(): continue after the first gap,
+	// with the kept prefix already part of the checksum
+	conn->total_received = conn->journal.ranges().prefix();
+	if (conn->verify && conn->total_received > 0 &&
+		!crc32cUpdateFromFile(conn->crc, conn->output_fd, 0, conn->total_received)) {
+		std::cerr << "Cannot read back " << conn->data_filename << ", receiving it from the start" << std::endl;
+		conn->crc = 0;
+		conn->total_received = 0;
+	}
+	lseek(conn->output_fd, static_cast<off_t>(conn->total_received), SEEK_SET);
+	conn->hashed = conn->total_received;
+
+	json receiving = {{"status", "receiving"}};
+	if (conn->total_received > 0) {
+		receiving["resume_offset"] = conn->total_received;
+	}
+	if (conn->verify) {
+		receiving["checksum"] = CHECKSUM_CRC32C;
+	}
+	queueReply(conn, statusMessage(receiving).encode(conn->format));
+	conn->phase = ConnectionPhase::RECEIVING_DATA;
+
+	// Data that arrived in the same segment as FILE_INFO
+	if (conn->reader.buffered() > 0) {
+		std::string early = conn->reader.takeBuffered();
+		uint64_t remaining = conn->file_info.filesize - conn->total_received;
+		size_t take = (early.size() < remaining) ? early.size() : remaining;
+		if (!writeData(conn, early.data(), take)) {
+			return false;
+		}
+		// Anything past the end of the file is the next control message
+		if (take < early.size()) {
+			conn->reader.feed(early.data() + take, early.size() - take);
+		}
+	}
+
+	if (conn->total_received == conn->file_info.filesize) {
+		finishFile(conn);
+	}
+
+	return true;
+}
+
+/**
+ * Pulls file data off the socket until it would block
+ */
+bool EventLoop::receiveData(Connection* conn) {
+	for (int reads = 0; reads < MAX_READS_PER_EVENT; reads++) {
+		if (conn->total_received >= conn->file_info.filesize) {
+			break;
+		}
+
+		uint64_t remaining = conn->file_info.filesize - conn->total_received;
+		ssize_t received;
+
+		if (splice_pipe[0] >= 0 && conn->splice_to_file) {
+			// Socket -> pipe -> file, same zero-copy path as receiveWithSplice()
+			size_t to_receive = (remaining < buffer.size()) ? remaining : buffer.size();
+			received = splice(conn->socket_fd, nullptr, splice_pipe[1], nullptr, to_receive,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+			if (received > 0) {
+				ssize_t pending_bytes = received;
+				while (pending_bytes > 0) {
+					ssize_t written = splice(splice_pipe[0], nullptr, conn->output_fd, nullptr,
+							pending_bytes, SPLICE_F_MOVE);
+					if (written < 0 && errno == EINTR) {
+						continue;
+					}
+					if (written < 0 && errno == EINVAL) {
+						// Same fallback as receiveFile(): this file continues with recv()/write()
+						std::cerr << "splice() not supported for " << conn->data_filename
+							<< ", falling back to buffered receive" << std::endl;
+						conn->splice_to_file = false;
+						break;
+					}
+					if (written < 0) {
+						std::cerr << "Error splicing file data to disk: " << strerror(errno) << std::endl;
+						drainSplicePipe();
+						return false;
+					}
+					pending_bytes -= written;
+				}
+
+				uint64_t spliced = received - pending_bytes;
+				conn->journal.record(conn->total_received, spliced, -1);
+				conn->writeback.written(conn->output_fd, conn->total_received, spliced);
+				conn->total_received += spliced;
+
+				if ((conn->total_received - conn->hashed >= CRC32C_READBACK_WINDOW ||
+					conn->total_received == conn->file_info.filesize) && !hashSpliced(conn)) {
+					std::cerr << "Failed to read back file data for its checksum" << std::endl;
+					drainSplicePipe();
+					return false;
+				}
+
+				// Whatever the file refused is still in the pipe: write it out by hand
+				while (pending_bytes > 0) {
+					size_t count = (static_cast<size_t>(pending_bytes) < buffer.size()) ? pending_bytes : buffer.size();
+					ssize_t n = read(splice_pipe[0], buffer.data(), count);
+					if (n <= 0 || !writeData(conn, buffer.data(), n)) {
+						drainSplicePipe();
+						return false;
+					}
+					pending_bytes -= n;
+				}
+			}
+		} else {
+			size_t to_receive = (remaining < buffer.size()) ? remaining : buffer.size();
+			received = recv(conn->socket_fd, buffer.data(), to_receive, 0);
+			if (received > 0 && !writeData(conn, buffer.data(), received)) {
+				return false;
+			}
+		}
+
+		if (received < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			if (errno == EINTR) continue;
+			std::cerr << "Error receiving file data: " << strerror(errno) << std::endl;
+			return false;
+		}
+
+		if (received == 0) {
+			std::cerr << "Connection closed during file transfer" << std::endl;
+			return false;
+		}
+	}
+
+	checkpointLater(conn);
+	server.updateProgress(conn->client.get(), conn->ip_address, conn->total_received,
+			conn->file_info.filesize, conn->last_percentage);
+
+	if (conn->total_received == conn->file_info.filesize) {
+		finishFile(conn);
+	}
+
+	return true;
+}
+
+/**
+ * Writes received bytes to the output file
+ */
+bool EventLoop::writeData(Connection* conn, const char* data, size_t length) {
+	size_t written = 0;
+	while (written < length) {
+		ssize_t w = write(conn->output_fd, data + written, length - written);
+		if (w < 0) {
+			if (errno == EINTR) continue;
+			std::cerr << "Error writing file data: " << strerror(errno) << std::endl;
+			return false;
+		}
+		written += w;
+	}
+	if (conn->verify) {
+		if (!hashSpliced(conn)) {
+			std::cerr << "Failed to read back file data for its checksum" << std::endl;
+			return false;
+		}
+		conn->crc = crc32cUpdate(conn->crc, data, length);
+		conn->hashed += length;
+	}
+
+	conn->journal.record(conn->total_received, length, -1);
+	conn->writeback.written(conn->output_fd, conn->total_received, length);
+	conn->total_received += length;
+	return true;
+}
+
+/**
+ * Never leave bytes of a failed connection in the shared pipe
+ */
+void EventLoop::drainSplicePipe() {
+	char scratch[8192];
+	while (read(splice_pipe[0], scratch, sizeof(scratch)) > 0) {}
+}
+
+/**
+ * Spliced data never entered user space; it is hashed from the page cache
+ */
+bool EventLoop::hashSpliced(Connection* conn) {
+	uint64_t length = conn->total_received - conn->hashed;
+	if (!conn->verify || length == 0) {
+		return true;
+	}
+	if (!crc32cUpdateFromFile(conn->crc, conn->output_fd, conn->hashed, length)) {
+		return false;
+	}
+	conn->hashed = conn->total_received;
+	return true;
+}
+
+/**
+ * FILE_STRIPE received: same checks and replies as FileTransferServer::receiveStripe()
+ */
+bool EventLoop::beginStripe(Connection* conn, const TransferMessage& msg) {
+	uint64_t id = msg.data.at("transfer_id");
+	uint64_t offset = msg.data.at("offset");
+	uint64_t length = msg.data.at("length");
+
+	// The stripe's bytes are already on their way, so a bad stripe ends the connection
+	std::shared_ptr<StripedTransfer> transfer = server.findStripedTransfer(id);
+	if (!transfer || offset > transfer->file_info.filesize || length > transfer->file_info.filesize - offset) {
+		std::cerr << "Rejecting stripe for transfer " << id << " from " << conn->ip_address << std::endl;
+		queueReply(conn, statusMessage({{"status", "error"}, {"reason", "Unknown transfer or bad range"}}).encode(conn->format));
+		return false;
+	}
+
+	conn->stripe = transfer;
+	conn->stripe_start = offset;
+	conn->stripe_offset = offset;
+	conn->stripe_remaining = length;
+	conn->stripe_completed = false;
+	conn->crc = 0;
+	conn->phase = ConnectionPhase::RECEIVING_STRIPE;
+
+	// Data that arrived in the same segment as FILE_STRIPE
+	if (conn->reader.buffered() > 0) {
+		std::string early = conn->reader.takeBuffered();
+		size_t take = (early.size() < length) ? early.size() : length;
+		if (!writeStripeData(conn, early.data(), take)) {
+			return false;
+		}
+		// Anything past the end of the stripe is the next control message
+		if (take < early.size()) {
+			conn->reader.feed(early.data() + take, early.size() - take);
+		}
+	}
+
+	if (conn->stripe_remaining == 0) {
+		finishStripe(conn);
+	}
+
+	return true;
+}
+
+/**
+ * Pulls stripe data off the socket until it would block or the stripe ends
+ */
+bool EventLoop::receiveStripeData(Connection* conn) {
+	for (int reads = 0; reads < MAX_READS_PER_EVENT && conn->stripe_remaining > 0; reads++) {
+		size_t to_receive = (conn->stripe_remaining < buffer.size()) ? conn->stripe_remaining : buffer.size();
+		ssize_t received = recv(conn->socket_fd, buffer.data(), to_receive, 0);
+
+		if (received < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			if (errno == EINTR) continue;
+			std::cerr << "Error receiving stripe data: " << strerror(errno) << std::endl;
+			return false;
+		}
+
+		if (received == 0) {
+			std::cerr << "Connection closed during stripe at offset " << conn->stripe_offset << std::endl;
+			return false;
+		}
+
+		if (!writeStripeData(conn, buffer.data(), received)) {
+			return false;
+		}
+	}
+
+	if (conn->stripe_remaining == 0) {
+		finishStripe(conn);
+	}
+
+	return true;
+}
+
+/**
+ * Writes stripe bytes in place and adds them to the transfer's total
+ * (verified stripes are added whole, once their checksum matched)
+ */
+bool EventLoop::writeStripeData(Connection* conn, const char* data, size_t length) {
+	if (!FileTransferServer::writeAt(conn->stripe->output_fd, data, length, conn->stripe_offset)) {
+		return false;
+	}
+
+	if (conn->stripe->verify) {
+		conn->crc = crc32cUpdate(conn->crc, data, length);
+	} else if (addStripeData(conn, conn->stripe, conn->stripe_offset, length)) {
+		conn->stripe_completed = true;
+	}
+	conn->stripe_offset += length;
+	conn->stripe_remaining -= length;
+	return true;
+}
+
+/**
+ * FILE_BATCH received: same as FileTransferServer::receiveBatch(), without blocking
+ */
+bool EventLoop::beginBatch(Connection* conn, const TransferMessage& msg) {
+	conn->batch.reset(new BatchReceiver());
+	conn->batch->setFileCallback(server.file_received_callback);
+
+	// The bodies are already on their way, so a bad manifest ends the connection
+	if (!conn->batch->begin(msg)) {
+		std::cerr << "Rejecting file batch from " << conn->ip_address << std::endl;
+		queueReply(conn, statusMessage({{"status", "error"}, {"reason", "Invalid batch"}}).encode(conn->format));
+		return false;
+	}
+	conn->phase = ConnectionPhase::RECEIVING_BATCH;
+
+	// Bodies that arrived in the same segment as the manifest
+	if (conn->reader.buffered() > 0) {
+		std::string early = conn->reader.takeBuffered();
+		size_t used = conn->batch->consume(early.data(), early.size());
+		// Anything past the last body is the next control message
+		if (used < early.size()) {
+			conn->reader.feed(early.data() + used, early.size() - used);
+		}
+	}
+
+	if (conn->batch->done()) {
+		finishBatch(conn);
+	}
+
+	return true;
+}
+
+/**
+ * Pulls batch bodies off the socket until it would block or the batch ends
+ */
+bool EventLoop::receiveBatchData(Connection* conn) {
+	for (int reads = 0; reads < MAX_READS_PER_EVENT && !conn->batch->done(); reads++) {
+		uint64_t remaining = conn->batch->remaining();
+		size_t to_receive = (remaining < buffer.size()) ? remaining : buffer.size();
+		ssize_t received = recv(conn->socket_fd, buffer.data(), to_receive, 0);
+
+		if (received < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			if (errno == EINTR) continue;
+			std::cerr << "Error receiving batch data: " << strerror(errno) << std::endl;
+			return false;
+		}
+
+		if (received == 0) {
+			std::cerr << "Connection closed during file batch" << std::endl;
+			return false;
+		}
+
+		conn->batch->consume(buffer.data(), received);
+	}
+
+	if (conn->batch->done()) {
+		finishBatch(conn);
+		// The next manifest may have come in with the last body
+		return processControl(conn);
+	}
+
+	return true;
+}
+
+/**
+ * All files of the batch are on disk: ack them and wait for the next message
+ */
+void EventLoop::finishBatch(Connection* conn) {
+	std::cout << "Received batch of " << conn->batch->fileCount() << " files (" << conn->batch->totalBytes()
+		<< " bytes) from " << conn->ip_address << std::endl;
+
+	queueReply(conn, conn->batch->reply().encode(conn->format));
+	conn->batch.reset();
+	conn->phase = ConnectionPhase::AWAITING_FILE_INFO;
+}
+
+/**
+ * Stripe done: ack it ("complete" if it was the last one) and wait for the next message
+ */
+void EventLoop::finishStripe(Connection* conn) {
+	if (conn->stripe->verify && conn->phase == ConnectionPhase::RECEIVING_STRIPE) {
+		conn->phase = ConnectionPhase::VERIFYING;
+		return;
+	}
+
+	if (conn->stripe_completed) {
+		queueReply(conn, statusMessage({{"status", "complete"},
+				{"filename", conn->stripe->output_filename}}).encode(conn->format));
+	} else {
+		queueReply(conn, statusMessage({{"status", "stripe_received"},
+				{"offset", conn->stripe_offset}}).encode(conn->format));
+	}
+
+	conn->stripe.reset();
+	conn->phase = ConnectionPhase::AWAITING_FILE_INFO;
+}
+
+/**
+ * Whole file is on disk: notify and go back to waiting for the next FILE_INFO
+ */
+void EventLoop::finishFile(Connection* conn) {
+	if (conn->verify && conn->phase == ConnectionPhase::RECEIVING_DATA) {
+		conn->phase = ConnectionPhase::VERIFYING;
+		return;
+	}
+
+	close(conn->output_fd);
+	conn->output_fd = -1;
+	conn->phase = ConnectionPhase::AWAITING_FILE_INFO;
+
+	if (!FileTransferServer::commitOutputFile(conn->data_filename, conn->output_filename, conn->journal)) {
+		queueReply(conn, statusMessage({{"status", "error"}, {"reason", "Cannot finalize file"}}).encode(conn->format));
+		return;
+	}
+
+	std::cout << "File received successfully: " << conn->output_filename
+		<< " (" << conn->total_received << " bytes)" << std::endl;
+
+	server.addToStore(conn->file_info, conn->output_filename);
+
+	if (server.file_received_callback) {
+		server.file_received_callback(conn->output_filename, conn->total_received);
+	}
+
+	json complete = {{"status", "complete"}, {"filename", conn->output_filename}};
+	if (conn->verify) {
+		complete["checksum"] = crc32cToHex(conn->crc);
+	}
+	queueReply(conn, statusMessage(complete).encode(conn->format));
+}
+
+/**
+ * FILE_CHECKSUM received: same checks as receiveFile()/receiveStripe()
+ */
+bool EventLoop::verifyChecksum(Connection* conn, const TransferMessage& msg) {
+	if (conn->phase != ConnectionPhase::VERIFYING) {
+		std::cerr << "Unexpected checksum from " << conn->ip_address << std::endl;
+		return true;
+	}
+
+	bool matches = FileTransferServer::checksumMatches(msg, conn->crc);
+
+	if (conn->stripe) {
+		if (!matches) {
+			std::cerr << "Checksum mismatch in stripe at offset " << conn->stripe_start
+				<< " of transfer " << conn->stripe->id << std::endl;
+			queueReply(conn, statusMessage({{"status", "error"}, {"reason", "Checksum mismatch"}}).encode(conn->format));
+			return false;  // closeConnection() aborts the transfer
+		}
+
+		// stripe_offset has advanced to the end of the stripe
+		if (addStripeData(conn, conn->stripe, conn->stripe_start, conn->stripe_offset - conn->stripe_start)) {
+			conn->stripe_completed = true;
+		}
+		finishStripe(conn);
+		return true;
+	}
+
+	if (!matches) {
+		std::cerr << "Checksum mismatch for " << conn->output_filename << ": expected "
+			<< msg.data.value("checksum", "none") << ", received data has " << crc32cToHex(conn->crc) << std::endl;
+
+		// Corrupt data must not be resumed from either
+		close(conn->output_fd);
+		conn->output_fd = -1;
+		conn->journal.discard();
+		std::remove(conn->data_filename.c_str());
+		conn->phase = ConnectionPhase::AWAITING_FILE_INFO;
+
+		queueReply(conn, statusMessage({{"status", "error"}, {"reason", "Checksum mismatch"}}).encode(conn->format));
+		return true;
+	}
+
+	finishFile(conn);
+	return true;
+}
+
+/**
+ * Appends a reply to the outbox and sends what the socket accepts now
+ */
+void EventLoop::queueReply(Connection* conn, const std::string& reply) {
+	conn->outbox += reply;
+	flushOutbox(conn);
+}
+
+/**
+ * Non-blocking send of the outbox; EPOLLOUT is only armed while data is queued
+ */
+bool EventLoop::flushOutbox(Connection* conn) {
+	while (!conn->outbox.empty()) {
+		ssize_t sent = send(conn->socket_fd, conn->outbox.data(), conn->outbox.size(), MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return false;
+		}
+		conn->outbox.erase(0, sent);
+	}
+
+	bool need_write = !conn->outbox.empty();
+	if (need_write != conn->want_write) {
+		struct epoll_event ev = {};
+		ev.events = EPOLLIN | EPOLLRDHUP | (need_write ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+		ev.data.fd = conn->socket_fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->socket_fd, &ev);
+		conn->want_write = need_write;
+	}
+
+	return true;
+}
+
+/**
+ * Same policy as the end of receiveFile(); the sync before keeping the file
+ * happens on the disk thread, which takes over the descriptor and journal
+ */
+void EventLoop::abandonFile(Connection* conn) {
+	if (conn->journal.isPersistent()) {
+		std::shared_ptr<TransferJournal> journal = std::make_shared<TransferJournal>(std::move(conn->journal));
+		int output_fd = conn->output_fd;
+		std::string data_filename = conn->data_filename;
+
+		queueDiskJob([journal, output_fd, data_filename]() {
+			bool kept = journal->checkpoint(output_fd);
+			close(output_fd);
+			if (kept) {
+				std::cout << "Kept " << data_filename << " for resuming" << std::endl;
+			} else {
+				journal->discard();
+				std::remove(data_filename.c_str());
+			}
+		});
+		conn->journal = TransferJournal();
+	} else {
+		close(conn->output_fd);
+		std::remove(conn->data_filename.c_str());
+	}
+	conn->output_fd = -1;
+}
+
+/**
+ * One job at a time, in the order they were queued
+ */
+void EventLoop::runDiskJobs() {
+	while (true) {
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(disk_mutex);
+			disk_cv.wait(lock, [this]() { return disk_stopping || !disk_jobs.empty(); });
+			if (disk_jobs.empty()) {
+				return;
+			}
+			job = std::move(disk_jobs.front());
+			disk_jobs.pop_front();
+		}
+		job();
+	}
+}
+
+void EventLoop::queueDiskJob(std::function<void()> job) {
+	{
+		std::lock_guard<std::mutex> lock(disk_mutex);
+		disk_jobs.push_back(std::move(job));
+	}
+	disk_cv.notify_one();
+}
+
+/**
+ * The snapshot is taken now; the job gets its own descriptor, since the
+ * file may be finished and closed before the job runs
+ */
+void EventLoop::checkpointLater(Connection* conn) {
+	if (!conn->journal.checkpointDue()) {
+		return;
+	}
+	int data_fd = dup(conn->output_fd);
+	if (data_fd < 0) {
+		return;
+	}
+
+	JournalCheckpoint checkpoint = conn->journal.snapshot();
+	queueDiskJob([checkpoint, data_fd]() {
+		TransferJournal::write(checkpoint, data_fd);
+		close(data_fd);
+	});
+}
+
+bool EventLoop::addStripeData(Connection* conn, const std::shared_ptr<StripedTransfer>& transfer,
+		uint64_t offset, uint64_t length) {
+	bool checkpoint_due = false;
+	bool completed = server.addStripeData(*transfer, offset, length, conn->client.get(), conn->ip_address,
+			&checkpoint_due);
+	if (checkpoint_due) {
+		queueDiskJob([transfer]() { FileTransferServer::checkpointStripedTransfer(*transfer); });
+	}
+	return completed;
+}
+
+/**
+ * Tears down a connection; a half-received file is handled like in receiveFile()
+ */
+void EventLoop::closeConnection(Connection* conn) {
+	int fd = conn->socket_fd;
+
+	if (conn->output_fd >= 0) {
+		std::cerr << "File transfer incomplete: received " << conn->total_received
+			<< " of " << conn->file_info.filesize << " bytes" << std::endl;
+		abandonFile(conn);
+	}
+
+	// A lost stripe (or the connection that announced the file) means the file
+	// can't complete; keeping it for resuming syncs it, so not on this thread
+	if (conn->stripe) {
+		uint64_t id = conn->stripe->id;
+		queueDiskJob([this, id]() { server.abortStripedTransfer(id); });
+	}
+	if (conn->owned_transfer != 0) {
+		uint64_t id = conn->owned_transfer;
+		queueDiskJob([this, id]() { server.abortStripedTransfer(id); });
+	}
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+	connections.erase(fd);
+
+	// Forget the client before closing so the fd number can't be reused under us
+	server.removeClient(fd);
+	close(fd);
+	delete conn;
+}
@@ -0,0 +1,291 @@
+#include "fileBatch.hpp"
+#include "checksum.hpp"
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+using json = nlohmann::json;
+
+BatchReceiver::BatchReceiver() : id(0), current(0), written(0), output_fd(-1), crc(0), received(0),
+	total_bytes(0), consumed(0), failed(json::array()) {
+}
+
+BatchReceiver::~BatchReceiver() {
+	if (output_fd >= 0) {
+		close(output_fd);
+		std::remove(entries[current].name.c_str());
+	}
+}
+
+bool BatchReceiver::begin(const TransferMessage& msg) {
+	try {
+		id = msg.data.at("batch");
+		const json& files = msg.data.at("files");
+		if (!files.is_array() || files.empty() || files.size() > BATCH_MAX_FILES) {
+			return false;
+		}
+
+		for (const auto& file : files) {
+			BatchEntry entry;
+			entry.name = file.at("name");
+			entry.directory = file.value("type", "file") == "dir";
+			entry.size = entry.directory ? 0 : file.at("size").get<uint64_t>();
+			entry.checksum = file.value("checksum", "");
+			entry.mode = file.value("mode", entry.directory ? 0755u : 0644u) & 0777;
+			if (entry.size > UINT64_MAX - total_bytes) {
+				return false;
+			}
+			total_bytes += entry.size;
+			entries.push_back(std::move(entry));
+		}
+	} catch (const json::exception& e) {
+		std::cerr << "Invalid batch manifest: " << e.what() << std::endl;
+		return false;
+	}
+
+	openCurrent();
+	return true;
+}
+
+/**
+ * mkdir -p for the directories above a relative path
+ */
+static bool createParents(const std::string& name) {
+	for (size_t slash = name.find('/'); slash != std::string::npos; slash = name.find('/', slash + 1)) {
+		std::string parent = name.substr(0, slash);
+		if (mkdir(parent.c_str(), 0755) != 0 && errno != EEXIST) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Small files are written with plain write(): no preallocation or journal,
+ * their whole life is an open, a write or two and a close
+ */
+void BatchReceiver::openCurrent() {
+	while (current < entries.size()) {
+		const BatchEntry& entry = entries[current];
+		written = 0;
+		crc = 0;
+
+		if (!isSafeRelativePath(entry.name)) {
+			std::cerr << "Refusing batch entry " << entry.name << std::endl;
+			failed.push_back({{"name", entry.name}, {"reason", "Invalid file name"}});
+		} else if (entry.directory) {
+			// Owner keeps write access, or the directory's contents couldn't be created
+			int result = mkdir(entry.name.c_str(), entry.mode | S_IRWXU);
+			if (result != 0 && errno == ENOENT && createParents(entry.name)) {
+				result = mkdir(entry.name.c_str(), entry.mode | S_IRWXU);
+			}
+
+			struct stat st;
+			if (result == 0 || (errno == EEXIST && stat(entry.name.c_str(), &st) == 0 && S_ISDIR(st.st_mode))) {
+				received++;
+			} else {
+				std::cerr << "Cannot create directory " << entry.name << ": " << strerror(errno) << std::endl;
+				failed.push_back({{"name", entry.name}, {"reason", "Cannot create directory"}});
+			}
+			current++;
+			continue;
+		} else {
+			int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+			output_fd = open(entry.name.c_str(), flags, entry.mode);
+			if (output_fd < 0 && errno == ENOENT && createParents(entry.name)) {
+				output_fd = open(entry.name.c_str(), flags, entry.mode);
+			}
+			if (output_fd < 0) {
+				std::cerr << "Cannot create " << entry.name << ": " << strerror(errno) << std::endl;
+				failed.push_back({{"name", entry.name}, {"reason", "Cannot create file"}});
+			}
+		}
+
+		if (entry.size > 0) {
+			return;
+		}
+		finishCurrent();
+	}
+}
+
+void BatchReceiver::finishCurrent() {
+	const BatchEntry& entry = entries[current];
+
+	if (output_fd >= 0) {
+		if (!entry.checksum.empty() && crc32cToHex(crc) != entry.checksum) {
+			std::cerr << "Checksum mismatch for " << entry.name << ": expected " << entry.checksum
+				<< ", received data has " << crc32cToHex(crc) << std::endl;
+			failCurrent("Checksum mismatch");
+		} else {
+			close(output_fd);
+			output_fd = -1;
+			received++;
+			if (file_callback) {
+				file_callback(entry.name, entry.size);
+			}
+		}
+	}
+
+	current++;
+}
+
+void BatchReceiver::failCurrent(const std::string& reason) {
+	if (output_fd >= 0) {
+		close(output_fd);
+		output_fd = -1;
+		std::remove(entries[current].name.c_str());
+	}
+	failed.push_back({{"name", entries[current].name}, {"reason", reason}});
+}
+
+size_t BatchReceiver::consume(const char* data, size_t length) {
+	size_t used = 0;
+
+	while (used < length && current < entries.size()) {
+		const BatchEntry& entry = entries[current];
+		uint64_t left = entry.size - written;
+		size_t take = (length - used < left) ? length - used : static_cast<size_t>(left);
+
+		if (output_fd >= 0) {
+			size_t done = 0;
+			while (done < take) {
+				ssize_t w = write(output_fd, data + used + done, take - done);
+				if (w < 0) {
+					if (errno == EINTR) continue;
+					std::cerr << "Error writing " << entry.name << ": " << strerror(errno) << std::endl;
+					failCurrent("Write failed");
+					break;
+				}
+				done += w;
+			}
+			if (!entry.checksum.empty()) {
+				crc = crc32cUpdate(crc, data + used, take);
+			}
+		}
+
+		written += take;
+		used += take;
+		if (written == entry.size) {
+			finishCurrent();
+			openCurrent();
+		}
+	}
+
+	consumed += used;
+	return used;
+}
+
+uint64_t BatchReceiver::remaining() const {
+	return total_bytes - consumed;
+}
+
+TransferMessage BatchReceiver::reply() const {
+	json reply = {{"status", "batch_complete"}, {"batch", id}, {"received", received}};
+	if (!failed.empty()) {
+		reply["failed"] = failed;
+	}
+	return statusMessage(reply);
+}
+
+BatchSender::BatchSender(int socket_fd, WireFormat format, std::function<bool(json&, int)> read_reply)
+	: socket_fd(socket_fd), format(format), read_reply(read_reply), files(json::array()), next_batch(0),
+	acks_pending(0), confirmed(0), failures(0) {
+}
+
+/**
+ * A batch goes out as soon as it is full, so the receiver gets busy while we read the next files
+ */
+bool BatchSender::addFile(const std::string& name, int file_fd, uint64_t size, uint32_t mode) {
+	size_t offset = bodies.size();
+	bodies.resize(offset + size);
+	size_t length = 0;
+	while (length < size) {
+		ssize_t n = read(file_fd, &bodies[offset + length], size - length);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		length += n;
+	}
+	bodies.resize(offset + length);
+
+	files.push_back({
+		{"name", name},
+		{"size", length},
+		{"checksum", crc32cToHex(crc32cUpdate(0, bodies.data() + offset, length))},
+		{"mode", mode & 0777}
+	});
+
+	if (files.size() >= BATCH_MAX_FILES || bodies.size() >= BATCH_MAX_BYTES) {
+		return flush();
+	}
+	return true;
+}
+
+bool BatchSender::addDirectory(const std::string& name, uint32_t mode) {
+	files.push_back({{"name", name}, {"type", "dir"}, {"mode", mode & 0777}});
+
+	if (files.size() >= BATCH_MAX_FILES) {
+		return flush();
+	}
+	return true;
+}
+
+bool BatchSender::flush() {
+	if (files.empty()) {
+		return true;
+	}
+
+	TransferMessage batch;
+	batch.type = MessageType::FILE_BATCH;
+	batch.data = {{"batch", next_batch++}, {"files", std::move(files)}};
+
+	if (!sendMessage(socket_fd, batch, format) || !sendAll(socket_fd, bodies.data(), bodies.size())) {
+		std::cerr << "Failed to send file batch" << std::endl;
+		return false;
+	}
+	files = json::array();
+	bodies.clear();
+	acks_pending++;
+
+	return collectAcks(BATCH_WINDOW - 1);
+}
+
+bool BatchSender::drain() {
+	return flush() && collectAcks(0);
+}
+
+bool BatchSender::collectAcks(size_t keep) {
+	while (acks_pending > 0) {
+		json reply;
+		errno = 0;
+		if (!read_reply(reply, acks_pending > keep ? 0 : MSG_DONTWAIT)) {
+			// Non-blocking poll with nothing to read yet is not an error
+			if (acks_pending <= keep && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				return true;
+			}
+			std::cerr << "Connection lost while waiting for batch acknowledgments" << std::endl;
+			return false;
+		}
+		acks_pending--;
+
+		if (reply.value("status", "") != "batch_complete") {
+			std::cerr << "Server rejected file batch: " << reply.value("reason", "unknown reason") << std::endl;
+			return false;
+		}
+		confirmed += reply.value("received", size_t(0));
+		for (const auto& failure : reply.value("failed", json::array())) {
+			std::cerr << "Server failed to store " << failure.value("name", "?") << ": "
+				<< failure.value("reason", "unknown reason") << std::endl;
+			failures++;
+		}
+	}
+	return true;
+}
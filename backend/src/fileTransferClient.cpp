@@ -1,15 +1,45 @@
 #include "fileTransferClient.hpp"
+#include "ioUringEngine.hpp"
+#include "checksum.hpp"
+#include "merkleTree.hpp"
+#include "deltaSync.hpp"
+#include "compression.hpp"
+#include "bufferPipeline.hpp"
+#include "bufferPool.hpp"
+#include "zeroCopy.hpp"
+#include "fileBatch.hpp"
+#include "directoryWalker.hpp"
+#include "sha256.hpp"
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
 #include <nlohmann/json.hpp>
 
 using json = nlohmann::json;
 
-FileTransferClient::FileTransferClient(const std::string& ip, int port) : server_ip(ip), port(port), connected(false) {
+FileTransferClient::FileTransferClient(const std::string& ip, int port) : server_ip(ip), port(port), connected(false),
+	send_mode(SendMode::SENDFILE), wire_format(WireFormat::JSON), active_format(WireFormat::JSON),
+	stripe_count(1), stripe_size(8 * 1024 * 1024), resume(true), checksum(true), chunk_size(0), delta_sync(false),
+	compression(false), deduplicate(false), pipeline_depth(4), pipeline_buffer_size(1024 * 1024), direct_io_size(4 * 1024 * 1024),
+	zero_copy(false), zero_copy_bytes(0), negotiated(false), batch_supported(false), hello_unanswered(false), retry_after(0),
+	last_percentage(-1) {
 
 	// socket() creates an endpoint for communication
 	// AF_INET: Address Family - IPv4 Internet protocols
@@ -62,6 +92,73 @@ bool FileTransferClient::connect() {
 
 	connected = true;
 	std::cout << "Connected to " << server_ip << ":" << port << std::endl;
+
+	// Control messages are small and most of them wait for an answer: don't
+	// let Nagle hold one back until the server's delayed ACK for the last
+	int nodelay = 1;
+	setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+	if (wire_format == WireFormat::BINARY && !negotiateWireFormat()) {
+		if (retry_after > 0) {
+			connected = false;   // Turned away, the server closes the connection
+			return false;
+		}
+		std::cerr << "Server did not answer HELLO, staying on JSON messages" << std::endl;
+	}
+	return true;
+}
+
+/**
+ * Asks the server to switch this connection to binary framing (if wanted)
+ * and learns which optional features it supports
+ * HELLO itself is always JSON, since neither side knows yet what the other speaks
+ */
+bool FileTransferClient::negotiateWireFormat() {
+	TransferMessage hello;
+	hello.type = MessageType::HELLO;
+	hello.data = {{"wire", wire_format == WireFormat::BINARY ? "binary" : "json"}, {"version", FRAME_VERSION}};
+
+	if (!sendMessage(client_fd, hello, WireFormat::JSON)) {
+		return false;
+	}
+
+	// Older servers log HELLO as an unknown message and never answer it
+	struct timeval timeout = {HELLO_TIMEOUT_MS / 1000, (HELLO_TIMEOUT_MS % 1000) * 1000};
+	setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	json reply;
+	errno = 0;
+	bool replied = readReply(reply);
+	bool timed_out = !replied && (errno == EAGAIN || errno == EWOULDBLOCK);
+	struct timeval no_timeout = {0, 0};
+	setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
+
+	if (timed_out) {
+		// Don't ask again on this connection: every request would wait as long
+		std::cerr << "No HELLO reply within " << HELLO_TIMEOUT_MS << "ms, assuming an older server" << std::endl;
+		negotiated = true;
+		hello_unanswered = true;
+		return false;
+	}
+	if (!replied) {
+		return false;
+	}
+	if (reply.value("status", "") == "busy") {
+		retry_after = reply.value("retry_after", 1);
+		std::cerr << "Server busy, retry in " << retry_after << "s" << std::endl;
+		return false;
+	}
+	if (reply.value("status", "") != "hello") {
+		return false;
+	}
+
+	negotiated = true;
+	batch_supported = reply.value("batch", false);
+
+	if (reply.value("wire", "json") == "binary") {
+		reader.setFormat(WireFormat::BINARY);
+		active_format = WireFormat::BINARY;
+		std::cout << "Using binary message framing" << std::endl;
+	}
 	return true;
 }
 
@@ -69,6 +166,15 @@ bool FileTransferClient::connect() {
  * Sends a file to the server with progress tracking
  */
 bool FileTransferClient::sendFile(const std::string& filepath) {
+	// Extract filename from path
+	size_t last_slash = filepath.find_last_of("/\\");
+	std::string filename = (last_slash != std::string::npos) ? 
+		filepath.substr(last_slash + 1) : filepath;
+
+	return sendFileAs(filepath, filename);
+}
+
+bool FileTransferClient::sendFileAs(const std::string& filepath, const std::string& filename) {
 	if (!connected) {
 		std::cerr << "Not connected to server" << std::endl;
 		return false;
@@ -85,75 +191,1236 @@ bool FileTransferClient::sendFile(const std::string& filepath) {
 	uint64_t file_size = file.tellg();
 	file.seekg(0, std::ios::beg);  // Reset to beginning for reading
 
-	// Extract filename from path
-	size_t last_slash = filepath.find_last_of("/\\");
-	std::string filename = (last_slash != std::string::npos) ? 
-		filepath.substr(last_slash + 1) : filepath;
+	// Striping and resuming need a stable, seekable source, so only regular files qualify
+	struct stat st;
+	bool regular = (stat(filepath.c_str(), &st) == 0 && S_ISREG(st.st_mode));
+	bool striped = regular && stripe_count > 1 && file_size > stripe_size;
 
 	// Create file info message using JSON for easy parsing
 	TransferMessage file_info_msg;
 	file_info_msg.type = MessageType::FILE_INFO;
 	file_info_msg.data = {
 		{"filename", filename},
-		{"filesize", file_size},
-		{"checksum", ""}  // TODO: We'll implement checksum later
+		{"filesize", file_size}
 	};
+	if (checksum) {
+		file_info_msg.data["checksum"] = CHECKSUM_CRC32C;  // Offered; the server says in its reply whether it verifies
+	}
+	if (striped) {
+		file_info_msg.data["stripes"] = stripe_count;
+		file_info_msg.data["stripe_size"] = stripe_size;
+	}
+	if (regular) {
+		file_info_msg.data["mode"] = st.st_mode & 0777;
+	}
+	if (resume && regular) {
+		file_info_msg.data["mtime"] = static_cast<int64_t>(st.st_mtime);
+	}
+	if (delta_sync && regular && !striped && file_size > 0) {
+		file_info_msg.data["delta"] = true;
+	}
+	if (compression && !striped && BlockCompressor::isAvailable()) {
+		file_info_msg.data["compression"] = {COMPRESSION_LZ4};
+	}
+	if (deduplicate && regular && file_size > 0) {
+		int hash_fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+		std::string hash;
+		if (hash_fd >= 0 && sha256File(hash_fd, hash)) {
+			file_info_msg.data["sha256"] = hash;
+		} else {
+			std::cerr << "Cannot hash " << filepath << ", sending without deduplication" << std::endl;
+		}
+		if (hash_fd >= 0) {
+			close(hash_fd);
+		}
+	}
+
+	// The tree needs a pass over the file before sending, spread over all cores
+	MerkleTree tree;
+	int tree_fd = -1;
+	if (chunk_size > 0 && regular && !striped && MerkleTree::validGeometry(file_size, chunk_size)) {
+		tree_fd = open(filepath.c_str(), O_RDONLY);
+		tree = MerkleTree(file_size, chunk_size);
+		if (tree_fd >= 0 && tree.build(tree_fd)) {
+			file_info_msg.data["merkle_root"] = tree.rootHex();
+			file_info_msg.data["chunk_size"] = chunk_size;
+		} else {
+			std::cerr << "Cannot hash " << filepath << ", sending without chunk verification" << std::endl;
+		}
+	}
+	// Closes tree_fd on every return path
+	std::unique_ptr<int, void (*)(int*)> tree_fd_guard(&tree_fd, [](int* fd) { if (*fd >= 0) close(*fd); });
 
 	// Send file information first
-	std::string serialized = file_info_msg.serialize();
-	ssize_t sent = send(client_fd, serialized.c_str(), serialized.length(), 0);
-	if (sent != static_cast<ssize_t>(serialized.length())) {
+	if (!sendMessage(client_fd, file_info_msg, active_format)) {
 		std::cerr << "Failed to send file info" << std::endl;
 		return false;
 	}
 
-	// Wait for acknowledgment from server
-	char ack_buffer[1024];
-	ssize_t received = recv(client_fd, ack_buffer, sizeof(ack_buffer), 0);
-	if (received <= 0) {
+	// Wait for acknowledgment ("ready") and for the output file to be open ("receiving")
+	// The two replies may arrive in one segment or two, so read them one message at a time
+	json reply;
+	if (!readReply(reply)) {
 		std::cerr << "No acknowledgment from server" << std::endl;
 		return false;
 	}
+	// Turned away by the server's admission control: nothing was received
+	if (reply.value("status", "") == "busy") {
+		retry_after = reply.value("retry_after", 1);
+		std::cerr << "Server busy, retry in " << retry_after << "s" << std::endl;
+		return false;
+	}
+	while (reply.value("status", "") == "ready") {
+		if (!readReply(reply)) {
+			std::cerr << "No acknowledgment from server" << std::endl;
+			return false;
+		}
+	}
+	// Resumed file that was already fully on disk, or content the server had stored
+	if (reply.value("status", "") == "complete") {
+		std::cout << "File transfer complete: " << filename
+			<< (reply.value("deduplicated", false) ? " (deduplicated on server)" : " (already on server)") << std::endl;
+		return true;
+	}
+	if (reply.value("status", "") != "receiving") {
+		std::cerr << "Server refused file: " << reply.value("reason", "unknown reason") << std::endl;
+		return false;
+	}
 
-	// Send file data in chunks to avoid loading entire file into memory
-	const size_t CHUNK_SIZE = 4096;  // 4KB chunks - good balance for network
-	std::vector<char> buffer(CHUNK_SIZE);
-	uint64_t total_sent = 0;
-	int last_percentage = -1;
+	// Bytes the server kept from an interrupted attempt; every data path starts at total_sent
+	uint64_t total_sent = reply.value("resume_offset", uint64_t(0));
+	if (total_sent > file_size) {
+		std::cerr << "Server wants to resume " << filename << " at byte " << total_sent
+			<< ", past its end (" << file_size << " bytes)" << std::endl;
+		return false;
+	}
+	last_percentage = -1;
+	if (total_sent > 0) {
+		std::cout << "Resuming at byte " << total_sent << std::endl;
+	}
 
 	std::cout << "Starting file transfer: " << filename << " (" << file_size << " bytes)" << std::endl;
 
+	// Older servers don't verify, and don't expect FILE_CHECKSUM messages either
+	bool verify = reply.value("checksum", "") == CHECKSUM_CRC32C;
+
+	// Servers that check chunks want every leaf hash before the data
+	bool merkle = reply.value("merkle", false) && file_info_msg.data.contains("merkle_root");
+	if (merkle && !sendMerkleLeaves(tree)) {
+		return false;
+	}
+
+	// The server has a copy of its own and sent its block signatures instead of taking the whole file
+	bool delta = reply.contains("delta") && file_info_msg.data.contains("delta");
+	if (delta) {
+		int file_fd = open(filepath.c_str(), O_RDONLY);
+		if (file_fd < 0) {
+			std::cerr << "Cannot open file: " << filepath << std::endl;
+			return false;
+		}
+		bool sent = sendDelta(file_fd, file_size, reply["delta"].at("block_size"), reply["delta"].at("blocks"));
+		close(file_fd);
+
+		if (!sent) {
+			return false;
+		}
+		if (!readReply(reply) || reply.value("status", "") != "complete") {
+			std::cerr << "Server did not confirm completion of " << filename << ": "
+				<< reply.value("reason", "connection closed") << std::endl;
+			return false;
+		}
+
+		std::cout << "File transfer complete: " << filename << " (delta, "
+			<< reply.value("literal_bytes", uint64_t(0)) << " of " << file_size << " bytes sent)" << std::endl;
+		return true;
+	}
+
+	// Servers that don't know striping reply without a transfer id and expect one stream
+	if (striped && reply.contains("transfer_id")) {
+		int file_fd = open(filepath.c_str(), O_RDONLY);
+		if (file_fd < 0) {
+			std::cerr << "Cannot open file: " << filepath << std::endl;
+			return false;
+		}
+
+		RangeSet received;
+		for (const auto& range : reply.value("ranges", json::array())) {
+			received.add(range.at(0), range.at(1).get<uint64_t>() - range.at(0).get<uint64_t>());
+		}
+		if (!received.empty()) {
+			std::cout << "Resuming: " << received.covered() << " bytes already on server" << std::endl;
+		}
+
+		bool success = sendStriped(file_fd, file_size, reply["transfer_id"], received, verify, total_sent);
+		close(file_fd);
+
+		if (success) {
+			std::cout << "File transfer complete: " << filename << std::endl;
+		}
+		return success;
+	}
+
+	bool success = false;
+	SendMode mode = send_mode;
+	int file_fd = -1;
+
+	// Covers the whole file: the prefix the server kept is hashed here, as it is there
+	uint32_t crc = 0;
+	uint32_t* running_crc = verify ? &crc : nullptr;
+	if (verify && total_sent > 0) {
+		int prefix_fd = open(filepath.c_str(), O_RDONLY);
+		bool hashed = prefix_fd >= 0 && crc32cUpdateFromFile(crc, prefix_fd, 0, total_sent);
+		if (prefix_fd >= 0) {
+			close(prefix_fd);
+		}
+		if (!hashed) {
+			std::cerr << "Cannot read " << filepath << " to checksum the resumed part" << std::endl;
+			return false;
+		}
+	}
+
+	// Blocks are encoded in user space, so the zero-copy paths don't apply
+	bool compressed = reply.value("compression", "") == COMPRESSION_LZ4 && file_info_msg.data.contains("compression");
+	if (compressed) {
+		mode = SendMode::BUFFERED;
+	}
+
+	if (mode == SendMode::IO_URING && !IoUringEngine::isAvailable()) {
+		std::cerr << "io_uring not available, using sendfile() instead" << std::endl;
+		mode = SendMode::SENDFILE;
+	}
+
+	if (mode != SendMode::BUFFERED) {
+		// sendfile() and io_uring need a real file behind the descriptor,
+		// so pipes, character devices etc. take the buffered path instead
+		// (the pipelined reader only needs read())
+		file_fd = open(filepath.c_str(), O_RDONLY);
+		struct stat st;
+		if (file_fd < 0 || fstat(file_fd, &st) != 0 || (!S_ISREG(st.st_mode) && mode != SendMode::PIPELINED)) {
+			mode = SendMode::BUFFERED;
+		}
+	}
+
+	if (mode == SendMode::DIRECT) {
+		// Same file, read around the page cache; tmpfs and some FUSE filesystems refuse
+		int direct_fd = open(filepath.c_str(), O_RDONLY | O_DIRECT);
+		if (direct_fd < 0) {
+			std::cerr << "O_DIRECT not supported here (" << strerror(errno)
+				<< "), falling back to pipelined send" << std::endl;
+			mode = SendMode::PIPELINED;
+		} else {
+			close(file_fd);
+			file_fd = direct_fd;
+		}
+	}
+
+	// Resume offset: a fallback is only safe while nothing beyond it has been sent
+	uint64_t started_at = total_sent;
+
+	if (mode == SendMode::IO_URING) {
+		IoUringEngine engine;
+		uint64_t hashed = total_sent;
+		success = engine.sendFile(file_fd, client_fd, file_size, total_sent, [&, file_size](uint64_t sent) {
+			// Completed sends are still in the page cache, hash them from there
+			if (running_crc && !crc32cUpdateFromFile(*running_crc, file_fd, hashed, sent - hashed)) {
+				return false;
+			}
+			hashed = sent;
+			reportProgress(sent, file_size);
+			return true;
+		});
+
+		// Ring setup refused (e.g. locked memory limit): nothing sent yet, use sendfile()
+		if (!success && total_sent == started_at) {
+			std::cerr << "io_uring transfer failed to start, falling back to sendfile()" << std::endl;
+			mode = SendMode::SENDFILE;
+		}
+	}
+
+	if (mode == SendMode::SENDFILE) {
+		success = sendWithSendfile(file_fd, file_size, total_sent, running_crc);
+
+		// Kernel refused before the first byte (e.g. unsupported filesystem): retry buffered
+		if (!success && total_sent == started_at && (errno == EINVAL || errno == ENOSYS)) {
+			std::cerr << "sendfile() not supported here, falling back to buffered send" << std::endl;
+			success = sendBuffered(file, file_size, total_sent, running_crc);
+		}
+	} else if (mode == SendMode::MMAP) {
+		success = sendMapped(file_fd, file_size, total_sent, running_crc);
+
+		// Filesystem without mmap support: nothing sent yet, read it instead
+		if (!success && total_sent == started_at && errno == ENODEV) {
+			std::cerr << "mmap() not supported here, falling back to pipelined send" << std::endl;
+			success = sendPipelined(file_fd, file_size, total_sent, running_crc);
+		}
+	} else if (mode == SendMode::PIPELINED || mode == SendMode::DIRECT) {
+		success = sendPipelined(file_fd, file_size, total_sent, running_crc, mode == SendMode::DIRECT);
+	} else if (mode == SendMode::BUFFERED && compressed) {
+		success = sendCompressed(file, file_size, total_sent, running_crc);
+	} else if (mode == SendMode::BUFFERED) {
+		success = sendBuffered(file, file_size, total_sent, running_crc);
+	}
+
+	if (file_fd >= 0) {
+		close(file_fd);
+	}
+	file.close();
+
+	if (!success) {
+		return false;
+	}
+
+	if (verify && !sendChecksum(crc)) {
+		return false;
+	}
+
+	// Wait until the server confirms the whole file is on disk. Closing the
+	// socket before that (with its reply still unread) makes the kernel send
+	// a RST, which can throw away data the server hasn't read yet.
+	bool replied = readReply(reply);
+
+	// Chunks that arrived corrupt are sent again on their own
+	while (merkle && replied && reply.value("status", "") == "resend") {
+		std::vector<uint64_t> chunks = reply.value("chunks", std::vector<uint64_t>());
+		std::cout << "Server asked for " << chunks.size() << " chunk(s) again" << std::endl;
+
+		for (uint64_t index : chunks) {
+			if (index >= tree.leafCount() ||
+				!sendRange(tree_fd, tree.chunkOffset(index), tree.chunkLength(index), [](uint64_t) {})) {
+				std::cerr << "Failed to resend chunk " << index << std::endl;
+				return false;
+			}
+		}
+		replied = readReply(reply);
+	}
+
+	if (!replied || reply.value("status", "") != "complete") {
+		std::cerr << "Server did not confirm completion of " << filename << ": "
+			<< reply.value("reason", "connection closed") << std::endl;
+		return false;
+	}
+
+	if (verify) {
+		std::cout << "File transfer complete: " << filename << " (crc32c " << crc32cToHex(crc) << " verified)" << std::endl;
+	} else if (merkle) {
+		std::cout << "File transfer complete: " << filename << " (" << tree.leafCount() << " chunks verified)" << std::endl;
+	} else {
+		std::cout << "File transfer complete: " << filename << std::endl;
+	}
+	return true;
+}
+
+/**
+ * Small files are packed into FILE_BATCH messages (see fileBatch.hpp) and
+ * streamed without waiting for the server in between. Large files and
+ * everything sent to servers without batch support go through sendFile(),
+ * once every batch before them has been acknowledged (their replies share
+ * the connection).
+ */
+bool FileTransferClient::sendFiles(const std::vector<std::string>& filepaths) {
+	if (!connected) {
+		std::cerr << "Not connected to server" << std::endl;
+		return false;
+	}
+
+	// JSON connections skip HELLO in connect(); batching needs to know what the server supports
+	if (!negotiated && !negotiateWireFormat() && retry_after > 0) {
+		return false;
+	}
+
+	BatchSender batch(client_fd, active_format, [this](json& reply, int recv_flags) {
+		return readReply(reply, recv_flags);
+	});
+	size_t sent_alone = 0;
+
+	for (const std::string& filepath : filepaths) {
+		size_t last_slash = filepath.find_last_of("/\\");
+		std::string filename = (last_slash != std::string::npos) ? filepath.substr(last_slash + 1) : filepath;
+
+		int file_fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+		if (file_fd < 0) {
+			std::cerr << "Cannot open file: " << filepath << std::endl;
+			continue;
+		}
+
+		struct stat st;
+		bool small = fstat(file_fd, &st) == 0 && S_ISREG(st.st_mode) &&
+			static_cast<uint64_t>(st.st_size) <= BATCH_FILE_LIMIT;
+
+		if (!batch_supported || !small) {
+			close(file_fd);
+			// Its replies must not be mistaken for batch acks; a failed
+			// transfer may have left the connection mid-file
+			if (!batch.drain() || !sendFileAs(filepath, filename)) {
+				return false;
+			}
+			sent_alone++;
+			continue;
+		}
+
+		bool added = batch.addFile(filename, file_fd, st.st_size, st.st_mode);
+		close(file_fd);
+		if (!added) {
+			return false;
+		}
+	}
+
+	if (!batch.drain()) {
+		return false;
+	}
+
+	size_t sent = batch.confirmedCount() + sent_alone;
+	std::cout << "Sent " << sent << " of " << filepaths.size() << " files";
+	if (batch.batchCount() > 0) {
+		std::cout << " (" << batch.batchCount() << " batches)";
+	}
+	std::cout << std::endl;
+	return sent == filepaths.size();
+}
+
+/**
+ * The walk runs on its own threads while this one sends: entries go into
+ * batches as they are found, a partial batch is sent whenever the walker
+ * has nothing ready, and every directory reaches the server (in an earlier
+ * batch, or earlier in the same one) before anything inside it
+ */
+bool FileTransferClient::sendDirectory(const std::string& dirpath, unsigned walk_threads) {
+	if (!connected) {
+		std::cerr << "Not connected to server" << std::endl;
+		return false;
+	}
+
+	if (!negotiated && !negotiateWireFormat() && retry_after > 0) {
+		return false;
+	}
+	if (!batch_supported) {
+		std::cerr << "Server does not support directory transfers" << std::endl;
+		return false;
+	}
+
+	// The tree arrives under the directory's own name, also for "." or "dir/"
+	char* resolved = realpath(dirpath.c_str(), nullptr);
+	std::string root = resolved ? resolved : dirpath;
+	free(resolved);
+	std::string top = root.substr(root.find_last_of('/') + 1);
+	if (top.empty()) {
+		std::cerr << "Cannot send " << dirpath << " as a directory" << std::endl;
+		return false;
+	}
+
+	struct stat st;
+	DirectoryWalker walker(root, walk_threads);
+	if (stat(root.c_str(), &st) != 0 || !walker.start()) {
+		std::cerr << "Cannot read directory: " << dirpath << std::endl;
+		return false;
+	}
+
+	BatchSender batch(client_fd, active_format, [this](json& reply, int recv_flags) {
+		return readReply(reply, recv_flags);
+	});
+	if (!batch.addDirectory(top, st.st_mode)) {
+		return false;
+	}
+
+	size_t files = 0;
+	size_t directories = 1;
+	size_t unreadable = 0;
+	uint64_t bytes = 0;
+	WalkEntry entry;
+
+	while (true) {
+		// Don't sit on a partial batch while the walk is slow
+		if (!walker.next(entry, false)) {
+			if (walker.done()) {
+				break;
+			}
+			if (!batch.flush()) {
+				return false;
+			}
+			if (!walker.next(entry)) {
+				break;
+			}
+		}
+
+		std::string name = top + "/" + entry.path;
+		if (entry.directory) {
+			if (!batch.addDirectory(name, entry.mode)) {
+				return false;
+			}
+			directories++;
+			continue;
+		}
+
+		std::string path = root + "/" + entry.path;
+		if (entry.size > BATCH_FILE_LIMIT) {
+			// Large files keep resume, striping etc.; the batches before them must be on disk first
+			if (!batch.drain() || !sendFileAs(path, name)) {
+				return false;
+			}
+		} else {
+			int file_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			if (file_fd < 0) {
+				std::cerr << "Cannot open file: " << path << std::endl;
+				unreadable++;
+				continue;
+			}
+			// Sent as big as it was when listed, so the manifest stays true
+			bool added = batch.addFile(name, file_fd, entry.size, entry.mode);
+			close(file_fd);
+			if (!added) {
+				return false;
+			}
+		}
+		files++;
+		bytes += entry.size;
+	}
+
+	if (!batch.drain()) {
+		return false;
+	}
+
+	std::cout << "Sent directory " << top << ": " << files << " files, " << directories << " directories, "
+		<< bytes << " bytes (" << batch.batchCount() << " batches)" << std::endl;
+	if (walker.skippedCount() > 0) {
+		std::cout << "Skipped " << walker.skippedCount() << " entries that are neither files nor directories" << std::endl;
+	}
+
+	return unreadable == 0 && walker.errorCount() == 0 && batch.failureCount() == 0;
+}
+
+/**
+ * Leaves go out in batches that stay well below the control message size limit
+ */
+bool FileTransferClient::sendMerkleLeaves(const MerkleTree& tree) {
+	const uint64_t LEAVES_PER_MESSAGE = 4096;
+
+	for (uint64_t first = 0; first < tree.leafCount(); first += LEAVES_PER_MESSAGE) {
+		uint64_t last = std::min(first + LEAVES_PER_MESSAGE, tree.leafCount());
+
+		TransferMessage batch;
+		batch.type = MessageType::MERKLE_LEAVES;
+		batch.data = {{"first", first}, {"hashes", json::array()}};
+		for (uint64_t i = first; i < last; i++) {
+			batch.data["hashes"].push_back(tree.leaf(i));
+		}
+
+		if (!sendMessage(client_fd, batch, active_format)) {
+			std::cerr << "Failed to send chunk hashes" << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Collects the server's signatures, then scans a read-only mapping of the file
+ * against them; matched blocks go out as references, everything else as literals
+ */
+bool FileTransferClient::sendDelta(int file_fd, uint64_t file_size, uint64_t block_size, uint64_t block_count) {
+	const size_t MAX_LITERAL = 1024 * 1024;    // Per FILE_DELTA operation, the server's limit
+
+	std::vector<BlockSignature> signatures;
+	signatures.reserve(block_count);
+	while (signatures.size() < block_count) {
+		json batch;
+		if (!readReply(batch) || batch.value("status", "") != "signatures" ||
+			batch.value("first", uint64_t(0)) != signatures.size()) {
+			std::cerr << "Missing block signatures from server: " << batch.value("reason", "unexpected reply") << std::endl;
+			return false;
+		}
+
+		const json& weak = batch.at("weak");
+		const json& strong = batch.at("strong");
+		for (size_t i = 0; i < weak.size() && i < strong.size(); i++) {
+			signatures.push_back({weak[i].get<uint32_t>(), strong[i].get<uint64_t>()});
+		}
+	}
+
+	void* mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+	if (mapping == MAP_FAILED) {
+		std::cerr << "Cannot map file for delta: " << strerror(errno) << std::endl;
+		return false;
+	}
+	madvise(mapping, file_size, MADV_SEQUENTIAL);
+	const unsigned char* data = static_cast<const unsigned char*>(mapping);
+
+	// Every operation continues where the last one ended, so the checksum and
+	// progress simply follow along
+	uint64_t position = 0;
+	uint32_t crc = 0;
+	last_percentage = -1;
+
+	bool success = generateDelta(data, file_size, signatures, block_size, MAX_LITERAL, [&](const DeltaOp& op) {
+		TransferMessage msg;
+		msg.type = MessageType::FILE_DELTA;
+		uint64_t length;
+
+		if (op.kind == DeltaOp::Kind::COPY) {
+			msg.data = {{"op", "copy"}, {"block", op.block}, {"count", op.count}};
+			length = op.count * block_size;
+			if (!sendMessage(client_fd, msg, active_format)) {
+				return false;
+			}
+		} else {
+			msg.data = {{"op", "data"}, {"length", op.length}};
+			length = op.length;
+			if (!sendMessage(client_fd, msg, active_format) ||
+				!sendAll(client_fd, reinterpret_cast<const char*>(data + op.offset), op.length)) {
+				return false;
+			}
+		}
+
+		crc = crc32cUpdate(crc, data + position, length);
+		position += length;
+		reportProgress(position, file_size);
+		return true;
+	});
+	munmap(mapping, file_size);
+
+	TransferMessage end;
+	end.type = MessageType::FILE_DELTA;
+	end.data = {{"op", "end"}};
+
+	if (!success || !sendMessage(client_fd, end, active_format) || !sendChecksum(crc)) {
+		std::cerr << "Error sending delta: " << strerror(errno) << std::endl;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Trailer after the data: the server compares it with what it received
+ */
+bool FileTransferClient::sendChecksum(uint32_t crc) {
+	TransferMessage checksum_msg;
+	checksum_msg.type = MessageType::FILE_CHECKSUM;
+	checksum_msg.data = {{"algorithm", CHECKSUM_CRC32C}, {"checksum", crc32cToHex(crc)}};
+
+	if (!sendMessage(client_fd, checksum_msg, active_format)) {
+		std::cerr << "Failed to send checksum" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Reads the next reply from the server
+ * Bytes past the first message stay in the reader for the next call
+ */
+bool FileTransferClient::readReply(json& reply, int recv_flags) {
+	// Large enough that a batch of block signatures arrives in a few reads
+	char buffer[64 * 1024];
+
+	while (true) {
+		TransferMessage msg;
+		try {
+			if (reader.next(msg)) {
+				// A HELLO reply that came after we gave up on it: harmless unless the server switched framing
+				if (hello_unanswered && msg.type == MessageType::STATUS && msg.data.value("status", "") == "hello") {
+					hello_unanswered = false;
+					if (msg.data.value("wire", "json") != "json") {
+						std::cerr << "Server switched to binary framing after the HELLO timeout" << std::endl;
+						return false;
+					}
+					continue;
+				}
+				if (msg.type == MessageType::STATUS) {
+					reply = msg.data;
+				} else {
+					// Anything else at this point (e.g. DISCONNECT) ends the exchange
+					reply = {{"status", "error"}, {"reason", msg.data.value("reason", "unexpected message")}};
+				}
+				return true;
+			}
+		} catch (const std::exception& e) {
+			std::cerr << "Invalid reply from server: " << e.what() << std::endl;
+			return false;
+		}
+
+		ssize_t received = recv(client_fd, buffer, sizeof(buffer), recv_flags);
+		if (received < 0 && errno == EINTR) {
+			continue;
+		}
+		if (received <= 0) {
+			return false;
+		}
+		reader.feed(buffer, received);
+	}
+}
+
+/**
+ * Buffered data path: every byte is copied disk -> user buffer -> socket buffer
+ */
+bool FileTransferClient::sendBuffered(std::ifstream& file, uint64_t file_size, uint64_t& total_sent, uint32_t* crc) {
+	// Send file data in chunks to avoid loading entire file into memory;
+	// the buffer comes from the shared pool, so repeated sends don't allocate
+	const size_t CHUNK_SIZE = 64 * 1024;
+	PooledBuffer buffer(CHUNK_SIZE);
+
+	file.clear();
+	file.seekg(static_cast<std::streamoff>(total_sent), std::ios::beg);
+
 	while (file.read(buffer.data(), CHUNK_SIZE) || file.gcount() > 0) {
 		size_t bytes_read = file.gcount();
 
 		// Send chunk
-		sent = send(client_fd, buffer.data(), bytes_read, 0);
+		ssize_t sent = send(client_fd, buffer.data(), bytes_read, 0);
 		if (sent != static_cast<ssize_t>(bytes_read)) {
 			std::cerr << "Failed to send file chunk" << std::endl;
 			return false;
 		}
+		if (crc) {
+			*crc = crc32cUpdate(*crc, buffer.data(), bytes_read);
+		}
 
 		total_sent += sent;
+		reportProgress(total_sent, file_size);
+	}
+
+	return total_sent == file_size;
+}
+
+/**
+ * Pipelined send: a reader thread keeps up to pipeline_depth buffers filled
+ * ahead of this thread, which only sends
+ *
+ * Direct reads must start on an aligned offset and ask for whole blocks: a
+ * resume offset is rounded down and the extra bytes dropped from the first
+ * buffer, and the short read at end of file delivers the unaligned tail.
+ */
+bool FileTransferClient::sendPipelined(int file_fd, uint64_t file_size, uint64_t& total_sent, uint32_t* crc,
+		bool direct) {
+	size_t buffer_size = pipeline_buffer_size;
+	if (direct) {
+		buffer_size = std::max(direct_io_size / DIRECT_IO_ALIGNMENT, static_cast<size_t>(1)) * DIRECT_IO_ALIGNMENT;
+	}
+	BufferPipeline pipeline(pipeline_depth, buffer_size);
+	bool read_failed = false;
+
+	if (!direct && total_sent > 0 && lseek(file_fd, static_cast<off_t>(total_sent), SEEK_SET) < 0) {
+		std::cerr << "Cannot seek to resume offset: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	std::thread reader_thread([&, file_size]() {
+		uint64_t offset = total_sent;
+		uint64_t read_at = offset - offset % DIRECT_IO_ALIGNMENT;   // Direct mode only
+		while (offset < file_size) {
+			BufferPipeline::Buffer* buffer = pipeline.acquire();
+			if (!buffer) {
+				break;  // Sender gave up
+			}
+			buffer->offset = offset;
+
+			if (direct) {
+				uint64_t left = file_size - read_at;
+				size_t needed = (left < pipeline.bufferSize()) ? left : pipeline.bufferSize();
+				size_t want = (needed + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+				while (buffer->length < needed) {
+					ssize_t n = pread(file_fd, buffer->data + buffer->length, want - buffer->length,
+						static_cast<off_t>(read_at + buffer->length));
+					if (n < 0 && errno == EINTR) {
+						continue;
+					}
+					if (n <= 0) {
+						std::cerr << "Error reading file: " << (n < 0 ? strerror(errno) : "file shrank") << std::endl;
+						read_failed = true;
+						break;
+					}
+					buffer->length += n;
+				}
+				if (buffer->length > needed) {
+					buffer->length = needed;  // File grew since FILE_INFO
+				}
+				read_at += buffer->length;
+
+				// Bytes before the resume offset were only read to stay aligned
+				size_t skip = static_cast<size_t>(offset - (read_at - buffer->length));
+				if (skip > 0) {
+					size_t kept = (buffer->length > skip) ? buffer->length - skip : 0;
+					memmove(buffer->data, buffer->data + skip, kept);
+					buffer->length = kept;
+				}
+			} else {
+				uint64_t remaining = file_size - offset;
+				size_t want = (remaining < pipeline.bufferSize()) ? remaining : pipeline.bufferSize();
+				while (buffer->length < want) {
+					ssize_t n = read(file_fd, buffer->data + buffer->length, want - buffer->length);
+					if (n < 0 && errno == EINTR) {
+						continue;
+					}
+					if (n <= 0) {
+						std::cerr << "Error reading file: " << (n < 0 ? strerror(errno) : "file shrank") << std::endl;
+						read_failed = true;
+						break;
+					}
+					buffer->length += n;
+				}
+			}
+
+			offset += buffer->length;
+			pipeline.push(buffer);
+			if (read_failed) {
+				break;
+			}
+		}
+		pipeline.finish();
+	});
+
+	// Zero-copy sends leave buffers with the kernel for a while: they go back
+	// to the reader once released, and at most all but one are held so the
+	// reader can always make progress
+	const int RELEASE_TIMEOUT_MS = 30000;
+	ZeroCopySender plain_sender(client_fd, false);
+	if (zero_copy && !zero_copy_sender) {
+		zero_copy_sender.reset(new ZeroCopySender(client_fd, true));
+	}
+	ZeroCopySender& sender = zero_copy ? *zero_copy_sender : plain_sender;
+	uint64_t zero_copy_before = sender.zeroCopyBytes();
+	uint64_t copied_before = sender.copiedBytes();
+	std::deque<std::pair<BufferPipeline::Buffer*, uint64_t>> in_flight;   // Buffer, sequence sent with
+	bool send_failed = false;
+	bool stuck = false;   // The kernel stopped releasing buffers
+
+	while (BufferPipeline::Buffer* buffer = pipeline.pop()) {
+		if (!sender.send(buffer->data, buffer->length)) {
+			std::cerr << "Failed to send file chunk" << std::endl;
+			send_failed = true;
+			pipeline.abort();
+			pipeline.release(buffer);
+			break;
+		}
+		if (crc) {
+			*crc = crc32cUpdate(*crc, buffer->data, buffer->length);
+		}
+
+		total_sent += buffer->length;
+		reportProgress(total_sent, file_size);
 
-		// Calculate and report progress
-		int percentage = static_cast<int>((total_sent * 100) / file_size);
-		if (percentage != last_percentage && percentage % 10 == 0) {
-			std::cout << "Progress: " << percentage << "% (" 
-				<< total_sent << "/" << file_size << " bytes)" << std::endl;
-			last_percentage = percentage;
+		in_flight.emplace_back(buffer, sender.sequence());
+		sender.reap();
+		while (!in_flight.empty() && (sender.isDone(in_flight.front().second) ||
+				(in_flight.size() >= pipeline.bufferCount() - 1 && sender.wait(in_flight.front().second, RELEASE_TIMEOUT_MS)))) {
+			pipeline.release(in_flight.front().first);
+			in_flight.pop_front();
 		}
+		if (in_flight.size() >= pipeline.bufferCount() - 1) {
+			std::cerr << "Kernel did not release sent buffers, giving up" << std::endl;
+			send_failed = true;
+			stuck = true;
+			pipeline.abort();
+			break;
+		}
+	}
 
-		// Call progress callback if set
-		if (progress_callback) {
-			progress_callback(percentage, total_sent, file_size);
+	// Buffers go back to the pool when the pipeline is destroyed: the kernel must be done with them.
+	// Ones it still holds are abandoned instead, so no later transfer writes over pages being sent
+	if (!in_flight.empty() && (stuck || !sender.wait(in_flight.back().second, RELEASE_TIMEOUT_MS))) {
+		std::cerr << "Kernel still holds sent buffers, not reusing them" << std::endl;
+		send_failed = true;
+	}
+	sender.reap();
+	for (const auto& held : in_flight) {
+		if (sender.isDone(held.second)) {
+			pipeline.release(held.first);
+		} else {
+			pipeline.abandon(held.first);
 		}
 	}
 
-	std::cout << "File transfer complete: " << filename << std::endl;
-	file.close();
+	uint64_t sent_zero_copy = sender.zeroCopyBytes() - zero_copy_before;
+	uint64_t sent_copied = sender.copiedBytes() - copied_before;
+	if (sender.enabled() || sent_zero_copy > 0) {
+		zero_copy_bytes += sent_zero_copy;
+		std::cout << "Zero-copy: " << sent_zero_copy << " of "
+			<< sent_zero_copy + sent_copied << " bytes sent without copying" << std::endl;
+	} else if (zero_copy) {
+		std::cerr << "MSG_ZEROCOPY not supported here, buffers were copied" << std::endl;
+	}
+
+	reader_thread.join();
+	return !send_failed && !read_failed && total_sent == file_size;
+}
+
+/**
+ * Reads a block at a time, encodes it and sends header and stored bytes in one go
+ */
+bool FileTransferClient::sendCompressed(std::ifstream& file, uint64_t file_size, uint64_t& total_sent, uint32_t* crc) {
+	PooledBuffer buffer(COMPRESSION_BLOCK_SIZE);
+	PooledBuffer block(COMPRESSION_HEADER_SIZE + compressionBound());
+	BlockCompressor compressor;
+	auto start = std::chrono::steady_clock::now();
+
+	file.clear();
+	file.seekg(static_cast<std::streamoff>(total_sent), std::ios::beg);
+
+	while (total_sent < file_size && (file.read(buffer.data(), COMPRESSION_BLOCK_SIZE) || file.gcount() > 0)) {
+		size_t bytes_read = file.gcount();
+
+		size_t encoded = compressor.encode(buffer.data(), bytes_read, block.data());
+		if (!sendAll(client_fd, block.data(), encoded)) {
+			std::cerr << "Failed to send file chunk" << std::endl;
+			return false;
+		}
+		if (crc) {
+			*crc = crc32cUpdate(*crc, buffer.data(), bytes_read);
+		}
+
+		total_sent += bytes_read;
+		reportProgress(total_sent, file_size);
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (seconds > 0 && compressor.rawBytes() > 0) {
+		// Formatted on the side: std::cout keeps its precision for everyone else
+		std::ostringstream line;
+		line << "Compression: " << compressor.rawBytes() << " bytes sent as " << compressor.wireBytes() << " ("
+			<< std::fixed << std::setprecision(1) << (100.0 * compressor.wireBytes() / compressor.rawBytes())
+			<< "%), effective " << (compressor.rawBytes() / seconds / 1e6) << " MB/s, wire "
+			<< (compressor.wireBytes() / seconds / 1e6) << " MB/s";
+		std::cout << line.str() << std::endl;
+	}
+
+	return total_sent == file_size;
+}
+
+/**
+ * Zero-copy data path: sendfile() moves pages from the page cache straight
+ * into the socket, so the data never passes through user space and each
+ * syscall can move megabytes instead of 4KB
+ */
+bool FileTransferClient::sendWithSendfile(int file_fd, uint64_t file_size, uint64_t& total_sent, uint32_t* crc) {
+	// Large counts keep syscall overhead negligible while still giving
+	// the progress callback a few updates per second on fast links
+	const size_t SENDFILE_CHUNK = 8 * 1024 * 1024;  // 8MB per call
+	off_t offset = static_cast<off_t>(total_sent);
+
+	// Pages just sent are hot in the page cache, so hashing them doesn't touch
+	// the disk again; partial sends are hashed a window at a time
+	uint64_t hashed = total_sent;
+
+	while (total_sent < file_size) {
+		uint64_t remaining = file_size - total_sent;
+		size_t count = (remaining < SENDFILE_CHUNK) ? remaining : SENDFILE_CHUNK;
+
+		// sendfile() advances offset by the number of bytes written
+		ssize_t sent = sendfile(client_fd, file_fd, &offset, count);
+		if (sent < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			int saved_errno = errno;
+			std::cerr << "sendfile() failed: " << strerror(errno) << std::endl;
+			errno = saved_errno;  // Caller checks errno to decide on fallback
+			return false;
+		}
+
+		if (sent == 0) {
+			// File shrank underneath us
+			std::cerr << "Unexpected end of file after " << total_sent << " bytes" << std::endl;
+			return false;
+		}
+
+		total_sent += sent;
+		if (crc && (total_sent - hashed >= CRC32C_READBACK_WINDOW || total_sent == file_size)) {
+			if (!crc32cUpdateFromFile(*crc, file_fd, hashed, total_sent - hashed)) {
+				std::cerr << "Failed to read back file for its checksum" << std::endl;
+				return false;
+			}
+			hashed = total_sent;
+		}
+		reportProgress(total_sent, file_size);
+	}
+
+	return true;
+}
+
+/**
+ * Memory-mapped data path: the file is mapped one window at a time and sent
+ * straight from the mapping, so there is no read() copy and the checksum
+ * reads the very pages that were just sent. The kernel reads the next window
+ * ahead while this one goes out, and a window is unmapped as soon as it is
+ * sent, so resident memory stays at about two windows whatever the file size.
+ */
+bool FileTransferClient::sendMapped(int file_fd, uint64_t file_size, uint64_t& total_sent, uint32_t* crc) {
+	const uint64_t MAP_WINDOW = 32 * 1024 * 1024;   // Mapped at a time
+	const size_t SEND_SLICE = 1024 * 1024;           // Per send(), keeps progress and hashing close behind
+	static const uint64_t page_size = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+
+	while (total_sent < file_size) {
+		// Offsets must be page aligned: start at the page holding total_sent
+		uint64_t window_start = total_sent - total_sent % page_size;
+		uint64_t window_end = std::min(window_start + MAP_WINDOW, file_size);
+		size_t window_length = static_cast<size_t>(window_end - window_start);
+
+		// Touching pages past the end of a file that shrank raises SIGBUS, so check first
+		struct stat st;
+		if (fstat(file_fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < window_end) {
+			std::cerr << "Unexpected end of file after " << total_sent << " bytes" << std::endl;
+			return false;
+		}
+
+		void* mapping = mmap(nullptr, window_length, PROT_READ, MAP_SHARED, file_fd, static_cast<off_t>(window_start));
+		if (mapping == MAP_FAILED) {
+			int saved_errno = errno;
+			std::cerr << "mmap() failed: " << strerror(errno) << std::endl;
+			errno = saved_errno;  // Caller checks errno to decide on fallback
+			return false;
+		}
+
+		// Separate pieces of advice: read this window aggressively and
+		// drop pages behind us, and start reading the next one already
+		madvise(mapping, window_length, MADV_SEQUENTIAL);
+		madvise(mapping, window_length, MADV_WILLNEED);
+		if (window_end < file_size) {
+			posix_fadvise(file_fd, static_cast<off_t>(window_end), static_cast<off_t>(MAP_WINDOW), POSIX_FADV_WILLNEED);
+		}
+
+		const char* data = static_cast<const char*>(mapping);
+		bool sent_window = true;
+		while (total_sent < window_end) {
+			uint64_t remaining = window_end - total_sent;
+			size_t count = (remaining < SEND_SLICE) ? remaining : SEND_SLICE;
+			const char* slice = data + (total_sent - window_start);
+
+			if (!sendAll(client_fd, slice, count)) {
+				std::cerr << "Failed to send file chunk" << std::endl;
+				sent_window = false;
+				break;
+			}
+			if (crc) {
+				*crc = crc32cUpdate(*crc, slice, count);
+			}
+
+			total_sent += count;
+			reportProgress(total_sent, file_size);
+		}
+
+		munmap(mapping, window_length);
+		if (!sent_window) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Striped transfer: every connection (this one included) runs sendStripes()
+ * on its own thread, claiming stripes from a shared cursor. Fast streams
+ * simply claim more stripes, so one slow or lossy path doesn't hold the
+ * others back.
+ */
+bool FileTransferClient::sendStriped(int file_fd, uint64_t file_size, uint64_t transfer_id, const RangeSet& received,
+		bool verify, uint64_t& total_sent) {
+	std::atomic<uint64_t> next_offset(0);
+	std::atomic<uint64_t> sent(0);
+	std::atomic<bool> failed(false);
+	std::atomic<bool> confirmed(false);
+	std::mutex progress_mutex;
+
+	// Progress of all streams is summed, so callbacks see a single transfer
+	auto on_sent = [&](uint64_t bytes) {
+		sent += bytes;
+		std::lock_guard<std::mutex> lock(progress_mutex);
+		reportProgress(sent, file_size);
+	};
+
+	// Extra streams negotiate the same wire format as this one
+	std::vector<std::unique_ptr<FileTransferClient>> streams;
+	for (unsigned int i = 1; i < stripe_count; i++) {
+		std::unique_ptr<FileTransferClient> stream(new FileTransferClient(server_ip, port));
+		stream->setWireFormat(wire_format);
+		if (!stream->connect()) {
+			std::cerr << "Opened " << i << " of " << stripe_count << " streams, continuing with those" << std::endl;
+			break;
+		}
+		streams.push_back(std::move(stream));
+	}
+
+	std::cout << "Striping over " << (streams.size() + 1) << " connection(s), "
+		<< stripe_size << " bytes per stripe" << std::endl;
+
+	auto run = [&](FileTransferClient* stream) {
+		bool completed = false;
+		if (!stream->sendStripes(file_fd, file_size, transfer_id, received, verify, next_offset, failed, on_sent,
+				completed)) {
+			failed = true;
+		}
+		if (completed) {
+			confirmed = true;
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (auto& stream : streams) {
+		workers.emplace_back(run, stream.get());
+	}
+	run(this);
+	for (auto& worker : workers) {
+		worker.join();
+	}
+
+	total_sent = sent;
+
+	// Extra streams are disconnected as they go out of scope
+	if (failed) {
+		return false;
+	}
+	if (!confirmed) {
+		std::cerr << "Server did not confirm completion of the striped file" << std::endl;
+		return false;
+	}
 	return true;
 }
 
+/**
+ * Stripes are streamed back to back without waiting for their acks;
+ * acks that have already arrived are drained after every stripe so they
+ * never fill the socket buffer while we are busy sending
+ */
+bool FileTransferClient::sendStripes(int file_fd, uint64_t file_size, uint64_t transfer_id, const RangeSet& received,
+		bool verify, std::atomic<uint64_t>& next_offset, std::atomic<bool>& failed,
+		const std::function<void(uint64_t)>& on_sent, bool& completed) {
+	size_t acks_pending = 0;
+
+	auto collectAcks = [&](int recv_flags) {
+		while (acks_pending > 0) {
+			json reply;
+			errno = 0;
+			if (!readReply(reply, recv_flags)) {
+				// Non-blocking poll with nothing to read yet is not an error
+				return recv_flags != 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+			}
+			acks_pending--;
+
+			std::string status = reply.value("status", "");
+			if (status == "complete") {
+				completed = true;
+			} else if (status != "stripe_received") {
+				std::cerr << "Server rejected stripe: " << reply.value("reason", "unknown reason") << std::endl;
+				return false;
+			}
+		}
+		return true;
+	};
+
+	while (!failed) {
+		uint64_t offset = next_offset.fetch_add(stripe_size);
+		if (offset >= file_size) {
+			break;
+		}
+		uint64_t length = (file_size - offset < stripe_size) ? file_size - offset : stripe_size;
+
+		// Already on the server from an interrupted attempt
+		if (received.contains(offset, length)) {
+			on_sent(length);
+			continue;
+		}
+
+		TransferMessage stripe;
+		stripe.type = MessageType::FILE_STRIPE;
+		stripe.data = {{"transfer_id", transfer_id}, {"offset", offset}, {"length", length}};
+
+		if (!sendMessage(client_fd, stripe, active_format)) {
+			std::cerr << "Failed to send stripe header" << std::endl;
+			return false;
+		}
+		// Each stripe carries its own checksum, so a bad one is caught before it's recorded as received
+		uint32_t crc = 0;
+		if (!sendRange(file_fd, offset, length, on_sent, verify ? &crc : nullptr)) {
+			return false;
+		}
+		if (verify && !sendChecksum(crc)) {
+			return false;
+		}
+		acks_pending++;
+
+		if (!collectAcks(MSG_DONTWAIT)) {
+			return false;
+		}
+	}
+
+	return collectAcks(0);
+}
+
+/**
+ * Sends one range with an explicit offset, so all streams can share one
+ * descriptor without racing on its file position
+ */
+bool FileTransferClient::sendRange(int file_fd, uint64_t offset, uint64_t length,
+		const std::function<void(uint64_t)>& on_sent, uint32_t* crc) {
+	// Small enough that progress moves several times per stripe
+	const size_t RANGE_CHUNK = 1024 * 1024;
+	off_t position = static_cast<off_t>(offset);
+	uint64_t end = offset + length;
+
+	while (static_cast<uint64_t>(position) < end) {
+		uint64_t remaining = end - position;
+		size_t count = (remaining < RANGE_CHUNK) ? remaining : RANGE_CHUNK;
+
+		ssize_t sent = sendfile(client_fd, file_fd, &position, count);
+		bool hashed = false;
+		if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			// No sendfile() for this file: copy the chunk through user space
+			PooledBuffer buffer(count);
+			sent = pread(file_fd, buffer.data(), count, position);
+			if (sent > 0) {
+				if (!sendAll(client_fd, buffer.data(), sent)) {
+					std::cerr << "Failed to send file chunk" << std::endl;
+					return false;
+				}
+				if (crc) {
+					*crc = crc32cUpdate(*crc, buffer.data(), sent);
+					hashed = true;
+				}
+				position += sent;
+			}
+		}
+
+		if (sent < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			std::cerr << "Failed to send stripe at offset " << offset << ": " << strerror(errno) << std::endl;
+			return false;
+		}
+
+		if (sent == 0) {
+			// File shrank underneath us
+			std::cerr << "Unexpected end of file at offset " << position << std::endl;
+			return false;
+		}
+
+		// sendfile() never copied the chunk to user space, read it back from the page cache
+		if (crc && !hashed && !crc32cUpdateFromFile(*crc, file_fd, position - sent, sent)) {
+			std::cerr << "Failed to read back stripe for its checksum" << std::endl;
+			return false;
+		}
+
+		on_sent(sent);
+	}
+
+	return true;
+}
+
+/**
+ * Calculate and report progress
+ */
+void FileTransferClient::reportProgress(uint64_t total_sent, uint64_t file_size) {
+	int percentage = static_cast<int>((total_sent * 100) / file_size);
+	if (percentage != last_percentage && percentage % 10 == 0) {
+		std::cout << "Progress: " << percentage << "% (" 
+			<< total_sent << "/" << file_size << " bytes)" << std::endl;
+		last_percentage = percentage;
+	}
+
+	// Call progress callback if set
+	if (progress_callback) {
+		progress_callback(percentage, total_sent, file_size);
+	}
+}
+
 /**
  * Gracefully disconnect from server
  */
@@ -164,11 +1431,12 @@ void FileTransferClient::disconnect() {
 		disconnect_msg.type = MessageType::ERROR;  // Using ERROR type for disconnect
 		disconnect_msg.data = {{"reason", "client_disconnect"}};
 
-		std::string serialized = disconnect_msg.serialize();
-		send(client_fd, serialized.c_str(), serialized.length(), 0);
+		sendMessage(client_fd, disconnect_msg, active_format);
 
 		// Close the socket (this sends FIN packet for TCP termination)
 		close(client_fd);
+		client_fd = -1;  // Don't let the destructor close a reused descriptor
+		zero_copy_sender.reset();
 		connected = false;
 		std::cout << "Disconnected from server" << std::endl;
 	}
@@ -1,13 +1,29 @@
 #include "fileTransferServer.hpp"
+#include "eventLoop.hpp"
+#include "ioUringEngine.hpp"
+#include "checksum.hpp"
+#include "merkleTree.hpp"
+#include "deltaSync.hpp"
+#include "compression.hpp"
+#include "bufferPipeline.hpp"
+#include "bufferPool.hpp"
+#include "fileBatch.hpp"
+#include "sha256.hpp"
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <cstdlib>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sched.h>
 #include <chrono>
+#include <algorithm>
 #include <iomanip>
+#include <sstream>
 #include <atomic>  // For atomic flags
 
 using json = nlohmann::json;
@@ -16,7 +32,13 @@ using namespace std::chrono_literals;
 /**
  * Constructor - initializes server with port
  */
-FileTransferServer::FileTransferServer(int port) : port(port), is_running(false), server_fd(-1), accept_thread(nullptr) {
+FileTransferServer::FileTransferServer(int port) : port(port), is_running(false), server_fd(-1), accept_thread(nullptr),
+	receive_mode(ReceiveMode::SPLICE), pipe_size(1024 * 1024), pipeline_depth(4), pipeline_buffer_size(1024 * 1024),
+	direct_io_size(4 * 1024 * 1024), server_mode(ServerMode::THREAD_PER_CLIENT), next_loop(0), sharded_listeners(false), listen_backlog(SOMAXCONN), max_workers(64), max_pending(256),
+	admission_policy(AdmissionPolicy::QUEUE), retry_after(5), idle_workers(0), next_transfer_id(1) {
+
+	unsigned int hw_threads = std::thread::hardware_concurrency();
+	event_loop_count = (hw_threads == 0) ? 1 : (hw_threads < 4 ? hw_threads : 4);
 
 	server_fd = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -61,12 +83,21 @@ bool FileTransferServer::start() {
 	server_addr.sin_addr.s_addr = INADDR_ANY;
 	server_addr.sin_port = htons(port);
 
+	// Every socket of a SO_REUSEPORT group must set the option before bind()
+	bool sharded = sharded_listeners && server_mode == ServerMode::EPOLL && event_loop_count > 1;
+	int opt = 1;
+	if (sharded && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+		std::cerr << "SO_REUSEPORT not supported, using a single listener: " << strerror(errno) << std::endl;
+		sharded = false;
+	}
+
 	if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
 		std::cerr << "Failed to bind to port " << port << ": " << strerror(errno) << std::endl;
 		return false;
 	}
 
-	if (listen(server_fd, 5) < 0) {
+	// A short accept queue drops connection bursts before admission control ever sees them
+	if (listen(server_fd, listen_backlog) < 0) {
 		std::cerr << "Failed to listen on socket: " << strerror(errno) << std::endl;
 		return false;
 	}
@@ -74,12 +105,83 @@ bool FileTransferServer::start() {
 	is_running = true;
 	std::cout << "Server listening on port " << port << std::endl;
 
+	if (server_mode == ServerMode::EPOLL) {
+		// The first loop also owns the listening socket; it must not block in accept()
+		fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+
+		// Sharded: loop i listens on a socket of its own and runs on the i-th CPU we may use
+		std::vector<int> cpus;
+		cpu_set_t allowed;
+		if (sharded && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+			for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+				if (CPU_ISSET(cpu, &allowed)) {
+					cpus.push_back(cpu);
+				}
+			}
+		}
+
+		for (size_t i = 0; i < event_loop_count; i++) {
+			int listener = (i == 0) ? server_fd : -1;
+			if (sharded && i > 0) {
+				listener = openShardListener();
+				if (listener < 0) {
+					stop();
+					return false;
+				}
+				shard_fds.push_back(listener);
+			}
+			int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+
+			EventLoop* loop = new EventLoop(*this);
+			event_loops.push_back(loop);
+			if (!loop->start(listener, cpu)) {
+				std::cerr << "Failed to start event loop " << i << std::endl;
+				stop();
+				return false;
+			}
+		}
+
+		std::cout << "Event-driven mode: " << event_loop_count << " event loop thread(s)"
+			<< (sharded ? ", one listener each" : "") << std::endl;
+		return true;
+	}
+
 	// Start accept thread
 	accept_thread = new std::thread(&FileTransferServer::acceptConnections, this);
 
 	return true;
 }
 
+/**
+ * Binds one more member of the SO_REUSEPORT group to our port
+ */
+int FileTransferServer::openShardListener() {
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		std::cerr << "Failed to create listener socket: " << strerror(errno) << std::endl;
+		return -1;
+	}
+
+	int opt = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+		std::cerr << "Failed to set SO_REUSEPORT: " << strerror(errno) << std::endl;
+		close(fd);
+		return -1;
+	}
+
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, listen_backlog) < 0) {
+		std::cerr << "Failed to open listener on port " << port << ": " << strerror(errno) << std::endl;
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
 /**
  * Stops the server gracefully
  */
@@ -89,6 +191,18 @@ void FileTransferServer::stop() {
 	std::cout << "\nShutting down server..." << std::endl;
 	is_running = false;
 
+	// Event loops close their own connections, so stop them first
+	for (EventLoop* loop : event_loops) {
+		loop->stop();
+		delete loop;
+	}
+	event_loops.clear();
+
+	for (int fd : shard_fds) {
+		close(fd);
+	}
+	shard_fds.clear();
+
 	// Close server socket to interrupt accept()
 	if (server_fd >= 0) {
 		shutdown(server_fd, SHUT_RDWR);  // SHUT_RDWR: Stop both reading and writing
@@ -99,10 +213,10 @@ void FileTransferServer::stop() {
 	// Close all client connections
 	{
 		std::lock_guard<std::mutex> lock(clients_mutex);
-		for (auto& client : clients) {
+		for (auto& entry : clients) {
+			ClientConnection& client = *entry.second;
 			if (client.socket_fd >= 0) {
-				shutdown(client.socket_fd, SHUT_RDWR);
-				close(client.socket_fd);
+				shutdown(client.socket_fd, SHUT_RDWR);   // Closed by whoever serves it
 				client.socket_fd = -1;
 			}
 			// Don't join threads here - they need to exit naturally
@@ -130,37 +244,40 @@ void FileTransferServer::stop() {
 		accept_thread = nullptr;
 	}
 
-	// Wait for client threads to finish (with timeout)
-	auto start = std::chrono::steady_clock::now();
-	while (std::chrono::steady_clock::now() - start < 3s) {
-		bool all_done = true;
-		{
-			std::lock_guard<std::mutex> lock(clients_mutex);
-			for (auto& client : clients) {
-				if (client.handler_thread && client.handler_thread->joinable()) {
-					all_done = false;
-					break;
-				}
-			}
+	// Workers finish the connection they are on (its socket is closed now) and exit
+	{
+		std::lock_guard<std::mutex> lock(workers_mutex);
+		workers_cv.notify_all();
+	}
+	for (std::thread& worker : workers) {
+		if (worker.joinable()) {
+			worker.join();
 		}
+	}
 
-		if (all_done) {
-			break;
+	{
+		std::lock_guard<std::mutex> workers_lock(workers_mutex);
+		workers.clear();
+		for (const auto& pending : pending_connections) {
+			close(pending.first);     // Never reached a worker
 		}
-		std::this_thread::sleep_for(100ms);
+		pending_connections.clear();
 	}
 
-	// Clean up any remaining threads
 	std::lock_guard<std::mutex> lock(clients_mutex);
-	for (auto& client : clients) {
-		if (client.handler_thread) {
-			if (client.handler_thread->joinable()) {
-				client.handler_thread->detach();  // Detach instead of join to avoid deadlock
-			}
-			delete client.handler_thread;
+	clients.clear();
+
+	// Striped files that didn't get all their stripes are partial, drop them
+	std::vector<uint64_t> unfinished;
+	{
+		std::lock_guard<std::mutex> transfers_lock(transfers_mutex);
+		for (const auto& entry : striped_transfers) {
+			unfinished.push_back(entry.first);
 		}
 	}
-	clients.clear();
+	for (uint64_t id : unfinished) {
+		abortStripedTransfer(id);
+	}
 
 	std::cout << "Server shutdown complete" << std::endl;
 }
@@ -204,24 +321,153 @@ void FileTransferServer::acceptConnections() {
 
 		std::cout << "New connection from " << client_ip << ":" << client_port << std::endl;
 
-		// Create client thread
-		std::thread* client_thread = new std::thread(&FileTransferServer::handleClient, 
-					       this, client_socket, client_addr);
+		admitConnection(client_socket, client_addr);
+	}
+}
+
+/**
+ * Admission control: a burst of connections waits for (or is turned away
+ * from) a fixed number of workers instead of starting a thread each
+ */
+bool FileTransferServer::admitConnection(int client_socket, const struct sockaddr_in& client_addr) {
+	bool all_busy;
+	{
+		std::lock_guard<std::mutex> lock(workers_mutex);
+		all_busy = idle_workers <= pending_connections.size() && workers.size() >= max_workers;
+	}
 
-		// Store client info
-		ClientInfo info;
-		info.socket_fd = client_socket;
-		info.ip_address = client_ip;
-		info.port = client_port;
-		info.handler_thread = client_thread;
-		info.is_active = true;
-		info.bytes_received = 0;
+	bool admit = !all_busy;
+	if (all_busy) {
+		switch (admission_policy) {
+			case AdmissionPolicy::SHED_IDLE:
+				// The shed connection's worker picks up the new one once its handler returns
+				if (shedIdleClient()) {
+					admit = true;
+					break;
+				}
+				// Nothing idle: wait like QUEUE
+				[[fallthrough]];
+			case AdmissionPolicy::QUEUE: {
+				std::lock_guard<std::mutex> lock(workers_mutex);
+				admit = pending_connections.size() < max_pending;
+				break;
+			}
+			case AdmissionPolicy::REJECT:
+				break;
+		}
+	}
+
+	if (!admit) {
+		std::cerr << "All workers busy, turning connection away" << std::endl;
+		sendMessage(client_socket, statusMessage({{"status", "busy"}, {"reason", "Server busy"},
+				{"retry_after", retry_after}}), WireFormat::JSON);
+		close(client_socket);
+		return false;
+	}
 
+	char client_ip[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
+	{
+		// Registered before a worker can look it up (and so that stop() closes it while queued)
+		std::lock_guard<std::mutex> lock(clients_mutex);
+		clients[client_socket] = std::make_shared<ClientConnection>(client_socket, client_ip, ntohs(client_addr.sin_port));
+	}
+
+	std::lock_guard<std::mutex> lock(workers_mutex);
+	pending_connections.emplace_back(client_socket, client_addr);
+	if (idle_workers < pending_connections.size() && workers.size() < max_workers) {
+		workers.emplace_back(&FileTransferServer::workerLoop, this);
+	}
+	workers_cv.notify_one();
+	return true;
+}
+
+/**
+ * Worker threads stay around between connections, so churn doesn't create threads
+ */
+void FileTransferServer::workerLoop() {
+	while (true) {
+		std::pair<int, struct sockaddr_in> next;
 		{
-			std::lock_guard<std::mutex> lock(clients_mutex);
-			clients.push_back(info);
+			std::unique_lock<std::mutex> lock(workers_mutex);
+			idle_workers++;
+			workers_cv.wait(lock, [this]() { return !is_running || !pending_connections.empty(); });
+			idle_workers--;
+			if (!is_running) {
+				return;
+			}
+			next = pending_connections.front();
+			pending_connections.pop_front();
+		}
+
+		handleClient(next.first, next.second);
+	}
+}
+
+/**
+ * Sheds the connection a worker has been waiting on the longest, telling the client why
+ */
+bool FileTransferServer::shedIdleClient() {
+	// A client between two messages of a transfer (e.g. hashing its file) isn't idle yet
+	const int64_t MIN_IDLE_MS = 1000;
+	int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+
+	std::lock_guard<std::mutex> lock(clients_mutex);
+	std::shared_ptr<ClientConnection> victim;
+	int64_t oldest = now - MIN_IDLE_MS;
+	for (const auto& entry : clients) {
+		int64_t since = entry.second->idle_since.load();
+		if (since > 0 && since <= oldest && entry.second->socket_fd == entry.first) {
+			oldest = since;
+			victim = entry.second;
 		}
 	}
+	if (!victim) {
+		return false;
+	}
+
+	// Sent and shut down without letting go of clients_mutex: once released,
+	// the client could hang up and its descriptor be reused by a new
+	// connection. The client may not be reading, so the DISCONNECT is best
+	// effort: a full send buffer drops it rather than blocking the acceptor.
+	TransferMessage disconnect_msg;
+	disconnect_msg.type = MessageType::DISCONNECT;
+	disconnect_msg.data = {{"reason", "server_busy"}};
+	std::string encoded = disconnect_msg.encode(victim->wire_format);
+	send(victim->socket_fd, encoded.data(), encoded.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+
+	std::cout << "Shedding idle connection to " << victim->ip_address << ":" << victim->port
+		<< " to make room" << std::endl;
+	victim->is_active = false;
+	shutdown(victim->socket_fd, SHUT_RDWR);
+	clients.erase(victim->socket_fd);
+	victim->socket_fd = -1;
+	return true;
+}
+
+/**
+ * Hands an accepted socket to the next event loop (round-robin)
+ */
+void FileTransferServer::dispatchConnection(int socket_fd, const struct sockaddr_in& client_addr, EventLoop* owner) {
+	char client_ip[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
+	int client_port = ntohs(client_addr.sin_port);
+
+	std::cout << "New connection from " << client_ip << ":" << client_port << std::endl;
+
+	std::shared_ptr<ClientConnection> client = std::make_shared<ClientConnection>(socket_fd, client_ip, client_port);
+	{
+		std::lock_guard<std::mutex> lock(clients_mutex);
+		clients[socket_fd] = client;
+	}
+
+	if (owner) {
+		owner->adopt(socket_fd, std::move(client));
+		return;
+	}
+	size_t index = next_loop.fetch_add(1) % event_loops.size();
+	event_loops[index]->adopt(socket_fd, std::move(client));
 }
 
 /**
@@ -232,6 +478,19 @@ void FileTransferServer::handleClient(int client_socket, struct sockaddr_in clie
 	inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
 
 	char buffer[4096];
+	MessageReader reader;                    // Starts as JSON until the client says HELLO
+	WireFormat format = WireFormat::JSON;
+	uint64_t owned_transfer = 0;             // Striped transfer announced on this connection
+
+	// A striped file can't complete without the connection that announced it
+	// The descriptor is closed only here, once nothing uses it any more
+	auto cleanup = [&]() {
+		if (owned_transfer != 0) {
+			abortStripedTransfer(owned_transfer);
+		}
+		removeClient(client_socket);
+		close(client_socket);
+	};
 
 	// Set socket timeout for recv()
 	struct timeval timeout;
@@ -239,8 +498,19 @@ void FileTransferServer::handleClient(int client_socket, struct sockaddr_in clie
 	timeout.tv_usec = 0;
 	setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
+	// Idle between messages: a candidate for shedding under SHED_IDLE admission
+	std::shared_ptr<ClientConnection> client = findClient(client_socket);
+
 	while (is_running) {
-		ssize_t bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
+		if (client && reader.buffered() == 0 && client->idle_since.load() == 0) {
+			client->idle_since = std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count() + 1;
+		}
+
+		ssize_t bytes_received = recv(client_socket, buffer, sizeof(buffer), 0);
+		if (client && bytes_received > 0) {
+			client->idle_since = 0;
+		}
 
 		if (bytes_received < 0) {
 			// Check if it's a timeout or real error
@@ -262,217 +532,1736 @@ void FileTransferServer::handleClient(int client_socket, struct sockaddr_in clie
 			break;
 		}
 
-		buffer[bytes_received] = '\0';
-
-		try {
-			std::string message_str(buffer, bytes_received);
-			TransferMessage msg = TransferMessage::deserialize(message_str);
+		// One recv() may hold part of a message or several messages
+		reader.feed(buffer, bytes_received);
 
-			switch (msg.type) {
-				case MessageType::FILE_INFO: {
-					FileInfo file_info;
-					file_info.filename = msg.data["filename"];
-					file_info.filesize = msg.data["filesize"];
+		while (true) {
+			TransferMessage msg;
+			try {
+				if (!reader.next(msg)) {
+					break;
+				}
+			} catch (const json::exception& e) {
+				std::cerr << "JSON parse error from " << client_ip << ": " << e.what() << std::endl;
+				continue;
+			} catch (const std::exception& e) {
+				std::cerr << "Error processing message from " << client_ip << ": " << e.what() << std::endl;
+				if (reader.isCorrupt()) {
+					cleanup();
+					return;
+				}
+				continue;
+			}
 
-					std::cout << "Receiving file: " << file_info.filename 
-						<< " (" << file_info.filesize << " bytes)" << std::endl;
+			try {
+				switch (msg.type) {
+					case MessageType::HELLO: {
+						TransferMessage reply;
+						format = negotiateWireFormat(msg, reply);
+						sendMessage(client_socket, reply, WireFormat::JSON);
+						reader.setFormat(format);
 
-					{
 						std::lock_guard<std::mutex> lock(clients_mutex);
-						for (auto& client : clients) {
-							if (client.socket_fd == client_socket) {
-								client.current_filename = file_info.filename;
-								client.bytes_received = 0;
+						auto it = clients.find(client_socket);
+						if (it != clients.end()) {
+							it->second->wire_format = format;
+						}
+						break;
+					}
+
+					case MessageType::FILE_INFO: {
+						FileInfo file_info;
+						file_info.filename = msg.data["filename"];
+						file_info.filesize = msg.data["filesize"];
+						file_info.mtime = msg.data.value("mtime", int64_t(0));
+						file_info.checksum = msg.data.value("checksum", "");
+						file_info.merkle_root = msg.data.value("merkle_root", "");
+						file_info.chunk_size = msg.data.value("chunk_size", uint64_t(0));
+						file_info.delta = msg.data.value("delta", false);
+						file_info.compression = msg.data.value("compression", std::vector<std::string>());
+						file_info.mode = msg.data.value("mode", 0644u) & 0777;
+						file_info.sha256 = msg.data.value("sha256", "");
+
+						// Directory transfers send relative paths; nothing may land outside this directory
+						if (!isSafeRelativePath(file_info.filename)) {
+							std::cerr << "Refusing file " << file_info.filename << " from " << client_ip << std::endl;
+							sendMessage(client_socket, statusMessage({{"status", "error"}, {"reason", "Invalid file name"}}), format);
+							break;
+						}
+
+						std::cout << "Receiving file: " << file_info.filename 
+							<< " (" << file_info.filesize << " bytes)" << std::endl;
+
+						{
+							std::lock_guard<std::mutex> lock(clients_mutex);
+							auto it = clients.find(client_socket);
+							if (it != clients.end()) {
+								it->second->current_filename = file_info.filename;
+								it->second->bytes_received.store(0, std::memory_order_relaxed);
+							}
+						}
+
+						// Send acknowledgment
+						sendMessage(client_socket, statusMessage({{"status", "ready"}}), format);
+
+						// Same content arrived before: nothing to send
+						if (restoreFromStore(file_info)) {
+							sendMessage(client_socket, statusMessage({{"status", "complete"}, {"filename", file_info.filename},
+								{"deduplicated", true}}), format);
+							break;
+						}
+
+						// Striped: data arrives later as FILE_STRIPE messages on any connection
+						if (msg.data.value("stripes", 1) > 1) {
+							// Clients only stripe files bigger than one stripe
+							if (!stripeableSize(msg)) {
+								sendMessage(client_socket, statusMessage({{"status", "error"}, {"reason", "File too small to stripe"}}), format);
+								break;
+							}
+							// The client gave up on the file it announced before (no-op if that completed)
+							if (owned_transfer != 0) {
+								abortStripedTransfer(owned_transfer);
+								owned_transfer = 0;
+							}
+							std::shared_ptr<StripedTransfer> transfer = beginStripedTransfer(file_info, client_socket);
+							if (!transfer) {
+								sendMessage(client_socket, statusMessage({{"status", "error"}, {"reason", "Cannot create file"}}), format);
+								break;
+							}
+							owned_transfer = transfer->id;
+
+							// A resumed file may already be complete: nothing left to send
+							if (transfer->bytes_received == file_info.filesize &&
+								addStripeData(*transfer, 0, 0, findClient(client_socket).get(), client_ip)) {
+								sendMessage(client_socket, statusMessage({{"status", "complete"}, {"filename", file_info.filename}}), format);
 								break;
 							}
+							sendMessage(client_socket, stripedReceivingReply(*transfer), format);
+							break;
 						}
+
+						receiveFile(client_socket, reader, file_info, client_ip, format);
+						break;
 					}
 
-					// Send acknowledgment
-					json ack = {{"status", "ready"}};
-					std::string ack_str = ack.dump();
-					send(client_socket, ack_str.c_str(), ack_str.length(), 0);
+					case MessageType::FILE_STRIPE: {
+						if (!receiveStripe(client_socket, reader, msg, client_ip, format)) {
+							cleanup();
+							return;
+						}
+						break;
+					}
 
-					receiveFile(client_socket, file_info, client_ip);
-					break;
-				}
+					case MessageType::FILE_BATCH: {
+						if (!receiveBatch(client_socket, reader, msg, client_ip, format)) {
+							cleanup();
+							return;
+						}
+						break;
+					}
 
-				case MessageType::DISCONNECT: {
-					std::cout << "Client " << client_ip << " sent disconnect" << std::endl;
-					removeClient(client_socket);
-					return;
-				}
+					case MessageType::DISCONNECT: {
+						std::cout << "Client " << client_ip << " sent disconnect" << std::endl;
+						cleanup();
+						return;
+					}
 
-				case MessageType::ERROR: {
-					std::string error_msg = msg.data.value("reason", "Unknown error");
-					if (error_msg != "client_disconnect" && error_msg != "client_finished") {
-						std::cerr << "Error from client " << client_ip << ": " << error_msg << std::endl;
+					case MessageType::ERROR: {
+						std::string error_msg = msg.data.value("reason", "Unknown error");
+						if (error_msg != "client_disconnect" && error_msg != "client_finished") {
+							std::cerr << "Error from client " << client_ip << ": " << error_msg << std::endl;
+						}
+						break;
 					}
-					break;
-				}
 
-				default:
-					std::cout << "Received message type " << static_cast<int>(msg.type) 
-						<< " from " << client_ip << std::endl;
-					break;
+					default:
+						std::cout << "Received message type " << static_cast<int>(msg.type) 
+							<< " from " << client_ip << std::endl;
+						break;
+				}
+			} catch (const json::exception& e) {
+				std::cerr << "Invalid message from " << client_ip << ": " << e.what() << std::endl;
 			}
-		} catch (const json::exception& e) {
-			std::cerr << "JSON parse error from " << client_ip << ": " << e.what() << std::endl;
-		} catch (const std::exception& e) {
-			std::cerr << "Error processing message from " << client_ip << ": " << e.what() << std::endl;
 		}
 	}
 
 	// Clean up
-	removeClient(client_socket);
+	cleanup();
 }
 
 /**
  * Receives a file from a client
  */
-bool FileTransferServer::receiveFile(int client_socket, const FileInfo& file_info, const std::string& client_ip) {
-	// Create filename
-	auto now = std::chrono::system_clock::now();
-	auto time = std::chrono::system_clock::to_time_t(now);
-
+bool FileTransferServer::receiveFile(int client_socket, MessageReader& reader, const FileInfo& file_info,
+		const std::string& client_ip, WireFormat format) {
 	std::string output_filename = file_info.filename;
+	std::string data_filename;
+	TransferJournal journal;
+	WriteBehind writeback;
+
+	// We have an older copy: only the differences need to cross the network
+	struct stat existing;
+	if (file_info.delta && file_info.filesize > 0 && stat(output_filename.c_str(), &existing) == 0 &&
+		S_ISREG(existing.st_mode) && existing.st_size > 0) {
+		return receiveDelta(client_socket, reader, file_info, client_ip, format);
+	}
 
-	// Open file
-	std::ofstream output_file(output_filename, std::ios::binary);
-	if (!output_file.is_open()) {
+	// Raw descriptor so the splice path can write into it directly
+	int output_fd = openOutputFile(file_info, journal, data_filename);
+	if (output_fd < 0) {
 		std::cerr << "Failed to create output file: " << output_filename << std::endl;
-		json error = {{"status", "error"}, {"reason", "Cannot create file"}};
-		std::string error_str = error.dump();
-		send(client_socket, error_str.c_str(), error_str.length(), 0);
+		const char* reason = (errno == ENOSPC) ? "Not enough disk space" : "Cannot create file";
+		sendMessage(client_socket, statusMessage({{"status", "error"}, {"reason", reason}}), format);
 		return false;
 	}
 
-	std::cout << "Creating file: " << output_filename << std::endl;
+	std::cout << "Creating file: " << data_filename << std::endl;
 
-	// Send ready signal
-	json ready = {{"status", "receiving"}};
-	std::string ready_str = ready.dump();
-	send(client_socket, ready_str.c_str(), ready_str.length(), 0);
+	// Per-chunk verification replaces the whole-file checksum when the sender built a tree
+	bool merkle = !file_info.merkle_root.empty() && MerkleTree::validGeometry(file_info.filesize, file_info.chunk_size);
 
-	// Receive file data
-	const size_t BUFFER_SIZE = 8192;
-	char buffer[BUFFER_SIZE];
-	uint64_t total_received = 0;
-	int last_percentage = -1;
+	// Everything before the first gap is skipped; later ranges (from an
+	// interrupted striped attempt) are simply received again. Chunk checks
+	// start on a chunk boundary.
+	uint64_t total_received = journal.ranges().prefix();
+	if (merkle) {
+		total_received -= total_received % file_info.chunk_size;
+	}
+	uint64_t resume_offset = total_received;
+	lseek(output_fd, static_cast<off_t>(total_received), SEEK_SET);
+
+	// The sender follows the data with FILE_CHECKSUM if we ask for it here
+	bool verify = file_info.checksum == CHECKSUM_CRC32C && !merkle;
+	uint32_t crc = 0;
+	uint32_t* running_crc = verify ? &crc : nullptr;
+
+	// The checksum covers the whole file: the kept prefix is hashed from disk
+	// (the sender hashes the same prefix of its copy). Unreadable: start over.
+	if (verify && total_received > 0 && !crc32cUpdateFromFile(crc, output_fd, 0, total_received)) {
+		std::cerr << "Cannot read back " << data_filename << ", receiving it from the start" << std::endl;
+		crc = 0;
+		total_received = 0;
+		resume_offset = 0;
+		lseek(output_fd, 0, SEEK_SET);
+	}
 
-	while (is_running && total_received < file_info.filesize) {
-		uint64_t remaining = file_info.filesize - total_received;
-		size_t to_receive = (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE;
+	// Compressed data is decoded in user space, whatever the receive mode
+	bool compressed = BlockCompressor::isAvailable() &&
+		std::find(file_info.compression.begin(), file_info.compression.end(), COMPRESSION_LZ4) != file_info.compression.end();
 
-		ssize_t received = recv(client_socket, buffer, to_receive, 0);
+	MerkleTree expected(merkle ? file_info.filesize : 0, merkle ? file_info.chunk_size : MerkleTree::DEFAULT_CHUNK_SIZE);
+	ChunkVerifier verifier(expected, total_received);
+	ChunkVerifier* chunks = merkle ? &verifier : nullptr;
 
-		if (received < 0) {
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				continue;  // Timeout, try again
-			}
-			std::cerr << "Error receiving file data: " << strerror(errno) << std::endl;
-			output_file.close();
-			std::remove(output_filename.c_str());
-			return false;
-		}
+	// Send ready signal
+	json receiving = {{"status", "receiving"}};
+	if (total_received > 0) {
+		receiving["resume_offset"] = total_received;
+	}
+	if (verify) {
+		receiving["checksum"] = CHECKSUM_CRC32C;
+	}
+	if (merkle) {
+		receiving["merkle"] = true;
+	}
+	if (compressed) {
+		receiving["compression"] = COMPRESSION_LZ4;
+	}
+	sendMessage(client_socket, statusMessage(receiving), format);
 
-		if (received == 0) {
-			std::cerr << "Connection closed during file transfer" << std::endl;
-			output_file.close();
-			std::remove(output_filename.c_str());
-			return false;
+	// Receive file data
+	bool success = true;
+
+	// The leaf hashes come first; bytes read past them are already file data
+	if (merkle) {
+		success = receiveMerkleLeaves(client_socket, reader, file_info, expected) &&
+			(compressed || receiveEarlyData(reader, output_fd, file_info, total_received, journal, writeback, chunks));
+		if (!success) {
+			sendMessage(client_socket, statusMessage({{"status", "error"}, {"reason", "Bad chunk hashes"}}), format);
 		}
+	}
 
-		output_file.write(buffer, received);
-		total_received += received;
-
-		{
-			std::lock_guard<std::mutex> lock(clients_mutex);
-			for (auto& client : clients) {
-				if (client.socket_fd == client_socket) {
-					client.bytes_received = total_received;
-					break;
-				}
-			}
+	if (!success) {
+		// Fall through to the incomplete-transfer handling below
+	} else if (compressed) {
+		success = receiveCompressed(client_socket, reader, output_fd, file_info, client_ip, total_received, journal,
+				writeback, running_crc, chunks);
+	} else if (receive_mode == ReceiveMode::IO_URING && IoUringEngine::isAvailable()) {
+		IoUringEngine engine;
+		std::shared_ptr<ClientConnection> client = findClient(client_socket);
+		int last_percentage = -1;
+		uint64_t started_at = total_received;
+		uint64_t hashed = total_received;
+		success = engine.receiveFile(client_socket, output_fd, file_info.filesize, total_received,
+				[&](uint64_t received) {
+					// Completed writes are in the page cache, hash them from there
+					if (running_crc && !crc32cUpdateFromFile(*running_crc, output_fd, hashed, received - hashed)) {
+						return false;
+					}
+					if (chunks && !chunks->updateFromFile(output_fd, received - hashed)) {
+						return false;
+					}
+					hashed = received;
+					journal.record(0, received, output_fd);
+					writeback.written(output_fd, 0, received);
+					updateProgress(client.get(), client_ip, received, file_info.filesize, last_percentage);
+					return is_running;
+				});
+
+		// Ring setup refused before any data moved: the socket is untouched, go buffered
+		if (!success && total_received == started_at && is_running) {
+			std::cerr << "io_uring receive failed to start, falling back to buffered receive" << std::endl;
+			success = receiveBuffered(client_socket, output_fd, file_info, client_ip, total_received, journal, writeback,
+					running_crc, chunks);
+		}
+	} else if (receive_mode == ReceiveMode::PIPELINED || receive_mode == ReceiveMode::DIRECT) {
+		success = receivePipelined(client_socket, output_fd, file_info, client_ip, total_received, journal, writeback,
+				running_crc, chunks, receive_mode == ReceiveMode::DIRECT);
+	} else if (receive_mode == ReceiveMode::SPLICE) {
+		success = receiveWithSplice(client_socket, output_fd, file_info, client_ip, total_received, journal, writeback,
+				running_crc, chunks);
+
+		// Filesystem without splice support: everything received so far is on
+		// disk, so just continue from there with the buffered loop
+		if (!success && errno == EINVAL) {
+			std::cerr << "splice() not supported for " << data_filename
+				<< ", falling back to buffered receive" << std::endl;
+			success = receiveBuffered(client_socket, output_fd, file_info, client_ip, total_received, journal, writeback,
+					running_crc, chunks);
 		}
+	} else {
+		success = receiveBuffered(client_socket, output_fd, file_info, client_ip, total_received, journal, writeback,
+				running_crc, chunks);
+	}
 
-		int percentage = static_cast<int>((total_received * 100) / file_info.filesize);
-		if (percentage != last_percentage && percentage % 10 == 0) {
-			std::cout << "Receiving from " << client_ip << ": " << percentage << "% "
-				<< "(" << total_received << "/" << file_info.filesize << " bytes)" << std::endl;
-			last_percentage = percentage;
+	// Corrupt chunks are asked for again, one by one, instead of failing the file.
+	// Chunks kept from an interrupted attempt were never checked, so check them
+	// now, spread over all cores.
+	if (success && total_received == file_info.filesize && merkle) {
+		std::vector<uint64_t> bad = expected.verify(output_fd, 0, resume_offset / file_info.chunk_size);
+		bad.insert(bad.end(), verifier.badChunks().begin(), verifier.badChunks().end());
+
+		if (!bad.empty()) {
+			std::cerr << bad.size() << " chunk(s) of " << output_filename << " failed verification, "
+				<< "asking for them again" << std::endl;
+			success = repairChunks(client_socket, reader, output_fd, expected, bad, format);
+		}
+	}
 
-			if (progress_callback) {
-				progress_callback(client_ip, percentage);
-			}
+	// Nothing is reported complete until the sender's checksum matches
+	if (success && total_received == file_info.filesize && verify) {
+		TransferMessage trailer;
+		if (!receiveMessage(client_socket, reader, MessageType::FILE_CHECKSUM, trailer)) {
+			success = false;
+		} else if (!checksumMatches(trailer, crc)) {
+			std::cerr << "Checksum mismatch for " << output_filename << ": expected "
+				<< trailer.data.value("checksum", "none") << ", received data has " << crc32cToHex(crc) << std::endl;
+
+			// Corrupt data must not be resumed from either
+			close(output_fd);
+			journal.discard();
+			std::remove(data_filename.c_str());
+
+			sendMessage(client_socket, statusMessage({{"status", "error"}, {"reason", "Checksum mismatch"}}), format);
+			return false;
 		}
 	}
 
-	output_file.close();
+	if (success && total_received == file_info.filesize) {
+		close(output_fd);
+
+		if (!commitOutputFile(data_filename, output_filename, journal)) {
+			sendMessage(client_socket, statusMessage({{"status", "error"}, {"reason", "Cannot finalize file"}}), format);
+			return false;
+		}
 
-	if (total_received == file_info.filesize) {
 		std::cout << "File received successfully: " << output_filename 
 			<< " (" << total_received << " bytes)" << std::endl;
 
+		addToStore(file_info, output_filename);
+
 		if (file_received_callback) {
 			file_received_callback(output_filename, total_received);
 		}
 
 		json complete = {{"status", "complete"}, {"filename", output_filename}};
-		std::string complete_str = complete.dump();
-		send(client_socket, complete_str.c_str(), complete_str.length(), 0);
+		if (verify) {
+			complete["checksum"] = crc32cToHex(crc);
+		}
+		if (merkle) {
+			complete["merkle_root"] = file_info.merkle_root;
+		}
+		sendMessage(client_socket, statusMessage(complete), format);
 
 		return true;
+	}
+
+	std::cerr << "File transfer incomplete: received " << total_received 
+		<< " of " << file_info.filesize << " bytes" << std::endl;
+
+	// Keep what arrived so the sender can resume, unless it can't
+	if (journal.isPersistent() && journal.checkpoint(output_fd)) {
+		std::cout << "Kept " << data_filename << " for resuming" << std::endl;
+		close(output_fd);
 	} else {
-		std::cerr << "File transfer incomplete: received " << total_received 
-			<< " of " << file_info.filesize << " bytes" << std::endl;
-		std::remove(output_filename.c_str());
-		return false;
+		close(output_fd);
+		journal.discard();
+		std::remove(data_filename.c_str());
 	}
+	return false;
 }
 
 /**
- * Removes a client from the clients list
+ * Delta receive: signatures of our copy go out, COPY/LITERAL operations come back
+ * and are applied to a temp file next to it
  */
-void FileTransferServer::removeClient(int socket_fd) {
-	std::lock_guard<std::mutex> lock(clients_mutex);
+bool FileTransferServer::receiveDelta(int client_socket, MessageReader& reader, const FileInfo& file_info,
+		const std::string& client_ip, WireFormat format) {
+	const size_t SIGNATURES_PER_BATCH = 4096;
+	const uint64_t MAX_LITERAL = 1024 * 1024;    // Largest literal the sender may send in one operation
+	const std::string& output_filename = file_info.filename;
+	std::string temp_filename = output_filename + ".delta";
+	std::shared_ptr<ClientConnection> client = findClient(client_socket);
+
+	int basis_fd = open(output_filename.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat basis;
+	std::vector<BlockSignature> signatures;
+	size_t block_size = 0;
+
+	if (basis_fd >= 0 && fstat(basis_fd, &basis) == 0) {
+		block_size = deltaBlockSize(basis.st_size);
+		if (!computeSignatures(basis_fd, basis.st_size, block_size, signatures)) {
+			block_size = 0;
+		}
+	}
+	if (block_size == 0) {
+		std::cerr << "Cannot read existing " << output_filename << ": " << strerror(errno) << std::endl;
+		if (basis_fd >= 0) {
+			close(basis_fd);
+		}
+		sendMessage(client_socket, statusMessage({{"status", "error"}, {"reason", "Cannot read existing file"}}), format);
+		return false;
+	}
 
-	auto it = std::find_if(clients.begin(), clients.end(), 
-			[socket_fd](const ClientInfo& client) { return client.socket_fd == socket_fd; });
+	int output_fd = open(temp_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, file_info.mode);
+	if (output_fd < 0 || !preallocate(output_fd, file_info.filesize)) {
+		std::cerr << "Failed to create output file: " << temp_filename << std::endl;
+		if (output_fd >= 0) {
+			close(output_fd);
+			std::remove(temp_filename.c_str());
+		}
+		close(basis_fd);
+		sendMessage(client_socket, statusMessage({{"status", "error"}, {"reason", "Cannot create file"}}), format);
+		return false;
+	}
 
-	if (it != clients.end()) {
-		std::cout << "Removing client " << it->ip_address << ":" << it->port << std::endl;
+	std::cout << "Delta transfer of " << output_filename << " against " << basis.st_size << " existing bytes ("
+		<< signatures.size() << " blocks of " << block_size << ")" << std::endl;
+
+	// The rebuilt file is always checked as a whole: a block that only
+	// looked identical would otherwise go unnoticed
+	json receiving = {{"status", "receiving"}, {"checksum", CHECKSUM_CRC32C},
+		{"delta", {{"block_size", block_size}, {"blocks", signatures.size()}}}};
+	bool success = sendMessage(client_socket, statusMessage(receiving), format);
+
+	for (size_t first = 0; success && first < signatures.size(); first += SIGNATURES_PER_BATCH) {
+		size_t last = std::min(signatures.size(), first + SIGNATURES_PER_BATCH);
+		json weak = json::array();
+		json strong = json::array();
+		for (size_t i = first; i < last; i++) {
+			weak.push_back(signatures[i].weak);
+			strong.push_back(signatures[i].strong);
+		}
+		success = sendMessage(client_socket, statusMessage({{"status", "signatures"}, {"first", first},
+			{"weak", weak}, {"strong", strong}}), format);
+	}
 
-		// Mark as inactive first
-		it->is_active = false;
+	uint64_t total_received = 0;    // Bytes of the new file written so far
+	uint64_t literal_bytes = 0;
+	uint32_t crc = 0;
+	int last_percentage = -1;
+	PooledBuffer buffer(MAX_LITERAL);
+	bool finished = false;
 
-		// Close socket to interrupt any blocking recv/send
-		if (it->socket_fd >= 0) {
-			shutdown(it->socket_fd, SHUT_RDWR);
-			close(it->socket_fd);
-			it->socket_fd = -1;
+	while (success && !finished) {
+		TransferMessage op;
+		if (!receiveMessage(client_socket, reader, MessageType::FILE_DELTA, op)) {
+			success = false;
+			break;
+		}
+
+		try {
+			std::string kind = op.data.at("op");
+			uint64_t remaining = file_info.filesize - total_received;
+
+			if (kind == "copy") {
+				uint64_t block = op.data.at("block");
+				uint64_t count = op.data.at("count");
+				uint64_t length = count * block_size;
+				if (block >= signatures.size() || count > signatures.size() - block || length > remaining) {
+					throw std::runtime_error("block reference out of range");
+				}
+				success = copyRange(basis_fd, block * block_size, output_fd, total_received, length) &&
+					crc32cUpdateFromFile(crc, basis_fd, block * block_size, length);
+				total_received += length;
+			} else if (kind == "data") {
+				uint64_t length = op.data.at("length");
+				if (length > MAX_LITERAL || length > remaining) {
+					throw std::runtime_error("literal too long");
+				}
+				if (!receiveRaw(client_socket, reader, buffer.data(), length)) {
+					std::cerr << "Connection lost during delta transfer" << std::endl;
+					success = false;
+					break;
+				}
+				success = writeAt(output_fd, buffer.data(), length, total_received);
+				crc = crc32cUpdate(crc, buffer.data(), length);
+				total_received += length;
+				literal_bytes += length;
+			} else if (kind == "end") {
+				finished = true;
+			} else {
+				throw std::runtime_error("unknown operation " + kind);
+			}
+		} catch (const std::exception& e) {
+			std::cerr << "Bad delta from " << client_ip << ": " << e.what() << std::endl;
+			sendMessage(client_socket, statusMessage({{"status", "error"}, {"reason", "Bad delta"}}), format);
+			success = false;
+			break;
+		}
+		if (!success) {
+			sendMessage(client_socket, statusMessage({{"status", "error"}, {"reason", "Cannot write file"}}), format);
+			break;
 		}
 
-		// DETACH the thread instead of joining - let it clean itself up
-		// The thread function will exit when it detects is_active=false or socket closed
-		if (it->handler_thread && it->handler_thread->joinable()) {
-			it->handler_thread->detach();  // Detach, don't join!
+		updateProgress(client.get(), client_ip, total_received, file_info.filesize, last_percentage);
+	}
+	close(basis_fd);
+
+	if (success && total_received == file_info.filesize) {
+		TransferMessage trailer;
+		if (!receiveMessage(client_socket, reader, MessageType::FILE_CHECKSUM, trailer)) {
+			success = false;
+		} else if (!checksumMatches(trailer, crc)) {
+			std::cerr << "Checksum mismatch for " << output_filename << " after delta: expected "
+				<< trailer.data.value("checksum", "none") << ", rebuilt file has " << crc32cToHex(crc) << std::endl;
+			close(output_fd);
+			std::remove(temp_filename.c_str());
+			sendMessage(client_socket, statusMessage({{"status", "error"}, {"reason", "Checksum mismatch"}}), format);
+			return false;
 		}
+	}
+	close(output_fd);
+
+	if (!success || total_received != file_info.filesize) {
+		std::cerr << "Delta transfer incomplete: rebuilt " << total_received
+			<< " of " << file_info.filesize << " bytes" << std::endl;
+		std::remove(temp_filename.c_str());
+		return false;
+	}
+
+	// rename() swaps the files atomically: readers see either the old or the new copy
+	if (rename(temp_filename.c_str(), output_filename.c_str()) < 0) {
+		std::cerr << "Failed to rename " << temp_filename << " to " << output_filename
+			<< ": " << strerror(errno) << std::endl;
+		std::remove(temp_filename.c_str());
+		sendMessage(client_socket, statusMessage({{"status", "error"}, {"reason", "Cannot finalize file"}}), format);
+		return false;
+	}
 
-		// Delete the thread object (safe after detach)
-		delete it->handler_thread;
+	std::cout << "File received successfully: " << output_filename << " (" << total_received << " bytes, "
+		<< literal_bytes << " sent, " << (total_received - literal_bytes) << " reused)" << std::endl;
 
-		// Remove from vector
-		clients.erase(it);
+	addToStore(file_info, output_filename);
+
+	if (file_received_callback) {
+		file_received_callback(output_filename, total_received);
 	}
+
+	sendMessage(client_socket, statusMessage({{"status", "complete"}, {"filename", output_filename},
+		{"checksum", crc32cToHex(crc)}, {"literal_bytes", literal_bytes}}), format);
+	return true;
 }
 
 /**
- * Gets list of connected clients
+ * copy_file_range() lets the filesystem share or copy the blocks without a round trip
+ * through user space; pread()/pwrite() when the kernel or filesystem can't
+ */
+bool FileTransferServer::copyRange(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t length) {
+	while (length > 0) {
+		loff_t in_off = static_cast<loff_t>(in_offset);
+		loff_t out_off = static_cast<loff_t>(out_offset);
+		ssize_t copied = copy_file_range(in_fd, &in_off, out_fd, &out_off, length, 0);
+		if (copied < 0 && errno == EINTR) {
+			continue;
+		}
+		if (copied <= 0) {
+			break;
+		}
+		in_offset += copied;
+		out_offset += copied;
+		length -= copied;
+	}
+
+	char buffer[64 * 1024];
+	while (length > 0) {
+		size_t want = (length < sizeof(buffer)) ? length : sizeof(buffer);
+		ssize_t n = pread(in_fd, buffer, want, static_cast<off_t>(in_offset));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0 || !writeAt(out_fd, buffer, n, out_offset)) {
+			std::cerr << "Error copying from existing file: " << strerror(errno) << std::endl;
+			return false;
+		}
+		in_offset += n;
+		out_offset += n;
+		length -= n;
+	}
+	return true;
+}
+
+/**
+ * Buffered receive loop: socket -> stack buffer -> file
+ */
+bool FileTransferServer::receiveBuffered(int client_socket, int output_fd, const FileInfo& file_info,
+		const std::string& client_ip, uint64_t& total_received, TransferJournal& journal, WriteBehind& writeback,
+		uint32_t* crc, ChunkVerifier* chunks) {
+	const size_t BUFFER_SIZE = 64 * 1024;
+	PooledBuffer pooled(BUFFER_SIZE);
+	char* buffer = pooled.data();
+	int last_percentage = -1;
+
+	// Held for the whole transfer: progress goes straight to its counter, no table lookups per chunk
+	std::shared_ptr<ClientConnection> client = findClient(client_socket);
+
+	while (is_running && total_received < file_info.filesize) {
+		uint64_t remaining = file_info.filesize - total_received;
+		size_t to_receive = (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE;
+
+		ssize_t received = recv(client_socket, buffer, to_receive, 0);
+
+		if (received < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				continue;  // Timeout, try again
+			}
+			std::cerr << "Error receiving file data: " << strerror(errno) << std::endl;
+			return false;
+		}
+
+		if (received == 0) {
+			std::cerr << "Connection closed during file transfer" << std::endl;
+			return false;
+		}
+
+		// write() may be partial (e.g. signal), loop until the chunk is on disk
+		ssize_t written = 0;
+		while (written < received) {
+			ssize_t w = write(output_fd, buffer + written, received - written);
+			if (w < 0) {
+				if (errno == EINTR) continue;
+				std::cerr << "Error writing file data: " << strerror(errno) << std::endl;
+				return false;
+			}
+			written += w;
+		}
+		if (crc) {
+			*crc = crc32cUpdate(*crc, buffer, received);
+		}
+		if (chunks) {
+			chunks->update(buffer, received);
+		}
+
+		journal.record(total_received, received, output_fd);
+		writeback.written(output_fd, total_received, received);
+		total_received += received;
+		updateProgress(client.get(), client_ip, total_received, file_info.filesize, last_percentage);
+	}
+
+	return true;
+}
+
+/**
+ * Pipelined receive: this thread fills buffers from the socket, a writer thread
+ * puts them on disk in order and does the per-byte bookkeeping
+ *
+ * In direct mode every buffer but the first starts on an aligned offset, so
+ * whole buffers go through O_DIRECT; only a short unaligned head (resume or
+ * early data) and the file's tail take the page cache route.
+ */
+bool FileTransferServer::receivePipelined(int client_socket, int output_fd, const FileInfo& file_info,
+		const std::string& client_ip, uint64_t& total_received, TransferJournal& journal, WriteBehind& writeback,
+		uint32_t* crc, ChunkVerifier* chunks, bool direct) {
+	int direct_fd = -1;
+	size_t buffer_size = pipeline_buffer_size;
+	if (direct) {
+		direct_fd = openDirect(output_fd);
+		if (direct_fd < 0) {
+			std::cerr << "O_DIRECT not supported here (" << strerror(errno)
+				<< "), falling back to pipelined receive" << std::endl;
+		} else {
+			buffer_size = std::max(direct_io_size / DIRECT_IO_ALIGNMENT, static_cast<size_t>(1)) * DIRECT_IO_ALIGNMENT;
+		}
+	}
+
+	bool align_buffers = direct_fd >= 0;   // The writer may drop direct_fd, keep the buffer layout anyway
+
+	BufferPipeline pipeline(pipeline_depth, buffer_size);
+	std::shared_ptr<ClientConnection> client = findClient(client_socket);
+	uint64_t written = total_received;
+	bool write_failed = false;
+
+	std::thread writer([&]() {
+		int last_percentage = -1;
+		while (BufferPipeline::Buffer* buffer = pipeline.pop()) {
+			// Aligned part through O_DIRECT, whatever is left through the page cache
+			size_t aligned = 0;
+			if (direct_fd >= 0 && buffer->offset % DIRECT_IO_ALIGNMENT == 0) {
+				aligned = buffer->length - buffer->length % DIRECT_IO_ALIGNMENT;
+			}
+			while (aligned > 0) {
+				ssize_t w = pwrite(direct_fd, buffer->data, aligned, static_cast<off_t>(buffer->offset));
+				if (w == static_cast<ssize_t>(aligned)) {
+					break;
+				}
+				if (w < 0 && errno == EINTR) {
+					continue;
+				}
+				if (w < 0 && errno != EINVAL) {
+					std::cerr << "Error writing file data: " << strerror(errno) << std::endl;
+					write_failed = true;
+					pipeline.abort();
+					return;
+				}
+
+				// Refused (EINVAL) or short: redo the buffer through the page cache from now on
+				std::cerr << "O_DIRECT write refused, continuing through the page cache" << std::endl;
+				close(direct_fd);
+				direct_fd = -1;
+				aligned = 0;
+			}
+
+			if (!writeAt(output_fd, buffer->data + aligned, buffer->length - aligned, buffer->offset + aligned)) {
+				write_failed = true;
+				pipeline.abort();
+				return;
+			}
+			if (crc) {
+				*crc = crc32cUpdate(*crc, buffer->data, buffer->length);
+			}
+			if (chunks) {
+				chunks->update(buffer->data, buffer->length);
+			}
+
+			journal.record(buffer->offset, buffer->length, output_fd);
+			writeback.written(output_fd, buffer->offset, buffer->length);
+			written += buffer->length;
+			updateProgress(client.get(), client_ip, written, file_info.filesize, last_percentage);
+			pipeline.release(buffer);
+		}
+	});
+
+	uint64_t offset = total_received;
+	bool receive_failed = false;
+
+	while (is_running && offset < file_info.filesize && !receive_failed) {
+		BufferPipeline::Buffer* buffer = pipeline.acquire();
+		if (!buffer) {
+			break;  // Writer gave up
+		}
+		buffer->offset = offset;
+
+		// Fill the whole buffer (or the rest of the file) before handing it over;
+		// an unaligned first buffer stops short so the next one starts aligned
+		uint64_t remaining = file_info.filesize - offset;
+		size_t want = (remaining < pipeline.bufferSize()) ? remaining : pipeline.bufferSize();
+		if (align_buffers && offset % DIRECT_IO_ALIGNMENT != 0) {
+			want = std::min(want, static_cast<size_t>(DIRECT_IO_ALIGNMENT - offset % DIRECT_IO_ALIGNMENT));
+		}
+		while (is_running && buffer->length < want) {
+			ssize_t received = recv(client_socket, buffer->data + buffer->length, want - buffer->length, 0);
+			if (received < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+					continue;  // Timeout, try again
+				}
+				std::cerr << "Error receiving file data: " << strerror(errno) << std::endl;
+				receive_failed = true;
+				break;
+			}
+			if (received == 0) {
+				std::cerr << "Connection closed during file transfer" << std::endl;
+				receive_failed = true;
+				break;
+			}
+			buffer->length += received;
+		}
+
+		// A partial buffer still holds good data: write it so it can be resumed from
+		offset += buffer->length;
+		pipeline.push(buffer);
+	}
+
+	pipeline.finish();
+	writer.join();
+
+	if (direct_fd >= 0) {
+		close(direct_fd);
+	}
+
+	total_received = written;
+	return !receive_failed && !write_failed;
+}
+
+/**
+ * Compressed receive loop: block header, stored bytes, decode, write at the file offset
+ */
+bool FileTransferServer::receiveCompressed(int client_socket, MessageReader& reader, int output_fd,
+		const FileInfo& file_info, const std::string& client_ip, uint64_t& total_received, TransferJournal& journal,
+		WriteBehind& writeback, uint32_t* crc, ChunkVerifier* chunks) {
+	PooledBuffer stored(compressionBound());
+	PooledBuffer raw(COMPRESSION_BLOCK_SIZE);
+	std::shared_ptr<ClientConnection> client = findClient(client_socket);
+	unsigned char header[COMPRESSION_HEADER_SIZE];
+	uint64_t wire_bytes = 0;
+	uint64_t started_at = total_received;
+	int last_percentage = -1;
+	auto start = std::chrono::steady_clock::now();
+
+	while (is_running && total_received < file_info.filesize) {
+		uint32_t raw_length;
+		uint32_t stored_length;
+		bool lz4;
+
+		if (!receiveRaw(client_socket, reader, reinterpret_cast<char*>(header), sizeof(header)) ||
+			!decodeBlockHeader(header, raw_length, stored_length, lz4) ||
+			raw_length > file_info.filesize - total_received ||
+			!receiveRaw(client_socket, reader, stored.data(), stored_length)) {
+			std::cerr << "Connection closed or bad block during compressed transfer" << std::endl;
+			return false;
+		}
+
+		const char* data = stored.data();
+		if (lz4) {
+			if (!decompressBlock(stored.data(), stored_length, raw.data(), raw_length)) {
+				std::cerr << "Corrupt compressed block at byte " << total_received << std::endl;
+				return false;
+			}
+			data = raw.data();
+		}
+
+		if (!writeAt(output_fd, data, raw_length, total_received)) {
+			return false;
+		}
+		if (crc) {
+			*crc = crc32cUpdate(*crc, data, raw_length);
+		}
+		if (chunks) {
+			chunks->update(data, raw_length);
+		}
+
+		wire_bytes += COMPRESSION_HEADER_SIZE + stored_length;
+		journal.record(total_received, raw_length, output_fd);
+		writeback.written(output_fd, total_received, raw_length);
+		total_received += raw_length;
+		updateProgress(client.get(), client_ip, total_received, file_info.filesize, last_percentage);
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	uint64_t raw_bytes = total_received - started_at;
+	if (seconds > 0 && raw_bytes > 0) {
+		// Formatted on the side: std::cout keeps its precision for everyone else
+		std::ostringstream line;
+		line << "Compressed transfer: " << raw_bytes << " bytes in " << wire_bytes << " on the wire ("
+			<< std::fixed << std::setprecision(1) << (100.0 * wire_bytes / raw_bytes) << "%), effective "
+			<< (raw_bytes / seconds / 1e6) << " MB/s, wire " << (wire_bytes / seconds / 1e6) << " MB/s";
+		std::cout << line.str() << std::endl;
+	}
+	return total_received == file_info.filesize;
+}
+
+/**
+ * Zero-copy receive loop
+ * splice() can't go socket -> file directly, so data takes a detour through
+ * a pipe: socket -> pipe moves skb pages into the pipe, pipe -> file hands
+ * those pages to the page cache. SPLICE_F_MOVE asks the kernel to move pages
+ * rather than copy them where it can.
+ */
+bool FileTransferServer::receiveWithSplice(int client_socket, int output_fd, const FileInfo& file_info,
+		const std::string& client_ip, uint64_t& total_received, TransferJournal& journal, WriteBehind& writeback,
+		uint32_t* crc, ChunkVerifier* chunks) {
+	std::shared_ptr<ClientConnection> client = findClient(client_socket);
+	int pipe_fds[2];
+	if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+		std::cerr << "Failed to create splice pipe: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	// Bigger pipe = more data per splice() pair. If the request is above the
+	// allowed maximum, keep the default size and carry on.
+	if (fcntl(pipe_fds[1], F_SETPIPE_SZ, static_cast<int>(pipe_size)) < 0) {
+		std::cerr << "Could not set pipe size to " << pipe_size << ": " << strerror(errno) << std::endl;
+	}
+	int capacity = fcntl(pipe_fds[1], F_GETPIPE_SZ);
+	size_t chunk = (capacity > 0) ? static_cast<size_t>(capacity) : 65536;
+
+	int last_percentage = -1;
+	bool success = true;
+
+	// The data never enters user space: it is hashed back from the page cache
+	// it was spliced into, CRC32C_READBACK_WINDOW bytes at a time
+	uint64_t hashed = total_received;
+	auto hashReceived = [&]() {
+		uint64_t length = total_received - hashed;
+		hashed = total_received;
+		return (!crc || crc32cUpdateFromFile(*crc, output_fd, hashed - length, length)) &&
+			(!chunks || chunks->updateFromFile(output_fd, length));
+	};
+
+	while (is_running && total_received < file_info.filesize) {
+		uint64_t remaining = file_info.filesize - total_received;
+		size_t to_receive = (remaining < chunk) ? remaining : chunk;
+
+		// Socket -> pipe
+		ssize_t received = splice(client_socket, nullptr, pipe_fds[1], nullptr, to_receive,
+				SPLICE_F_MOVE | SPLICE_F_MORE);
+
+		if (received < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				continue;  // Receive timeout, try again
+			}
+			int saved_errno = errno;
+			std::cerr << "Error splicing file data from socket: " << strerror(errno) << std::endl;
+			errno = saved_errno;
+			success = false;
+			break;
+		}
+
+		if (received == 0) {
+			std::cerr << "Connection closed during file transfer" << std::endl;
+			success = false;
+			break;
+		}
+
+		// Pipe -> file, drain everything we just pulled in
+		// (no offset pointer: splice advances the file position like write() would)
+		ssize_t pending = received;
+		while (pending > 0) {
+			ssize_t written = splice(pipe_fds[0], nullptr, output_fd, nullptr, pending, SPLICE_F_MOVE);
+			if (written < 0) {
+				if (errno == EINTR) continue;
+				int saved_errno = errno;
+				if (saved_errno == EINVAL) {
+					// Target filesystem can't splice: flush what is already in the
+					// pipe by hand so the caller can resume with the buffered loop
+					char buffer[8192];
+					while (pending > 0) {
+						ssize_t n = read(pipe_fds[0], buffer, sizeof(buffer));
+						if (n <= 0 || write(output_fd, buffer, n) != n) {
+							saved_errno = EIO;
+							break;
+						}
+						pending -= n;
+					}
+				}
+				if (saved_errno != EINVAL) {
+					std::cerr << "Error splicing file data to disk: " << strerror(saved_errno) << std::endl;
+				}
+				errno = saved_errno;
+				success = false;
+				break;
+			}
+			pending -= written;
+		}
+
+		if (!success) {
+			if (errno == EINVAL) {
+				// Caller checks errno for the buffered fallback, keep it across the
+				// journal update; the buffered loop continues the checksums in place
+				journal.record(total_received, received, output_fd);
+				writeback.written(output_fd, total_received, received);
+				total_received += received;
+				hashReceived();
+				errno = EINVAL;
+			}
+			break;
+		}
+
+		journal.record(total_received, received, output_fd);
+		writeback.written(output_fd, total_received, received);
+		total_received += received;
+
+		if ((total_received - hashed >= CRC32C_READBACK_WINDOW || total_received == file_info.filesize) &&
+			!hashReceived()) {
+			std::cerr << "Failed to read back file data for its checksum" << std::endl;
+			success = false;
+			break;
+		}
+		updateProgress(client.get(), client_ip, total_received, file_info.filesize, last_percentage);
+	}
+
+	int saved_errno = errno;
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+	errno = saved_errno;
+	return success;
+}
+
+StripedTransfer::~StripedTransfer() {
+	if (output_fd >= 0) {
+		close(output_fd);
+	}
+}
+
+/**
+ * Creates the output file for a striped transfer at its final size
+ */
+std::shared_ptr<StripedTransfer> FileTransferServer::beginStripedTransfer(const FileInfo& file_info, int control_socket) {
+	std::shared_ptr<StripedTransfer> transfer = std::make_shared<StripedTransfer>();
+	transfer->file_info = file_info;
+	transfer->output_filename = file_info.filename;
+	transfer->control_socket = control_socket;
+	transfer->last_percentage = -1;
+	transfer->finished = false;
+	transfer->verify = file_info.checksum == CHECKSUM_CRC32C;
+	transfer->checkpoint_queued = false;
+
+	transfer->output_fd = openOutputFile(file_info, transfer->journal, transfer->data_filename);
+	if (transfer->output_fd < 0) {
+		std::cerr << "Failed to create output file: " << transfer->output_filename << std::endl;
+		return nullptr;
+	}
+	transfer->bytes_received = transfer->journal.ranges().covered();
+
+	// Reserve every block up front: stripes land at scattered offsets, and
+	// allocating as they arrive fragments the file and fails late on a full disk
+	if (fallocate(transfer->output_fd, 0, 0, static_cast<off_t>(file_info.filesize)) < 0) {
+		bool no_space = (errno == ENOSPC);
+		// Filesystems without fallocate() still take a sparse file of the right size
+		if (no_space || ftruncate(transfer->output_fd, static_cast<off_t>(file_info.filesize)) < 0) {
+			std::cerr << "Failed to preallocate " << transfer->data_filename << ": " << strerror(errno) << std::endl;
+			transfer->journal.discard();
+			std::remove(transfer->data_filename.c_str());
+			return nullptr;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(transfers_mutex);
+		transfer->id = next_transfer_id++;
+		striped_transfers[transfer->id] = transfer;
+	}
+
+	std::cout << "Creating file: " << transfer->data_filename << " (striped transfer " << transfer->id << ")" << std::endl;
+	return transfer;
+}
+
+std::shared_ptr<StripedTransfer> FileTransferServer::findStripedTransfer(uint64_t id) {
+	std::lock_guard<std::mutex> lock(transfers_mutex);
+	auto it = striped_transfers.find(id);
+	return (it != striped_transfers.end()) ? it->second : nullptr;
+}
+
+/**
+ * Aggregates stripe progress; the connection whose bytes complete the file finalizes it
+ */
+bool FileTransferServer::addStripeData(StripedTransfer& transfer, uint64_t offset, uint64_t length, ClientConnection* client,
+		const std::string& client_ip, bool* checkpoint_due) {
+	std::lock_guard<std::mutex> lock(transfer.mutex);
+	if (transfer.finished) {
+		return false;
+	}
+
+	// Only newly covered bytes count, a resent range doesn't complete the file twice
+	transfer.bytes_received += transfer.journal.record(offset, length, checkpoint_due ? -1 : transfer.output_fd);
+	if (checkpoint_due && transfer.journal.checkpointDue() && !transfer.checkpoint_queued) {
+		transfer.checkpoint_queued = true;
+		*checkpoint_due = true;
+	}
+	updateProgress(client, client_ip, transfer.bytes_received, transfer.file_info.filesize,
+			transfer.last_percentage);
+
+	if (transfer.bytes_received < transfer.file_info.filesize) {
+		return false;
+	}
+
+	transfer.finished = true;
+	close(transfer.output_fd);
+	transfer.output_fd = -1;
+
+	{
+		std::lock_guard<std::mutex> transfers_lock(transfers_mutex);
+		striped_transfers.erase(transfer.id);
+	}
+
+	if (!commitOutputFile(transfer.data_filename, transfer.output_filename, transfer.journal)) {
+		return false;
+	}
+
+	std::cout << "File received successfully: " << transfer.output_filename
+		<< " (" << transfer.bytes_received << " bytes)" << std::endl;
+
+	addToStore(transfer.file_info, transfer.output_filename);
+
+	if (file_received_callback) {
+		file_received_callback(transfer.output_filename, transfer.bytes_received);
+	}
+	return true;
+}
+
+/**
+ * The snapshot is taken under the transfer's mutex, the slow part happens outside it
+ */
+void FileTransferServer::checkpointStripedTransfer(StripedTransfer& transfer) {
+	JournalCheckpoint checkpoint;
+	int data_fd;
+	{
+		std::lock_guard<std::mutex> lock(transfer.mutex);
+		transfer.checkpoint_queued = false;
+		if (transfer.finished || !transfer.journal.checkpointDue()) {
+			return;
+		}
+		checkpoint = transfer.journal.snapshot();
+		data_fd = dup(transfer.output_fd);  // Closed by whoever finalizes the transfer, maybe meanwhile
+	}
+
+	if (data_fd >= 0) {
+		TransferJournal::write(checkpoint, data_fd);
+		close(data_fd);
+	}
+}
+
+/**
+ * An empty file (or one that fits in a single stripe) has no ranges to split
+ */
+bool FileTransferServer::stripeableSize(const TransferMessage& msg) {
+	uint64_t filesize = msg.data.value("filesize", uint64_t(0));
+	return filesize > 0 && filesize > msg.data.value("stripe_size", uint64_t(0));
+}
+
+/**
+ * Keeps (resumable) or removes the partial file; connections still holding
+ * the transfer may write a little more, which a resume simply receives again
+ */
+void FileTransferServer::abortStripedTransfer(uint64_t id) {
+	std::shared_ptr<StripedTransfer> transfer;
+	{
+		std::lock_guard<std::mutex> lock(transfers_mutex);
+		auto it = striped_transfers.find(id);
+		if (it == striped_transfers.end()) {
+			return;
+		}
+		transfer = it->second;
+		striped_transfers.erase(it);
+	}
+
+	std::lock_guard<std::mutex> lock(transfer->mutex);
+	transfer->finished = true;
+	std::cerr << "File transfer incomplete: received " << transfer->bytes_received
+		<< " of " << transfer->file_info.filesize << " bytes" << std::endl;
+
+	if (transfer->journal.isPersistent() && transfer->journal.checkpoint(transfer->output_fd)) {
+		std::cout << "Kept " << transfer->data_filename << " for resuming" << std::endl;
+	} else {
+		transfer->journal.discard();
+		std::remove(transfer->data_filename.c_str());
+	}
+}
+
+/**
+ * Receives one stripe and writes it in place
+ * Stripes are acknowledged individually; the ack for the stripe that
+ * completes the file is the usual "complete" reply
+ */
+bool FileTransferServer::receiveStripe(int client_socket, MessageReader& reader, const TransferMessage& msg,
+		const std::string& client_ip, WireFormat format) {
+	uint64_t id = msg.data.at("transfer_id");
+	uint64_t offset = msg.data.at("offset");
+	uint64_t length = msg.data.at("length");
+	std::shared_ptr<ClientConnection> client = findClient(client_socket);
+
+	// The stripe's bytes are already on their way, so a bad stripe ends the connection
+	std::shared_ptr<StripedTransfer> transfer = findStripedTransfer(id);
+	if (!transfer || offset > transfer->file_info.filesize || length > transfer->file_info.filesize - offset) {
+		std::cerr << "Rejecting stripe for transfer " << id << " from " << client_ip << std::endl;
+		sendMessage(client_socket, statusMessage({{"status", "error"}, {"reason", "Unknown transfer or bad range"}}), format);
+		return false;
+	}
+
+	uint64_t done = 0;
+	bool completed = false;
+
+	// Verified stripes are only recorded once their checksum matched,
+	// so a corrupt stripe is never counted (or journaled) as received
+	uint32_t crc = 0;
+
+	// Data that arrived in the same recv() as the FILE_STRIPE message
+	if (reader.buffered() > 0) {
+		std::string early = reader.takeBuffered();
+		size_t take = (early.size() < length) ? early.size() : length;
+		if (!writeAt(transfer->output_fd, early.data(), take, offset)) {
+			abortStripedTransfer(id);
+			return false;
+		}
+		done = take;
+		if (transfer->verify) {
+			crc = crc32cUpdate(crc, early.data(), take);
+		} else {
+			completed = addStripeData(*transfer, offset, take, client.get(), client_ip);
+		}
+
+		// Anything past the end of the stripe is the next message
+		if (take < early.size()) {
+			reader.feed(early.data() + take, early.size() - take);
+		}
+	}
+
+	char buffer[65536];
+	while (done < length) {
+		if (!is_running) {
+			return false;
+		}
+
+		uint64_t remaining = length - done;
+		size_t to_receive = (remaining < sizeof(buffer)) ? remaining : sizeof(buffer);
+		ssize_t received = recv(client_socket, buffer, to_receive, 0);
+
+		if (received < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				continue;  // Timeout, try again
+			}
+			std::cerr << "Error receiving stripe data: " << strerror(errno) << std::endl;
+			abortStripedTransfer(id);
+			return false;
+		}
+
+		if (received == 0) {
+			std::cerr << "Connection closed during stripe at offset " << offset << std::endl;
+			abortStripedTransfer(id);
+			return false;
+		}
+
+		if (!writeAt(transfer->output_fd, buffer, received, offset + done)) {
+			abortStripedTransfer(id);
+			return false;
+		}
+		if (transfer->verify) {
+			crc = crc32cUpdate(crc, buffer, received);
+		} else {
+			completed = addStripeData(*transfer, offset + done, received, client.get(), client_ip) || completed;
+		}
+		done += received;
+	}
+
+	if (transfer->verify) {
+		TransferMessage trailer;
+		if (!receiveMessage(client_socket, reader, MessageType::FILE_CHECKSUM, trailer)) {
+			abortStripedTransfer(id);
+			return false;
+		}
+		if (!checksumMatches(trailer, crc)) {
+			std::cerr << "Checksum mismatch in stripe at offset " << offset << " of transfer " << id << std::endl;
+			sendMessage(client_socket, statusMessage({{"status", "error"}, {"reason", "Checksum mismatch"}}), format);
+			abortStripedTransfer(id);
+			return false;
+		}
+		completed = addStripeData(*transfer, offset, length, client.get(), client_ip);
+	}
+
+	if (completed) {
+		sendMessage(client_socket, statusMessage({{"status", "complete"}, {"filename", transfer->output_filename}}), format);
+	} else {
+		sendMessage(client_socket, statusMessage({{"status", "stripe_received"}, {"offset", offset}}), format);
+	}
+	return true;
+}
+
+/**
+ * Receives a batch of small files; the sender doesn't wait for the ack,
+ * so the next manifest may already be behind the last body
+ */
+bool FileTransferServer::receiveBatch(int client_socket, MessageReader& reader, const TransferMessage& msg,
+		const std::string& client_ip, WireFormat format) {
+	BatchReceiver batch;
+	batch.setFileCallback(file_received_callback);
+
+	// The bodies are already on their way, so a bad manifest ends the connection
+	if (!batch.begin(msg)) {
+		std::cerr << "Rejecting file batch from " << client_ip << std::endl;
+		sendMessage(client_socket, statusMessage({{"status", "error"}, {"reason", "Invalid batch"}}), format);
+		return false;
+	}
+
+	// Bodies that arrived in the same recv() as the manifest
+	if (reader.buffered() > 0) {
+		std::string early = reader.takeBuffered();
+		size_t used = batch.consume(early.data(), early.size());
+		if (used < early.size()) {
+			reader.feed(early.data() + used, early.size() - used);
+		}
+	}
+
+	char buffer[65536];
+	while (!batch.done()) {
+		if (!is_running) {
+			return false;
+		}
+
+		uint64_t remaining = batch.remaining();
+		size_t to_receive = (remaining < sizeof(buffer)) ? remaining : sizeof(buffer);
+		ssize_t received = recv(client_socket, buffer, to_receive, 0);
+
+		if (received < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				continue;  // Timeout, try again
+			}
+			std::cerr << "Error receiving batch data: " << strerror(errno) << std::endl;
+			return false;
+		}
+
+		if (received == 0) {
+			std::cerr << "Connection closed during file batch" << std::endl;
+			return false;
+		}
+
+		batch.consume(buffer, received);
+	}
+
+	std::cout << "Received batch of " << batch.fileCount() << " files (" << batch.totalBytes()
+		<< " bytes) from " << client_ip << std::endl;
+
+	return sendMessage(client_socket, batch.reply(), format);
+}
+
+/**
+ * Waits for a control message that must come next (e.g. the FILE_CHECKSUM trailer after the data)
+ */
+bool FileTransferServer::receiveMessage(int client_socket, MessageReader& reader, MessageType type,
+		TransferMessage& msg) {
+	char buffer[4096];
+
+	while (is_running) {
+		try {
+			if (reader.next(msg)) {
+				if (msg.type != type) {
+					std::cerr << "Expected message type " << static_cast<int>(type)
+						<< ", got " << static_cast<int>(msg.type) << std::endl;
+					return false;
+				}
+				return true;
+			}
+		} catch (const std::exception& e) {
+			std::cerr << "Invalid message: " << e.what() << std::endl;
+			return false;
+		}
+
+		ssize_t received = recv(client_socket, buffer, sizeof(buffer), 0);
+		if (received < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				continue;  // Timeout, try again
+			}
+			std::cerr << "Error receiving message: " << strerror(errno) << std::endl;
+			return false;
+		}
+		if (received == 0) {
+			std::cerr << "Connection closed while waiting for a message" << std::endl;
+			return false;
+		}
+		reader.feed(buffer, received);
+	}
+
+	return false;
+}
+
+/**
+ * Collects MERKLE_LEAVES batches until every leaf is known, then checks them against the root
+ */
+bool FileTransferServer::receiveMerkleLeaves(int client_socket, MessageReader& reader, const FileInfo& file_info,
+		MerkleTree& tree) {
+	uint64_t filled = 0;
+
+	while (filled < tree.leafCount()) {
+		TransferMessage batch;
+		if (!receiveMessage(client_socket, reader, MessageType::MERKLE_LEAVES, batch)) {
+			return false;
+		}
+
+		// Batches arrive in order, each continuing where the last one ended
+		uint64_t first = batch.data.at("first");
+		const json& hashes = batch.data.at("hashes");
+		if (first != filled || hashes.size() > tree.leafCount() - filled) {
+			std::cerr << "Out of order chunk hashes for " << file_info.filename << std::endl;
+			return false;
+		}
+		for (const auto& hash : hashes) {
+			tree.setLeaf(filled++, hash.get<uint32_t>());
+		}
+	}
+
+	if (tree.rootHex() != file_info.merkle_root) {
+		std::cerr << "Chunk hashes of " << file_info.filename << " don't match their root" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Writes file bytes that were read together with the last control message
+ */
+bool FileTransferServer::receiveEarlyData(MessageReader& reader, int output_fd, const FileInfo& file_info,
+		uint64_t& total_received, TransferJournal& journal, WriteBehind& writeback, ChunkVerifier* chunks) {
+	if (reader.buffered() == 0) {
+		return true;
+	}
+
+	std::string early = reader.takeBuffered();
+	uint64_t remaining = file_info.filesize - total_received;
+	size_t take = (early.size() < remaining) ? early.size() : remaining;
+
+	if (!writeAt(output_fd, early.data(), take, total_received)) {
+		return false;
+	}
+	lseek(output_fd, static_cast<off_t>(total_received + take), SEEK_SET);
+	if (chunks) {
+		chunks->update(early.data(), take);
+	}
+	journal.record(total_received, take, output_fd);
+	writeback.written(output_fd, total_received, take);
+	total_received += take;
+
+	// Anything past the end of the file is the next message
+	if (take < early.size()) {
+		reader.feed(early.data() + take, early.size() - take);
+	}
+	return true;
+}
+
+/**
+ * Raw data after a control message: whatever the reader already holds first, then the socket
+ */
+bool FileTransferServer::receiveRaw(int client_socket, MessageReader& reader, char* data, uint64_t length) {
+	uint64_t done = 0;
+
+	std::string early = reader.takeBuffered();
+	if (!early.empty()) {
+		done = (early.size() < length) ? early.size() : length;
+		std::copy(early.begin(), early.begin() + done, data);
+		if (done < early.size()) {
+			reader.feed(early.data() + done, early.size() - done);
+		}
+	}
+
+	while (done < length) {
+		if (!is_running) {
+			return false;
+		}
+		ssize_t received = recv(client_socket, data + done, length - done, 0);
+		if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			continue;  // Timeout, try again
+		}
+		if (received <= 0) {
+			return false;
+		}
+		done += received;
+	}
+	return true;
+}
+
+/**
+ * Asks for bad chunks again in batches and checks each resent chunk as it lands;
+ * gives up when a round fixes nothing MAX_REPAIR_ROUNDS times
+ */
+bool FileTransferServer::repairChunks(int client_socket, MessageReader& reader, int output_fd, const MerkleTree& tree,
+		std::vector<uint64_t> bad, WireFormat format) {
+	const int MAX_REPAIR_ROUNDS = 3;
+	const size_t MAX_CHUNKS_PER_ROUND = 4096;   // Keeps the request well under the control message limit
+	PooledBuffer buffer(tree.chunkSize());
+	int failed_rounds = 0;
+
+	while (!bad.empty()) {
+		size_t count = (bad.size() < MAX_CHUNKS_PER_ROUND) ? bad.size() : MAX_CHUNKS_PER_ROUND;
+		std::vector<uint64_t> batch(bad.begin(), bad.begin() + count);
+		bad.erase(bad.begin(), bad.begin() + count);
+
+		sendMessage(client_socket, statusMessage({{"status", "resend"}, {"chunks", batch}}), format);
+
+		// The sender answers with the raw bytes of every listed chunk, in order
+		std::vector<uint64_t> still_bad;
+		for (uint64_t index : batch) {
+			uint64_t length = tree.chunkLength(index);
+			if (!receiveRaw(client_socket, reader, buffer.data(), length)) {
+				std::cerr << "Connection lost while resending chunk " << index << std::endl;
+				return false;
+			}
+
+			if (crc32cUpdate(0, buffer.data(), length) != tree.leaf(index)) {
+				still_bad.push_back(index);
+			} else if (!writeAt(output_fd, buffer.data(), length, tree.chunkOffset(index))) {
+				return false;
+			}
+		}
+
+		if (!still_bad.empty()) {
+			if (++failed_rounds >= MAX_REPAIR_ROUNDS) {
+				std::cerr << still_bad.size() << " chunk(s) still corrupt after resending" << std::endl;
+				sendMessage(client_socket, statusMessage({{"status", "error"}, {"reason", "Chunks still corrupt after resending"}}), format);
+				return false;
+			}
+			bad.insert(bad.end(), still_bad.begin(), still_bad.end());
+		}
+	}
+
+	std::cout << "Repaired corrupt chunks" << std::endl;
+	return true;
+}
+
+bool FileTransferServer::checksumMatches(const TransferMessage& msg, uint32_t crc) {
+	return msg.data.value("algorithm", CHECKSUM_CRC32C) == std::string(CHECKSUM_CRC32C) &&
+		msg.data.value("checksum", "") == crc32cToHex(crc);
+}
+
+/**
+ * "receiving" reply of a striped transfer; ranges already on disk are listed so the sender skips them
+ */
+TransferMessage FileTransferServer::stripedReceivingReply(StripedTransfer& transfer) {
+	json reply = {{"status", "receiving"}, {"transfer_id", transfer.id}};
+	if (transfer.verify) {
+		reply["checksum"] = CHECKSUM_CRC32C;
+	}
+
+	std::lock_guard<std::mutex> lock(transfer.mutex);
+	if (!transfer.journal.ranges().empty()) {
+		json ranges = json::array();
+		for (const auto& span : transfer.journal.ranges().spanMap()) {
+			ranges.push_back({span.first, span.second});
+		}
+		reply["ranges"] = ranges;
+	}
+	return statusMessage(reply);
+}
+
+/**
+ * Resumable transfers reopen their .part file; the journal decides which ranges survive
+ */
+int FileTransferServer::openOutputFile(const FileInfo& file_info, TransferJournal& journal, std::string& data_filename) {
+	int fd;
+	if (file_info.mtime == 0) {
+		data_filename = file_info.filename;
+		journal.open("", file_info, -1);
+		fd = open(data_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, file_info.mode);
+		if (fd < 0) {
+			return -1;
+		}
+	} else {
+		data_filename = TransferJournal::partPath(file_info.filename);
+		fd = open(data_filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, file_info.mode);
+		if (fd < 0) {
+			return -1;
+		}
+
+		if (journal.open(data_filename, file_info, fd)) {
+			std::cout << "Resuming " << file_info.filename << ": " << journal.ranges().covered()
+				<< " of " << file_info.filesize << " bytes already received" << std::endl;
+		} else if (ftruncate(fd, 0) < 0) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	if (!preallocate(fd, file_info.filesize)) {
+		std::cerr << "Not enough disk space for " << file_info.filename << " (" << file_info.filesize
+			<< " bytes)" << std::endl;
+		close(fd);
+		if (!journal.isPersistent()) {
+			std::remove(data_filename.c_str());
+		}
+		errno = ENOSPC;
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * Allocating the whole file at once gives the filesystem a chance to lay it
+ * out in a few large extents, instead of growing it a write at a time
+ */
+bool FileTransferServer::preallocate(int fd, uint64_t size) {
+	// KEEP_SIZE: the file still grows with the data, so an interrupted transfer has its real length
+	if (size > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size)) < 0 && errno == ENOSPC) {
+		return false;
+	}
+
+	// Written front to back, and read back the same way for checksums
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	return true;
+}
+
+bool FileTransferServer::commitOutputFile(const std::string& data_filename, const std::string& output_filename,
+		TransferJournal& journal) {
+	if (data_filename != output_filename && rename(data_filename.c_str(), output_filename.c_str()) < 0) {
+		std::cerr << "Failed to rename " << data_filename << " to " << output_filename
+			<< ": " << strerror(errno) << std::endl;
+		return false;
+	}
+	journal.discard();
+	return true;
+}
+
+bool FileTransferServer::restoreFromStore(const FileInfo& file_info) {
+	if (!content_store || file_info.sha256.empty() ||
+		!content_store->materialize(file_info.sha256, file_info.filesize, file_info.filename, file_info.mode)) {
+		return false;
+	}
+
+	std::cout << "File deduplicated: " << file_info.filename << " (" << file_info.filesize
+		<< " bytes from the content store)" << std::endl;
+
+	if (file_received_callback) {
+		file_received_callback(file_info.filename, file_info.filesize);
+	}
+	return true;
+}
+
+void FileTransferServer::addToStore(const FileInfo& file_info, const std::string& path) {
+	if (content_store && !file_info.sha256.empty() && !content_store->add(file_info.sha256, path)) {
+		std::cerr << "Could not add " << path << " to the content store" << std::endl;
+	}
+}
+
+/**
+ * Positional write, so stripes on different connections never share a file offset
+ */
+bool FileTransferServer::writeAt(int fd, const char* data, size_t length, uint64_t offset) {
+	size_t written = 0;
+	while (written < length) {
+		ssize_t w = pwrite(fd, data + written, length - written, static_cast<off_t>(offset + written));
+		if (w < 0) {
+			if (errno == EINTR) continue;
+			std::cerr << "Error writing file data: " << strerror(errno) << std::endl;
+			return false;
+		}
+		written += w;
+	}
+	return true;
+}
+
+/**
+ * Reopening keeps the original descriptor (and its page cache writes) usable
+ * for the unaligned pieces; both end up on the same inode
+ */
+int FileTransferServer::openDirect(int fd) {
+	std::string path = "/proc/self/fd/" + std::to_string(fd);
+	return open(path.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+}
+
+/**
+ * Publishes progress for getConnectedClients() and the progress callback
+ */
+void FileTransferServer::updateProgress(ClientConnection* client, const std::string& client_ip,
+		uint64_t total_received, uint64_t file_size, int& last_percentage) {
+	if (client) {
+		client->bytes_received.store(total_received, std::memory_order_relaxed);
+	}
+
+	// An empty file is complete from the start
+	int percentage = (file_size > 0) ? static_cast<int>((total_received * 100) / file_size) : 100;
+	if (percentage != last_percentage && percentage % 10 == 0) {
+		std::cout << "Receiving from " << client_ip << ": " << percentage << "% "
+			<< "(" << total_received << "/" << file_size << " bytes)" << std::endl;
+		last_percentage = percentage;
+
+		if (progress_callback) {
+			progress_callback(client_ip, percentage);
+		}
+	}
+}
+
+/**
+ * Removes a client from the clients list
+ */
+void FileTransferServer::removeClient(int socket_fd) {
+	std::lock_guard<std::mutex> lock(clients_mutex);
+
+	auto found = clients.find(socket_fd);
+
+	if (found != clients.end()) {
+		ClientConnection* it = found->second.get();
+		std::cout << "Removing client " << it->ip_address << ":" << it->port << std::endl;
+
+		// Mark as inactive first
+		it->is_active = false;
+
+		// Shut the socket down to interrupt any blocking recv/send
+		// It is only shut down: the worker or event loop serving it sees the
+		// hangup and closes the descriptor itself, so it can't be reused early
+		if (it->socket_fd >= 0) {
+			shutdown(it->socket_fd, SHUT_RDWR);
+			it->socket_fd = -1;
+		}
+
+		// Remove from the table; a transfer still holding the state keeps it alive
+		clients.erase(found);
+	}
+}
+
+/**
+ * Clients name their files relative to the current directory: a store in
+ * there could have its objects replaced by a client sending a file with
+ * the right name
+ */
+bool FileTransferServer::setContentStore(const std::string& directory) {
+	std::unique_ptr<ContentStore> store(new ContentStore(directory));
+	if (!store->open()) {
+		return false;
+	}
+
+	char* store_path = realpath(directory.c_str(), nullptr);
+	char* receive_path = realpath(".", nullptr);
+	bool inside = store_path && receive_path &&
+		(std::string(store_path) + "/").compare(0, strlen(receive_path) + 1, std::string(receive_path) + "/") == 0;
+	free(store_path);
+	free(receive_path);
+
+	if (inside) {
+		std::cerr << "Content store " << directory << " must be outside the receive directory" << std::endl;
+		return false;
+	}
+
+	std::cout << "Content store: " << directory << " (SHA-256: " << sha256Implementation() << ")" << std::endl;
+	content_store = std::move(store);
+	return true;
+}
+
+/**
+ * Gets list of connected clients
  */
 std::vector<ClientInfo> FileTransferServer::getConnectedClients() {
+	// Receiving threads never take clients_mutex, so holding it here doesn't stall them
 	std::lock_guard<std::mutex> lock(clients_mutex);
-	return clients;
+
+	std::vector<ClientInfo> snapshot;
+	snapshot.reserve(clients.size());
+	for (const auto& entry : clients) {
+		const ClientConnection& client = *entry.second;
+		ClientInfo info;
+		info.socket_fd = client.socket_fd;
+		info.ip_address = client.ip_address;
+		info.port = client.port;
+		info.is_active = client.is_active.load();
+		info.bytes_received = client.bytes_received.load(std::memory_order_relaxed);
+		info.current_filename = client.current_filename;
+		info.wire_format = client.wire_format;
+		snapshot.push_back(info);
+	}
+	return snapshot;
+}
+
+/**
+ * Looks up a client's state by socket
+ */
+std::shared_ptr<ClientConnection> FileTransferServer::findClient(int socket_fd) {
+	std::lock_guard<std::mutex> lock(clients_mutex);
+	auto it = clients.find(socket_fd);
+	return it != clients.end() ? it->second : nullptr;
 }
 
 /**
@@ -483,8 +2272,15 @@ void FileTransferServer::disconnectClient(int client_socket) {
 	disconnect_msg.type = MessageType::DISCONNECT;
 	disconnect_msg.data = {{"reason", "server_shutdown"}};
 
-	std::string serialized = disconnect_msg.serialize();
-	send(client_socket, serialized.c_str(), serialized.length(), 0);
+	WireFormat format = WireFormat::JSON;
+	{
+		std::lock_guard<std::mutex> lock(clients_mutex);
+		auto it = clients.find(client_socket);
+		if (it != clients.end()) {
+			format = it->second->wire_format;
+		}
+	}
+	sendMessage(client_socket, disconnect_msg, format);
 
 	removeClient(client_socket);
 }
@@ -495,7 +2291,8 @@ void FileTransferServer::disconnectClient(int client_socket) {
 void FileTransferServer::broadcastToClients(const std::string& message) {
 	std::lock_guard<std::mutex> lock(clients_mutex);
 
-	for (const auto& client : clients) {
+	for (const auto& entry : clients) {
+		const ClientConnection& client = *entry.second;
 		if (client.is_active && client.socket_fd >= 0) {
 			ssize_t sent = send(client.socket_fd, message.c_str(), message.length(), 0);
 			if (sent != static_cast<ssize_t>(message.length())) {
@@ -0,0 +1,379 @@
+#include "ioUringEngine.hpp"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+// Slots in the registered file table
+static const int FILE_INDEX = 0;
+static const int SOCKET_INDEX = 1;
+
+IoUringEngine::IoUringEngine(unsigned int batch_size, size_t chunk_size)
+	: ring(nullptr), batch_size(batch_size > 0 ? batch_size : 1), chunk_size(chunk_size), initialized(false) {}
+
+#ifdef HAVE_LIBURING
+
+IoUringEngine::~IoUringEngine() {
+	if (ring) {
+		io_uring_queue_exit(ring);
+		delete ring;
+		ring = nullptr;
+	}
+	for (char* buffer : buffers) {
+		free(buffer);
+	}
+}
+
+/**
+ * Tries to create a tiny ring once; seccomp filters and kernels built
+ * without io_uring make this fail with ENOSYS/EPERM
+ */
+bool IoUringEngine::isAvailable() {
+	static const bool available = []() {
+		struct io_uring probe;
+		if (io_uring_queue_init(2, &probe, 0) < 0) {
+			return false;
+		}
+		io_uring_queue_exit(&probe);
+		return true;
+	}();
+	return available;
+}
+
+/**
+ * Creates the ring on first use and registers buffers and descriptors
+ */
+bool IoUringEngine::setup(int file_fd, int socket_fd) {
+	if (!ring) {
+		ring = new struct io_uring;
+		// Two SQEs per pair: read+send or recv+write
+		int ret = io_uring_queue_init(batch_size * 2, ring, 0);
+		if (ret < 0) {
+			std::cerr << "io_uring_queue_init failed: " << strerror(-ret) << std::endl;
+			delete ring;
+			ring = nullptr;
+			errno = -ret;
+			return false;
+		}
+		initialized = false;
+	}
+
+	if (!initialized) {
+		// Page-aligned buffers, pinned once by the kernel for *_fixed operations
+		std::vector<struct iovec> iovecs;
+		while (buffers.size() < batch_size) {
+			void* memory = nullptr;
+			if (posix_memalign(&memory, 4096, chunk_size) != 0) {
+				std::cerr << "Failed to allocate io_uring buffers" << std::endl;
+				errno = ENOMEM;
+				return false;
+			}
+			buffers.push_back(static_cast<char*>(memory));
+		}
+		for (char* buffer : buffers) {
+			iovecs.push_back({buffer, chunk_size});
+		}
+
+		int ret = io_uring_register_buffers(ring, iovecs.data(), iovecs.size());
+		if (ret < 0) {
+			std::cerr << "io_uring_register_buffers failed: " << strerror(-ret) << std::endl;
+			errno = -ret;
+			return false;
+		}
+		initialized = true;
+	}
+
+	int fds[2];
+	fds[FILE_INDEX] = file_fd;
+	fds[SOCKET_INDEX] = socket_fd;
+	int ret = io_uring_register_files(ring, fds, 2);
+	if (ret < 0) {
+		std::cerr << "io_uring_register_files failed: " << strerror(-ret) << std::endl;
+		errno = -ret;
+		return false;
+	}
+
+	return true;
+}
+
+void IoUringEngine::teardown() {
+	if (ring) {
+		io_uring_unregister_files(ring);
+	}
+}
+
+/**
+ * Waits for one completion, giving the caller a chance to abort every second
+ * @return: 0 on success, negative errno on failure/abort
+ */
+static int waitCompletion(struct io_uring* ring, struct io_uring_cqe** cqe,
+		const std::function<bool(uint64_t)>& progress, uint64_t total) {
+	while (true) {
+		struct __kernel_timespec timeout = {1, 0};
+		int ret = io_uring_wait_cqe_timeout(ring, cqe, &timeout);
+		if (ret == 0) return 0;
+		if (ret == -EINTR) continue;
+		if (ret == -ETIME) {
+			if (progress && !progress(total)) return -ECANCELED;
+			continue;
+		}
+		return ret;
+	}
+}
+
+/**
+ * Sender: batches of linked read_fixed -> send pairs
+ * The whole batch is one chain, so sends hit the socket in file order and a
+ * short or failed operation cancels everything behind it. Whatever really
+ * went out is counted and the next batch resumes right after it.
+ */
+bool IoUringEngine::sendFile(int file_fd, int socket_fd, uint64_t length, uint64_t& total_sent,
+		std::function<bool(uint64_t)> progress) {
+	if (!setup(file_fd, socket_fd)) {
+		return false;
+	}
+
+	std::vector<size_t> lengths(batch_size);
+	std::vector<int> results(batch_size * 2);
+	bool success = true;
+
+	while (success && total_sent < length) {
+		unsigned int pairs = 0;
+		uint64_t offset = total_sent;
+		struct io_uring_sqe* sqe = nullptr;
+
+		for (; pairs < batch_size && offset < length; pairs++) {
+			size_t n = (length - offset < chunk_size) ? length - offset : chunk_size;
+			lengths[pairs] = n;
+
+			sqe = io_uring_get_sqe(ring);
+			io_uring_prep_read_fixed(sqe, FILE_INDEX, buffers[pairs], n, offset, pairs);
+			sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+			io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(static_cast<uintptr_t>(pairs * 2)));
+
+			sqe = io_uring_get_sqe(ring);
+			io_uring_prep_send(sqe, SOCKET_INDEX, buffers[pairs], n, MSG_WAITALL | MSG_NOSIGNAL);
+			sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+			io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(static_cast<uintptr_t>(pairs * 2 + 1)));
+
+			offset += n;
+		}
+		sqe->flags &= ~IOSQE_IO_LINK;  // Chain ends with the last send
+
+		int ret = io_uring_submit(ring);
+		if (ret < 0) {
+			std::cerr << "io_uring_submit failed: " << strerror(-ret) << std::endl;
+			errno = -ret;
+			success = false;
+			break;
+		}
+
+		// Every SQE posts exactly one CQE, cancelled ones included
+		for (unsigned int i = 0; i < pairs * 2; i++) {
+			struct io_uring_cqe* cqe;
+			ret = waitCompletion(ring, &cqe, progress, total_sent);
+			if (ret < 0) {
+				// Aborted or ring broken: drop the ring, exiting it cancels in-flight I/O
+				io_uring_queue_exit(ring);
+				delete ring;
+				ring = nullptr;
+				errno = -ret;
+				return false;
+			}
+			results[reinterpret_cast<uintptr_t>(io_uring_cqe_get_data(cqe))] = cqe->res;
+			io_uring_cqe_seen(ring, cqe);
+		}
+
+		// Walk the chain in stream order and count what reached the socket
+		uint64_t before = total_sent;
+		for (unsigned int p = 0; p < pairs; p++) {
+			int read_result = results[p * 2];
+			int send_result = results[p * 2 + 1];
+
+			if (read_result == -ECANCELED || send_result == -ECANCELED) {
+				if (read_result < 0 && read_result != -ECANCELED) {
+					std::cerr << "io_uring read failed: " << strerror(-read_result) << std::endl;
+					success = false;
+				}
+				break;
+			}
+			if (read_result <= 0) {
+				std::cerr << "io_uring read failed: "
+					<< (read_result == 0 ? "unexpected end of file" : strerror(-read_result)) << std::endl;
+				success = false;
+				break;
+			}
+			if (send_result < 0) {
+				std::cerr << "io_uring send failed: " << strerror(-send_result) << std::endl;
+				errno = -send_result;
+				success = false;
+				break;
+			}
+
+			total_sent += send_result;
+			if (static_cast<size_t>(send_result) < lengths[p]) {
+				break;  // Short send, resume from here next batch
+			}
+		}
+
+		if (success && total_sent == before) {
+			std::cerr << "io_uring transfer made no progress" << std::endl;
+			success = false;
+		}
+
+		if (success && progress && !progress(total_sent)) {
+			success = false;
+		}
+	}
+
+	teardown();
+	return success;
+}
+
+/**
+ * Receiver: batches of linked recv -> write_fixed pairs
+ * recv uses MSG_WAITALL so each buffer is normally filled completely; a
+ * short recv breaks the chain, and its bytes are written out directly
+ * before the next batch picks up from there.
+ */
+bool IoUringEngine::receiveFile(int socket_fd, int file_fd, uint64_t length, uint64_t& total_received,
+		std::function<bool(uint64_t)> progress) {
+	if (!setup(file_fd, socket_fd)) {
+		return false;
+	}
+
+	std::vector<size_t> lengths(batch_size);
+	std::vector<int> results(batch_size * 2);
+	bool success = true;
+
+	while (success && total_received < length) {
+		unsigned int pairs = 0;
+		uint64_t offset = total_received;
+		struct io_uring_sqe* sqe = nullptr;
+
+		for (; pairs < batch_size && offset < length; pairs++) {
+			size_t n = (length - offset < chunk_size) ? length - offset : chunk_size;
+			lengths[pairs] = n;
+
+			sqe = io_uring_get_sqe(ring);
+			io_uring_prep_recv(sqe, SOCKET_INDEX, buffers[pairs], n, MSG_WAITALL);
+			sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+			io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(static_cast<uintptr_t>(pairs * 2)));
+
+			sqe = io_uring_get_sqe(ring);
+			io_uring_prep_write_fixed(sqe, FILE_INDEX, buffers[pairs], n, offset, pairs);
+			sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+			io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(static_cast<uintptr_t>(pairs * 2 + 1)));
+
+			offset += n;
+		}
+		sqe->flags &= ~IOSQE_IO_LINK;
+
+		int ret = io_uring_submit(ring);
+		if (ret < 0) {
+			std::cerr << "io_uring_submit failed: " << strerror(-ret) << std::endl;
+			errno = -ret;
+			success = false;
+			break;
+		}
+
+		for (unsigned int i = 0; i < pairs * 2; i++) {
+			struct io_uring_cqe* cqe;
+			ret = waitCompletion(ring, &cqe, progress, total_received);
+			if (ret < 0) {
+				io_uring_queue_exit(ring);
+				delete ring;
+				ring = nullptr;
+				errno = -ret;
+				return false;
+			}
+			results[reinterpret_cast<uintptr_t>(io_uring_cqe_get_data(cqe))] = cqe->res;
+			io_uring_cqe_seen(ring, cqe);
+		}
+
+		for (unsigned int p = 0; p < pairs && success; p++) {
+			int recv_result = results[p * 2];
+			int write_result = results[p * 2 + 1];
+
+			if (recv_result == -ECANCELED) break;
+			if (recv_result == -EINTR || recv_result == -EAGAIN) break;
+			if (recv_result < 0) {
+				std::cerr << "Error receiving file data: " << strerror(-recv_result) << std::endl;
+				errno = -recv_result;
+				success = false;
+				break;
+			}
+			if (recv_result == 0) {
+				std::cerr << "Connection closed during file transfer" << std::endl;
+				success = false;
+				break;
+			}
+
+			// Whatever the linked write didn't store (cancelled or short) goes out by hand
+			size_t stored = (write_result > 0) ? static_cast<size_t>(write_result) : 0;
+			if (write_result < 0 && write_result != -ECANCELED) {
+				std::cerr << "io_uring write failed: " << strerror(-write_result) << std::endl;
+				errno = -write_result;
+				success = false;
+				break;
+			}
+			while (stored < static_cast<size_t>(recv_result)) {
+				ssize_t w = pwrite(file_fd, buffers[p] + stored, recv_result - stored, total_received + stored);
+				if (w < 0) {
+					if (errno == EINTR) continue;
+					std::cerr << "Error writing file data: " << strerror(errno) << std::endl;
+					success = false;
+					break;
+				}
+				stored += w;
+			}
+			if (!success) break;
+
+			total_received += recv_result;
+			if (static_cast<size_t>(recv_result) < lengths[p]) {
+				break;  // Short recv broke the chain
+			}
+		}
+
+		if (success && progress && !progress(total_received)) {
+			success = false;
+		}
+	}
+
+	teardown();
+	return success;
+}
+
+#else  // !HAVE_LIBURING
+
+IoUringEngine::~IoUringEngine() {}
+
+bool IoUringEngine::isAvailable() {
+	return false;
+}
+
+bool IoUringEngine::setup(int, int) {
+	errno = ENOSYS;
+	return false;
+}
+
+void IoUringEngine::teardown() {}
+
+bool IoUringEngine::sendFile(int, int, uint64_t, uint64_t&, std::function<bool(uint64_t)>) {
+	errno = ENOSYS;
+	return false;
+}
+
+bool IoUringEngine::receiveFile(int, int, uint64_t, uint64_t&, std::function<bool(uint64_t)>) {
+	errno = ENOSYS;
+	return false;
+}
+
+#endif
@@ -3,6 +3,7 @@
 #include <chrono>
 #include <csignal>
 #include <atomic>
+#include <sys/stat.h>
 #include "fileTransferServer.hpp"
 #include "fileTransferClient.hpp"
 #include "networkDiscovery.hpp"
@@ -75,7 +76,7 @@ int main() {
             std::cout << "Enter server IP: ";
             std::cin >> server_ip;
             
-            std::cout << "Enter file path: ";
+            std::cout << "Enter file or directory path: ";
             std::cin >> filepath;
             
             FileTransferClient client(server_ip, 5000);
@@ -86,7 +87,13 @@ int main() {
             });
             
             if (client.connect()) {
-                client.sendFile(filepath);
+                // Directories are sent with everything in them
+                struct stat st;
+                if (stat(filepath.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+                    client.sendDirectory(filepath);
+                } else {
+                    client.sendFile(filepath);
+                }
                 client.disconnect();
             }
             
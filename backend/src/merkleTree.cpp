@@ -0,0 +1,166 @@
+#include "merkleTree.hpp"
+#include "checksum.hpp"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+/**
+ * Runs fn(index) for every chunk in [first, last) on a pool of threads
+ * Chunks are claimed one at a time, so a slow read doesn't hold up the rest
+ */
+template <typename Fn>
+static void forEachChunk(uint64_t first, uint64_t last, unsigned int threads, Fn fn) {
+	if (threads == 0) {
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	if (last - first < threads) {
+		threads = static_cast<unsigned int>(std::max<uint64_t>(1, last - first));
+	}
+
+	std::atomic<uint64_t> next(first);
+	auto worker = [&]() {
+		for (uint64_t i = next++; i < last; i = next++) {
+			fn(i);
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned int t = 1; t < threads; t++) {
+		pool.emplace_back(worker);
+	}
+	worker();
+	for (auto& thread : pool) {
+		thread.join();
+	}
+}
+
+MerkleTree::MerkleTree(uint64_t file_size, uint64_t chunk_size) : file_size(file_size), chunk_size(chunk_size) {
+	leaves.assign((file_size + chunk_size - 1) / chunk_size, 0);
+}
+
+bool MerkleTree::validGeometry(uint64_t file_size, uint64_t chunk_size) {
+	return file_size > 0 && chunk_size >= MIN_CHUNK_SIZE &&
+		(file_size + chunk_size - 1) / chunk_size <= MAX_LEAVES;
+}
+
+uint64_t MerkleTree::chunkLength(uint64_t index) const {
+	uint64_t offset = chunkOffset(index);
+	return (file_size - offset < chunk_size) ? file_size - offset : chunk_size;
+}
+
+bool MerkleTree::build(int fd, unsigned int threads) {
+	std::atomic<bool> ok(true);
+	forEachChunk(0, leaves.size(), threads, [&](uint64_t i) {
+		uint32_t crc = 0;
+		if (!crc32cUpdateFromFile(crc, fd, chunkOffset(i), chunkLength(i))) {
+			ok = false;
+		}
+		leaves[i] = crc;
+	});
+	return ok;
+}
+
+std::vector<uint64_t> MerkleTree::verify(int fd, uint64_t first, uint64_t last, unsigned int threads) const {
+	std::vector<uint64_t> mismatched;
+	std::mutex mismatched_mutex;
+
+	last = std::min<uint64_t>(last, leaves.size());
+	if (first >= last) {
+		return mismatched;
+	}
+
+	forEachChunk(first, last, threads, [&](uint64_t i) {
+		uint32_t crc = 0;
+		if (!crc32cUpdateFromFile(crc, fd, chunkOffset(i), chunkLength(i)) || crc != leaves[i]) {
+			std::lock_guard<std::mutex> lock(mismatched_mutex);
+			mismatched.push_back(i);
+		}
+	});
+
+	std::sort(mismatched.begin(), mismatched.end());
+	return mismatched;
+}
+
+/**
+ * Folds the leaves level by level; hashes are combined in little-endian byte order
+ */
+uint32_t MerkleTree::root() const {
+	if (leaves.empty()) {
+		return 0;
+	}
+
+	std::vector<uint32_t> level = leaves;
+	while (level.size() > 1) {
+		std::vector<uint32_t> parents;
+		parents.reserve((level.size() + 1) / 2);
+
+		for (size_t i = 0; i + 1 < level.size(); i += 2) {
+			unsigned char pair[8];
+			for (int b = 0; b < 4; b++) {
+				pair[b] = static_cast<unsigned char>(level[i] >> (8 * b));
+				pair[4 + b] = static_cast<unsigned char>(level[i + 1] >> (8 * b));
+			}
+			parents.push_back(crc32cUpdate(0, pair, sizeof(pair)));
+		}
+		if (level.size() % 2 == 1) {
+			parents.push_back(level.back());
+		}
+		level.swap(parents);
+	}
+	return level[0];
+}
+
+std::string MerkleTree::rootHex() const {
+	return crc32cToHex(root());
+}
+
+ChunkVerifier::ChunkVerifier(const MerkleTree& tree, uint64_t start) : tree(tree), position(start), crc(0) {}
+
+void ChunkVerifier::advance(uint64_t length) {
+	position += length;
+
+	uint64_t index = (position - 1) / tree.chunkSize();
+	if (position == tree.chunkOffset(index) + tree.chunkLength(index)) {
+		if (crc != tree.leaf(index)) {
+			bad.push_back(index);
+		}
+		crc = 0;
+	}
+}
+
+void ChunkVerifier::update(const char* data, size_t length) {
+	while (length > 0) {
+		uint64_t index = position / tree.chunkSize();
+		if (index >= tree.leafCount()) {
+			return;  // Past the end of the file, not ours to check
+		}
+
+		uint64_t chunk_end = tree.chunkOffset(index) + tree.chunkLength(index);
+		size_t take = static_cast<size_t>(std::min<uint64_t>(length, chunk_end - position));
+		crc = crc32cUpdate(crc, data, take);
+		advance(take);
+
+		data += take;
+		length -= take;
+	}
+}
+
+bool ChunkVerifier::updateFromFile(int fd, uint64_t length) {
+	while (length > 0) {
+		uint64_t index = position / tree.chunkSize();
+		if (index >= tree.leafCount()) {
+			return true;
+		}
+
+		uint64_t chunk_end = tree.chunkOffset(index) + tree.chunkLength(index);
+		uint64_t take = std::min<uint64_t>(length, chunk_end - position);
+		if (!crc32cUpdateFromFile(crc, fd, position, take)) {
+			return false;
+		}
+		advance(take);
+
+		length -= take;
+	}
+	return true;
+}
@@ -1,5 +1,14 @@
 #include "protocol.hpp"
 #include <nlohmann/json.hpp>
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "checksum.hpp"
 
 using json = nlohmann::json;
 
@@ -47,6 +56,34 @@ std::string TransferMessage::serialize() const {
             j["type"] = "ERROR";
             j["data"] = data;
             break;
+
+        case MessageType::HELLO:
+            j["type"] = "HELLO";
+            break;
+
+        case MessageType::STATUS:
+            j["type"] = "STATUS";
+            break;
+
+        case MessageType::FILE_STRIPE:
+            j["type"] = "FILE_STRIPE";
+            break;
+
+        case MessageType::FILE_CHECKSUM:
+            j["type"] = "FILE_CHECKSUM";
+            break;
+
+        case MessageType::MERKLE_LEAVES:
+            j["type"] = "MERKLE_LEAVES";
+            break;
+
+        case MessageType::FILE_DELTA:
+            j["type"] = "FILE_DELTA";
+            break;
+
+        case MessageType::FILE_BATCH:
+            j["type"] = "FILE_BATCH";
+            break;
     }
 
     // For non-chunk messages, include all data
@@ -63,6 +100,13 @@ TransferMessage TransferMessage::deserialize(const std::string& jsonStr) {
     TransferMessage msg;
     json j = json::parse(jsonStr);
 
+    // Server replies are bare objects like {"status": "ready"}
+    if (!j.contains("type")) {
+        msg.type = MessageType::STATUS;
+        msg.data = j;
+        return msg;
+    }
+
     // Convert string type back to enum
     std::string type_str = j["type"];
     if (type_str == "DISCOVERY") msg.type = MessageType::DISCOVERY;
@@ -72,6 +116,14 @@ TransferMessage TransferMessage::deserialize(const std::string& jsonStr) {
     else if (type_str == "TRANSFER_PROGRESS") msg.type = MessageType::TRANSFER_PROGRESS;
     else if (type_str == "DISCONNECT") msg.type = MessageType::DISCONNECT;
     else if (type_str == "ERROR") msg.type = MessageType::ERROR;
+    else if (type_str == "HELLO") msg.type = MessageType::HELLO;
+    else if (type_str == "STATUS") msg.type = MessageType::STATUS;
+    else if (type_str == "FILE_STRIPE") msg.type = MessageType::FILE_STRIPE;
+    else if (type_str == "FILE_CHECKSUM") msg.type = MessageType::FILE_CHECKSUM;
+    else if (type_str == "MERKLE_LEAVES") msg.type = MessageType::MERKLE_LEAVES;
+    else if (type_str == "FILE_DELTA") msg.type = MessageType::FILE_DELTA;
+    else if (type_str == "FILE_BATCH") msg.type = MessageType::FILE_BATCH;
+    else throw std::runtime_error("unknown message type: " + type_str);
 
     // Handle chunk messages specially
     if (msg.type == MessageType::FILE_CHUNK) {
@@ -87,12 +139,286 @@ TransferMessage TransferMessage::deserialize(const std::string& jsonStr) {
 }
 
 /**
- * Calculate MD5 or SHA-1 checksum of a file
- * TODO: Implement actual checksum calculation
- * This helps verify file integrity after transfer
+ * Encode for the negotiated wire format
+ * Binary payloads use MessagePack: same data model as the JSON messages,
+ * but no text parsing and noticeably smaller for numbers and binary data
+ */
+std::string TransferMessage::encode(WireFormat format) const {
+    if (format == WireFormat::JSON) {
+        return (type == MessageType::STATUS) ? data.dump() : serialize();
+    }
+
+    std::vector<uint8_t> payload = json::to_msgpack(data);
+
+    FrameHeader header;
+    header.magic = FRAME_MAGIC;
+    header.version = FRAME_VERSION;
+    header.type = static_cast<uint8_t>(type);
+    header.flags = FRAME_FLAG_MSGPACK;
+    header.length = payload.size();
+
+    std::string frame(FRAME_HEADER_SIZE + payload.size(), '\0');
+    encodeFrameHeader(header, reinterpret_cast<uint8_t*>(&frame[0]));
+    std::copy(payload.begin(), payload.end(), frame.begin() + FRAME_HEADER_SIZE);
+    return frame;
+}
+
+TransferMessage statusMessage(json data) {
+    TransferMessage msg;
+    msg.type = MessageType::STATUS;
+    msg.data = std::move(data);
+    return msg;
+}
+
+void encodeFrameHeader(const FrameHeader& header, uint8_t* out) {
+    for (int i = 0; i < 4; i++) out[i] = static_cast<uint8_t>(header.magic >> (24 - 8 * i));
+    out[4] = header.version;
+    out[5] = header.type;
+    out[6] = static_cast<uint8_t>(header.flags >> 8);
+    out[7] = static_cast<uint8_t>(header.flags);
+    for (int i = 0; i < 8; i++) out[8 + i] = static_cast<uint8_t>(header.length >> (56 - 8 * i));
+}
+
+FrameDecoder::FrameDecoder() : header_filled(0), current(), payload_filled(0) {}
+
+/**
+ * Two-stage state machine: fill the fixed header, then the payload
+ */
+size_t FrameDecoder::feed(const uint8_t* data, size_t length, Status& status) {
+    size_t consumed = 0;
+
+    if (header_filled < FRAME_HEADER_SIZE) {
+        size_t take = std::min(length, FRAME_HEADER_SIZE - header_filled);
+        std::memcpy(header_bytes + header_filled, data, take);
+        header_filled += take;
+        consumed += take;
+
+        if (header_filled < FRAME_HEADER_SIZE) {
+            status = Status::NEED_MORE;
+            return consumed;
+        }
+
+        const uint8_t* h = header_bytes;
+        current.magic = (uint32_t(h[0]) << 24) | (uint32_t(h[1]) << 16) | (uint32_t(h[2]) << 8) | h[3];
+        current.version = h[4];
+        current.type = h[5];
+        current.flags = static_cast<uint16_t>((h[6] << 8) | h[7]);
+        current.length = 0;
+        for (int i = 0; i < 8; i++) current.length = (current.length << 8) | h[8 + i];
+
+        // An unknown type would otherwise be cast into a MessageType no handler expects
+        if (current.magic != FRAME_MAGIC || current.version != FRAME_VERSION ||
+            current.type > static_cast<uint8_t>(MessageType::FILE_BATCH) ||
+            current.length > MAX_FRAME_PAYLOAD) {
+            status = Status::BAD_FRAME;
+            return consumed;
+        }
+
+        // Grows only when a frame is bigger than any seen before
+        if (payload_buffer.size() < current.length) {
+            payload_buffer.resize(current.length);
+        }
+        payload_filled = 0;
+    }
+
+    size_t take = std::min<uint64_t>(length - consumed, current.length - payload_filled);
+    if (take > 0) {
+        std::memcpy(payload_buffer.data() + payload_filled, data + consumed, take);
+        payload_filled += take;
+        consumed += take;
+    }
+
+    status = (payload_filled == current.length) ? Status::FRAME_READY : Status::NEED_MORE;
+    return consumed;
+}
+
+void FrameDecoder::reset() {
+    header_filled = 0;
+    payload_filled = 0;
+}
+
+MessageReader::MessageReader() : format(WireFormat::JSON), corrupt(false), pending_offset(0), scanned(0), depth(0),
+    in_string(false), escaped(false) {}
+
+void MessageReader::feed(const char* data, size_t length) {
+    // Drop consumed bytes first; clear() keeps the capacity for the next recv()
+    if (pending_offset == pending.size()) {
+        pending.clear();
+        pending_offset = 0;
+    } else if (pending_offset > 64 * 1024) {
+        pending.erase(0, pending_offset);
+        pending_offset = 0;
+    }
+    pending.append(data, length);
+}
+
+/**
+ * The JSON wire format has no framing: a message ends with the brace that
+ * closes its top-level object. Braces inside strings (and escaped quotes) don't count
+ */
+size_t MessageReader::scanJson() {
+    while (pending_offset + scanned < pending.size()) {
+        char c = pending[pending_offset + scanned++];
+
+        if (in_string) {
+            if (escaped) escaped = false;
+            else if (c == '\\') escaped = true;
+            else if (c == '"') in_string = false;
+            continue;
+        }
+
+        if (c == '"') {
+            in_string = true;
+        } else if (c == '{') {
+            depth++;
+        } else if (c == '}') {
+            if (--depth < 0) {
+                corrupt = true;
+                throw std::runtime_error("unbalanced '}' in JSON message");
+            }
+            if (depth == 0) {
+                size_t length = scanned;
+                scanned = 0;
+                return length;
+            }
+        }
+    }
+
+    if (scanned > MAX_CONTROL_MESSAGE) {
+        corrupt = true;
+        throw std::runtime_error("JSON message over " + std::to_string(MAX_CONTROL_MESSAGE) + " bytes");
+    }
+    return 0;
+}
+
+bool MessageReader::next(TransferMessage& msg) {
+    if (corrupt) {
+        throw std::runtime_error("stream is corrupt");
+    }
+
+    if (format == WireFormat::JSON) {
+        size_t length = scanJson();
+        if (length == 0) {
+            return false;
+        }
+        std::string message_str = pending.substr(pending_offset, length);
+        pending_offset += length;
+        msg = TransferMessage::deserialize(message_str);
+        return true;
+    }
+
+    while (pending_offset < pending.size()) {
+        FrameDecoder::Status status;
+        pending_offset += decoder.feed(reinterpret_cast<const uint8_t*>(pending.data()) + pending_offset,
+                                       pending.size() - pending_offset, status);
+
+        if (status == FrameDecoder::Status::BAD_FRAME) {
+            corrupt = true;
+            throw std::runtime_error("corrupt frame header");
+        }
+        if (status == FrameDecoder::Status::FRAME_READY) {
+            const FrameHeader& header = decoder.header();
+            msg.type = static_cast<MessageType>(header.type);
+
+            // The frame is used up either way: a throw must not leave it to be decoded again
+            json data = json::object();
+            if (header.flags & FRAME_FLAG_MSGPACK) {
+                try {
+                    data = json::from_msgpack(decoder.payload(), decoder.payload() + decoder.payloadSize());
+                } catch (const json::exception& e) {
+                    decoder.reset();
+                    corrupt = true;
+                    throw std::runtime_error(std::string("bad frame payload: ") + e.what());
+                }
+            }
+            decoder.reset();
+            msg.data = std::move(data);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+std::string MessageReader::takeBuffered() {
+    std::string rest = pending.substr(pending_offset);
+    pending.clear();
+    pending_offset = 0;
+    scanned = 0;
+    depth = 0;
+    in_string = false;
+    escaped = false;
+    return rest;
+}
+
+WireFormat negotiateWireFormat(const TransferMessage& hello, TransferMessage& reply) {
+    bool binary = hello.data.value("wire", "json") == "binary" &&
+                  hello.data.value("version", 0) == FRAME_VERSION;
+
+    reply.type = MessageType::STATUS;
+    reply.data = {
+        {"status", "hello"},
+        {"wire", binary ? "binary" : "json"},
+        {"version", FRAME_VERSION},
+        {"batch", true}     // Accepts FILE_BATCH (see fileBatch.hpp)
+    };
+    return binary ? WireFormat::BINARY : WireFormat::JSON;
+}
+
+bool isSafeRelativePath(const std::string& name) {
+    if (name.empty() || name[0] == '/' || name.find('\0') != std::string::npos) {
+        return false;
+    }
+
+    size_t start = 0;
+    while (start <= name.size()) {
+        size_t end = name.find('/', start);
+        if (end == std::string::npos) {
+            end = name.size();
+        }
+        std::string component = name.substr(start, end - start);
+        if (component.empty() || component == "." || component == "..") {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+bool sendAll(int socket_fd, const char* data, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t n = send(socket_fd, data + sent, length - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+bool sendMessage(int socket_fd, const TransferMessage& msg, WireFormat format) {
+    std::string encoded = msg.encode(format);
+    return sendAll(socket_fd, encoded.data(), encoded.size());
+}
+
+/**
+ * Calculate the CRC32C checksum of a file
+ * Uses the same hash as the transfer path, so the result can be compared
+ * with the "checksum" a server reports on completion
  */
 std::string calculateChecksum(const std::string& filepath) {
-    // For now, return placeholder
-    // In production, use OpenSSL or similar library
-    return "checksum_not_implemented";
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return "";
+    }
+
+    struct stat st;
+    uint32_t crc = 0;
+    bool ok = fstat(fd, &st) == 0 &&
+              crc32cUpdateFromFile(crc, fd, 0, static_cast<uint64_t>(st.st_size));
+    close(fd);
+
+    return ok ? crc32cToHex(crc) : "";
 }
@@ -0,0 +1,234 @@
+#include "sha256.hpp"
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <vector>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+typedef void (*CompressFunction)(uint32_t state[8], const unsigned char* data, size_t blocks);
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+	return (x >> n) | (x << (32 - n));
+}
+
+/**
+ * FIPS 180-4 as written, one 64-byte block per iteration
+ */
+static void sha256CompressSoftware(uint32_t state[8], const unsigned char* data, size_t blocks) {
+	uint32_t w[64];
+
+	while (blocks-- > 0) {
+		for (int i = 0; i < 16; i++) {
+			w[i] = (uint32_t(data[i * 4]) << 24) | (uint32_t(data[i * 4 + 1]) << 16) |
+				(uint32_t(data[i * 4 + 2]) << 8) | uint32_t(data[i * 4 + 3]);
+		}
+		for (int i = 16; i < 64; i++) {
+			uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+		for (int i = 0; i < 64; i++) {
+			uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+			uint32_t ch = (e & f) ^ (~e & g);
+			uint32_t t1 = h + s1 + ch + K[i] + w[i];
+			uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+			uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+			uint32_t t2 = s0 + maj;
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+		data += 64;
+	}
+}
+
+#if defined(__x86_64__)
+/**
+ * SHA extensions: sha256rnds2 does two rounds per instruction on the state
+ * kept as ABEF/CDGH, sha256msg1/msg2 extend the message schedule four
+ * words at a time
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256CompressShaNi(uint32_t state[8], const unsigned char* data, size_t blocks) {
+	const __m128i BYTE_SWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	// state[] is ABCDEFGH; the instructions want ABEF and CDGH
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0])), 0xB1);
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4])), 0x1B);
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	while (blocks-- > 0) {
+		__m128i abef = state0;
+		__m128i cdgh = state1;
+		__m128i msg[4];
+
+		for (int i = 0; i < 4; i++) {
+			msg[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i * 16)), BYTE_SWAP);
+		}
+
+		// Four rounds per step; msg[step % 4] holds words 4 * step .. 4 * step + 3
+		for (int step = 0; step < 16; step++) {
+			__m128i wk = _mm_add_epi32(msg[step & 3], _mm_loadu_si128(reinterpret_cast<const __m128i*>(&K[step * 4])));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(wk, 0x0E));
+
+			// Words of step + 4 replace the ones just used
+			if (step < 12) {
+				__m128i next = _mm_sha256msg1_epu32(msg[step & 3], msg[(step + 1) & 3]);
+				next = _mm_add_epi32(next, _mm_alignr_epi8(msg[(step + 3) & 3], msg[(step + 2) & 3], 4));
+				msg[step & 3] = _mm_sha256msg2_epu32(next, msg[(step + 3) & 3]);
+			}
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+		data += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), _mm_blend_epi16(tmp, state1, 0xF0));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+/**
+ * Picks the fastest implementation this CPU supports
+ */
+static CompressFunction selectImplementation(const char** name) {
+#if defined(__x86_64__)
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29)) &&
+		__builtin_cpu_supports("sse4.1")) {
+		*name = "sha-ni";
+		return sha256CompressShaNi;
+	}
+#endif
+	*name = "software";
+	return sha256CompressSoftware;
+}
+
+static const char* implementation_name = nullptr;
+static const CompressFunction compress = selectImplementation(&implementation_name);
+
+Sha256::Sha256() : total_length(0), pending_length(0) {
+	static const uint32_t INITIAL[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	std::memcpy(state, INITIAL, sizeof(state));
+}
+
+void Sha256::update(const void* data, size_t length) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	total_length += length;
+
+	if (pending_length > 0) {
+		size_t take = (length < 64 - pending_length) ? length : 64 - pending_length;
+		std::memcpy(pending + pending_length, bytes, take);
+		pending_length += take;
+		bytes += take;
+		length -= take;
+		if (pending_length < 64) {
+			return;
+		}
+		compress(state, pending, 1);
+		pending_length = 0;
+	}
+
+	// Whole blocks straight from the caller's buffer
+	if (length >= 64) {
+		compress(state, bytes, length / 64);
+		bytes += length - length % 64;
+		length %= 64;
+	}
+
+	std::memcpy(pending, bytes, length);
+	pending_length = length;
+}
+
+std::string Sha256::finishHex() {
+	uint64_t bits = total_length * 8;
+
+	// 0x80, zeros up to 56 mod 64, then the big-endian bit length
+	unsigned char padding[72] = {0x80};
+	size_t padding_length = (pending_length < 56) ? 56 - pending_length : 120 - pending_length;
+	for (int i = 0; i < 8; i++) {
+		padding[padding_length + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+	}
+	update(padding, padding_length + 8);
+
+	char hex[65];
+	for (int i = 0; i < 8; i++) {
+		std::snprintf(hex + i * 8, 9, "%08x", state[i]);
+	}
+	return std::string(hex, 64);
+}
+
+bool sha256File(int fd, std::string& hex) {
+	Sha256 hash;
+	std::vector<char> buffer(1024 * 1024);
+	off_t offset = 0;
+
+	while (true) {
+		ssize_t n = pread(fd, buffer.data(), buffer.size(), offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return false;
+		}
+		if (n == 0) {
+			break;
+		}
+		hash.update(buffer.data(), n);
+		offset += n;
+	}
+
+	hex = hash.finishHex();
+	return true;
+}
+
+bool isSha256Hex(const std::string& hex) {
+	if (hex.size() != 64) {
+		return false;
+	}
+	for (char c : hex) {
+		if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+const char* sha256Implementation() {
+	return implementation_name;
+}
@@ -0,0 +1,283 @@
+#include "transferJournal.hpp"
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <iterator>
+#include <mutex>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+using json = nlohmann::json;
+
+/**
+ * Merge the new range with every span it overlaps or touches
+ */
+uint64_t RangeSet::add(uint64_t offset, uint64_t length) {
+	if (length == 0) {
+		return 0;
+	}
+
+	uint64_t start = offset;
+	uint64_t end = offset + length;
+	uint64_t before = total;
+
+	// Start at the last span beginning at or before `start`, if it reaches us
+	auto it = spans.upper_bound(start);
+	if (it != spans.begin() && std::prev(it)->second >= start) {
+		--it;
+	}
+
+	while (it != spans.end() && it->first <= end) {
+		if (it->first < start) start = it->first;
+		if (it->second > end) end = it->second;
+		total -= it->second - it->first;
+		it = spans.erase(it);
+	}
+
+	spans[start] = end;
+	total += end - start;
+	return total - before;
+}
+
+bool RangeSet::contains(uint64_t offset, uint64_t length) const {
+	auto it = spans.upper_bound(offset);
+	if (it == spans.begin()) {
+		return false;
+	}
+	--it;
+	return it->first <= offset && it->second >= offset + length;
+}
+
+uint64_t RangeSet::prefix() const {
+	auto it = spans.find(0);
+	return (it != spans.end()) ? it->second : 0;
+}
+
+/**
+ * Adler-32 (RFC 1950), continued from a previous value
+ */
+static uint32_t adler32(uint32_t adler, const unsigned char* data, size_t length) {
+	const uint32_t MOD_ADLER = 65521;
+	uint32_t a = adler & 0xffff;
+	uint32_t b = adler >> 16;
+
+	while (length > 0) {
+		// 5552 is the most bytes we can sum before b could overflow 32 bits
+		size_t block = (length < 5552) ? length : 5552;
+		length -= block;
+		while (block-- > 0) {
+			a += *data++;
+			b += a;
+		}
+		a %= MOD_ADLER;
+		b %= MOD_ADLER;
+	}
+
+	return (b << 16) | a;
+}
+
+/**
+ * Checkpoints of one journal are written one at a time, and none after discard()
+ */
+struct JournalFile {
+	std::mutex mutex;
+	bool discarded;
+
+	JournalFile() : discarded(false) {}
+};
+
+TransferJournal::TransferJournal() : unsynced(0) {
+	file_info.filesize = 0;
+	file_info.mtime = 0;
+}
+
+bool TransferJournal::open(const std::string& part_path, const FileInfo& info, int data_fd) {
+	file_info = info;
+	completed.clear();
+	unsynced = 0;
+	journal_path = part_path.empty() ? "" : part_path + ".journal";
+	file = part_path.empty() ? nullptr : std::make_shared<JournalFile>();
+
+	if (journal_path.empty()) {
+		return false;
+	}
+	if (load(data_fd)) {
+		return true;
+	}
+
+	// Nothing usable from before: forget any stale journal
+	completed.clear();
+	std::remove(journal_path.c_str());
+	return false;
+}
+
+bool TransferJournal::load(int data_fd) {
+	std::ifstream in(journal_path);
+	if (!in.is_open()) {
+		return false;
+	}
+
+	try {
+		json j = json::parse(in);
+
+		// A different size or timestamp means the source changed since the partial copy
+		if (j.at("filesize").get<uint64_t>() != file_info.filesize ||
+			j.at("mtime").get<int64_t>() != file_info.mtime) {
+			std::cout << "Source of " << file_info.filename << " changed, not resuming" << std::endl;
+			return false;
+		}
+
+		for (const auto& range : j.at("ranges")) {
+			uint64_t start = range.at(0);
+			uint64_t end = range.at(1);
+			if (start >= end || end > file_info.filesize) {
+				return false;
+			}
+			completed.add(start, end - start);
+		}
+
+		struct stat st;
+		if (!completed.empty() &&
+			(fstat(data_fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < completed.spanMap().rbegin()->second)) {
+			std::cerr << "Partial file of " << file_info.filename << " is shorter than its journal" << std::endl;
+			return false;
+		}
+
+		uint32_t checksum;
+		if (!rangeChecksum(completed, data_fd, checksum) || checksum != j.at("checksum").get<uint32_t>()) {
+			std::cerr << "Partial file of " << file_info.filename << " doesn't match its journal" << std::endl;
+			return false;
+		}
+	} catch (const json::exception& e) {
+		std::cerr << "Ignoring unreadable journal " << journal_path << ": " << e.what() << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+uint64_t TransferJournal::record(uint64_t offset, uint64_t length, int data_fd) {
+	uint64_t added = completed.add(offset, length);
+
+	if (isPersistent()) {
+		unsynced += added;
+		if (unsynced >= JOURNAL_INTERVAL && data_fd >= 0) {
+			checkpoint(data_fd);
+		}
+	}
+
+	return added;
+}
+
+bool TransferJournal::rangeChecksum(const RangeSet& ranges, int data_fd, uint32_t& checksum) {
+	std::vector<unsigned char> window(CHECK_WINDOW);
+	checksum = 1;
+
+	for (const auto& span : ranges.spanMap()) {
+		uint64_t length = span.second - span.first;
+		size_t count = (length < CHECK_WINDOW) ? length : CHECK_WINDOW;
+		uint64_t offset = span.second - count;
+
+		size_t done = 0;
+		while (done < count) {
+			ssize_t n = pread(data_fd, window.data() + done, count - done, static_cast<off_t>(offset + done));
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) {
+				return false;
+			}
+			done += n;
+		}
+		checksum = adler32(checksum, window.data(), count);
+	}
+
+	return true;
+}
+
+bool TransferJournal::checkpoint(int data_fd) {
+	if (!isPersistent()) {
+		return true;
+	}
+	return write(snapshot(), data_fd);
+}
+
+JournalCheckpoint TransferJournal::snapshot() {
+	unsynced = 0;
+	return {journal_path, file_info, completed, file};
+}
+
+bool TransferJournal::write(const JournalCheckpoint& checkpoint, int data_fd) {
+	if (checkpoint.journal_path.empty()) {
+		return true;
+	}
+
+	// A finished transfer may have discarded the journal while this waited for its turn
+	std::lock_guard<std::mutex> lock(checkpoint.file->mutex);
+	if (checkpoint.file->discarded) {
+		return false;
+	}
+
+	// Data first: the journal must never claim bytes that aren't on disk yet
+	if (fdatasync(data_fd) < 0) {
+		std::cerr << "Failed to sync partial file: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	uint32_t checksum;
+	if (!rangeChecksum(checkpoint.ranges, data_fd, checksum)) {
+		std::cerr << "Failed to read back partial file for its journal" << std::endl;
+		return false;
+	}
+
+	json ranges = json::array();
+	for (const auto& span : checkpoint.ranges.spanMap()) {
+		ranges.push_back({span.first, span.second});
+	}
+
+	std::string contents = json({
+		{"filename", checkpoint.file_info.filename},
+		{"filesize", checkpoint.file_info.filesize},
+		{"mtime", checkpoint.file_info.mtime},
+		{"ranges", ranges},
+		{"checksum", checksum}
+	}).dump();
+
+	// Write a temp file and rename it over the journal, so a crash leaves the old or the new one
+	std::string temp_path = checkpoint.journal_path + ".tmp";
+	int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		std::cerr << "Failed to write journal " << temp_path << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	size_t written = 0;
+	while (written < contents.size()) {
+		ssize_t w = ::write(fd, contents.data() + written, contents.size() - written);
+		if (w < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		written += w;
+	}
+
+	bool ok = written == contents.size() && fsync(fd) == 0;
+	close(fd);
+
+	if (!ok || rename(temp_path.c_str(), checkpoint.journal_path.c_str()) < 0) {
+		std::cerr << "Failed to write journal " << checkpoint.journal_path << ": " << strerror(errno) << std::endl;
+		std::remove(temp_path.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+void TransferJournal::discard() {
+	if (isPersistent()) {
+		std::lock_guard<std::mutex> lock(file->mutex);
+		file->discarded = true;
+		std::remove(journal_path.c_str());
+	}
+}
@@ -0,0 +1,42 @@
+#include "writeBehind.hpp"
+#include <fcntl.h>
+
+/**
+ * Two windows in flight: the one being written back and the one being filled
+ */
+void WriteBehind::written(int data_fd, uint64_t offset, uint64_t length) {
+	if (data_fd < 0 || length == 0) {
+		return;
+	}
+	// Paths that report cumulative ranges ([0, received)) still continue the file
+	uint64_t new_end = offset + length;
+	if (offset > end || new_end < end) {
+		window_start = flushing_start = offset;
+		end = new_end;
+		return;
+	}
+
+	end = new_end;
+	if (end - window_start < WINDOW) {
+		return;
+	}
+
+	// Queue the full window for writeback without waiting for it
+	sync_file_range(data_fd, static_cast<off64_t>(window_start), static_cast<off64_t>(end - window_start),
+			SYNC_FILE_RANGE_WRITE);
+
+	// The previous window had a whole window's worth of time: it is normally on disk already
+	if (flushing_start < window_start) {
+		off64_t start = static_cast<off64_t>(flushing_start);
+		off64_t bytes = static_cast<off64_t>(window_start - flushing_start);
+		if (wait) {
+			sync_file_range(data_fd, start, bytes,
+					SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		}
+		// Pages still under writeback are skipped, not waited for
+		posix_fadvise(data_fd, start, bytes, POSIX_FADV_DONTNEED);
+	}
+
+	flushing_start = window_start;
+	window_start = end;
+}
@@ -0,0 +1,116 @@
+#include "zeroCopy.hpp"
+#include "protocol.hpp"
+#include <chrono>
+#include <cerrno>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <poll.h>
+
+// Older libc headers don't know the flags yet (added in Linux 4.14)
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+ZeroCopySender::ZeroCopySender(int socket_fd, bool enable) : socket_fd(socket_fd), active(false), calls(0),
+	released(0), zero_copy_bytes(0), copied_bytes(0) {
+	int one = 1;
+	if (enable && setsockopt(socket_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+		active = true;
+	}
+}
+
+bool ZeroCopySender::send(const char* data, size_t length) {
+	size_t sent = 0;
+	while (sent < length) {
+		if (!active) {
+			return sendAll(socket_fd, data + sent, length - sent);
+		}
+
+		ssize_t n = ::send(socket_fd, data + sent, length - sent, MSG_NOSIGNAL | MSG_ZEROCOPY);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == ENOBUFS) {
+				// Out of pinned-page budget (net.core.optmem_max): let some
+				// completions come back, or copy if none are outstanding
+				if (calls == released || !wait(released + 1, 1000)) {
+					active = false;
+				}
+				continue;
+			}
+			return false;
+		}
+
+		lengths.push_back(static_cast<size_t>(n));
+		calls++;
+		sent += n;
+	}
+	return true;
+}
+
+void ZeroCopySender::release(uint32_t last, bool copied) {
+	// Kernel ids are 32 bits and wrap; count forward from the oldest outstanding call
+	uint64_t count = static_cast<uint32_t>(last - static_cast<uint32_t>(released)) + uint64_t(1);
+	if (count > calls - released) {
+		return;  // Already reported (or not ours)
+	}
+
+	for (uint64_t i = 0; i < count; i++) {
+		(copied ? copied_bytes : zero_copy_bytes) += lengths.front();
+		lengths.pop_front();
+	}
+	released += count;
+}
+
+/**
+ * Completions arrive as extended errors on the error queue, one per range
+ * of send calls [ee_info, ee_data]; reading the queue never blocks
+ */
+void ZeroCopySender::reap() {
+	while (released < calls) {
+		char control[CMSG_SPACE(sizeof(sock_extended_err)) * 4];
+		msghdr msg = {};
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(socket_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			return;  // EAGAIN: nothing (more) queued
+		}
+
+		for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			bool recverr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+				(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+			if (!recverr) {
+				continue;
+			}
+
+			const sock_extended_err* err = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cm));
+			if (err->ee_errno == 0 && err->ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+				release(err->ee_data, (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0);
+			}
+		}
+	}
+}
+
+bool ZeroCopySender::wait(uint64_t seq, int timeout_ms) {
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	reap();
+	while (!isDone(seq)) {
+		int left = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+			deadline - std::chrono::steady_clock::now()).count());
+		if (left <= 0) {
+			return false;
+		}
+
+		// A queued notification shows up as POLLERR
+		pollfd pfd = {socket_fd, 0, 0};
+		poll(&pfd, 1, left < 10 ? left : 10);
+		reap();
+	}
+	return true;
+}
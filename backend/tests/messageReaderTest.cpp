@@ -0,0 +1,193 @@
+/**
+ * filetransfer_message_reader_test: MessageReader on split, coalesced and hostile input
+ *
+ * Feeds both wire formats one byte at a time and several messages at once,
+ * then checks that input which can't be trusted (a frame whose payload
+ * doesn't decode or whose header claims an unknown type or an oversized
+ * payload, a stray '}', an endless JSON object) marks the stream corrupt
+ * instead of being returned or scanned forever.
+ *
+ * Usage: filetransfer_message_reader_test
+ */
+#include "protocol.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+static int failures = 0;
+
+static void check(bool condition, const std::string& what) {
+	if (!condition) {
+		std::cerr << "FAIL: " << what << std::endl;
+		failures++;
+	}
+}
+
+static TransferMessage makeMessage(MessageType type, const nlohmann::json& data) {
+	TransferMessage msg;
+	msg.type = type;
+	msg.data = data;
+	return msg;
+}
+
+/**
+ * Drains every complete message the reader holds
+ */
+static std::vector<TransferMessage> drain(MessageReader& reader) {
+	std::vector<TransferMessage> messages;
+	TransferMessage msg;
+	while (reader.next(msg)) {
+		messages.push_back(msg);
+	}
+	return messages;
+}
+
+static void testSplitAndCoalesced(WireFormat format, const char* name) {
+	std::vector<TransferMessage> sent = {
+		makeMessage(MessageType::FILE_INFO, {{"filename", "a {b} \"c\\\" }"}, {"filesize", 42}}),
+		makeMessage(MessageType::FILE_CHECKSUM, {{"algorithm", "crc32c"}, {"checksum", "0000abcd"}}),
+		makeMessage(MessageType::FILE_INFO, {{"filename", std::string(5000, 'x')}, {"filesize", 1}})
+	};
+	std::string stream;
+	for (const TransferMessage& msg : sent) {
+		stream += msg.encode(format);
+	}
+
+	// One byte per feed: every message only completes with its last byte
+	MessageReader split;
+	split.setFormat(format);
+	std::vector<TransferMessage> received;
+	for (char c : stream) {
+		split.feed(&c, 1);
+		for (TransferMessage& msg : drain(split)) {
+			received.push_back(msg);
+		}
+	}
+	check(received.size() == sent.size(), std::string(name) + ": byte-at-a-time feed lost messages");
+	for (size_t i = 0; i < received.size() && i < sent.size(); i++) {
+		check(received[i].type == sent[i].type && received[i].data == sent[i].data,
+			std::string(name) + ": byte-at-a-time message " + std::to_string(i) + " differs");
+	}
+
+	// Everything in one feed, followed by bytes that belong to the next message
+	MessageReader coalesced;
+	coalesced.setFormat(format);
+	std::string next = sent[0].encode(format);
+	std::string all = stream + next.substr(0, next.size() / 2);
+	coalesced.feed(all.data(), all.size());
+	received = drain(coalesced);
+	check(received.size() == sent.size(), std::string(name) + ": coalesced feed lost messages");
+	coalesced.feed(next.data() + next.size() / 2, next.size() - next.size() / 2);
+	received = drain(coalesced);
+	check(received.size() == 1 && received[0].data == sent[0].data,
+		std::string(name) + ": message split across feeds after a coalesced one");
+}
+
+/**
+ * Expects next() to throw and leave the reader marked corrupt
+ */
+static void expectCorrupt(MessageReader& reader, const std::string& what) {
+	bool threw = false;
+	try {
+		drain(reader);
+	} catch (const std::runtime_error&) {
+		threw = true;
+	}
+	check(threw && reader.isCorrupt(), what + ": not reported as corrupt");
+
+	// Callers close the connection; calling again must not hand out the bad input either
+	threw = false;
+	try {
+		TransferMessage msg;
+		reader.next(msg);
+	} catch (const std::runtime_error&) {
+		threw = true;
+	}
+	check(threw, what + ": reader usable after corruption");
+}
+
+static void testBadPayload() {
+	// Valid header, payload 0xC1 (never used in MessagePack), then a valid frame
+	uint8_t header[FRAME_HEADER_SIZE];
+	encodeFrameHeader({FRAME_MAGIC, FRAME_VERSION, static_cast<uint8_t>(MessageType::FILE_INFO),
+		FRAME_FLAG_MSGPACK, 1}, header);
+	std::string stream(reinterpret_cast<const char*>(header), sizeof(header));
+	stream += '\xC1';
+	stream += makeMessage(MessageType::FILE_CHECKSUM, {{"checksum", "00000000"}}).encode(WireFormat::BINARY);
+
+	MessageReader reader;
+	reader.setFormat(WireFormat::BINARY);
+	reader.feed(stream.data(), stream.size());
+	expectCorrupt(reader, "bad MessagePack payload");
+}
+
+static void testBadHeader() {
+	// A type past the end of MessageType
+	uint8_t header[FRAME_HEADER_SIZE];
+	encodeFrameHeader({FRAME_MAGIC, FRAME_VERSION, static_cast<uint8_t>(MessageType::FILE_BATCH) + 1,
+		FRAME_FLAG_MSGPACK, 1}, header);
+	std::string stream(reinterpret_cast<const char*>(header), sizeof(header));
+	stream += '\xC0';
+
+	MessageReader unknown;
+	unknown.setFormat(WireFormat::BINARY);
+	unknown.feed(stream.data(), stream.size());
+	expectCorrupt(unknown, "unknown frame type");
+
+	// A control frame claiming more than MAX_CONTROL_MESSAGE, refused before its payload is buffered
+	encodeFrameHeader({FRAME_MAGIC, FRAME_VERSION, static_cast<uint8_t>(MessageType::FILE_INFO),
+		FRAME_FLAG_MSGPACK, MAX_CONTROL_MESSAGE + 1}, header);
+	MessageReader oversized;
+	oversized.setFormat(WireFormat::BINARY);
+	oversized.feed(reinterpret_cast<const char*>(header), sizeof(header));
+	expectCorrupt(oversized, "oversized frame");
+}
+
+static void testBadJson() {
+	MessageReader stray;
+	stray.feed("}{\"type\":\"HELLO\"}", 17);
+	expectCorrupt(stray, "stray '}'");
+
+	// An object that never closes: refused once it passes the limit, not buffered forever
+	MessageReader endless;
+	endless.feed("{", 1);
+	std::string junk(64 * 1024, 'x');
+	bool threw = false;
+	for (size_t fed = 0; fed <= MAX_CONTROL_MESSAGE + junk.size() && !threw; fed += junk.size()) {
+		endless.feed(junk.data(), junk.size());
+		try {
+			drain(endless);
+		} catch (const std::runtime_error&) {
+			threw = true;
+		}
+	}
+	check(threw && endless.isCorrupt(), "unterminated JSON object: not refused past MAX_CONTROL_MESSAGE");
+
+	// A JSON message that doesn't parse is skipped, the stream goes on
+	MessageReader skip;
+	std::string text = "{\"type\": nope}{\"type\":\"DISCONNECT\",\"data\":{}}";
+	skip.feed(text.data(), text.size());
+	TransferMessage msg;
+	bool threw_json = false;
+	try {
+		skip.next(msg);
+	} catch (const nlohmann::json::exception&) {
+		threw_json = true;
+	}
+	check(threw_json && !skip.isCorrupt(), "unparsable JSON message: should be skipped, not corrupt");
+	check(skip.next(msg) && msg.type == MessageType::DISCONNECT, "message after an unparsable one was lost");
+}
+
+int main() {
+	testSplitAndCoalesced(WireFormat::JSON, "json");
+	testSplitAndCoalesced(WireFormat::BINARY, "binary");
+	testBadPayload();
+	testBadHeader();
+	testBadJson();
+
+	if (failures == 0) {
+		std::cout << "PASS: message reader" << std::endl;
+	}
+	return failures == 0 ? 0 : 1;
+}
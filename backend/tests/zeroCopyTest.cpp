@@ -0,0 +1,101 @@
+/**
+ * filetransfer_zerocopy_test: several PIPELINED files with MSG_ZEROCOPY on one connection
+ *
+ * The kernel numbers zero-copy completions per socket, so every file after
+ * the first only works if the client keeps counting where the previous one
+ * stopped. Sends the files over 127.0.0.1 to a server in this process and
+ * fails if any of them is refused, differs from the source, or takes long
+ * enough to suggest a buffer release timed out.
+ *
+ * Usage: filetransfer_zerocopy_test [port]
+ */
+#include "fileTransferServer.hpp"
+#include "fileTransferClient.hpp"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <filesystem>
+#include <cstdlib>
+#include <unistd.h>
+
+static const int FILE_COUNT = 3;
+static const size_t FILE_SIZE = 5 * 1024 * 1024 + 123;   // Several pipeline buffers and a partial one
+static const double MAX_SECONDS_PER_FILE = 5.0;
+
+static std::string readAll(const std::string& path) {
+	std::ifstream in(path, std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+int main(int argc, char** argv) {
+	int port = argc > 1 ? std::atoi(argv[1]) : 47900 + getpid() % 1000;
+
+	std::filesystem::path dir = std::filesystem::temp_directory_path() /
+		("ft_zerocopy_test_" + std::to_string(getpid()));
+	std::filesystem::create_directories(dir / "out");
+	std::filesystem::create_directories(dir / "in");
+
+	std::vector<std::string> sources;
+	for (int i = 0; i < FILE_COUNT; i++) {
+		std::string data(FILE_SIZE, '\0');
+		uint32_t state = 12345 + i;
+		for (char& c : data) {
+			state = state * 1103515245 + 12345;
+			c = static_cast<char>(state >> 24);
+		}
+		sources.push_back((dir / "out" / ("file" + std::to_string(i) + ".bin")).string());
+		std::ofstream(sources.back(), std::ios::binary) << data;
+	}
+
+	// The server writes into its current directory
+	std::filesystem::path previous = std::filesystem::current_path();
+	std::filesystem::current_path(dir / "in");
+
+	FileTransferServer server(port);
+	if (!server.start()) {
+		std::cerr << "FAIL: server did not start on port " << port << std::endl;
+		return 1;
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	FileTransferClient client("127.0.0.1", port);
+	client.setSendMode(SendMode::PIPELINED);
+	client.setPipeline(4, 1024 * 1024);
+	client.setZeroCopy(true);
+
+	int failures = 0;
+	if (!client.connect()) {
+		std::cerr << "FAIL: cannot connect" << std::endl;
+		failures++;
+	}
+
+	for (int i = 0; i < FILE_COUNT && failures == 0; i++) {
+		auto start = std::chrono::steady_clock::now();
+		bool sent = client.sendFile(sources[i]);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		if (!sent) {
+			std::cerr << "FAIL: file " << i << " was not sent" << std::endl;
+			failures++;
+		} else if (seconds > MAX_SECONDS_PER_FILE) {
+			std::cerr << "FAIL: file " << i << " took " << seconds << "s" << std::endl;
+			failures++;
+		} else if (readAll(sources[i]) != readAll("file" + std::to_string(i) + ".bin")) {
+			std::cerr << "FAIL: file " << i << " differs from the source" << std::endl;
+			failures++;
+		}
+	}
+
+	client.disconnect();
+	server.stop();
+	std::filesystem::current_path(previous);
+	std::filesystem::remove_all(dir);
+
+	if (failures == 0) {
+		std::cout << "PASS: " << FILE_COUNT << " zero-copy files on one connection" << std::endl;
+	}
+	return failures == 0 ? 0 : 1;
+}